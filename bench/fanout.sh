@@ -0,0 +1,77 @@
+#!/bin/bash
+#
+# fan one server out to many loopback clients and measure how long it takes
+# until every mirror holds the initial tree, and then a single changed file.
+#
+# usage: bench/fanout.sh [n_client] [n_file] [file_kb]
+#
+
+N_CLI=${1:-200}
+N_FILE=${2:-64}
+FILE_KB=${3:-16}
+
+BIN=$(cd "$(dirname "$0")/.." && pwd)/smartsync
+WORK=$(mktemp -d /tmp/ss_fanout.XXXXXX)
+PIDS=()
+
+cleanup()
+{
+    kill "${PIDS[@]}" > /dev/null 2>&1
+    wait > /dev/null 2>&1
+    rm -rf "$WORK"
+}
+trap cleanup EXIT
+
+now_ms()
+{
+    echo $(( $(date +%s%N) / 1000000 ))
+}
+
+# wait until every client dir holds $1 with the same content as the source,
+# a dir is compared as a whole
+wait_all()
+{
+    local f=$1 i done
+    while true; do
+        done=0
+        for ((i = 0; i < N_CLI; i++)); do
+            if [ -d "$WORK/src/$f" ]; then
+                diff -r "$WORK/src/$f" "$WORK/cli$i/$f" > /dev/null 2>&1 && done=$((done + 1))
+            else
+                cmp -s "$WORK/src/$f" "$WORK/cli$i/$f" && done=$((done + 1))
+            fi
+        done
+        [ $done -eq $N_CLI ] && return
+        sleep 0.05
+    done
+}
+
+[ -x "$BIN" ] || { echo "build $BIN first"; exit 1; }
+ulimit -n $((N_CLI * 2 + 64)) 2> /dev/null
+
+mkdir -p "$WORK/src/d"
+for ((i = 0; i < N_FILE; i++)); do
+    head -c $((FILE_KB * 1024)) /dev/urandom > "$WORK/src/d/f$i"
+done
+
+"$BIN" -p "$WORK/src" > /dev/null 2>&1 &
+PIDS+=($!)
+sleep 0.5
+
+t0=$(now_ms)
+for ((i = 0; i < N_CLI; i++)); do
+    mkdir -p "$WORK/cli$i"
+    "$BIN" -p "$WORK/cli$i" -a 127.0.0.1 > /dev/null 2>&1 &
+    PIDS+=($!)
+done
+
+wait_all "d"
+t1=$(now_ms)
+echo "clients: $N_CLI, files: $N_FILE x ${FILE_KB}KB"
+echo "initial sync:   $((t1 - t0)) ms"
+
+head -c $((FILE_KB * 1024)) /dev/urandom > "$WORK/src/d/f0"
+t0=$(now_ms)
+wait_all "d/f0"
+t1=$(now_ms)
+echo "change fan-out: $((t1 - t0)) ms"
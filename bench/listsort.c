@@ -0,0 +1,112 @@
+/*
+ * sort of file lists, against the qsort it replaced
+ *
+ * a synthetic tree of n files, names under a few levels of directories,
+ * sorted by qsort of the records with strcmp, as path_scan did, and by
+ * ss_dm_sort. the files of a directory are next to each other, the
+ * directories and the files in them in no order, as readdir has them.
+ *
+ * usage: bench/listsort.sh [n_file] [rounds]
+ */
+
+#include "../src/pub.h"
+
+#define SS_BENCH_DIR    64
+
+static uint64_t now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int qsort_comp(const void *a, const void *b)
+{
+    return strcmp(((ss_filemeta_t *)a)->name, ((ss_filemeta_t *)b)->name);
+}
+
+static uint32_t rnd(uint32_t *r)
+{
+    *r = *r * 1103515245 + 12345;
+
+    return *r >> 8;
+}
+
+/* n files, SS_BENCH_DIR to a directory, both directories and files in no order, as readdir has them */
+static ss_dirmeta_t *make_dm(int n, uint32_t seed)
+{
+    ss_dirmeta_t *dm = (ss_dirmeta_t *)ss_pool_zget(sizeof(ss_dirmeta_t) + n * sizeof(ss_filemeta_t));
+    int n_dir = (n + SS_BENCH_DIR - 1) / SS_BENCH_DIR;
+    int *dir = (int *)malloc(n_dir * sizeof(int));
+    uint32_t r = seed;
+    ss_filemeta_t t, *fm;
+    int i, j, k, d, m;
+
+    for (d = 0; d < n_dir; d++) {
+        dir[d] = d;
+    }
+    for (d = n_dir - 1; d > 0; d--) {
+        j = rnd(&r) % (d + 1);
+        m = dir[d];
+        dir[d] = dir[j];
+        dir[j] = m;
+    }
+
+    dm->n_slot = dm->n_file = n;
+    for (d = 0, i = 0; d < n_dir; d++) {
+        m = i;
+        for (j = 0; (j < SS_BENCH_DIR) && (i < n); j++, i++) {
+            fm = &(dm->fml[i]);
+            fm->name_len = sprintf(fm->name, "project/src/module_%02d/component_%05d/source_%06d.c",
+                                   dir[d] % 37, dir[d], j);
+        }
+        for (j = i - 1; j > m; j--) {
+            k = m + rnd(&r) % (j - m + 1);
+            t = dm->fml[j];
+            dm->fml[j] = dm->fml[k];
+            dm->fml[k] = t;
+        }
+    }
+    free(dir);
+
+    return dm;
+}
+
+int main(int argc, char **argv)
+{
+    int n = argc > 1 ? atoi(argv[1]) : 1000000;
+    int rounds = argc > 2 ? atoi(argv[2]) : 5;
+    uint64_t t, t_qsort = 0, t_sort = 0;
+    ss_dirmeta_t *dm, *ref;
+    int i, k;
+
+    for (k = 0; k < rounds; k++) {
+        ref = make_dm(n, k + 1);
+        dm = (ss_dirmeta_t *)ss_pool_get(sizeof(ss_dirmeta_t) + n * sizeof(ss_filemeta_t));
+        memcpy(dm, ref, sizeof(ss_dirmeta_t) + n * sizeof(ss_filemeta_t));
+
+        t = now_us();
+        qsort(ref->fml, ref->n_file, sizeof(ss_filemeta_t), qsort_comp);
+        t_qsort += now_us() - t;
+
+        t = now_us();
+        ss_dm_sort(dm);
+        t_sort += now_us() - t;
+
+        for (i = 0; i < n; i++) {
+            if (memcmp(&(ref->fml[i]), &(dm->fml[i]), sizeof(ss_filemeta_t))) {
+                printf("order differs at %d: %s %s\n", i, ref->fml[i].name, dm->fml[i].name);
+                return 1;
+            }
+        }
+        ss_pool_put(ref);
+        ss_pool_put(dm);
+    }
+
+    printf("n_file %d, %d rounds, ms per round: qsort %.1f, ss_dm_sort %.1f\n",
+           n, rounds, t_qsort / 1000.0 / rounds, t_sort / 1000.0 / rounds);
+
+    return 0;
+}
@@ -0,0 +1,14 @@
+#!/bin/bash
+#
+# time the sort of path_scan against the qsort it replaced, on a
+# synthetic list, see listsort.c.
+#
+# usage: bench/listsort.sh [n_file] [rounds]
+#
+
+DIR=$(cd "$(dirname "$0")" && pwd)
+BIN=$(mktemp /tmp/ss_listsort.XXXXXX)
+trap 'rm -f "$BIN"' EXIT
+
+gcc -O2 -Wall -Wno-unused-function -o "$BIN" "$DIR/listsort.c" "$DIR/../src/sort.c" "$DIR/../src/pool.c" -lpthread || exit 1
+"$BIN" "$@"
@@ -0,0 +1,102 @@
+#!/bin/bash
+#
+# stop receivers in the middle of a large file and measure how long another
+# client takes to get the small files of the tree, and then a changed one.
+# fails if either is over the bound, a stalled client must hold up no one.
+#
+# usage: bench/stall.sh [n_stall] [big_mb] [bound_ms]
+#
+
+N_STALL=${1:-8}
+BIG_MB=${2:-256}
+BOUND_MS=${3:-3000}
+N_FILE=32
+
+BIN=$(cd "$(dirname "$0")/.." && pwd)/smartsync
+WORK=$(mktemp -d /tmp/ss_stall.XXXXXX)
+PIDS=()
+STALLED=()
+
+cleanup()
+{
+    kill -CONT "${STALLED[@]}" > /dev/null 2>&1
+    kill "${PIDS[@]}" > /dev/null 2>&1
+    wait > /dev/null 2>&1
+    rm -rf "$WORK"
+}
+trap cleanup EXIT
+
+now_ms()
+{
+    echo $(( $(date +%s%N) / 1000000 ))
+}
+
+# wait until dir $1 holds the small files of the source, or the bound is over
+wait_small()
+{
+    local dst=$1 t_end=$(( $(now_ms) + BOUND_MS * 4 )) i
+    while [ $(now_ms) -lt $t_end ]; do
+        for ((i = 0; i < N_FILE; i++)); do
+            cmp -s "$WORK/src/d/s$i" "$dst/d/s$i" || break
+        done
+        [ $i -eq $N_FILE ] && return 0
+        sleep 0.02
+    done
+    return 1
+}
+
+# wait until the big file of dir $1 is on its way in
+wait_part()
+{
+    while [ -z "$(find "$1" -name '*.ss_part' -size +1M 2> /dev/null)" ]; do
+        sleep 0.02
+    done
+}
+
+[ -x "$BIN" ] || { echo "build $BIN first"; exit 1; }
+
+# tcp: on the unix socket a client gets the fd of a file, nothing to stall on
+mkdir -p "$WORK/src/d"
+head -c $((BIG_MB * 1024 * 1024)) /dev/urandom > "$WORK/src/big"
+for ((i = 0; i < N_FILE; i++)); do
+    head -c 4096 /dev/urandom > "$WORK/src/d/s$i"
+done
+
+"$BIN" -p "$WORK/src" --tcp > /dev/null 2>&1 &
+PIDS+=($!)
+sleep 0.5
+
+for ((i = 0; i < N_STALL; i++)); do
+    mkdir -p "$WORK/stall$i"
+    "$BIN" -p "$WORK/stall$i" -a 127.0.0.1 --tcp > /dev/null 2>&1 &
+    PIDS+=($!)
+    STALLED+=($!)
+done
+for ((i = 0; i < N_STALL; i++)); do
+    wait_part "$WORK/stall$i"
+    kill -STOP "${STALLED[$i]}"
+done
+# let the socket buffers of the stalled clients fill up
+sleep 1
+
+echo "stalled clients: $N_STALL, big file: ${BIG_MB}MB, small files: $N_FILE x 4KB"
+ret=0
+
+mkdir -p "$WORK/live"
+t0=$(now_ms)
+"$BIN" -p "$WORK/live" -a 127.0.0.1 --tcp > /dev/null 2>&1 &
+PIDS+=($!)
+wait_small "$WORK/live" || ret=1
+t1=$(now_ms)
+echo "initial small files: $((t1 - t0)) ms"
+[ $((t1 - t0)) -gt $BOUND_MS ] && ret=1
+
+head -c 4096 /dev/urandom > "$WORK/src/d/s0"
+t0=$(now_ms)
+wait_small "$WORK/live" || ret=1
+t1=$(now_ms)
+echo "changed file:        $((t1 - t0)) ms"
+[ $((t1 - t0)) -gt $BOUND_MS ] && ret=1
+
+[ $ret -eq 0 ] && echo "ok, bound ${BOUND_MS} ms" || echo "over the bound of ${BOUND_MS} ms"
+exit $ret
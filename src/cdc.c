@@ -0,0 +1,1118 @@
+#include "pub.h"
+#include <errno.h>
+
+/*
+ * content defined chunking
+ *
+ * a large file is cut where a rolling gear hash of the last bytes hits a
+ * mask, FastCDC style with normalized chunk sizes, so the cut points move
+ * along with inserted or removed bytes instead of shifting every block
+ * behind them. a chunk is named by its xxh64.
+ *
+ * srv: FILE_CREQ is answered with the chunk map of the file, built by a tx
+ * worker and kept for the SS_CDC_CACHE files asked for last.
+ *
+ * cli: keeps an index of the chunks of the large files in its mirror. a
+ * large file to fetch is asked for as a chunk map first, the new version
+ * is put together in a temp file from the chunks the mirror has anywhere,
+ * each checked against its hash, and the runs of chunks it does not have
+ * are fetched as ranges with FILE_RREQ. the result must match the hash of
+ * the whole file before it replaces the old one. whatever goes wrong, the
+ * file is fetched with a plain FILE_REQ instead.
+ */
+
+#define SS_CDC_MASK_S               (((1ULL << 18) - 1) << 46)  /* before the average size, harder */
+#define SS_CDC_MASK_L               (((1ULL << 14) - 1) << 50)  /* behind it, easier */
+#define SS_CDC_BUCKETS              (64 * 1024)
+#define SS_CDC_WINDOW               (4 * 1024 * 1024)   /* bytes a pread of a file being chunked takes */
+
+static uint64_t g_cdc_gear[256];
+static pthread_once_t g_cdc_once = PTHREAD_ONCE_INIT;
+
+/* both sides need the same table, it is derived from a fixed seed */
+static void ss_cdc_gear_init(void)
+{
+    uint64_t x = 0x5353434443444300ULL, z;
+    int i;
+
+    for (i = 0; i < 256; i++) {
+        z = (x += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        g_cdc_gear[i] = z ^ (z >> 31);
+    }
+}
+
+/* length of the chunk at the start of p */
+static uint32_t ss_cdc_cut(const uint8_t *p, uint64_t n)
+{
+    uint64_t fp = 0;
+    uint32_t i, normal = SS_CDC_AVGCHUNK;
+
+    if (n <= SS_CDC_MINCHUNK) {
+        return n;
+    }
+    if (n > SS_CDC_MAXCHUNK) {
+        n = SS_CDC_MAXCHUNK;
+    }
+    if (n < normal) {
+        normal = n;
+    }
+
+    for (i = SS_CDC_MINCHUNK; i < normal; i++) {
+        fp = (fp << 1) + g_cdc_gear[p[i]];
+        if (!(fp & SS_CDC_MASK_S)) {
+            return i + 1;
+        }
+    }
+    for (; i < n; i++) {
+        fp = (fp << 1) + g_cdc_gear[p[i]];
+        if (!(fp & SS_CDC_MASK_L)) {
+            return i + 1;
+        }
+    }
+
+    return n;
+}
+
+/*
+ * chunk the first size bytes of fd, read a window at a time, and hash them
+ * whole into *hash if it is not NULL. returns the number of chunks, ent is
+ * malloced, -1: the file is shorter, or can not be read.
+ */
+static int ss_cdc_chunk(int fd, uint64_t size, ss_cdcent_t **ent, uint64_t *hash)
+{
+    alg_xxh64_t st;
+    uint64_t base = 0;
+    uint32_t n = 0, pos = 0, have = 0, len;
+    uint8_t *buf;
+    ssize_t ret;
+
+    pthread_once(&g_cdc_once, ss_cdc_gear_init);
+
+    *ent = (ss_cdcent_t *)malloc((size / SS_CDC_MINCHUNK + 1) * sizeof(ss_cdcent_t));
+    SS_ASSERT(*ent);
+    buf = (uint8_t *)ss_pool_get(SS_CDC_WINDOW);
+    alg_xxh64_init(&st, 0);
+    posix_fadvise(fd, 0, size, POSIX_FADV_SEQUENTIAL);
+
+    while (base + pos < size) {
+        /* a cut looks SS_CDC_MAXCHUNK ahead at most, less only at the end of the file */
+        if ((have - pos < SS_CDC_MAXCHUNK) && (base + have < size)) {
+            memmove(buf, buf + pos, have - pos);
+            base += pos;
+            have -= pos;
+            pos = 0;
+            while ((have < SS_CDC_WINDOW) && (base + have < size)) {
+                len = (size - base - have < SS_CDC_WINDOW - have) ? size - base - have : SS_CDC_WINDOW - have;
+                ret = pread(fd, buf + have, len, base + have);
+                if (ret <= 0) {
+                    if ((ret < 0) && (errno == EINTR)) {
+                        continue;
+                    }
+                    ss_pool_put(buf);
+                    free(*ent);
+                    *ent = NULL;
+                    return -1;
+                }
+                alg_xxh64_update(&st, buf + have, ret);
+                have += ret;
+            }
+        }
+
+        len = ss_cdc_cut(buf + pos, have - pos);
+        (*ent)[n].hash = alg_xxh64(buf + pos, len, 0);
+        (*ent)[n].len = len;
+        (*ent)[n].rsv = 0;
+        pos += len;
+        n++;
+    }
+
+    ss_pool_put(buf);
+    if (hash) {
+        *hash = alg_xxh64_digest(&st);
+    }
+
+    return n;
+}
+
+/*
+ * srv
+ */
+
+typedef struct {
+    dev_t                   dev;
+    ino_t                   ino;
+    uint64_t                size;
+    time_t                  mtime;
+    uint32_t                mtime_ns;
+    uint32_t                n_chunk;
+    uint64_t                hash;
+    uint64_t                used;           /* lru tick */
+    ss_cdcent_t             *ent;
+} ss_cdcmap_t;
+
+typedef struct _ss_cdc_srv {
+    pthread_mutex_t         lock;
+    ss_cdcmap_t             map[SS_CDC_CACHE];
+    uint64_t                tick;
+} ss_cdc_srv_t;
+
+void ss_cdc_srv_init(ss_ctx_t *ctx)
+{
+    ss_cdc_srv_t *cs;
+
+    cs = (ss_cdc_srv_t *)calloc(1, sizeof(ss_cdc_srv_t));
+    SS_ASSERT(cs);
+    pthread_mutex_init(&(cs->lock), NULL);
+    ctx->u.srv.cdc = cs;
+}
+
+/* tx worker, the FILE_CRES of name, *len is set to its length */
+void *ss_cdc_srv_map(ss_ctx_t *ctx, char *name, int valid, time_t mtime, uint32_t *len)
+{
+    ss_cdc_srv_t *cs = ctx->u.srv.cdc;
+    ss_cdcmap_t *m = NULL, *lru;
+    ss_filecres_t *cres;
+    ss_cdcent_t *ent = NULL;
+    char pathname[SS_MAXPATH_LEN];
+    uint32_t i, n_chunk = 0, flag = 0, name_len = strlen(name);
+    uint64_t hash = 0;
+    struct stat st;
+    int fd = -1, ret;
+
+    memset(&st, 0, sizeof(st));
+
+    if (valid) {
+        flag |= SS_FILERES_VALID;
+
+        if (snprintf(pathname, sizeof(pathname), "%s/%s", ctx->localpath, name) >= (int)sizeof(pathname)) {
+            printf("cdc: path of %s too long.\n", name);
+        } else {
+            fd = open(pathname, O_RDONLY);
+        }
+        if ((fd >= 0) && (fstat(fd, &st) == 0)) {
+            flag |= SS_FILERES_EXIST;
+        }
+    }
+
+    if (flag & SS_FILERES_EXIST) {
+        pthread_mutex_lock(&(cs->lock));
+        for (i = 0; i < SS_CDC_CACHE; i++) {
+            m = &(cs->map[i]);
+            if (m->ent && (m->dev == st.st_dev) && (m->ino == st.st_ino) && (m->size == st.st_size) &&
+                (m->mtime == st.st_mtim.tv_sec) && (m->mtime_ns == st.st_mtim.tv_nsec)) {
+                m->used = ++(cs->tick);
+                n_chunk = m->n_chunk;
+                hash = m->hash;
+                ent = (ss_cdcent_t *)malloc((n_chunk + 1) * sizeof(ss_cdcent_t));
+                SS_ASSERT(ent);
+                memcpy(ent, m->ent, n_chunk * sizeof(ss_cdcent_t));
+                break;
+            }
+        }
+        pthread_mutex_unlock(&(cs->lock));
+
+        if (ent == NULL) {
+            ret = ss_cdc_chunk(fd, st.st_size, &ent, &hash);
+            if (ret >= 0) {
+                n_chunk = ret;
+                hash = hash ? hash : 1;
+            } else {
+                flag &= ~SS_FILERES_EXIST;
+            }
+        }
+
+        if ((ent != NULL) && (i == SS_CDC_CACHE)) {
+            /* not cached, take the place of the one used longest ago */
+            pthread_mutex_lock(&(cs->lock));
+            for (i = 0, lru = &(cs->map[0]); i < SS_CDC_CACHE; i++) {
+                if (cs->map[i].used < lru->used) {
+                    lru = &(cs->map[i]);
+                }
+            }
+            if (lru->ent) {
+                free(lru->ent);
+            }
+            lru->dev = st.st_dev;
+            lru->ino = st.st_ino;
+            lru->size = st.st_size;
+            lru->mtime = st.st_mtim.tv_sec;
+            lru->mtime_ns = st.st_mtim.tv_nsec;
+            lru->n_chunk = n_chunk;
+            lru->hash = hash;
+            lru->used = ++(cs->tick);
+            lru->ent = (ss_cdcent_t *)malloc((n_chunk + 1) * sizeof(ss_cdcent_t));
+            SS_ASSERT(lru->ent);
+            memcpy(lru->ent, ent, n_chunk * sizeof(ss_cdcent_t));
+            pthread_mutex_unlock(&(cs->lock));
+        }
+    }
+
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    *len = sizeof(ss_filecres_t) + n_chunk * sizeof(ss_cdcent_t) + name_len + 1;
+    cres = (ss_filecres_t *)ss_pool_get(*len);
+    memset(cres, 0, sizeof(ss_filecres_t));
+
+    cres->flag = flag;
+    cres->n_chunk = n_chunk;
+    cres->size = st.st_size;
+    cres->mtime = ctx->relay ? mtime : st.st_mtime;
+    cres->hash = hash;
+    cres->name_len = name_len;
+    if (n_chunk) {
+        memcpy(cres->ent, ent, n_chunk * sizeof(ss_cdcent_t));
+    }
+    memcpy((char *)(cres->ent + n_chunk), name, name_len + 1);
+
+    if (ent) {
+        free(ent);
+    }
+
+    return cres;
+}
+
+/*
+ * cli
+ *
+ * the index is the thread's alone: it indexes the mirror, copies the
+ * chunks it has into a file being put together and checks the result.
+ * the epoll thread opens and commits the temp files, sends the requests
+ * and writes the ranges that come in, a job is handed over and comes back
+ * with SS_CBTYPE_EVENT. a file is the thread's while its job is.
+ */
+
+struct _ss_cdcfile;
+
+/* where a chunk is in the mirror */
+typedef struct _ss_cdcref {
+    struct _ss_cdcref       *next;
+    uint64_t                hash;
+    uint64_t                off;
+    uint32_t                len;
+    struct _ss_cdcfile      *file;
+} ss_cdcref_t;
+
+/* an indexed file, as it was when it was chunked */
+typedef struct _ss_cdcfile {
+    struct _ss_cdcfile      *next;
+    uint64_t                size;
+    time_t                  mtime;
+    uint32_t                mtime_ns;
+    uint32_t                gen;            /* index pass that saw it last */
+    uint32_t                n_ref;
+    ss_cdcref_t             *ref;
+    char                    name[SS_MAXPATH_LEN];
+} ss_cdcfile_t;
+
+/* a run of chunks the mirror does not have */
+typedef struct {
+    uint64_t                off, len;
+} ss_cdcrun_t;
+
+/* a file being put together */
+typedef struct _ss_cdcasm {
+    struct _ss_cdcasm       *next;
+    int                     fd;
+    int                     failed;
+    int                     held;           /* a job of the thread has it */
+    volatile int            dropped;        /* the connection went while it was held */
+    uint32_t                n_left;         /* ranges not done yet */
+    uint64_t                size;
+    time_t                  mtime;
+    uint64_t                hash;
+    uint32_t                n_chunk;
+    ss_cdcent_t             *ent;
+    uint32_t                n_local;        /* chunks found in the mirror */
+    uint32_t                n_run;
+    ss_cdcrun_t             *run;
+    struct stat             st;             /* as it was committed */
+    char                    name[SS_MAXPATH_LEN];
+} ss_cdcasm_t;
+
+typedef enum {
+    SS_CDCJOB_INDEX,                        /* bring the index up to the large files of dm */
+    SS_CDCJOB_LOCAL,                        /* copy the chunks the mirror has, find the runs to fetch */
+    SS_CDCJOB_CHECK,                        /* hash the file put together */
+    SS_CDCJOB_SET,                          /* index a committed file, the job takes as */
+} ss_cdcjob_e;
+
+typedef struct _ss_cdcjob {
+    struct _ss_cdcjob       *next;
+    ss_cdcjob_e             type;
+    ss_cdcasm_t             *as;
+    uint32_t                gen;            /* INDEX: of dm, n_name names follow */
+    uint32_t                n_name;
+    char                    names[0];
+} ss_cdcjob_t;
+
+/* a run of missing chunks in flight, its FILE_RREQ token is SS_CDC_TOKEN | index */
+typedef struct {
+    ss_cdcasm_t             *as;            /* NULL: free slot */
+    uint32_t                sid;
+    uint64_t                off, len, got;
+} ss_cdcrange_t;
+
+typedef struct _ss_cdc_cli {
+    ss_ctx_t                *ctx;
+
+    /* the thread's */
+    ss_cdcref_t             **ref_bucket;
+    ss_cdcfile_t            **file_bucket;
+    uint64_t                n_ref;
+    uint32_t                gen;            /* dm_gen of the last index pass */
+    uint8_t                 *buf;           /* one chunk */
+
+    /* the epoll thread's */
+    int                     threaded;
+    uint32_t                gen_asked;      /* dm_gen the last INDEX was queued for */
+    int                     on_disk;        /* a large file of that dm is in the mirror */
+    ss_cdcasm_t             *as_list;
+    ss_cdcrange_t           *range;
+    uint32_t                n_range;
+
+    pthread_mutex_t         lock;
+    pthread_cond_t          cond;
+    pthread_t               thread;
+    ss_cdcjob_t             *job_head, *job_tail;
+    ss_cdcjob_t             *done;          /* back to the epoll thread */
+} ss_cdc_cli_t;
+
+static inline uint32_t ss_cdc_ref_slot(uint64_t hash)
+{
+    return (uint32_t)(hash ^ (hash >> 32)) & (SS_CDC_BUCKETS - 1);
+}
+
+static inline uint32_t ss_cdc_file_slot(char *name)
+{
+    return (uint32_t)alg_xxh64(name, strlen(name), 0) & (SS_CDC_BUCKETS - 1);
+}
+
+static ss_cdcfile_t *ss_cdc_file_find(ss_cdc_cli_t *cc, char *name)
+{
+    ss_cdcfile_t *f;
+
+    for (f = cc->file_bucket[ss_cdc_file_slot(name)]; f; f = f->next) {
+        if (strcmp(f->name, name) == 0) {
+            return f;
+        }
+    }
+
+    return NULL;
+}
+
+/* take the chunks of f out of the index */
+static void ss_cdc_file_unref(ss_cdc_cli_t *cc, ss_cdcfile_t *f)
+{
+    ss_cdcref_t **pp;
+    uint32_t i;
+
+    for (i = 0; i < f->n_ref; i++) {
+        for (pp = &(cc->ref_bucket[ss_cdc_ref_slot(f->ref[i].hash)]); *pp; pp = &((*pp)->next)) {
+            if (*pp == &(f->ref[i])) {
+                *pp = f->ref[i].next;
+                break;
+            }
+        }
+    }
+    cc->n_ref -= f->n_ref;
+
+    free(f->ref);
+    f->ref = NULL;
+    f->n_ref = 0;
+}
+
+static void ss_cdc_file_drop(ss_cdc_cli_t *cc, ss_cdcfile_t *f)
+{
+    ss_cdcfile_t **pp;
+
+    ss_cdc_file_unref(cc, f);
+    for (pp = &(cc->file_bucket[ss_cdc_file_slot(f->name)]); *pp; pp = &((*pp)->next)) {
+        if (*pp == f) {
+            *pp = f->next;
+            break;
+        }
+    }
+    free(f);
+}
+
+/* (re)index name with the chunks ent, as st says the file is now */
+static void ss_cdc_file_set(ss_cdc_cli_t *cc, char *name, struct stat *st, ss_cdcent_t *ent, uint32_t n_chunk)
+{
+    ss_cdcfile_t *f;
+    ss_cdcref_t *r;
+    uint64_t off = 0;
+    uint32_t i, slot;
+
+    f = ss_cdc_file_find(cc, name);
+    if (f) {
+        ss_cdc_file_unref(cc, f);
+    } else {
+        f = (ss_cdcfile_t *)calloc(1, sizeof(ss_cdcfile_t));
+        SS_ASSERT(f);
+        strcpy(f->name, name);
+        slot = ss_cdc_file_slot(name);
+        f->next = cc->file_bucket[slot];
+        cc->file_bucket[slot] = f;
+    }
+
+    f->size = st->st_size;
+    f->mtime = st->st_mtim.tv_sec;
+    f->mtime_ns = st->st_mtim.tv_nsec;
+    f->gen = cc->gen;
+    f->ref = (ss_cdcref_t *)calloc(n_chunk + 1, sizeof(ss_cdcref_t));
+    SS_ASSERT(f->ref);
+    f->n_ref = n_chunk;
+
+    for (i = 0; i < n_chunk; i++) {
+        r = &(f->ref[i]);
+        r->hash = ent[i].hash;
+        r->off = off;
+        r->len = ent[i].len;
+        r->file = f;
+        slot = ss_cdc_ref_slot(r->hash);
+        r->next = cc->ref_bucket[slot];
+        cc->ref_bucket[slot] = r;
+        off += ent[i].len;
+    }
+    cc->n_ref += n_chunk;
+}
+
+/* thread: bring the index up to the large files of the job, only changed ones are read */
+static void ss_cdc_index(ss_ctx_t *ctx, ss_cdc_cli_t *cc, ss_cdcjob_t *job)
+{
+    char pathname[SS_MAXPATH_LEN], *name;
+    ss_cdcfile_t *f, *next;
+    ss_cdcent_t *ent;
+    struct stat st;
+    uint32_t i;
+    int fd, n_chunk;
+
+    cc->gen = job->gen;
+
+    for (i = 0, name = job->names; i < job->n_name; i++, name += strlen(name) + 1) {
+        /* what is on disk counts, it may be the old version of the file */
+        if ((snprintf(pathname, sizeof(pathname), "%s/%s", ctx->localpath, name) >= (int)sizeof(pathname)) ||
+            stat(pathname, &st) || (st.st_size < SS_CDC_MINSIZE)) {
+            continue;
+        }
+
+        f = ss_cdc_file_find(cc, name);
+        if (f && (f->size == st.st_size) && (f->mtime == st.st_mtim.tv_sec) &&
+            (f->mtime_ns == st.st_mtim.tv_nsec)) {
+            f->gen = cc->gen;
+            continue;
+        }
+
+        fd = open(pathname, O_RDONLY);
+        if (fd < 0) {
+            continue;
+        }
+        n_chunk = ss_cdc_chunk(fd, st.st_size, &ent, NULL);
+        close(fd);
+        if (n_chunk < 0) {
+            continue;
+        }
+
+        ss_cdc_file_set(cc, name, &st, ent, n_chunk);
+        free(ent);
+    }
+
+    /* files that left the mirror */
+    for (i = 0; i < SS_CDC_BUCKETS; i++) {
+        for (f = cc->file_bucket[i]; f; f = next) {
+            next = f->next;
+            if (f->gen != cc->gen) {
+                ss_cdc_file_drop(cc, f);
+            }
+        }
+    }
+
+    printf("cdc: %lu chunks indexed\n", cc->n_ref);
+}
+
+/* thread: copy a chunk the mirror has into the file being built, -1: not found or not what it claims */
+static int ss_cdc_local(ss_ctx_t *ctx, ss_cdc_cli_t *cc, ss_cdcasm_t *as, ss_cdcent_t *ent, uint64_t off,
+                        int *src_fd, ss_cdcfile_t **src)
+{
+    char pathname[SS_MAXPATH_LEN];
+    ss_cdcref_t *r;
+
+    for (r = cc->ref_bucket[ss_cdc_ref_slot(ent->hash)]; r; r = r->next) {
+        if ((r->hash != ent->hash) || (r->len != ent->len)) {
+            continue;
+        }
+
+        if (*src != r->file) {
+            if (*src_fd >= 0) {
+                close(*src_fd);
+            }
+            *src_fd = -1;
+            if (snprintf(pathname, sizeof(pathname), "%s/%s", ctx->localpath, r->file->name) < (int)sizeof(pathname)) {
+                *src_fd = open(pathname, O_RDONLY);
+            }
+            *src = r->file;
+        }
+
+        if ((*src_fd >= 0) && (pread(*src_fd, cc->buf, r->len, r->off) == r->len) &&
+            (alg_xxh64(cc->buf, r->len, 0) == ent->hash) &&
+            (ss_pwrite_sparse(as->fd, cc->buf, r->len, off) == r->len)) {
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+/* thread: as many chunks from the mirror as there are, the runs of the others go to as->run */
+static void ss_cdc_asm_local(ss_ctx_t *ctx, ss_cdc_cli_t *cc, ss_cdcasm_t *as)
+{
+    ss_cdcfile_t *src = NULL;
+    uint64_t off, run_off = 0, run_len = 0;
+    uint32_t i;
+    int src_fd = -1;
+
+    as->run = (ss_cdcrun_t *)malloc((as->n_chunk / 2 + 1) * sizeof(ss_cdcrun_t));
+    SS_ASSERT(as->run);
+
+    for (i = 0, off = 0; i <= as->n_chunk; i++) {
+        if ((i < as->n_chunk) && !as->dropped && ss_cdc_local(ctx, cc, as, &(as->ent[i]), off, &src_fd, &src)) {
+            if (run_len == 0) {
+                run_off = off;
+            }
+            run_len += as->ent[i].len;
+        } else {
+            if (i < as->n_chunk) {
+                as->n_local++;
+            }
+            if (run_len) {
+                as->run[as->n_run].off = run_off;
+                as->run[as->n_run].len = run_len;
+                as->n_run++;
+                run_len = 0;
+            }
+        }
+        if (i < as->n_chunk) {
+            off += as->ent[i].len;
+        }
+    }
+
+    if (src_fd >= 0) {
+        close(src_fd);
+    }
+}
+
+/* thread: the file put together must match the hash of the whole file */
+static void ss_cdc_asm_check(ss_cdcasm_t *as)
+{
+    uint64_t hash = 0;
+
+    if (ss_file_xxh64(as->fd, as->size, &hash) == 0) {
+        hash = hash ? hash : 1;
+    }
+    if (hash != as->hash) {
+        printf("cdc: %s does not match its hash.\n", as->name);
+        as->failed = 1;
+    }
+}
+
+static void ss_cdc_asm_free(ss_cdcasm_t *as)
+{
+    free(as->run);
+    free(as->ent);
+    free(as);
+}
+
+static void *ss_cdc_thread(void *arg)
+{
+    ss_cdc_cli_t *cc = (ss_cdc_cli_t *)arg;
+    ss_ctx_t *ctx = cc->ctx;
+    ss_cdcjob_t *job;
+
+    while (1) {
+        pthread_mutex_lock(&(cc->lock));
+        while (cc->job_head == NULL) {
+            pthread_cond_wait(&(cc->cond), &(cc->lock));
+        }
+        job = cc->job_head;
+        cc->job_head = job->next;
+        if (cc->job_head == NULL) {
+            cc->job_tail = NULL;
+        }
+        pthread_mutex_unlock(&(cc->lock));
+
+        switch (job->type) {
+        case SS_CDCJOB_INDEX:
+            ss_cdc_index(ctx, cc, job);
+            break;
+        case SS_CDCJOB_LOCAL:
+            ss_cdc_asm_local(ctx, cc, job->as);
+            break;
+        case SS_CDCJOB_CHECK:
+            ss_cdc_asm_check(job->as);
+            break;
+        case SS_CDCJOB_SET:
+            ss_cdc_file_set(cc, job->as->name, &(job->as->st), job->as->ent, job->as->n_chunk);
+            ss_cdc_asm_free(job->as);
+            job->as = NULL;
+            break;
+        }
+
+        if (job->as) {
+            pthread_mutex_lock(&(cc->lock));
+            job->next = cc->done;
+            cc->done = job;
+            pthread_mutex_unlock(&(cc->lock));
+            ss_com_notify(&(ctx->com));
+        } else {
+            free(job);
+        }
+    }
+
+    return NULL;
+}
+
+static void ss_cdc_job_put(ss_cdc_cli_t *cc, ss_cdcjob_t *job)
+{
+    pthread_mutex_lock(&(cc->lock));
+    if (cc->job_tail) {
+        cc->job_tail->next = job;
+    } else {
+        cc->job_head = job;
+    }
+    cc->job_tail = job;
+    pthread_cond_signal(&(cc->cond));
+    pthread_mutex_unlock(&(cc->lock));
+}
+
+/* hand as to the thread, but for SET it comes back with SS_CBTYPE_EVENT */
+static void ss_cdc_job(ss_cdc_cli_t *cc, ss_cdcjob_e type, ss_cdcasm_t *as)
+{
+    ss_cdcjob_t *job;
+
+    job = (ss_cdcjob_t *)calloc(1, sizeof(ss_cdcjob_t));
+    SS_ASSERT(job);
+    job->type = type;
+    job->as = as;
+    if (type != SS_CDCJOB_SET) {
+        as->held = 1;
+    }
+    ss_cdc_job_put(cc, job);
+}
+
+/*
+ * an index pass over the large files of dm, their names are taken along.
+ * whether there is anything to index at all is seen here, a stat or a few.
+ */
+static void ss_cdc_job_index(ss_ctx_t *ctx, ss_cdc_cli_t *cc)
+{
+    char pathname[SS_MAXPATH_LEN];
+    ss_dirmeta_t *dm = ctx->dm;
+    ss_cdcjob_t *job;
+    struct stat st;
+    uint32_t i, len = 0;
+    char *p;
+
+    cc->on_disk = 0;
+    for (i = 0; i < dm->n_file; i++) {
+        if (dm->fml[i].size < SS_CDC_MINSIZE) {
+            continue;
+        }
+        len += strlen(dm->fml[i].name) + 1;
+        if (!cc->on_disk &&
+            (snprintf(pathname, sizeof(pathname), "%s/%s", ctx->localpath, dm->fml[i].name) < (int)sizeof(pathname)) &&
+            (stat(pathname, &st) == 0) && (st.st_size >= SS_CDC_MINSIZE)) {
+            cc->on_disk = 1;
+        }
+    }
+
+    job = (ss_cdcjob_t *)calloc(1, sizeof(ss_cdcjob_t) + len);
+    SS_ASSERT(job);
+    job->type = SS_CDCJOB_INDEX;
+    job->gen = ctx->u.cli.dm_gen;
+    for (i = 0, p = job->names; i < dm->n_file; i++) {
+        if (dm->fml[i].size >= SS_CDC_MINSIZE) {
+            strcpy(p, dm->fml[i].name);
+            p += strlen(p) + 1;
+            job->n_name++;
+        }
+    }
+
+    cc->gen_asked = job->gen;
+    ss_cdc_job_put(cc, job);
+}
+
+static ss_cdc_cli_t *ss_cdc_cli_get(ss_ctx_t *ctx)
+{
+    ss_cdc_cli_t *cc = ctx->u.cli.cdc;
+
+    if (cc == NULL) {
+        cc = (ss_cdc_cli_t *)calloc(1, sizeof(ss_cdc_cli_t));
+        SS_ASSERT(cc);
+        cc->ctx = ctx;
+        cc->ref_bucket = (ss_cdcref_t **)calloc(SS_CDC_BUCKETS, sizeof(ss_cdcref_t *));
+        cc->file_bucket = (ss_cdcfile_t **)calloc(SS_CDC_BUCKETS, sizeof(ss_cdcfile_t *));
+        cc->buf = (uint8_t *)malloc(SS_CDC_MAXCHUNK);
+        SS_ASSERT(cc->ref_bucket && cc->file_bucket && cc->buf);
+        cc->gen_asked = ctx->u.cli.dm_gen - 1;
+        pthread_mutex_init(&(cc->lock), NULL);
+        pthread_cond_init(&(cc->cond), NULL);
+
+        if (pthread_create(&(cc->thread), NULL, ss_cdc_thread, cc)) {
+            printf("cdc: thread create faild, large files are fetched whole.\n");
+        } else {
+            cc->threaded = 1;
+        }
+        ctx->u.cli.cdc = cc;
+    }
+
+    return cc;
+}
+
+static void ss_cdc_send_filereq(ss_ctx_t *ctx, ss_msgtype_e type, char *name)
+{
+    char buf[sizeof(ss_filereq_t) + SS_MAXPATH_LEN];
+    ss_filereq_t *req = (ss_filereq_t *)buf;
+    uint32_t len = strlen(name) + 1;
+
+    memset(req, 0, sizeof(ss_filereq_t));
+    memcpy(req->name, name, len);
+
+    ss_send_msg(ctx->com.main_inst, type, req, sizeof(ss_filereq_t) + len);
+}
+
+/* ask for the chunk map of a large file, -1: not worth it, use FILE_REQ */
+int ss_cdc_cli_file(ss_ctx_t *ctx, ss_filemeta_t *fm)
+{
+    ss_cdc_cli_t *cc;
+
+    if ((ctx->u.cli.srv_ver < SS_VER_CDC) || (fm->size < SS_CDC_MINSIZE) || (fm->hash == 0) ||
+        (ctx->swarm && (fm->size >= SS_SWARM_MINSIZE))) {
+        return -1;
+    }
+
+    cc = ss_cdc_cli_get(ctx);
+    if (!cc->threaded) {
+        return -1;
+    }
+    if (cc->gen_asked != ctx->u.cli.dm_gen) {
+        ss_cdc_job_index(ctx, cc);
+    }
+
+    /* nothing to take chunks from */
+    if (!cc->on_disk) {
+        return -1;
+    }
+
+    ss_cdc_send_filereq(ctx, SS_MSGTYPE_FILE_CREQ, fm->name);
+
+    return 0;
+}
+
+static uint32_t ss_cdc_range_get(ss_cdc_cli_t *cc)
+{
+    uint32_t i;
+
+    for (i = 0; i < cc->n_range; i++) {
+        if (cc->range[i].as == NULL) {
+            return i;
+        }
+    }
+
+    cc->range = (ss_cdcrange_t *)realloc(cc->range, (cc->n_range + 64) * sizeof(ss_cdcrange_t));
+    SS_ASSERT(cc->range);
+    memset(cc->range + cc->n_range, 0, 64 * sizeof(ss_cdcrange_t));
+    cc->n_range += 64;
+
+    return i;
+}
+
+static void ss_cdc_send_rreq(ss_ctx_t *ctx, char *name, uint64_t off, uint64_t len, uint32_t token)
+{
+    char buf[sizeof(ss_filerreq_t) + SS_MAXPATH_LEN];
+    ss_filerreq_t *rreq = (ss_filerreq_t *)buf;
+    uint32_t len_name = strlen(name) + 1;
+
+    memset(rreq, 0, sizeof(ss_filerreq_t));
+    rreq->off = off;
+    rreq->len = len;
+    rreq->token = token;
+    memcpy(rreq->name, name, len_name);
+
+    ss_send_msg(ctx->com.main_inst, SS_MSGTYPE_FILE_RREQ, rreq, sizeof(ss_filerreq_t) + len_name);
+}
+
+/* the hash is checked, put the file in place or fetch it the plain way */
+static void ss_cdc_asm_finish(ss_ctx_t *ctx, ss_cdcasm_t *as)
+{
+    ss_cdc_cli_t *cc = ctx->u.cli.cdc;
+    char pathname[SS_MAXPATH_LEN];
+    ss_cdcasm_t **pp;
+    int indexed = 0;
+
+    for (pp = &(cc->as_list); *pp; pp = &((*pp)->next)) {
+        if (*pp == as) {
+            *pp = as->next;
+            break;
+        }
+    }
+
+    if (as->failed) {
+        ss_wr_abort(ctx, as->fd, as->name);
+    } else if (ss_wr_commit(ctx, as->fd, as->name)) {
+        as->failed = 1;
+    }
+
+    if (as->failed) {
+        ss_cdc_send_filereq(ctx, SS_MSGTYPE_FILE_REQ, as->name);
+    } else {
+        if ((snprintf(pathname, sizeof(pathname), "%s/%s", ctx->localpath, as->name) < (int)sizeof(pathname)) &&
+            (stat(pathname, &(as->st)) == 0)) {
+            indexed = 1;
+        }
+        printf("cdc: %s done.\n", as->name);
+        ss_cli_file_done(ctx, as->name, SS_FILEDONE_SAVED, as->mtime, as->size);
+    }
+
+    if (indexed) {
+        ss_cdc_job(cc, SS_CDCJOB_SET, as);
+    } else {
+        ss_cdc_asm_free(as);
+    }
+}
+
+/* all ranges are in, a failed file is not worth the hashing */
+static void ss_cdc_asm_done(ss_ctx_t *ctx, ss_cdcasm_t *as)
+{
+    if (as->failed) {
+        ss_cdc_asm_finish(ctx, as);
+    } else {
+        ss_cdc_job(ctx->u.cli.cdc, SS_CDCJOB_CHECK, as);
+    }
+}
+
+/* the chunks of as the mirror has are in, the runs of the others are fetched */
+static void ss_cdc_asm_fetch(ss_ctx_t *ctx, ss_cdc_cli_t *cc, ss_cdcasm_t *as)
+{
+    ss_cdcrange_t *rg;
+    uint64_t fetch = 0;
+    uint32_t i, idx;
+
+    for (i = 0; i < as->n_run; i++) {
+        idx = ss_cdc_range_get(cc);
+        rg = &(cc->range[idx]);
+        rg->as = as;
+        rg->off = as->run[i].off;
+        rg->len = as->run[i].len;
+        as->n_left++;
+        fetch += rg->len;
+        ss_cdc_send_rreq(ctx, as->name, rg->off, rg->len, SS_CDC_TOKEN | idx);
+    }
+
+    printf("cdc: %s, %u of %u chunks local, %lu bytes to fetch\n", as->name, as->n_local, as->n_chunk, fetch);
+
+    if (as->n_left == 0) {
+        ss_cdc_asm_done(ctx, as);
+    }
+}
+
+/* epoll thread, on SS_CBTYPE_EVENT: the jobs the thread is done with */
+void ss_cdc_cli_pickup(ss_ctx_t *ctx)
+{
+    ss_cdc_cli_t *cc = ctx->u.cli.cdc;
+    ss_cdcjob_t *job, *next;
+    ss_cdcasm_t *as;
+
+    if (cc == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&(cc->lock));
+    job = cc->done;
+    cc->done = NULL;
+    pthread_mutex_unlock(&(cc->lock));
+
+    for (; job; job = next) {
+        next = job->next;
+        as = job->as;
+        as->held = 0;
+
+        if (as->dropped) {
+            /* its temp file is gone already, see ss_cdc_cli_reset */
+            close(as->fd);
+            ss_cdc_asm_free(as);
+        } else if (job->type == SS_CDCJOB_LOCAL) {
+            ss_cdc_asm_fetch(ctx, cc, as);
+        } else {
+            ss_cdc_asm_finish(ctx, as);
+        }
+        free(job);
+    }
+}
+
+/* the chunk map of a file asked for with FILE_CREQ */
+void ss_cdc_cli_map(ss_com_inst_t *inst, ss_filecres_t *cres, uint32_t len)
+{
+    ss_ctx_t *ctx = (ss_ctx_t *)inst->com->param;
+    ss_cdc_cli_t *cc = ss_cdc_cli_get(ctx);
+    char *name;
+    ss_cdcasm_t *as;
+    uint64_t sum = 0;
+    uint32_t i;
+
+    if ((len < sizeof(ss_filecres_t)) ||
+        ((uint64_t)cres->n_chunk * sizeof(ss_cdcent_t) + cres->name_len + 1 > len - sizeof(ss_filecres_t)) ||
+        (cres->name_len >= SS_MAXPATH_LEN)) {
+        printf("\tbroken chunk map, drop.\n");
+        return;
+    }
+    name = (char *)(cres->ent + cres->n_chunk);
+    name[cres->name_len] = '\0';
+
+    if (ss_dm_find(ctx->dm, name) == NULL) {
+        return;
+    }
+
+    for (i = 0; i < cres->n_chunk; i++) {
+        sum += cres->ent[i].len;
+        if ((cres->ent[i].len == 0) || (cres->ent[i].len > SS_CDC_MAXCHUNK)) {
+            break;
+        }
+    }
+    if (!(cres->flag & SS_FILERES_VALID) || !(cres->flag & SS_FILERES_EXIST) ||
+        (i != cres->n_chunk) || (sum != cres->size) || !cc->threaded) {
+        /* gone or odd, the plain way sorts it out */
+        ss_cdc_send_filereq(ctx, SS_MSGTYPE_FILE_REQ, name);
+        return;
+    }
+
+    as = (ss_cdcasm_t *)calloc(1, sizeof(ss_cdcasm_t));
+    SS_ASSERT(as);
+    strcpy(as->name, name);
+    as->size = cres->size;
+    as->mtime = cres->mtime;
+    as->hash = cres->hash;
+    as->n_chunk = cres->n_chunk;
+    as->ent = (ss_cdcent_t *)malloc((cres->n_chunk + 1) * sizeof(ss_cdcent_t));
+    SS_ASSERT(as->ent);
+    memcpy(as->ent, cres->ent, cres->n_chunk * sizeof(ss_cdcent_t));
+
+    /* local zero chunks are not written, they stay holes */
+    as->fd = ss_wr_open(ctx, name, as->size, 1);
+    if (as->fd < 0) {
+        ss_cdc_asm_free(as);
+        ss_cdc_send_filereq(ctx, SS_MSGTYPE_FILE_REQ, name);
+        return;
+    }
+
+    as->next = cc->as_list;
+    cc->as_list = as;
+
+    /* behind the index pass of this update, if one is queued */
+    ss_cdc_job(cc, SS_CDCJOB_LOCAL, as);
+}
+
+/* a FILE_RRES frame, 0 if it was one of a missing run, -1 if it is not ours */
+int ss_cdc_cli_res(ss_com_inst_t *inst, ss_msghead_t *msghead, void *body)
+{
+    ss_ctx_t *ctx = (ss_ctx_t *)inst->com->param;
+    ss_cdc_cli_t *cc = ctx->u.cli.cdc;
+    ss_filerres_t *res = (ss_filerres_t *)body;
+    ss_cdcrange_t *rg = NULL;
+    ss_cdcasm_t *as;
+    uint32_t i, idx, off = 0;
+    ssize_t ret;
+
+    if ((cc == NULL) || (inst != ctx->com.main_inst)) {
+        return -1;
+    }
+
+    if (msghead->sop) {
+        if ((msghead->len < sizeof(ss_filerres_t)) || !(res->token & SS_CDC_TOKEN)) {
+            return -1;
+        }
+        idx = res->token & ~SS_CDC_TOKEN;
+        if ((idx >= cc->n_range) || (cc->range[idx].as == NULL)) {
+            printf("cdc: unknown range, drop.\n");
+            return 0;
+        }
+        rg = &(cc->range[idx]);
+        rg->sid = msghead->sid;
+        as = rg->as;
+
+        off = sizeof(ss_filerres_t) + strnlen(res->name, msghead->len - sizeof(ss_filerres_t)) + 1;
+        if (!(res->flag & SS_FILERES_EXIST) || (res->size != as->size) || (res->mtime != as->mtime) ||
+            (res->off != rg->off) || (res->len != rg->len)) {
+            /* changed since the map, the hash check would fail anyway */
+            as->failed = 1;
+        }
+    } else {
+        for (i = 0; i < cc->n_range; i++) {
+            if (cc->range[i].as && cc->range[i].sid && (cc->range[i].sid == msghead->sid)) {
+                rg = &(cc->range[i]);
+                break;
+            }
+        }
+        if (rg == NULL) {
+            return -1;
+        }
+        as = rg->as;
+    }
+
+    while ((off < msghead->len) && !as->failed) {
+        if (rg->got + (msghead->len - off) > rg->len) {
+            as->failed = 1;
+            break;
+        }
+        ret = ss_pwrite_sparse(as->fd, (char *)body + off, msghead->len - off, rg->off + rg->got);
+        if (ret <= 0) {
+            printf("cdc: write %s faild.\n", as->name);
+            as->failed = 1;
+            break;
+        }
+        off += ret;
+        rg->got += ret;
+    }
+
+    if (msghead->eop) {
+        if (rg->got != rg->len) {
+            as->failed = 1;
+        }
+        memset(rg, 0, sizeof(ss_cdcrange_t));
+        if (--(as->n_left) == 0) {
+            ss_cdc_asm_done(ctx, as);
+        }
+    }
+
+    return 0;
+}
+
+/* the main connection is lost, the files being put together are dropped without a callback */
+void ss_cdc_cli_reset(ss_ctx_t *ctx)
+{
+    ss_cdc_cli_t *cc = ctx->u.cli.cdc;
+    ss_cdcasm_t *as;
+
+    if (cc == NULL) {
+        return;
+    }
+
+    while ((as = cc->as_list) != NULL) {
+        cc->as_list = as->next;
+        if (as->held) {
+            /* the thread still writes to it, only the name goes now, a new temp file may take it */
+            ss_wr_abort(ctx, -1, as->name);
+            as->dropped = 1;
+        } else {
+            ss_wr_abort(ctx, as->fd, as->name);
+            ss_cdc_asm_free(as);
+        }
+    }
+
+    if (cc->range) {
+        memset(cc->range, 0, cc->n_range * sizeof(ss_cdcrange_t));
+    }
+}
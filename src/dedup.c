@@ -0,0 +1,273 @@
+#define _GNU_SOURCE
+#include "pub.h"
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+/*
+ * whole file dedup on the cli
+ *
+ * a file to fetch whose content hash is already in the mirror under another
+ * name is copied locally instead: a FICLONE reflink where the fs can share
+ * extents, copy_file_range or a plain copy otherwise. of several files to
+ * fetch with the same content only the first one is asked for, the others
+ * are copied from it once it is saved, or asked for if that failed.
+ */
+
+/* a file waiting for the one with its content to be saved */
+typedef struct {
+    uint32_t                idx;            /* dm index */
+    uint32_t                leader;         /* dm index of the one fetched */
+} ss_dedup_wait_t;
+
+typedef struct _ss_dedup_cli {
+    ss_dedup_wait_t         *wait;
+    uint32_t                n_wait;
+} ss_dedup_cli_t;
+
+static int ss_dedup_comp(const void *a, const void *b)
+{
+    const ss_filemeta_t *pa = *(ss_filemeta_t **)a;
+    const ss_filemeta_t *pb = *(ss_filemeta_t **)b;
+
+    if (pa->hash != pb->hash) {
+        return pa->hash < pb->hash ? -1 : 1;
+    }
+    if (pa->size != pb->size) {
+        return pa->size < pb->size ? -1 : 1;
+    }
+
+    /* the same content, the first in dm order leads */
+    return (pa > pb) - (pa < pb);
+}
+
+static int ss_dedup_same(ss_filemeta_t *a, ss_filemeta_t *b)
+{
+    return (a->hash == b->hash) && (a->size == b->size);
+}
+
+/* one of have with the content of fm, have is sorted by ss_dedup_comp */
+static ss_filemeta_t **ss_dedup_find(ss_filemeta_t **have, uint32_t n_have, ss_filemeta_t *fm)
+{
+    uint32_t lo = 0, hi = n_have, mid;
+
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if ((have[mid]->hash < fm->hash) ||
+            ((have[mid]->hash == fm->hash) && (have[mid]->size < fm->size))) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return ((lo < n_have) && ss_dedup_same(have[lo], fm)) ? &(have[lo]) : NULL;
+}
+
+/*
+ * copy src to dst within the mirror, -1 if src is not what the dm says.
+ * the mirror keeps no mtimes of its own to key a hash on, src is hashed
+ * as the srv hashes its files: a local edit of the same size is not copied.
+ */
+static int ss_dedup_copy(ss_ctx_t *ctx, ss_filemeta_t *src, ss_filemeta_t *dst)
+{
+    char srcpath[SS_MAXPATH_LEN], buf[64 * 1024];
+    struct stat st;
+    uint64_t off = 0, hash;
+    ssize_t ret, len, n = 0;
+    int sfd, dfd;
+
+    if (snprintf(srcpath, sizeof(srcpath), "%s/%s", ctx->localpath, src->name) >= (int)sizeof(srcpath)) {
+        printf("dedup: path of %s too long.\n", src->name);
+        return -1;
+    }
+
+    sfd = open(srcpath, O_RDONLY);
+    if (sfd < 0) {
+        return -1;
+    }
+    if (fstat(sfd, &st) || ((uint64_t)st.st_size != dst->size) ||
+        ss_file_xxh64(sfd, dst->size, &hash) || (hash != dst->hash)) {
+        printf("dedup: %s changed, fetch %s.\n", src->name, dst->name);
+        close(sfd);
+        return -1;
+    }
+
+    /* empty, a reflink wants the whole file */
+    dfd = ss_wr_open(ctx, dst->name, 0, 0);
+    if (dfd < 0) {
+        close(sfd);
+        return -1;
+    }
+
+    if (dst->size && ioctl(dfd, FICLONE, sfd)) {
+        /* no reflink here, let the kernel copy, then by hand from where it stopped */
+        while (off < dst->size) {
+            ret = copy_file_range(sfd, NULL, dfd, NULL, dst->size - off, 0);
+            if (ret <= 0) {
+                break;
+            }
+            off += ret;
+        }
+        while (off < dst->size) {
+            len = read(sfd, buf, sizeof(buf));
+            if (len <= 0) {
+                break;
+            }
+            for (n = 0; n < len; n += ret) {
+                ret = write(dfd, buf + n, len - n);
+                if (ret <= 0) {
+                    break;
+                }
+            }
+            if (n < len) {
+                break;
+            }
+            off += len;
+        }
+        if (off < dst->size) {
+            printf("dedup: copy %s faild.\n", dst->name);
+            close(sfd);
+            ss_wr_abort(ctx, dfd, dst->name);
+            return -1;
+        }
+    }
+
+    close(sfd);
+    if (ss_wr_commit(ctx, dfd, dst->name)) {
+        return -1;
+    }
+
+    printf("dedup %s -> %s\n", src->name, dst->name);
+
+    return 0;
+}
+
+/*
+ * after ss_do_fileupdate: copy what the mirror already has, hold back
+ * files whose content another pending one brings. newdm is about to
+ * become ctx->dm.
+ */
+void ss_dedup_cli_plan(ss_ctx_t *ctx, ss_dirmeta_t *newdm)
+{
+    ss_dedup_cli_t *dd = ctx->u.cli.dedup;
+    ss_filemeta_t **have, **pend, **hit, *fm, *lead;
+    uint8_t *pending;
+    uint32_t i, n_have = 0, n_pend = 0;
+
+    if (ctx->u.cli.n_pend == 0) {
+        return;
+    }
+
+    if (dd == NULL) {
+        dd = (ss_dedup_cli_t *)calloc(1, sizeof(ss_dedup_cli_t));
+        SS_ASSERT(dd);
+        ctx->u.cli.dedup = dd;
+    }
+    SS_ASSERT(dd->n_wait == 0);
+
+    pending = (uint8_t *)calloc(newdm->n_file + 1, 1);
+    have = (ss_filemeta_t **)malloc((newdm->n_file + 1) * sizeof(ss_filemeta_t *));
+    pend = (ss_filemeta_t **)malloc((ctx->u.cli.n_pend + 1) * sizeof(ss_filemeta_t *));
+    dd->wait = (ss_dedup_wait_t *)realloc(dd->wait, (ctx->u.cli.n_pend + 1) * sizeof(ss_dedup_wait_t));
+    SS_ASSERT(pending && have && pend && dd->wait);
+
+    for (i = 0; i < ctx->u.cli.n_pend; i++) {
+        pending[ctx->u.cli.pend[i]] = 1;
+    }
+
+    /* what is in place already */
+    for (i = 0; i < newdm->n_file; i++) {
+        if (!pending[i] && newdm->fml[i].hash) {
+            have[n_have++] = &(newdm->fml[i]);
+        }
+    }
+    qsort(have, n_have, sizeof(ss_filemeta_t *), ss_dedup_comp);
+
+    for (i = 0; i < ctx->u.cli.n_pend; i++) {
+        fm = &(newdm->fml[ctx->u.cli.pend[i]]);
+        hit = fm->hash ? ss_dedup_find(have, n_have, fm) : NULL;
+        if (hit && (ss_dedup_copy(ctx, *hit, fm) == 0)) {
+            ctx->u.cli.n_update--;
+            continue;
+        }
+
+        pend[n_pend] = fm;
+        ctx->u.cli.pend[n_pend++] = ctx->u.cli.pend[i];
+    }
+    ctx->u.cli.n_pend = n_pend;
+
+    /* several of the same content, the first leads and the others wait for it */
+    qsort(pend, n_pend, sizeof(ss_filemeta_t *), ss_dedup_comp);
+    memset(pending, 0, newdm->n_file + 1);
+    for (i = 1, lead = n_pend ? pend[0] : NULL; i < n_pend; i++) {
+        if ((pend[i]->hash == 0) || !ss_dedup_same(pend[i], lead)) {
+            lead = pend[i];
+            continue;
+        }
+        dd->wait[dd->n_wait].idx = pend[i] - newdm->fml;
+        dd->wait[dd->n_wait].leader = lead - newdm->fml;
+        dd->n_wait++;
+        pending[pend[i] - newdm->fml] = 1;
+    }
+
+    if (dd->n_wait) {
+        for (i = 0, n_pend = 0; i < ctx->u.cli.n_pend; i++) {
+            if (!pending[ctx->u.cli.pend[i]]) {
+                ctx->u.cli.pend[n_pend++] = ctx->u.cli.pend[i];
+            }
+        }
+        ctx->u.cli.n_pend = n_pend;
+        printf("dedup: %d files wait for one with the same content\n", dd->n_wait);
+    }
+
+    free(pending);
+    free(have);
+    free(pend);
+}
+
+/* fm has been settled, copy it to the ones waiting for it or ask for them */
+void ss_dedup_cli_settled(ss_ctx_t *ctx, ss_filemeta_t *fm, ss_filedone_e how)
+{
+    ss_dedup_cli_t *dd = ctx->u.cli.dedup;
+    ss_filemeta_t *dst;
+    uint32_t i, n_wait = 0, leader;
+
+    if ((dd == NULL) || (dd->n_wait == 0)) {
+        return;
+    }
+
+    leader = fm - ctx->dm->fml;
+    for (i = 0; i < dd->n_wait; i++) {
+        if (dd->wait[i].leader != leader) {
+            dd->wait[n_wait++] = dd->wait[i];
+            continue;
+        }
+
+        dst = &(ctx->dm->fml[dd->wait[i].idx]);
+        if ((how == SS_FILEDONE_SAVED) && fm->hash && ss_dedup_same(fm, dst) &&
+            (ss_dedup_copy(ctx, fm, dst) == 0)) {
+            SS_ASSERT(ctx->u.cli.n_update);
+            ctx->u.cli.n_update--;
+        } else {
+            /* not what it was meant to be, fetch it after all */
+            ctx->u.cli.pend[ctx->u.cli.n_pend++] = dd->wait[i].idx;
+        }
+    }
+    dd->n_wait = n_wait;
+}
+
+/* the main connection is lost, the files waiting go back to pend, they are not settled */
+void ss_dedup_cli_reset(ss_ctx_t *ctx)
+{
+    ss_dedup_cli_t *dd = ctx->u.cli.dedup;
+    uint32_t i;
+
+    if (dd == NULL) {
+        return;
+    }
+
+    for (i = 0; i < dd->n_wait; i++) {
+        ctx->u.cli.pend[ctx->u.cli.n_pend++] = dd->wait[i].idx;
+    }
+    dd->n_wait = 0;
+}
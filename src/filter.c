@@ -0,0 +1,192 @@
+#include "pub.h"
+
+/*
+ * -m / -i filters
+ *
+ * a path is taken if it contains one of the match patterns, or there are
+ * none, and none of the ignore patterns. each list is compiled once into an
+ * aho-corasick automaton with every transition resolved, so a path costs
+ * one table step per byte however many patterns there are. the state is
+ * carried down the directory tree by path_scan: a name only feeds its own
+ * bytes, and a directory whose path with a trailing '/' already contains
+ * an ignore pattern is not entered at all, since every path below it
+ * contains it as well. a directory that contains a match pattern lets
+ * everything below it match.
+ */
+
+typedef struct _ss_acm {
+    uint32_t                (*next)[256];
+    uint8_t                 *out;           /* a pattern ends here */
+    uint32_t                n_state;
+} ss_acm_t;
+
+static ss_acm_t *ss_acm_build(char **pat, int n_pat)
+{
+    ss_acm_t *ac;
+    uint32_t *fail, *queue, n_max = 1, head = 0, tail = 0, s, t, f;
+    uint8_t *p;
+    int i, c;
+
+    if (n_pat == 0) {
+        return NULL;
+    }
+
+    for (i = 0; i < n_pat; i++) {
+        n_max += strlen(pat[i]);
+    }
+
+    ac = (ss_acm_t *)calloc(1, sizeof(ss_acm_t));
+    SS_ASSERT(ac);
+    ac->next = (uint32_t (*)[256])calloc(n_max, sizeof(*(ac->next)));
+    ac->out = (uint8_t *)calloc(n_max, 1);
+    fail = (uint32_t *)calloc(n_max, sizeof(uint32_t));
+    queue = (uint32_t *)malloc(n_max * sizeof(uint32_t));
+    SS_ASSERT(ac->next && ac->out && fail && queue);
+    ac->n_state = 1;
+
+    /* the trie, no edge leads back to the root so 0 is no edge */
+    for (i = 0; i < n_pat; i++) {
+        for (s = 0, p = (uint8_t *)pat[i]; *p; p++) {
+            if (ac->next[s][*p] == 0) {
+                ac->next[s][*p] = ac->n_state++;
+            }
+            s = ac->next[s][*p];
+        }
+        ac->out[s] = 1;
+    }
+
+    /* breadth first, a missing edge is the one of the fail state */
+    for (c = 0; c < 256; c++) {
+        if ((t = ac->next[0][c]) != 0) {
+            queue[tail++] = t;
+        }
+    }
+    while (head < tail) {
+        s = queue[head++];
+        f = fail[s];
+        ac->out[s] |= ac->out[f];
+        for (c = 0; c < 256; c++) {
+            t = ac->next[s][c];
+            if (t) {
+                fail[t] = ac->next[f][c];
+                queue[tail++] = t;
+            } else {
+                ac->next[s][c] = ac->next[f][c];
+            }
+        }
+    }
+
+    free(fail);
+    free(queue);
+
+    return ac;
+}
+
+/* feed s, returns 1 once a pattern has been seen */
+static int ss_acm_feed(ss_acm_t *ac, uint32_t *state, const char *s)
+{
+    uint32_t st = *state;
+
+    for (; *s; s++) {
+        st = ac->next[st][(uint8_t)*s];
+        if (ac->out[st]) {
+            *state = st;
+            return 1;
+        }
+    }
+    *state = st;
+
+    return 0;
+}
+
+void ss_filter_compile(ss_filefilter_t *ff)
+{
+    if (ff->compiled) {
+        return;
+    }
+
+    ff->ac_ignore = ss_acm_build(ff->ignore, ff->n_ignore);
+    ff->ac_match = ss_acm_build(ff->match, ff->n_match);
+    ff->compiled = 1;
+}
+
+static void ss_acm_free(ss_acm_t *ac)
+{
+    if (ac) {
+        free(ac->next);
+        free(ac->out);
+        free(ac);
+    }
+}
+
+void ss_filter_free(ss_filefilter_t *ff)
+{
+    ss_acm_free(ff->ac_ignore);
+    ss_acm_free(ff->ac_match);
+    ff->ac_ignore = ff->ac_match = NULL;
+    ff->compiled = 0;
+}
+
+/* where the root of a scan starts, paths are matched as "/dir/name". 0: nothing is taken */
+int ss_filter_root(ss_filefilter_t *ff, ss_filterpos_t *pos)
+{
+    ss_filter_compile(ff);
+
+    memset(pos, 0, sizeof(ss_filterpos_t));
+    pos->matched = (ff->ac_match == NULL);
+
+    return ss_filter_dir(ff, pos, "", pos);
+}
+
+/* pos is at dir/, whether its file name is taken */
+int ss_filter_file(ss_filefilter_t *ff, ss_filterpos_t *pos, char *name)
+{
+    uint32_t st;
+
+    if (ff->ac_ignore) {
+        st = pos->ignore;
+        if (ss_acm_feed(ff->ac_ignore, &st, name)) {
+            return 0;
+        }
+    }
+
+    if (!pos->matched) {
+        st = pos->match;
+        return ss_acm_feed(ff->ac_match, &st, name);
+    }
+
+    return 1;
+}
+
+/* pos is at dir/, sub is set at dir/name/. 0: nothing below it is taken, skip it */
+int ss_filter_dir(ss_filefilter_t *ff, ss_filterpos_t *pos, char *name, ss_filterpos_t *sub)
+{
+    ss_filterpos_t next = *pos;
+
+    if (ff->ac_ignore &&
+        (ss_acm_feed(ff->ac_ignore, &(next.ignore), name) || ss_acm_feed(ff->ac_ignore, &(next.ignore), "/"))) {
+        return 0;
+    }
+
+    if (!next.matched) {
+        next.matched = ss_acm_feed(ff->ac_match, &(next.match), name) ||
+                       ss_acm_feed(ff->ac_match, &(next.match), "/");
+    }
+
+    *sub = next;
+
+    return 1;
+}
+
+/* a whole relative path, as "/dir/name" */
+int ss_filter_path(ss_filefilter_t *ff, char *path)
+{
+    uint32_t st = 0;
+
+    if (ff->ac_ignore && ss_acm_feed(ff->ac_ignore, &st, path)) {
+        return 0;
+    }
+
+    st = 0;
+    return (ff->ac_match == NULL) || ss_acm_feed(ff->ac_match, &st, path);
+}
@@ -0,0 +1,182 @@
+#include "pub.h"
+
+#define XXH_PRIME64_1               0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2               0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3               0x165667B19E3779F9ULL
+#define XXH_PRIME64_4               0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5               0x27D4EB2F165667C5ULL
+
+static inline uint64_t xxh_rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t xxh_read64(const uint8_t *p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t xxh_read32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t xxh64_round(uint64_t acc, uint64_t input)
+{
+    acc += input * XXH_PRIME64_2;
+    acc = xxh_rotl64(acc, 31);
+    acc *= XXH_PRIME64_1;
+    return acc;
+}
+
+static inline uint64_t xxh64_merge(uint64_t acc, uint64_t val)
+{
+    acc ^= xxh64_round(0, val);
+    acc = acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+    return acc;
+}
+
+/* the 8, 4 and 1 byte steps over the tail, under 32 bytes, and the avalanche */
+static uint64_t xxh64_finish(uint64_t h, const uint8_t *p, const uint8_t *end)
+{
+    while (p + 8 <= end) {
+        h ^= xxh64_round(0, xxh_read64(p));
+        h = xxh_rotl64(h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+        p += 8;
+    }
+
+    if (p + 4 <= end) {
+        h ^= (uint64_t)xxh_read32(p) * XXH_PRIME64_1;
+        h = xxh_rotl64(h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+        p += 4;
+    }
+
+    while (p < end) {
+        h ^= (*p) * XXH_PRIME64_5;
+        h = xxh_rotl64(h, 11) * XXH_PRIME64_1;
+        p++;
+    }
+
+    h ^= h >> 33;
+    h *= XXH_PRIME64_2;
+    h ^= h >> 29;
+    h *= XXH_PRIME64_3;
+    h ^= h >> 32;
+
+    return h;
+}
+
+static uint64_t xxh64_converge(uint64_t v1, uint64_t v2, uint64_t v3, uint64_t v4)
+{
+    uint64_t h;
+
+    h = xxh_rotl64(v1, 1) + xxh_rotl64(v2, 7) + xxh_rotl64(v3, 12) + xxh_rotl64(v4, 18);
+    h = xxh64_merge(h, v1);
+    h = xxh64_merge(h, v2);
+    h = xxh64_merge(h, v3);
+    h = xxh64_merge(h, v4);
+
+    return h;
+}
+
+/* xxHash64, content fingerprint of file chunks */
+uint64_t alg_xxh64(const void *pv, uint64_t len, uint64_t seed)
+{
+    const uint8_t *p = (const uint8_t *)pv;
+    const uint8_t *end = p + len;
+    uint64_t h, v1, v2, v3, v4;
+
+    if (len >= 32) {
+        const uint8_t *limit = end - 32;
+
+        v1 = seed + XXH_PRIME64_1 + XXH_PRIME64_2;
+        v2 = seed + XXH_PRIME64_2;
+        v3 = seed;
+        v4 = seed - XXH_PRIME64_1;
+
+        do {
+            v1 = xxh64_round(v1, xxh_read64(p));
+            v2 = xxh64_round(v2, xxh_read64(p + 8));
+            v3 = xxh64_round(v3, xxh_read64(p + 16));
+            v4 = xxh64_round(v4, xxh_read64(p + 24));
+            p += 32;
+        } while (p <= limit);
+
+        h = xxh64_converge(v1, v2, v3, v4);
+    } else {
+        h = seed + XXH_PRIME64_5;
+    }
+
+    h += len;
+
+    return xxh64_finish(h, p, end);
+}
+
+/* the same hash over data that comes in pieces, a whole file read a buffer at a time */
+void alg_xxh64_init(alg_xxh64_t *st, uint64_t seed)
+{
+    memset(st, 0, sizeof(alg_xxh64_t));
+    st->seed = seed;
+    st->v[0] = seed + XXH_PRIME64_1 + XXH_PRIME64_2;
+    st->v[1] = seed + XXH_PRIME64_2;
+    st->v[2] = seed;
+    st->v[3] = seed - XXH_PRIME64_1;
+}
+
+static inline void xxh64_stripe(alg_xxh64_t *st, const uint8_t *p)
+{
+    st->v[0] = xxh64_round(st->v[0], xxh_read64(p));
+    st->v[1] = xxh64_round(st->v[1], xxh_read64(p + 8));
+    st->v[2] = xxh64_round(st->v[2], xxh_read64(p + 16));
+    st->v[3] = xxh64_round(st->v[3], xxh_read64(p + 24));
+}
+
+void alg_xxh64_update(alg_xxh64_t *st, const void *pv, uint64_t len)
+{
+    const uint8_t *p = (const uint8_t *)pv;
+    const uint8_t *end = p + len;
+    uint32_t n;
+
+    st->total += len;
+
+    if (st->n_mem + len < sizeof(st->mem)) {
+        memcpy(st->mem + st->n_mem, p, len);
+        st->n_mem += len;
+        return;
+    }
+
+    if (st->n_mem) {
+        n = sizeof(st->mem) - st->n_mem;
+        memcpy(st->mem + st->n_mem, p, n);
+        xxh64_stripe(st, st->mem);
+        p += n;
+        st->n_mem = 0;
+    }
+
+    while (p + 32 <= end) {
+        xxh64_stripe(st, p);
+        p += 32;
+    }
+
+    st->n_mem = end - p;
+    memcpy(st->mem, p, st->n_mem);
+}
+
+uint64_t alg_xxh64_digest(alg_xxh64_t *st)
+{
+    uint64_t h;
+
+    if (st->total >= 32) {
+        h = xxh64_converge(st->v[0], st->v[1], st->v[2], st->v[3]);
+    } else {
+        h = st->seed + XXH_PRIME64_5;
+    }
+
+    h += st->total;
+
+    return xxh64_finish(h, st->mem, st->mem + st->n_mem);
+}
@@ -0,0 +1,431 @@
+#include "pub.h"
+#include <errno.h>
+
+/*
+ * content hash cache of the srv
+ *
+ * every file in the dm carries the xxh64 of its content, so a cli can tell
+ * a touch from an edit. a file is hashed the first time a refresh sees it
+ * with a given (dev, ino, size, mtime) and the hash is kept under that key,
+ * so unchanged files are never read again. entries of files the last two
+ * refreshes did not come across are dropped, one miss is allowed for a
+ * file that was moved and is found again by the rescan.
+ *
+ * the hashing itself is done by a thread of its own, a refresh only queues
+ * the file and leaves its hash 0 (unknown) in the dm. once the queue is
+ * empty, or every SS_HCACHE_NOTIFY ms while it is not, the epoll thread is
+ * woken and ss_hcache_fill puts the hashes that came in into ctx->dm. a
+ * changed dm waits for the hashes of its files at most SS_HCACHE_HOLD s
+ * before its digest goes out, see ss_srv_digest. files are read with pread
+ * a buffer at a time, a file cut short under the reader is not hashed.
+ */
+
+#define SS_HCACHE_READ              (1024 * 1024)       /* bytes a pread of a file being hashed takes */
+#define SS_HCACHE_NOTIFY            1000                /* ms, the epoll thread is told of hashes at least this often */
+
+typedef struct _ss_hcent {
+    struct _ss_hcent        *next;
+    dev_t                   dev;
+    ino_t                   ino;
+    uint64_t                size;
+    time_t                  mtime;
+    uint32_t                mtime_ns;
+    uint32_t                gen;            /* of the last refresh that saw it */
+    uint64_t                hash;
+    uint32_t                queued;         /* jobs of it the hash thread has not done yet */
+} ss_hcent_t;
+
+typedef struct _ss_hcjob {
+    struct _ss_hcjob        *next;
+    dev_t                   dev;
+    ino_t                   ino;
+    uint64_t                size;
+    time_t                  mtime;
+    uint32_t                mtime_ns;
+    char                    pathname[SS_MAXPATH_LEN];
+} ss_hcjob_t;
+
+typedef struct _ss_hcache {
+    ss_ctx_t                *ctx;
+    ss_hcent_t              **bucket;
+    uint32_t                n_bucket;       /* power of 2 */
+    uint32_t                n_ent;
+    uint32_t                gen;
+
+    /* hash thread, guarded by lock */
+    pthread_mutex_t         lock;
+    pthread_cond_t          cond;
+    pthread_t               thread;
+    int                     threaded;       /* 0: files are hashed right in ss_hcache_get */
+    ss_hcjob_t              *job_head, *job_tail;
+    int                     landed;         /* hashes the epoll thread has not put into ctx->dm */
+} ss_hcache_t;
+
+static inline uint32_t ss_hcache_slot(ss_hcache_t *hc, dev_t dev, ino_t ino)
+{
+    return (uint32_t)((ino * 0x9E3779B97F4A7C15ULL) ^ dev) & (hc->n_bucket - 1);
+}
+
+static void ss_hcache_grow(ss_hcache_t *hc)
+{
+    ss_hcent_t **old = hc->bucket, *ent, *next;
+    uint32_t i, n_old = hc->n_bucket, slot;
+
+    hc->n_bucket = n_old ? n_old * 2 : SS_HCACHE_BUCKETS;
+    hc->bucket = (ss_hcent_t **)calloc(hc->n_bucket, sizeof(ss_hcent_t *));
+    SS_ASSERT(hc->bucket);
+
+    for (i = 0; i < n_old; i++) {
+        for (ent = old[i]; ent; ent = next) {
+            next = ent->next;
+            slot = ss_hcache_slot(hc, ent->dev, ent->ino);
+            ent->next = hc->bucket[slot];
+            hc->bucket[slot] = ent;
+        }
+    }
+
+    free(old);
+}
+
+static ss_hcent_t *ss_hcache_find(ss_hcache_t *hc, dev_t dev, ino_t ino)
+{
+    ss_hcent_t *ent;
+
+    for (ent = hc->bucket[ss_hcache_slot(hc, dev, ino)]; ent; ent = ent->next) {
+        if ((ent->dev == dev) && (ent->ino == ino)) {
+            break;
+        }
+    }
+
+    return ent;
+}
+
+static int ss_hcache_same(ss_hcent_t *ent, uint64_t size, time_t mtime, uint32_t mtime_ns)
+{
+    return (ent->size == size) && (ent->mtime == mtime) && (ent->mtime_ns == mtime_ns);
+}
+
+/* xxh64 of the first size bytes of fd, read a buffer at a time. -1: it is shorter, or can not be read */
+int ss_file_xxh64(int fd, uint64_t size, uint64_t *hash)
+{
+    alg_xxh64_t st;
+    uint64_t off = 0, len;
+    ssize_t ret;
+    char *buf;
+
+    buf = (char *)ss_pool_get(SS_HCACHE_READ);
+    alg_xxh64_init(&st, 0);
+    posix_fadvise(fd, 0, size, POSIX_FADV_SEQUENTIAL);
+
+    while (off < size) {
+        len = size - off < SS_HCACHE_READ ? size - off : SS_HCACHE_READ;
+        ret = pread(fd, buf, len, off);
+        if (ret <= 0) {
+            if ((ret < 0) && (errno == EINTR)) {
+                continue;
+            }
+            break;
+        }
+        alg_xxh64_update(&st, buf, ret);
+        off += ret;
+    }
+
+    ss_pool_put(buf);
+    if (off < size) {
+        return -1;
+    }
+    *hash = alg_xxh64_digest(&st);
+
+    return 0;
+}
+
+/* xxh64 of the file if it still is what the job saw, 0: it is not, or could not be read */
+static uint64_t ss_hcache_hashfile(ss_hcjob_t *job)
+{
+    struct stat st;
+    uint64_t hash = 0;
+    int fd;
+
+    fd = open(job->pathname, O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
+
+    if ((fstat(fd, &st) == 0) && (st.st_dev == job->dev) && (st.st_ino == job->ino) &&
+        ((uint64_t)st.st_size == job->size) && (st.st_mtim.tv_sec == job->mtime) &&
+        (st.st_mtim.tv_nsec == job->mtime_ns)) {
+        if (ss_file_xxh64(fd, job->size, &hash)) {
+            hash = 0;
+        } else if (hash == 0) {
+            /* 0 is kept for unknown */
+            hash = 1;
+        }
+    }
+    close(fd);
+
+    return hash;
+}
+
+static uint64_t ss_hcache_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void *ss_hcache_thread(void *arg)
+{
+    ss_hcache_t *hc = (ss_hcache_t *)arg;
+    ss_hcjob_t *job;
+    ss_hcent_t *ent;
+    uint64_t hash, told = ss_hcache_ms();
+    int drained, landed;
+
+    while (1) {
+        pthread_mutex_lock(&(hc->lock));
+        while (hc->job_head == NULL) {
+            pthread_cond_wait(&(hc->cond), &(hc->lock));
+        }
+        job = hc->job_head;
+        hc->job_head = job->next;
+        if (hc->job_head == NULL) {
+            hc->job_tail = NULL;
+        }
+        pthread_mutex_unlock(&(hc->lock));
+
+        hash = ss_hcache_hashfile(job);
+
+        pthread_mutex_lock(&(hc->lock));
+        ent = ss_hcache_find(hc, job->dev, job->ino);
+        if (ent) {
+            ent->queued--;
+            /* the file changed again while it was read, the later job has it */
+            if (hash && ss_hcache_same(ent, job->size, job->mtime, job->mtime_ns)) {
+                ent->hash = hash;
+                hc->landed = 1;
+            }
+        }
+        drained = (hc->job_head == NULL);
+        landed = hc->landed;
+        pthread_mutex_unlock(&(hc->lock));
+        free(job);
+
+        if (landed && (drained || (ss_hcache_ms() - told >= SS_HCACHE_NOTIFY))) {
+            ss_com_notify(&(hc->ctx->com));
+            told = ss_hcache_ms();
+        }
+    }
+
+    return NULL;
+}
+
+/* srv, before its first refresh */
+void ss_hcache_start(ss_ctx_t *ctx)
+{
+    ss_hcache_t *hc;
+
+    hc = (ss_hcache_t *)calloc(1, sizeof(ss_hcache_t));
+    SS_ASSERT(hc);
+    hc->ctx = ctx;
+    ss_hcache_grow(hc);
+    pthread_mutex_init(&(hc->lock), NULL);
+    pthread_cond_init(&(hc->cond), NULL);
+
+    if (pthread_create(&(hc->thread), NULL, ss_hcache_thread, hc)) {
+        printf("hash thread create faild, files are hashed as the refresh sees them.\n");
+    } else {
+        hc->threaded = 1;
+    }
+    ctx->u.srv.hcache = hc;
+}
+
+/*
+ * hash of the file st was taken of if it is cached, 0 otherwise: the file
+ * is queued for the hash thread
+ */
+uint64_t ss_hcache_get(ss_ctx_t *ctx, char *pathname, struct stat *st)
+{
+    ss_hcache_t *hc = ctx->u.srv.hcache;
+    ss_hcent_t *ent;
+    ss_hcjob_t *job;
+    uint64_t hash;
+    uint32_t slot;
+
+    if (hc == NULL) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&(hc->lock));
+    ent = ss_hcache_find(hc, st->st_dev, st->st_ino);
+    if (ent == NULL) {
+        if (hc->n_ent >= hc->n_bucket * 2) {
+            ss_hcache_grow(hc);
+        }
+        slot = ss_hcache_slot(hc, st->st_dev, st->st_ino);
+        ent = (ss_hcent_t *)calloc(1, sizeof(ss_hcent_t));
+        SS_ASSERT(ent);
+        ent->dev = st->st_dev;
+        ent->ino = st->st_ino;
+        ent->next = hc->bucket[slot];
+        hc->bucket[slot] = ent;
+        hc->n_ent++;
+    } else if (ss_hcache_same(ent, st->st_size, st->st_mtim.tv_sec, st->st_mtim.tv_nsec) &&
+               (ent->hash || ent->queued)) {
+        ent->gen = hc->gen;
+        hash = ent->hash;
+        pthread_mutex_unlock(&(hc->lock));
+        return hash;
+    }
+
+    ent->size = st->st_size;
+    ent->mtime = st->st_mtim.tv_sec;
+    ent->mtime_ns = st->st_mtim.tv_nsec;
+    ent->gen = hc->gen;
+    ent->hash = 0;
+
+    if (st->st_size == 0) {
+        hash = alg_xxh64(NULL, 0, 0);
+        ent->hash = hash ? hash : 1;
+        hash = ent->hash;
+        pthread_mutex_unlock(&(hc->lock));
+        return hash;
+    }
+
+    job = (ss_hcjob_t *)malloc(sizeof(ss_hcjob_t));
+    SS_ASSERT(job);
+    job->next = NULL;
+    job->dev = st->st_dev;
+    job->ino = st->st_ino;
+    job->size = st->st_size;
+    job->mtime = st->st_mtim.tv_sec;
+    job->mtime_ns = st->st_mtim.tv_nsec;
+    snprintf(job->pathname, sizeof(job->pathname), "%s", pathname);
+
+    if (!hc->threaded) {
+        pthread_mutex_unlock(&(hc->lock));
+        hash = ss_hcache_hashfile(job);
+        free(job);
+        pthread_mutex_lock(&(hc->lock));
+        if (ss_hcache_same(ent, st->st_size, st->st_mtim.tv_sec, st->st_mtim.tv_nsec)) {
+            ent->hash = hash;
+        }
+        pthread_mutex_unlock(&(hc->lock));
+        return hash;
+    }
+
+    ent->queued++;
+    if (hc->job_tail) {
+        hc->job_tail->next = job;
+    } else {
+        hc->job_head = job;
+    }
+    hc->job_tail = job;
+    pthread_cond_signal(&(hc->cond));
+    pthread_mutex_unlock(&(hc->lock));
+
+    return 0;
+}
+
+/*
+ * epoll thread: hashes that came in since dm was refreshed are put into
+ * it. returns the number of its files whose hash is still being computed.
+ */
+int ss_hcache_fill(ss_ctx_t *ctx, ss_dirmeta_t *dm)
+{
+    ss_hcache_t *hc = ctx->u.srv.hcache;
+    char pathname[SS_MAXPATH_LEN];
+    ss_filemeta_t *fm;
+    ss_hcent_t *ent;
+    struct stat st;
+    int i, n_set = 0, n_wait = 0;
+
+    if ((hc == NULL) || (dm == NULL)) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&(hc->lock));
+    hc->landed = 0;
+    pthread_mutex_unlock(&(hc->lock));
+
+    for (i = 0; i < dm->n_file; i++) {
+        fm = &(dm->fml[i]);
+        if (fm->hash) {
+            continue;
+        }
+        if ((snprintf(pathname, sizeof(pathname), "%s/%s", ctx->localpath, fm->name) >= sizeof(pathname)) ||
+            stat(pathname, &st)) {
+            continue;
+        }
+        /* changed since the refresh, the next one queues it again */
+        if (((uint64_t)st.st_size != fm->size) || (st.st_mtim.tv_sec != fm->mtime) || (st.st_mtim.tv_nsec != fm->mtime_ns)) {
+            continue;
+        }
+
+        pthread_mutex_lock(&(hc->lock));
+        ent = ss_hcache_find(hc, st.st_dev, st.st_ino);
+        if (ent && ss_hcache_same(ent, fm->size, fm->mtime, fm->mtime_ns)) {
+            if (ent->hash) {
+                fm->hash = ent->hash;
+                n_set++;
+            } else if (ent->queued) {
+                n_wait++;
+            }
+        }
+        pthread_mutex_unlock(&(hc->lock));
+    }
+
+    if (n_set) {
+        dm->crc = alg_crc32(dm->fml, dm->n_file * sizeof(ss_filemeta_t));
+    }
+
+    return n_wait;
+}
+
+/* epoll thread: hashes came in since the last ss_hcache_fill */
+int ss_hcache_landed(ss_ctx_t *ctx)
+{
+    ss_hcache_t *hc = ctx->u.srv.hcache;
+    int landed;
+
+    if (hc == NULL) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&(hc->lock));
+    landed = hc->landed;
+    pthread_mutex_unlock(&(hc->lock));
+
+    return landed;
+}
+
+/* a refresh is over, forget the files neither it nor the one before saw */
+void ss_hcache_sweep(ss_ctx_t *ctx)
+{
+    ss_hcache_t *hc = ctx->u.srv.hcache;
+    ss_hcent_t **pp, *ent;
+    uint32_t i;
+
+    if (hc == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&(hc->lock));
+    for (i = 0; i < hc->n_bucket; i++) {
+        pp = &(hc->bucket[i]);
+        while ((ent = *pp) != NULL) {
+            /* a queued one is looked up by the hash thread once it is done */
+            if (((hc->gen - ent->gen) > 1) && !ent->queued) {
+                *pp = ent->next;
+                free(ent);
+                hc->n_ent--;
+            } else {
+                pp = &(ent->next);
+            }
+        }
+    }
+
+    hc->gen++;
+    pthread_mutex_unlock(&(hc->lock));
+}
@@ -0,0 +1,327 @@
+#include "pub.h"
+
+/*
+ * srv prefetch and hot file cache
+ *
+ * when a digest goes out for a change, the files that changed are about
+ * to be asked for by every cli. the srv keeps a signature of each file
+ * (name, mtime, size, hash) as of the last digest, the files whose
+ * signature is new are handed to a prefetch thread: a small one is read
+ * whole into the hot cache, of a larger one the head gets a WILLNEED hint.
+ * bundles are packed from the hot cache, so a small file fanned out to
+ * many clients is read from disk once. an entry is keyed by the dm mtime
+ * (with ns) and size, it is only filled when the file on disk matches them.
+ */
+
+typedef struct _ss_hotent {
+    struct _ss_hotent       *next;          /* bucket chain */
+    struct _ss_hotent       *lru_prev, *lru_next;
+    uint64_t                key;            /* xxh64 of the name */
+    time_t                  mtime;
+    uint32_t                mtime_ns;
+    uint64_t                size;
+    char                    *data;
+    char                    name[SS_MAXPATH_LEN];
+} ss_hotent_t;
+
+/* a changed file to prefetch */
+typedef struct {
+    time_t                  mtime;
+    uint32_t                mtime_ns;
+    uint64_t                size;
+    char                    name[SS_MAXPATH_LEN];
+} ss_hotpf_t;
+
+typedef struct _ss_hot {
+    pthread_mutex_t         lock;
+    ss_hotent_t             *bucket[SS_HOT_BUCKETS];
+    ss_hotent_t             *lru_head, *lru_tail;   /* most recent first */
+    uint64_t                bytes;
+
+    /* epoll thread only */
+    uint64_t                *sig;           /* sorted, as of the last digest */
+    uint32_t                n_sig;
+    int                     have_sig;
+
+    /* handed to the prefetch thread */
+    pthread_mutex_t         pf_lock;
+    pthread_cond_t          pf_cond;
+    ss_hotpf_t              *pf;
+    uint32_t                n_pf;
+    pthread_t               pf_thread;
+    ss_ctx_t                *ctx;
+} ss_hot_t;
+
+static ss_hotent_t **ss_hot_find(ss_hot_t *hot, char *name, uint64_t key)
+{
+    ss_hotent_t **pp;
+
+    for (pp = &(hot->bucket[key & (SS_HOT_BUCKETS - 1)]); *pp; pp = &((*pp)->next)) {
+        if (((*pp)->key == key) && (strcmp((*pp)->name, name) == 0)) {
+            break;
+        }
+    }
+
+    return pp;
+}
+
+static void ss_hot_lru_unlink(ss_hot_t *hot, ss_hotent_t *ent)
+{
+    if (ent->lru_prev) {
+        ent->lru_prev->lru_next = ent->lru_next;
+    } else {
+        hot->lru_head = ent->lru_next;
+    }
+    if (ent->lru_next) {
+        ent->lru_next->lru_prev = ent->lru_prev;
+    } else {
+        hot->lru_tail = ent->lru_prev;
+    }
+    ent->lru_prev = ent->lru_next = NULL;
+}
+
+static void ss_hot_lru_front(ss_hot_t *hot, ss_hotent_t *ent)
+{
+    ent->lru_next = hot->lru_head;
+    if (hot->lru_head) {
+        hot->lru_head->lru_prev = ent;
+    } else {
+        hot->lru_tail = ent;
+    }
+    hot->lru_head = ent;
+}
+
+static void ss_hot_drop(ss_hot_t *hot, ss_hotent_t **pp)
+{
+    ss_hotent_t *ent = *pp;
+
+    *pp = ent->next;
+    ss_hot_lru_unlink(hot, ent);
+    hot->bytes -= ent->size;
+    free(ent->data);
+    free(ent);
+}
+
+/* copy name of dm mtime and size into buf, 0: it was cached */
+int ss_hot_get(ss_ctx_t *ctx, char *name, time_t mtime, uint32_t mtime_ns, uint64_t size, char *buf)
+{
+    ss_hot_t *hot = ctx->u.srv.hot;
+    uint64_t key = alg_xxh64(name, strlen(name), 0);
+    ss_hotent_t *ent;
+    int ret = -1;
+
+    if (size > SS_HOT_MAXFILE) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&(hot->lock));
+    ent = *ss_hot_find(hot, name, key);
+    if (ent && (ent->mtime == mtime) && (ent->mtime_ns == mtime_ns) && (ent->size == size)) {
+        memcpy(buf, ent->data, size);
+        ss_hot_lru_unlink(hot, ent);
+        ss_hot_lru_front(hot, ent);
+        ret = 0;
+    }
+    pthread_mutex_unlock(&(hot->lock));
+
+    return ret;
+}
+
+/* data is the content of name as of dm mtime and size */
+void ss_hot_put(ss_ctx_t *ctx, char *name, time_t mtime, uint32_t mtime_ns, uint64_t size, char *data)
+{
+    ss_hot_t *hot = ctx->u.srv.hot;
+    uint64_t key = alg_xxh64(name, strlen(name), 0);
+    ss_hotent_t *ent, **pp;
+
+    if (size > SS_HOT_MAXFILE) {
+        return;
+    }
+
+    ent = (ss_hotent_t *)calloc(1, sizeof(ss_hotent_t));
+    SS_ASSERT(ent);
+    ent->data = (char *)malloc(size ? size : 1);
+    SS_ASSERT(ent->data);
+    memcpy(ent->data, data, size);
+    ent->key = key;
+    ent->mtime = mtime;
+    ent->mtime_ns = mtime_ns;
+    ent->size = size;
+    strcpy(ent->name, name);
+
+    pthread_mutex_lock(&(hot->lock));
+    pp = ss_hot_find(hot, name, key);
+    if (*pp) {
+        ss_hot_drop(hot, pp);
+    }
+    while (hot->lru_tail && (hot->bytes + size > SS_HOT_BYTES)) {
+        ss_hot_drop(hot, ss_hot_find(hot, hot->lru_tail->name, hot->lru_tail->key));
+    }
+
+    pp = &(hot->bucket[key & (SS_HOT_BUCKETS - 1)]);
+    ent->next = *pp;
+    *pp = ent;
+    ss_hot_lru_front(hot, ent);
+    hot->bytes += size;
+    pthread_mutex_unlock(&(hot->lock));
+}
+
+/* a small file goes into the cache, of a larger one the head is read ahead */
+static void ss_hot_prefetch(ss_ctx_t *ctx, ss_hotpf_t *pf, char *buf)
+{
+    char pathname[SS_MAXPATH_LEN * 2];
+    struct stat st;
+    uint64_t n;
+    ssize_t ret;
+    int fd;
+
+    snprintf(pathname, sizeof(pathname), "%s/%s", ctx->localpath, pf->name);
+    fd = open(pathname, O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+
+    if (pf->size > SS_HOT_MAXFILE) {
+        posix_fadvise(fd, 0, pf->size < SS_PREFETCH_FILE ? pf->size : SS_PREFETCH_FILE, POSIX_FADV_WILLNEED);
+    } else if ((fstat(fd, &st) == 0) && (st.st_mtim.tv_sec == pf->mtime) &&
+               (st.st_mtim.tv_nsec == pf->mtime_ns) && (st.st_size == pf->size)) {
+        for (n = 0; n < pf->size; n += ret) {
+            ret = read(fd, buf + n, pf->size - n);
+            if (ret <= 0) {
+                break;
+            }
+        }
+        if (n == pf->size) {
+            ss_hot_put(ctx, pf->name, pf->mtime, pf->mtime_ns, pf->size, buf);
+        }
+    }
+
+    close(fd);
+}
+
+static void *ss_hot_thread(void *arg)
+{
+    ss_hot_t *hot = (ss_hot_t *)arg;
+    ss_hotpf_t *pf;
+    uint32_t i, n;
+    char *buf;
+
+    buf = (char *)malloc(SS_HOT_MAXFILE);
+    SS_ASSERT(buf);
+
+    while (1) {
+        pthread_mutex_lock(&(hot->pf_lock));
+        while (hot->pf == NULL) {
+            pthread_cond_wait(&(hot->pf_cond), &(hot->pf_lock));
+        }
+        pf = hot->pf;
+        n = hot->n_pf;
+        hot->pf = NULL;
+        hot->n_pf = 0;
+        pthread_mutex_unlock(&(hot->pf_lock));
+
+        for (i = 0; i < n; i++) {
+            ss_hot_prefetch(hot->ctx, &(pf[i]), buf);
+        }
+        free(pf);
+    }
+
+    return NULL;
+}
+
+void ss_hot_srv_init(ss_ctx_t *ctx)
+{
+    ss_hot_t *hot;
+
+    hot = (ss_hot_t *)calloc(1, sizeof(ss_hot_t));
+    SS_ASSERT(hot);
+    pthread_mutex_init(&(hot->lock), NULL);
+    pthread_mutex_init(&(hot->pf_lock), NULL);
+    pthread_cond_init(&(hot->pf_cond), NULL);
+    hot->ctx = ctx;
+    ctx->u.srv.hot = hot;
+
+    if (pthread_create(&(hot->pf_thread), NULL, ss_hot_thread, hot)) {
+        printf("prefetch thread create faild.\n");
+    }
+}
+
+static uint64_t ss_hot_sig(ss_filemeta_t *fm)
+{
+    return alg_xxh64(fm->name, fm->name_len,
+                     fm->hash ^ fm->size ^ ((uint64_t)fm->mtime << 32) ^ fm->mtime_ns);
+}
+
+static int ss_hot_sig_comp(const void *a, const void *b)
+{
+    uint64_t x = *(uint64_t *)a, y = *(uint64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+/*
+ * epoll thread, dm is about to go out in a digest: prefetch what changed
+ * since the last one. nothing is prefetched for the first dm, every file
+ * in it is new.
+ */
+void ss_hot_srv_changed(ss_ctx_t *ctx, ss_dirmeta_t *dm)
+{
+    ss_hot_t *hot = ctx->u.srv.hot;
+    uint64_t *sig, budget = 0;
+    ss_hotpf_t *pf = NULL;
+    uint32_t n_pf = 0, max_pf = 0;
+    int i;
+
+    if (hot == NULL) {
+        return;
+    }
+
+    sig = (uint64_t *)malloc((dm->n_file + 1) * sizeof(uint64_t));
+    SS_ASSERT(sig);
+    for (i = 0; i < dm->n_file; i++) {
+        sig[i] = ss_hot_sig(&(dm->fml[i]));
+
+        if (!hot->have_sig || (budget >= SS_PREFETCH_BYTES) ||
+            bsearch(&(sig[i]), hot->sig, hot->n_sig, sizeof(uint64_t), ss_hot_sig_comp)) {
+            continue;
+        }
+
+        /* sized by what changed, not by dm */
+        if (n_pf == max_pf) {
+            max_pf = max_pf ? 2 * max_pf : SS_PREFETCH_FIRST;
+            pf = (ss_hotpf_t *)realloc(pf, max_pf * sizeof(ss_hotpf_t));
+            SS_ASSERT(pf);
+        }
+        pf[n_pf].mtime = dm->fml[i].mtime;
+        pf[n_pf].mtime_ns = dm->fml[i].mtime_ns;
+        pf[n_pf].size = dm->fml[i].size;
+        strcpy(pf[n_pf].name, dm->fml[i].name);
+        n_pf++;
+        budget += dm->fml[i].size < SS_PREFETCH_FILE ? dm->fml[i].size : SS_PREFETCH_FILE;
+    }
+    qsort(sig, dm->n_file, sizeof(uint64_t), ss_hot_sig_comp);
+
+    free(hot->sig);
+    hot->sig = sig;
+    hot->n_sig = dm->n_file;
+    hot->have_sig = 1;
+
+    if (n_pf == 0) {
+        return;
+    }
+
+    /* behind what the thread has not got to yet */
+    pthread_mutex_lock(&(hot->pf_lock));
+    if (hot->pf) {
+        hot->pf = (ss_hotpf_t *)realloc(hot->pf, (hot->n_pf + n_pf) * sizeof(ss_hotpf_t));
+        SS_ASSERT(hot->pf);
+        memcpy(hot->pf + hot->n_pf, pf, n_pf * sizeof(ss_hotpf_t));
+        hot->n_pf += n_pf;
+        free(pf);
+    } else {
+        hot->pf = pf;
+        hot->n_pf = n_pf;
+    }
+    pthread_cond_signal(&(hot->pf_cond));
+    pthread_mutex_unlock(&(hot->pf_lock));
+}
@@ -0,0 +1,199 @@
+#include "pub.h"
+
+/*
+ * fast LZ codec, the LZ4 block format: sequences of a token, literals, a 16
+ * bit little endian offset and the match length. greedy single probe
+ * matching on a hash of 4 bytes, the probe step grows while nothing
+ * matches, so incompressible input is skipped quickly.
+ */
+
+#define LZ_HASHLOG                  14
+#define LZ_MINMATCH                 4
+#define LZ_MFLIMIT                  12      /* last match starts this far from the end */
+#define LZ_LASTLITERALS             5       /* the block ends with literals */
+#define LZ_MAXOFFSET                65535
+#define LZ_SKIPSTRENGTH             6
+
+static inline uint32_t lz_read32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t lz_hash(uint32_t v)
+{
+    return (v * 2654435761U) >> (32 - LZ_HASHLOG);
+}
+
+static inline uint8_t *lz_put_len(uint8_t *op, uint32_t len)
+{
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (uint8_t)len;
+
+    return op;
+}
+
+/* returns the compressed len, 0 if it does not fit into cap */
+uint32_t alg_lz_compress(const void *src, uint32_t len, void *dst, uint32_t cap)
+{
+    const uint8_t *base = (const uint8_t *)src;
+    const uint8_t *ip = base, *anchor = base, *iend = base + len;
+    const uint8_t *mflimit = iend - LZ_MFLIMIT, *matchlimit = iend - LZ_LASTLITERALS;
+    const uint8_t *ref, *mp;
+    uint8_t *op = (uint8_t *)dst, *oend = op + cap, *token;
+    uint32_t table[1 << LZ_HASHLOG];
+    uint32_t h, seq, litlen, mlen, step;
+
+    if (len > LZ_MFLIMIT) {
+        memset(table, 0, sizeof(table));
+        ip++;
+
+        while (ip < mflimit) {
+            seq = lz_read32(ip);
+            h = lz_hash(seq);
+            ref = base + table[h];
+            table[h] = ip - base;
+
+            if ((ref >= ip) || ((ip - ref) > LZ_MAXOFFSET) || (lz_read32(ref) != seq)) {
+                step = 1 + ((ip - anchor) >> LZ_SKIPSTRENGTH);
+                ip += step;
+                continue;
+            }
+
+            /* widen the match both ways */
+            while ((ip > anchor) && (ref > base) && (ip[-1] == ref[-1])) {
+                ip--;
+                ref--;
+            }
+            mp = ip + LZ_MINMATCH;
+            ref += LZ_MINMATCH;
+            while ((mp < matchlimit) && (*mp == *ref)) {
+                mp++;
+                ref++;
+            }
+
+            litlen = ip - anchor;
+            mlen = mp - ip - LZ_MINMATCH;
+            if ((op + 1 + (litlen / 255) + 1 + litlen + 2 + (mlen / 255) + 1) > oend) {
+                return 0;
+            }
+
+            token = op++;
+            if (litlen >= 15) {
+                *token = 15 << 4;
+                op = lz_put_len(op, litlen - 15);
+            } else {
+                *token = litlen << 4;
+            }
+            memcpy(op, anchor, litlen);
+            op += litlen;
+
+            op[0] = (uint8_t)(mp - ref);
+            op[1] = (uint8_t)((mp - ref) >> 8);
+            op += 2;
+
+            if (mlen >= 15) {
+                *token |= 15;
+                op = lz_put_len(op, mlen - 15);
+            } else {
+                *token |= mlen;
+            }
+
+            ip = anchor = mp;
+        }
+    }
+
+    litlen = iend - anchor;
+    if ((op + 1 + (litlen / 255) + 1 + litlen) > oend) {
+        return 0;
+    }
+    token = op++;
+    if (litlen >= 15) {
+        *token = 15 << 4;
+        op = lz_put_len(op, litlen - 15);
+    } else {
+        *token = litlen << 4;
+    }
+    memcpy(op, anchor, litlen);
+    op += litlen;
+
+    return op - (uint8_t *)dst;
+}
+
+static inline int lz_get_len(const uint8_t **pip, const uint8_t *iend, uint32_t *len)
+{
+    const uint8_t *ip = *pip;
+    uint32_t b;
+
+    do {
+        if (ip >= iend) {
+            return -1;
+        }
+        b = *ip++;
+        *len += b;
+    } while (b == 255);
+
+    *pip = ip;
+    return 0;
+}
+
+/* returns the decompressed len, -1 on a broken block or if it does not fit into cap */
+int alg_lz_decompress(const void *src, uint32_t len, void *dst, uint32_t cap)
+{
+    const uint8_t *ip = (const uint8_t *)src, *iend = ip + len, *ref;
+    uint8_t *op = (uint8_t *)dst, *oend = op + cap;
+    uint32_t token, litlen, mlen, off;
+
+    while (ip < iend) {
+        token = *ip++;
+
+        litlen = token >> 4;
+        if ((litlen == 15) && lz_get_len(&ip, iend, &litlen)) {
+            return -1;
+        }
+        if ((litlen > (uint32_t)(iend - ip)) || (litlen > (uint32_t)(oend - op))) {
+            return -1;
+        }
+        memcpy(op, ip, litlen);
+        op += litlen;
+        ip += litlen;
+
+        /* the last sequence has no match */
+        if (ip == iend) {
+            break;
+        }
+
+        if ((iend - ip) < 2) {
+            return -1;
+        }
+        off = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if ((off == 0) || (off > (uint32_t)(op - (uint8_t *)dst))) {
+            return -1;
+        }
+
+        mlen = token & 15;
+        if ((mlen == 15) && lz_get_len(&ip, iend, &mlen)) {
+            return -1;
+        }
+        mlen += LZ_MINMATCH;
+        if (mlen > (uint32_t)(oend - op)) {
+            return -1;
+        }
+
+        /* overlapping, the last off bytes repeat, the period doubles with each copy */
+        ref = op - off;
+        while (mlen) {
+            off = mlen < (uint32_t)(op - ref) ? mlen : (uint32_t)(op - ref);
+            memcpy(op, ref, off);
+            op += off;
+            mlen -= off;
+        }
+    }
+
+    return op - (uint8_t *)dst;
+}
@@ -99,6 +99,36 @@ int ctx_init(ss_ctx_t *ctx)
         ctx->localpath[0] = '.';
     }
 
+    if (ctx->port == 0) {
+        ctx->port = SS_DEFAULT_PORT;
+    }
+
+    if (ctx->win_files == 0) {
+        ctx->win_files = SS_WIN_FILES;
+    }
+
+    if (ctx->win_bytes == 0) {
+        ctx->win_bytes = SS_WIN_BYTES;
+    }
+
+    if (ctx->stripes == 0) {
+        ctx->stripes = SS_STRIPES;
+    } else if (ctx->stripes > SS_STRIPE_MAX) {
+        ctx->stripes = SS_STRIPE_MAX;
+    }
+
+    if (ctx->stripe_min == 0) {
+        ctx->stripe_min = SS_STRIPE_MIN;
+    }
+
+    if (ctx->debounce == 0) {
+        ctx->debounce = SS_DEBOUNCE;
+    }
+
+    if (ctx->heartbeat == 0) {
+        ctx->heartbeat = SS_HEARTBEAT;
+    }
+
     return 0;
 }
 
@@ -108,11 +138,30 @@ static void usage(const char *program)
        "-h, --help           display this help and exit\n"
        "-l, --list           display all file in dir\n"
        "-p, --path           local path\n"
-       "-a, --address        server ip\n"
+       "-a, --address        server ip[:port]\n"
+       "-P, --port           listen port, default %d\n"
+       "-r, --relay          with -a, also serve the local mirror to downstream clients\n"
+       "-s, --swarm          clients exchange chunks of large files with each other\n"
+       "    --swarm-port     cli: port to serve chunks to other clients on, default any\n"
+       "-w, --window-files   cli: max file requests in flight, default %d\n"
+       "-W, --window-bytes   cli: max bytes of file requests in flight, default %d\n"
+       "-t, --stripes        cli: connections to fetch a large file over, default %d, max %d\n"
+       "-T, --stripe-min     cli: smallest file to stripe, default %d\n"
+       "-F, --fsync          cli: 0 no sync, 1 fsync each file, n syncfs every n files and per update, default 0\n"
+       "-z, --compress       srv: lz compress file and metadata frames\n"
+       "-D, --debounce       srv: ms to coalesce changes before the digest goes out, default %d\n"
+       "-H, --heartbeat      srv: s between digests when nothing changes, default %d\n"
+       "    --tcp            no unix socket and no file handover to a peer on the same host\n"
+       "    --scan-rate      at most n files a second stat'ed by the periodic scan, default no limit\n"
+       "    --scan-cpu       at most n ms of cpu a tick used by the periodic scan, default no limit\n"
+       "    --scan-low       srv: scan at the lowest cpu and idle io priority\n"
+       "-o, --order          cli: size (smallest first), mtime (newest first) or name, default size\n"
+       "    --priority       cli: files whose path contains one of the list go first, in list order\n"
        "-m, --match          match list\n"
        "-i, --ignore         ignore list\n"
        "\n",
-       program);
+       program, SS_DEFAULT_PORT, SS_WIN_FILES, SS_WIN_BYTES, SS_STRIPES, SS_STRIPE_MAX, SS_STRIPE_MIN,
+       SS_DEBOUNCE, SS_HEARTBEAT);
 }
 
 static void list_path(char *path, ss_filefilter_t *ff)
@@ -146,14 +195,14 @@ static void list_path(char *path, ss_filefilter_t *ff)
             printf("%s\n", dm->fml[i].name);
         }
 
-        free(dm);
+        ss_pool_put(dm);
     }
 }
 
 int main(int argc, char *argv[])
 {
     static ss_ctx_t ctx;
-    int i, opt, optind, do_list = 0, n_arg;
+    int i, opt, optind, do_list = 0, do_relay = 0, n_arg;
     char *substr[SS_MAX_STRARG];
     uint32_t len[SS_MAX_STRARG];
 
@@ -162,12 +211,31 @@ int main(int argc, char *argv[])
         { "list",           no_argument,             NULL, 'l' },
         { "path",           required_argument,       NULL, 'p' },
         { "address",        required_argument,       NULL, 'a' },
+        { "port",           required_argument,       NULL, 'P' },
+        { "relay",          no_argument,             NULL, 'r' },
+        { "swarm",          no_argument,             NULL, 's' },
+        { "swarm-port",     required_argument,       NULL, 'S' },
+        { "window-files",   required_argument,       NULL, 'w' },
+        { "window-bytes",   required_argument,       NULL, 'W' },
+        { "stripes",        required_argument,       NULL, 't' },
+        { "stripe-min",     required_argument,       NULL, 'T' },
+        { "fsync",          required_argument,       NULL, 'F' },
+        { "compress",       no_argument,             NULL, 'z' },
+        { "debounce",       required_argument,       NULL, 'D' },
+        { "heartbeat",      required_argument,       NULL, 'H' },
+        { "tcp",            no_argument,             NULL, 'N' },
+        { "scan-rate",      required_argument,       NULL, 'R' },
+        { "scan-cpu",       required_argument,       NULL, 'C' },
+        { "scan-low",       no_argument,             NULL, 'L' },
+        { "order",          required_argument,       NULL, 'o' },
+        { "priority",       required_argument,       NULL, 'O' },
         { "match",          required_argument,       NULL, 'm' },
         { "ignore",         required_argument,       NULL, 'i' },
         { 0, 0, 0, 0 },
     };
-    const char *sopts = "hlp:a:m:i:";
-    char *ip = NULL;
+    const char *sopts = "hlp:a:P:rsS:w:W:t:T:F:zD:H:NR:C:Lo:O:m:i:";
+    char *ip = NULL, *p;
+    uint16_t port = SS_DEFAULT_PORT;
 
     memset(&ctx, 0, sizeof(ctx));
 
@@ -188,6 +256,80 @@ int main(int argc, char *argv[])
             break;
         case 'a':
             ip = strdup(optarg);
+            p = strchr(ip, ':');
+            if (p) {
+                *p = '\0';
+                port = (uint16_t)atoi(p + 1);
+            }
+            break;
+        case 'P':
+            ctx.port = (uint16_t)atoi(optarg);
+            break;
+        case 'r':
+            do_relay = 1;
+            break;
+        case 's':
+            ctx.swarm = 1;
+            break;
+        case 'S':
+            ctx.swarm_port = (uint16_t)atoi(optarg);
+            break;
+        case 'w':
+            ctx.win_files = (uint32_t)atoi(optarg);
+            break;
+        case 'W':
+            ctx.win_bytes = strtoull(optarg, NULL, 0);
+            break;
+        case 't':
+            ctx.stripes = (uint32_t)atoi(optarg);
+            break;
+        case 'T':
+            ctx.stripe_min = strtoull(optarg, NULL, 0);
+            break;
+        case 'F':
+            ctx.fsync = (uint32_t)atoi(optarg);
+            break;
+        case 'z':
+            ctx.lz = 1;
+            break;
+        case 'D':
+            ctx.debounce = (uint32_t)atoi(optarg);
+            break;
+        case 'H':
+            ctx.heartbeat = (uint32_t)atoi(optarg);
+            break;
+        case 'N':
+            ctx.tcp = 1;
+            break;
+        case 'R':
+            ctx.scan_rate = (uint32_t)atoi(optarg);
+            break;
+        case 'C':
+            ctx.scan_cpu = (uint32_t)atoi(optarg);
+            break;
+        case 'L':
+            ctx.scan_low = 1;
+            break;
+        case 'o':
+            if (strcmp(optarg, "size") == 0) {
+                ctx.order = SS_ORDER_SIZE;
+            } else if (strcmp(optarg, "mtime") == 0) {
+                ctx.order = SS_ORDER_MTIME;
+            } else if (strcmp(optarg, "name") == 0) {
+                ctx.order = SS_ORDER_NAME;
+            } else {
+                usage(argv[0]);
+                return 0;
+            }
+            break;
+        case 'O':
+            n_arg = stdiv(optarg, strlen(optarg), SS_MAX_STRARG, substr, len, 3, ",; ", 0);
+            for (i = 0; i < n_arg; i++) {
+                ctx.prio[i] = malloc(len[i] + 1);
+                memcpy(ctx.prio[i], substr[i], len[i]);
+                ctx.prio[i][len[i]] = '\0';
+            }
+            ctx.n_prio = n_arg;
             break;
         case 'm':
             n_arg = stdiv(optarg, strlen(optarg), SS_MAX_STRARG, substr, len, 3, ",; ", 0);
@@ -219,8 +361,10 @@ int main(int argc, char *argv[])
 
     if (ip == NULL) {
         ss_srv(&ctx);
+    } else if (do_relay) {
+        ss_relay(&ctx, ip, port);
     } else {
-        ss_cli(&ctx, ip);
+        ss_cli(&ctx, ip, port);
     }
 
     return 0;
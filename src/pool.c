@@ -0,0 +1,148 @@
+#include "pub.h"
+
+/*
+ * buffer pool
+ *
+ * message buffers come and go with every request: reassembly of multi
+ * frame messages, prebuilt responses, bundles, and the dm snapshots of
+ * each scan and update. they are taken from power of 2 size classes,
+ * SS_POOL_MIN up to SS_POOL_MAX, and put back instead of freed. each thread
+ * keeps up to SS_POOL_TCACHE buffers of a class of its own, without a lock,
+ * the rest goes to a list shared by all threads, holding at most
+ * SS_POOL_BYTES. a buffer that has been used once stays faulted in, so
+ * under sustained sync neither malloc nor page faults show in the profile.
+ * larger buffers, and what the shared list has no room for, are plain
+ * malloc and free.
+ */
+
+#define SS_POOL_MIN_SHIFT           10
+#define SS_POOL_MAX_SHIFT           25
+#define SS_POOL_CLASSES             (SS_POOL_MAX_SHIFT - SS_POOL_MIN_SHIFT + 1)
+#define SS_POOL_TCACHE              4
+#define SS_POOL_TCACHE_MAX          (1024 * 1024)       /* larger classes go to the shared list only */
+#define SS_POOL_BYTES               (64 * 1024 * 1024)
+#define SS_POOL_MAGIC               0x9001
+
+/* in front of every buffer, keeps the data 16 byte aligned */
+typedef struct _ss_poolhdr {
+    union {
+        struct _ss_poolhdr  *next;          /* on a free list */
+        uint64_t            rsv;
+    };
+    uint16_t                magic;
+    uint16_t                cls;            /* SS_POOL_CLASSES: not pooled */
+    uint32_t                rsv2;
+} ss_poolhdr_t;
+
+typedef struct {
+    ss_poolhdr_t            *head[SS_POOL_CLASSES];
+    uint32_t                n[SS_POOL_CLASSES];
+} ss_poolcache_t;
+
+static __thread ss_poolcache_t g_pool_tcache;
+
+static pthread_mutex_t g_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static ss_poolhdr_t *g_pool_head[SS_POOL_CLASSES];
+static uint64_t g_pool_bytes;
+
+static uint32_t ss_pool_cls(size_t len)
+{
+    uint32_t cls = 0;
+
+    while ((cls < SS_POOL_CLASSES) && (((size_t)1 << (cls + SS_POOL_MIN_SHIFT)) < len)) {
+        cls++;
+    }
+
+    return cls;
+}
+
+static size_t ss_pool_cls_len(uint32_t cls)
+{
+    return (size_t)1 << (cls + SS_POOL_MIN_SHIFT);
+}
+
+/* a buffer of at least len bytes, not cleared */
+void *ss_pool_get(size_t len)
+{
+    ss_poolcache_t *tc = &g_pool_tcache;
+    uint32_t cls = ss_pool_cls(len);
+    ss_poolhdr_t *h = NULL;
+
+    if (cls < SS_POOL_CLASSES) {
+        if (tc->head[cls]) {
+            h = tc->head[cls];
+            tc->head[cls] = h->next;
+            tc->n[cls]--;
+        } else {
+            pthread_mutex_lock(&g_pool_lock);
+            h = g_pool_head[cls];
+            if (h) {
+                g_pool_head[cls] = h->next;
+                g_pool_bytes -= ss_pool_cls_len(cls);
+            }
+            pthread_mutex_unlock(&g_pool_lock);
+        }
+        len = ss_pool_cls_len(cls);
+    }
+
+    if (h == NULL) {
+        h = (ss_poolhdr_t *)malloc(sizeof(ss_poolhdr_t) + len);
+        SS_ASSERT(h);
+        h->magic = SS_POOL_MAGIC;
+        h->cls = cls;
+    }
+    h->next = NULL;
+
+    return h + 1;
+}
+
+/* a buffer of ss_pool_get goes back, NULL is fine */
+void ss_pool_put(void *buf)
+{
+    ss_poolcache_t *tc = &g_pool_tcache;
+    ss_poolhdr_t *h;
+    uint32_t cls;
+
+    if (buf == NULL) {
+        return;
+    }
+
+    h = (ss_poolhdr_t *)buf - 1;
+    SS_ASSERT(h->magic == SS_POOL_MAGIC);
+    cls = h->cls;
+
+    if (cls == SS_POOL_CLASSES) {
+        free(h);
+        return;
+    }
+
+    if ((tc->n[cls] < SS_POOL_TCACHE) && (ss_pool_cls_len(cls) <= SS_POOL_TCACHE_MAX)) {
+        h->next = tc->head[cls];
+        tc->head[cls] = h;
+        tc->n[cls]++;
+        return;
+    }
+
+    pthread_mutex_lock(&g_pool_lock);
+    if (g_pool_bytes + ss_pool_cls_len(cls) <= SS_POOL_BYTES) {
+        h->next = g_pool_head[cls];
+        g_pool_head[cls] = h;
+        g_pool_bytes += ss_pool_cls_len(cls);
+        h = NULL;
+    }
+    pthread_mutex_unlock(&g_pool_lock);
+
+    if (h) {
+        free(h);
+    }
+}
+
+/* a cleared buffer of at least len bytes */
+void *ss_pool_zget(size_t len)
+{
+    void *buf = ss_pool_get(len);
+
+    memset(buf, 0, len);
+
+    return buf;
+}
@@ -7,13 +7,19 @@
 #include <unistd.h>
 #include <dirent.h>
 #include <string.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <time.h>
 #include <pthread.h>
 #include <getopt.h>
 #include <sys/epoll.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <sys/timerfd.h>
+#include <sys/eventfd.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 // #include <libgen.h>
@@ -31,15 +37,24 @@
 
 #define SS_MAXFILE_SUPPORT          1024 * 256
 #define SS_MAXPATH_LEN              256
-#define SS_MAX_CLIINST              16
+#define SS_INST_BLKSZ               64      /* com instances allocated per block */
+#define SS_EPOLL_BATCH              64
 #define SS_MAX_STRARG               256
 #define SS_PATH_RESCAN_CYCLE        5
+#define SS_DEBOUNCE                 20      /* ms, srv: changes coalesced into one digest */
+#define SS_HEARTBEAT                10      /* s, srv: digest sent when nothing changed */
+#define SS_DEFAULT_PORT             55443
+#define SS_CONNECT_TIMEOUT          3       /* s, cli: a reconnect attempt gives up */
+#define SS_RECONNECT_MAX            30      /* s, cli: longest wait between reconnect attempts */
+#define SS_LOCAL_NAME               "smartsync.%u"  /* abstract unix socket of a srv port, same-host peers */
+#define SS_LOCAL_MINFD              (64 * 1024)     /* smaller files go inline, not as an fd */
 
 typedef enum {
     SS_NODE_NONE,
     SS_NODE_SRV,
     SS_NODE_CLI,
     SS_NODE_TIMER,
+    SS_NODE_EVENT,
 } ss_nodetype_e;
 
 static const char *g_nodetype_str[] __attribute__ ((unused)) = {
@@ -47,14 +62,23 @@ static const char *g_nodetype_str[] __attribute__ ((unused)) = {
     [SS_NODE_SRV] = "SS_NODE_SRV",
     [SS_NODE_CLI] = "SS_NODE_CLI",
     [SS_NODE_TIMER] = "SS_NODE_TIMER",
+    [SS_NODE_EVENT] = "SS_NODE_EVENT",
 };
 
 struct _ss_com;
-typedef struct {
+typedef struct _ss_com_inst {
     struct _ss_com      *com;
     ss_nodetype_e       type;
+    int                 id;                 /* slot index, stable for the life of com */
     int                 fd;
     struct sockaddr_in  addr;
+    int                 local;              /* AF_UNIX to a peer on the same host, fds may come with frames */
+    time_t              dial_end;           /* ss_com_dial: connecting, given up at this time; 0: connected */
+
+    /* free list or connected list, depending on state */
+    struct _ss_com_inst *prev, *next;
+
+    pthread_mutex_t     send_lock;          /* frames from more than one thread: cli, swarm peers */
 
     void                *payload;
 } ss_com_inst_t;
@@ -64,6 +88,8 @@ typedef enum {
     SS_CBTYPE_RECV,
     SS_CBTYPE_CLOSE,
     SS_CBTYPE_TIMER,
+    SS_CBTYPE_EVENT,
+    SS_CBTYPE_WRITABLE,                     /* ss_com_watch_send: the socket takes data again */
 } ss_cbtype_e;
 
 static const char *g_cbtype_str[] __attribute__ ((unused)) = {
@@ -71,23 +97,44 @@ static const char *g_cbtype_str[] __attribute__ ((unused)) = {
     [SS_CBTYPE_RECV] = "SS_CBTYPE_RECV",
     [SS_CBTYPE_CLOSE] = "SS_CBTYPE_CLOSE",
     [SS_CBTYPE_TIMER] = "SS_CBTYPE_TIMER",
+    [SS_CBTYPE_EVENT] = "SS_CBTYPE_EVENT",
+    [SS_CBTYPE_WRITABLE] = "SS_CBTYPE_WRITABLE",
 };
 
 typedef void (*ss_com_cb)(ss_com_inst_t *inst, ss_cbtype_e cbt, void *head, void *body);
 
+/* the head of a frame is in, where its (expanded) body is to be read to, NULL: recv_buf */
+typedef void *(*ss_com_rxdst)(ss_com_inst_t *inst, void *head);
+
+/* ss_com_init flags */
+#define SS_COM_LOCAL        0x1             /* srv: also listen on the local socket, cli: try it first for a loopback address */
+
 typedef struct _ss_com {
     ss_nodetype_e       type;
+    int                 flags;
     int                 ep;
 
     int                 loop;
 
     pthread_t           epoll_thread;
 
-    int                 n_inst;
-    ss_com_inst_t       inst_list[SS_MAX_CLIINST];
+    int                 n_inst;             /* instances in use */
+    int                 n_slot;             /* instances allocated */
+    int                 n_blk;
+    ss_com_inst_t       **blk_list;         /* instance blocks, never moved once allocated */
+    ss_com_inst_t       *free_list;
+    ss_com_inst_t       *cli_list;          /* connected peers, a digest goes to only these */
+    int                 n_cli;
+    ss_com_inst_t       *event_inst;        /* wakeup from other threads, see ss_com_notify */
+    ss_com_inst_t       *main_inst;         /* listening socket of srv, upstream connection of cli */
+    struct sockaddr_in  srv_addr;           /* cli: where main_inst connects to, kept for ss_com_reconnect */
 
     void                *recv_buf;
     int                 max_recv_len;
+    void                *lz_buf;            /* expanded lz frames, allocated on the first one */
+    int                 rx_fd;              /* came with the frame being handled, -1: none. the cb may take it */
+    ss_com_rxdst        rx_dst;             /* set by the cb, on SS_CBTYPE_CONNECT of a cli */
+    void                *rx_hold;           /* pool buffer rx_dst handed out for this frame, the cb may take it */
     ss_com_cb           cb;
 
     void                *param;
@@ -95,6 +142,10 @@ typedef struct _ss_com {
 
 typedef struct _ss_filemeta {
     time_t              mtime;
+    uint32_t            mtime_ns;
+    uint32_t            rsv;
+    uint64_t            size;
+    uint64_t            hash;               /* xxh64 of the content, 0: unknown */
     uint32_t            name_len;
     char                name[SS_MAXPATH_LEN];
 } ss_filemeta_t;
@@ -110,8 +161,24 @@ typedef struct _ss_filefilter {
     int                 n_match, n_ignore;
     char                *ignore[SS_MAX_STRARG];
     char                *match[SS_MAX_STRARG];
+    int                 compiled;
+    struct _ss_acm      *ac_ignore;         /* the patterns as automata, NULL if there are none */
+    struct _ss_acm      *ac_match;
 } ss_filefilter_t;
 
+/* where a filter stands at a directory of a scan */
+typedef struct _ss_filterpos {
+    uint32_t            ignore, match;      /* automaton states */
+    int                 matched;            /* a match pattern is in the directory path */
+} ss_filterpos_t;
+
+/* cli: in which order the files of an update are asked for */
+typedef enum {
+    SS_ORDER_SIZE,                          /* smallest first */
+    SS_ORDER_MTIME,                         /* most recently modified first */
+    SS_ORDER_NAME,                          /* dm order */
+} ss_order_e;
+
 typedef enum {
     SS_STATE_IDLE,
     SS_STATE_META_UPDATE,
@@ -131,11 +198,123 @@ typedef struct {
     uint32_t    len;
 } ss_segasm_t;
 
+struct _ss_extent;
+
+/* cli: a multiplexed message being received, keyed by the sid of its frames */
+typedef struct _ss_rxstream {
+    struct _ss_rxstream *next;
+    uint32_t        sid;
+    uint32_t        type;
+    ss_segasm_t     segasm;             /* all but FILE_RES */
+
+    /* FILE_RES, written to the file as the frames arrive */
+    int             fd;
+    int             err;
+    uint32_t        flag;
+    uint64_t        len, got;
+    uint64_t        want;               /* data bytes to come, len but for a sparse file */
+    time_t          mtime;
+    struct _ss_extent *ext;             /* SPARSE: data extents, NULL otherwise */
+    uint32_t        n_ext, i_ext;
+    uint64_t        ext_got;            /* bytes of ext[i_ext] written */
+    char            name[SS_MAXPATH_LEN];
+} ss_rxstream_t;
+
+#define SS_TX_WORKERS               4
+#define SS_TX_BULK_STREAMS          4                   /* multi frame streams interleaved per cli */
+#define SS_TX_MAX_STREAMS           64                  /* all streams active per cli */
+#define SS_TX_SJF_AGE               8                   /* smaller bulk jobs let in ahead of the oldest one */
+#define SS_WIN_FILES                16                  /* FILE_REQ in flight per cli */
+#define SS_WIN_BYTES                (64 * 1024 * 1024)  /* bytes of FILE_REQ in flight per cli */
+
+struct _ss_txjob;
+struct _ss_sub;
+
+/* srv: per client state, inst->payload */
+typedef struct _ss_srvcli {
+    ss_com_inst_t       *inst;
+    uint16_t            peer_port;          /* swarm: port the client serves chunks on, 0: none */
+
+    /* tx engine, guarded by the tx lock */
+    struct _ss_srvcli   *run_next;
+    struct _ss_txjob    *job_head, *job_tail;     /* waiting, single frame */
+    struct _ss_txjob    *bulk_head, *bulk_tail;   /* waiting, multi frame */
+    struct _ss_txjob    *act_head, *act_tail;     /* streams being sent, one frame each in turn */
+    int                 n_job;
+    int                 n_act, n_act_bulk;
+    uint32_t            next_sid;
+    int                 queued;             /* on the run queue */
+    int                 busy;               /* a worker is sending to it */
+    int                 parked;             /* the socket is full, off the run queue until SS_CBTYPE_WRITABLE */
+    char                *out;               /* pool buffer, the rest of a frame the socket did not take */
+    uint32_t            out_off, out_len;
+    int                 out_fd;             /* local: goes along with the first byte of out, -1: none */
+    uint32_t            ver;                /* msghead ver of its last message */
+    int                 closing;
+    struct _ss_sub      *sub;               /* its -m / -i view of dm, NULL: all of it */
+} ss_srvcli_t;
+
+struct _ss_swarm_srv;
+struct _ss_swarm_cli;
+struct _ss_stripe_cli;
+struct _ss_dedup_cli;
+struct _ss_cdc_srv;
+struct _ss_cdc_cli;
+struct _ss_resume;
+struct _ss_hcache;
+struct _ss_wr;
+struct _ss_watch;
+struct _ss_scan;
+struct _ss_hot;
+struct _ss_tx;
+
 typedef struct _ss_ctx {
     int                 cycle;
     ss_nodetype_e       nt;                 /* node type */
     ss_state_e          state;
     char                localpath[SS_MAXPATH_LEN];
+    uint16_t            port;               /* listen port of srv */
+
+    /*
+     * relay mode, cli: the downstream srv ctx fed from this mirror
+     *             srv: the upstream cli ctx, dm is published by it instead of path_scan
+     */
+    struct _ss_ctx      *relay;
+
+    /* swarm mode, clients exchange chunks of large files with each other */
+    int                 swarm;
+    uint16_t            swarm_port;         /* cli: port to serve chunks on, 0: any */
+
+    /* cli: FILE_REQ window, a completion lets the next request out */
+    uint32_t            win_files;
+    uint64_t            win_bytes;
+
+    /* srv: compress FILE_RES, FILE_BRES and META_RES frames for clients that can expand them */
+    int                 lz;
+
+    /* cli: connections to fetch ranges of files of at least stripe_min bytes over */
+    uint32_t            stripes;
+    uint64_t            stripe_min;
+
+    /* cli: 0 no sync, 1 fsync each file before its rename, n one syncfs per n files and per update */
+    uint32_t            fsync;
+
+    /* srv: digests go out on change, debounce ms after a burst, and every heartbeat s otherwise */
+    uint32_t            debounce;
+    uint32_t            heartbeat;
+
+    /* cli: order of the requests of an update, files under a priority pattern go before the rest */
+    ss_order_e          order;
+    char                *prio[SS_MAX_STRARG];
+    int                 n_prio;
+
+    /* no unix socket and no fd handover to a peer on the same host, it goes over tcp as any other */
+    int                 tcp;
+
+    /* scans within a budget: stats a second and ms of cpu a tick, 0: none. low: srv scan thread at idle priority */
+    uint32_t            scan_rate;
+    uint32_t            scan_cpu;
+    int                 scan_low;
 
     ss_com_t            com;
 
@@ -145,25 +324,195 @@ typedef struct _ss_ctx {
     union {
         struct {
             uint32_t            n_filereq_recv;
+
+            /* relay: dm published by the upstream cli, picked up on SS_CBTYPE_EVENT */
+            pthread_mutex_t     relay_lock;
+            ss_dirmeta_t        *relay_dm;
+
+            struct _ss_swarm_srv *swarm;
+            struct _ss_tx       *tx;
+            struct _ss_hcache   *hcache;        /* content hash by (dev, ino, size, mtime) */
+            struct _ss_cdc_srv  *cdc;           /* chunk maps, shared by the tx workers */
+            struct _ss_sub      *sub;           /* filtered views of dm, one per distinct filter */
+            struct _ss_watch    *watch;         /* inotify on the tree, NULL: periodic scan only */
+            struct _ss_scan     *scan;          /* paced scan thread, NULL: scans on the epoll thread */
+            struct _ss_hot      *hot;           /* prefetch of changed files, small ones cached */
+            uint32_t            md_crc;         /* digest last sent */
+            int                 md_n_file;
+            time_t              md_sent;
+            time_t              md_hold;        /* a changed dm has waited for hashes since, 0: not waiting */
         } srv;
         struct {
-            ss_segasm_t         segasm;
-            uint32_t            n_update;
+            ss_segasm_t         segasm;         /* sid 0 messages */
+            ss_rxstream_t       *rx_list;       /* streams being received */
+            uint32_t            n_update;       /* files not synced yet, queued or in flight */
+
+            uint32_t            *pend;          /* dm index of files to request */
+            uint32_t            n_pend, pend_head;
+            uint32_t            n_inflight;
+            uint64_t            inflight_bytes;
+
+            ss_com_t            peer_com;       /* swarm: serves chunks to other clients */
+            struct _ss_swarm_cli *swarm;
+            struct _ss_stripe_cli *stripe;
+            struct _ss_dedup_cli *dedup;        /* files waiting for a copy of the same content */
+            struct _ss_cdc_cli  *cdc;           /* chunk index of the mirror, files being assembled */
+            uint32_t            dm_gen;         /* META_RES applied so far */
+            uint32_t            srv_ver;        /* msghead ver of the srv */
+            struct _ss_wr       *wr;            /* write pipeline: mirror dirfd, directories made */
+            int                 subscribed;     /* the srv has the -m / -i lists */
+            uint32_t            md_crc;         /* latest digest of the srv, dm is to match it */
+            int                 md_n_file;
+            int                 md_valid;
+            int                 md_new;         /* came while an update was running */
+            uint8_t             *settled;       /* by dm index, pend files done with in this update */
+            uint32_t            *bundle;        /* by dm index, token of the FILE_BREQ the file went out in */
+            int                 lost;           /* main connection closed, reconnecting */
+            uint32_t            backoff;        /* s to the next attempt after this one fails */
+            time_t              retry_at;
+            struct _ss_resume   *resume;        /* part files kept over a lost connection */
+            int                 scan_pos;       /* dm index the next slice of a paced refresh starts at */
         } cli;
     } u;
 } ss_ctx_t;
 
 ss_dirmeta_t* path_scan(char *path, ss_filefilter_t *ff);
+int ss_dmstate_refresh(ss_ctx_t *ctx, ss_dirmeta_t *dm, int ts_srv);
+int ss_dmstate_refresh_part(ss_ctx_t *ctx, ss_dirmeta_t *dm, int ts_srv, int from, int to);
 
-int ss_com_init(ss_com_t *com, ss_nodetype_e type, char *ip, uint16_t port, ss_com_cb cb, int max_recv_len, void *param);
+/* see sort.c */
+void ss_dm_sort(ss_dirmeta_t *dm);
+
+void ss_filter_compile(ss_filefilter_t *ff);
+void ss_filter_free(ss_filefilter_t *ff);
+int ss_filter_root(ss_filefilter_t *ff, ss_filterpos_t *pos);
+int ss_filter_file(ss_filefilter_t *ff, ss_filterpos_t *pos, char *name);
+int ss_filter_dir(ss_filefilter_t *ff, ss_filterpos_t *pos, char *name, ss_filterpos_t *sub);
+int ss_filter_path(ss_filefilter_t *ff, char *path);
+
+int ss_com_init(ss_com_t *com, ss_nodetype_e type, char *ip, uint16_t port, ss_com_cb cb, int max_recv_len, void *param, int flags);
 int ss_com_init_timer(ss_com_t *com, int usec);
+int ss_com_init_event(ss_com_t *com);
+int ss_com_notify(ss_com_t *com);
+ss_com_inst_t *ss_com_dial(ss_com_t *com, struct sockaddr_in *addr, int tmo, int local);
+int ss_com_reconnect(ss_com_t *com);
 int ss_com_send(ss_com_inst_t *inst, void *buf, uint32_t len);
+int ss_com_send_frame(ss_com_inst_t *inst, void *head, uint32_t hlen, void *body, uint32_t len);
+int ss_com_send_fd(ss_com_inst_t *inst, void *head, uint32_t hlen, void *body, uint32_t len, int fd);
+ssize_t ss_com_send_some(ss_com_inst_t *inst, void *head, uint32_t hlen, void *body, uint32_t len, int fd);
+int ss_com_watch_send(ss_com_inst_t *inst);
+
+/* message buffers and dm snapshots, see pool.c */
+void *ss_pool_get(size_t len);
+void *ss_pool_zget(size_t len);
+void ss_pool_put(void *buf);
+
+uint32_t alg_crc32(const void *pv, uint32_t size);
+uint64_t alg_xxh64(const void *pv, uint64_t len, uint64_t seed);
+
+typedef struct {
+    uint64_t        v[4];
+    uint64_t        total, seed;
+    uint8_t         mem[32];            /* the part of a stripe not hashed yet */
+    uint32_t        n_mem;
+} alg_xxh64_t;
+void alg_xxh64_init(alg_xxh64_t *st, uint64_t seed);
+void alg_xxh64_update(alg_xxh64_t *st, const void *pv, uint64_t len);
+uint64_t alg_xxh64_digest(alg_xxh64_t *st);
+uint32_t alg_lz_compress(const void *src, uint32_t len, void *dst, uint32_t cap);
+int alg_lz_decompress(const void *src, uint32_t len, void *dst, uint32_t cap);
+
+typedef enum {
+    SS_FILEDONE_SAVED,                      /* stamp the new mtime and size */
+    SS_FILEDONE_FAILED,                     /* clear the mtime, forces a refetch */
+    SS_FILEDONE_REMOVED,
+} ss_filedone_e;
+
+/* cli write pipeline, a file is fetched into name SS_PART_SUFFIX and renamed */
+#define SS_PART_SUFFIX              ".ss_part"
+#define SS_WR_BUCKETS               1024
+int ss_mkdir_parent(ss_ctx_t *ctx, char *pathname);
+void ss_wr_forget(ss_ctx_t *ctx, char *dirname);
+void ss_wr_reset(ss_ctx_t *ctx);
+int ss_wr_open(ss_ctx_t *ctx, char *name, uint64_t size, int sparse);
+int ss_wr_commit(ss_ctx_t *ctx, int fd, char *name);
+void ss_wr_abort(ss_ctx_t *ctx, int fd, char *name);
+void ss_wr_flush(ss_ctx_t *ctx);
+ssize_t ss_pwrite_sparse(int fd, void *buf, size_t len, uint64_t off);
+int ss_local_copy(int src, int dst, uint64_t len);
+void ss_cli_file_done(ss_ctx_t *ctx, char *name, ss_filedone_e how, time_t mtime, uint64_t size);
+
+void ss_dedup_cli_plan(ss_ctx_t *ctx, ss_dirmeta_t *newdm);
+void ss_dedup_cli_settled(ss_ctx_t *ctx, ss_filemeta_t *fm, ss_filedone_e how);
+void ss_dedup_cli_reset(ss_ctx_t *ctx);
+
+ss_filemeta_t *ss_dm_find(ss_dirmeta_t *dm, char *name);
+
+#define SS_HCACHE_BUCKETS           4096
+#define SS_HCACHE_HOLD              3       /* s, a changed dm waits for the hashes of its files */
+void ss_hcache_start(ss_ctx_t *ctx);
+uint64_t ss_hcache_get(ss_ctx_t *ctx, char *pathname, struct stat *st);
+int ss_hcache_fill(ss_ctx_t *ctx, ss_dirmeta_t *dm);
+int ss_hcache_landed(ss_ctx_t *ctx);
+void ss_hcache_sweep(ss_ctx_t *ctx);
+int ss_file_xxh64(int fd, uint64_t size, uint64_t *hash);
+
+int ss_watch_start(ss_ctx_t *ctx);
+int ss_watch_take(ss_ctx_t *ctx);
+
+/* scans within a budget, see scan.c */
+void ss_scan_pace(void);
+int ss_scan_srv_start(ss_ctx_t *ctx);
+void ss_scan_srv_kick(ss_ctx_t *ctx);
+void ss_scan_srv_pickup(ss_ctx_t *ctx);
+int ss_scan_cli_tick(ss_ctx_t *ctx);
+
+/* srv prefetch of changed files, small ones are kept for the bundles of every cli */
+#define SS_HOT_BUCKETS              1024
+#define SS_HOT_BYTES                (64 * 1024 * 1024)
+#define SS_HOT_MAXFILE              (256 * 1024)        /* larger files are read ahead, not cached */
+#define SS_PREFETCH_FILE            (4 * 1024 * 1024)   /* head of a large file read ahead */
+#define SS_PREFETCH_BYTES           (256 * 1024 * 1024) /* per digest */
+#define SS_PREFETCH_FIRST           16                  /* prefetch entries of a digest to start with, doubled as needed */
+void ss_hot_srv_init(ss_ctx_t *ctx);
+void ss_hot_srv_changed(ss_ctx_t *ctx, ss_dirmeta_t *dm);
+int ss_hot_get(ss_ctx_t *ctx, char *name, time_t mtime, uint32_t mtime_ns, uint64_t size, char *buf);
+void ss_hot_put(ss_ctx_t *ctx, char *name, time_t mtime, uint32_t mtime_ns, uint64_t size, char *data);
+
+int ss_tx_init(ss_ctx_t *ctx);
+void ss_tx_filereq(ss_com_inst_t *inst, char *name);
+void ss_tx_writable(ss_com_inst_t *inst);
+void ss_tx_close(ss_com_inst_t *inst);
 
 void ss_srv(ss_ctx_t *ctx);
-void ss_cli(ss_ctx_t *ctx, char *ip);
+void ss_cli(ss_ctx_t *ctx, char *ip, uint16_t port);
+void ss_relay(ss_ctx_t *ctx, char *ip, uint16_t port);
 
 #define SS_FRAME_MAXLEN             (1024 * 1024)
-#define SS_MSGHEAD_MAGIC            0xace0ace0
+/*
+ * the head grew sid and rlen, 24 bytes where it was 16, and a FILE_RES
+ * has a 64 bit len. the magic changed with it: a frame of the older
+ * magic, or of another hlen, is refused and the connection closed, see
+ * ss_inst_event. the ver below is of peers of this magic.
+ */
+#define SS_MSGHEAD_MAGIC            0xace1ace1
+
+/*
+ * msghead ver, what the sender understands. the srv compresses frames only
+ * for clients that sent ver >= SS_VER_LZ. from SS_VER_HASH on META_RES
+ * carries mtime_ns and the content hash of each file, a cli asks a srv of
+ * SS_VER_CDC for chunk maps. a FILE_RES to a cli of SS_VER_SPARSE skips the
+ * holes of a sparse file. a srv of SS_VER_SUB takes the filter of a cli.
+ * to a cli of SS_VER_LOCAL on the local socket a FILE_RES hands the file
+ * over as an fd.
+ */
+#define SS_VER_LZ                   1
+#define SS_VER_HASH                 2
+#define SS_VER_CDC                  3
+#define SS_VER_SPARSE               4
+#define SS_VER_SUB                  5
+#define SS_VER_LOCAL                6
+#define SS_VER                      SS_VER_LOCAL
 
 typedef enum {
     SS_MSGTYPE_META_DIGEST,         /* srv->cli, dir metainfo digest */
@@ -171,6 +520,18 @@ typedef enum {
     SS_MSGTYPE_META_RES,            /* srv->cli */
     SS_MSGTYPE_FILE_REQ,            /* cli->srv */
     SS_MSGTYPE_FILE_RES,            /* srv->cli */
+    SS_MSGTYPE_PEER_HELLO,          /* cli->srv, swarm: port the cli serves chunks on */
+    SS_MSGTYPE_SWARM_MAP,           /* srv->cli, swarm: answers FILE_REQ of a large file */
+    SS_MSGTYPE_CHUNK_REQ,           /* cli->srv, cli->cli */
+    SS_MSGTYPE_CHUNK_RES,           /* srv->cli, cli->cli */
+    SS_MSGTYPE_CHUNK_HAVE,          /* cli->srv */
+    SS_MSGTYPE_FILE_BREQ,           /* cli->srv, a bundle of small files */
+    SS_MSGTYPE_FILE_BRES,           /* srv->cli, their contents back to back */
+    SS_MSGTYPE_FILE_RREQ,           /* cli->srv, a byte range of a large file */
+    SS_MSGTYPE_FILE_RRES,           /* srv->cli */
+    SS_MSGTYPE_FILE_CREQ,           /* cli->srv, content defined chunks of a large file */
+    SS_MSGTYPE_FILE_CRES,           /* srv->cli */
+    SS_MSGTYPE_SUBSCRIBE,           /* cli->srv, the -m / -i lists of the cli */
 } ss_msgtype_e;
 
 static const char *g_msgtype_str[] __attribute__ ((unused)) = {
@@ -179,6 +540,18 @@ static const char *g_msgtype_str[] __attribute__ ((unused)) = {
     [SS_MSGTYPE_META_RES] = "SS_MSGTYPE_META_RES",
     [SS_MSGTYPE_FILE_REQ] = "SS_MSGTYPE_FILE_REQ",
     [SS_MSGTYPE_FILE_RES] = "SS_MSGTYPE_FILE_RES",
+    [SS_MSGTYPE_PEER_HELLO] = "SS_MSGTYPE_PEER_HELLO",
+    [SS_MSGTYPE_SWARM_MAP] = "SS_MSGTYPE_SWARM_MAP",
+    [SS_MSGTYPE_CHUNK_REQ] = "SS_MSGTYPE_CHUNK_REQ",
+    [SS_MSGTYPE_CHUNK_RES] = "SS_MSGTYPE_CHUNK_RES",
+    [SS_MSGTYPE_CHUNK_HAVE] = "SS_MSGTYPE_CHUNK_HAVE",
+    [SS_MSGTYPE_FILE_BREQ] = "SS_MSGTYPE_FILE_BREQ",
+    [SS_MSGTYPE_FILE_BRES] = "SS_MSGTYPE_FILE_BRES",
+    [SS_MSGTYPE_FILE_RREQ] = "SS_MSGTYPE_FILE_RREQ",
+    [SS_MSGTYPE_FILE_RRES] = "SS_MSGTYPE_FILE_RRES",
+    [SS_MSGTYPE_FILE_CREQ] = "SS_MSGTYPE_FILE_CREQ",
+    [SS_MSGTYPE_FILE_CRES] = "SS_MSGTYPE_FILE_CRES",
+    [SS_MSGTYPE_SUBSCRIBE] = "SS_MSGTYPE_SUBSCRIBE",
 };
 
 /*  */
@@ -191,7 +564,10 @@ typedef struct {
     uint64_t        len     : 22;       /* payload length, without head */
     uint64_t        sop     : 1;
     uint64_t        eop     : 1;
-    uint64_t        rsv     : 8;
+    uint64_t        lz      : 1;        /* payload is LZ compressed, rlen bytes once expanded */
+    uint64_t        rsv     : 7;
+    uint32_t        sid;                /* stream id, frames of different streams interleave, 0: none */
+    uint32_t        rlen;
 } ss_msghead_t;
 
 typedef struct {
@@ -215,13 +591,221 @@ typedef struct {
 
 #define SS_FILERES_VALID            0x1
 #define SS_FILERES_EXIST            0x2
-
+#define SS_FILERES_DEFER            0x4     /* FILE_BRES: no room left, follows as its own FILE_RES */
+#define SS_FILERES_SPARSE           0x8     /* FILE_RES: a ss_sparse_t follows the name */
+#define SS_FILERES_FD               0x10    /* FILE_RES: no data, the file came as an fd with the frame */
+
+/*
+ * FILE_RES always goes out as a stream, the first frame carries the whole
+ * ss_fileres_t. total_len of the msghead is not used for it, len is.
+ */
 typedef struct {
     uint32_t        flag;
-    uint32_t        len;
+    uint32_t        rsv;
+    uint64_t        len;
     time_t          mtime;
     char            name[0];
 } ss_fileres_t;
 
+/*
+ * sparse files: only the data extents are sent, back to back in file
+ * order. len of the fileres is the file size, the rest is a hole.
+ */
+#define SS_SPARSE_MAXEXT            4096                /* the last one runs to the end of the file */
+#define SS_SPARSE_BLOCK             4096                /* cli: zero blocks of ranges are not written */
+
+typedef struct _ss_extent {
+    uint64_t        off;
+    uint64_t        len;
+} ss_extent_t;
+
+typedef struct {
+    uint32_t        n_ext;
+    uint32_t        rsv;
+    ss_extent_t     ext[0];
+} ss_sparse_t;
+
+/* small file bundles */
+#define SS_BUNDLE_FILES             256                 /* names per FILE_BREQ */
+#define SS_BUNDLE_BYTES             SS_FRAME_MAXLEN     /* a FILE_BRES is one frame */
+#define SS_BUNDLE_ALIGN(x)          (((x) + 7) & ~7)
+
+typedef struct {
+    uint32_t        n_file;
+    uint32_t        token;              /* echoed in the FILE_BRES */
+    char            name[0];            /* n_file NUL terminated names */
+} ss_filebreq_t;
+
+/*
+ * followed by n_file records back to back, each one a ss_fileres_t, the
+ * name and the file data, padded to SS_BUNDLE_ALIGN
+ */
+typedef struct {
+    uint32_t        n_file;
+    uint32_t        token;
+} ss_filebres_t;
+
+/* striping, ranges of a large file over several connections */
+#define SS_STRIPES                  1                   /* connections per cli, 1: no striping */
+#define SS_STRIPE_MAX               16
+#define SS_STRIPE_MIN               (16 * 1024 * 1024)  /* smaller files are not striped */
+#define SS_STRIPE_ALIGN             (64 * 1024)
+
+typedef struct {
+    uint64_t        off;
+    uint64_t        len;
+    uint32_t        token;              /* echoed in the FILE_RRES */
+    uint32_t        rsv;
+    char            name[0];
+} ss_filerreq_t;
+
+/* first frame of a FILE_RRES, len bytes of the file at off follow */
+typedef struct {
+    uint32_t        flag;               /* SS_FILERES_* */
+    uint32_t        token;
+    uint64_t        off;
+    uint64_t        len;
+    uint64_t        size;               /* of the whole file */
+    time_t          mtime;
+    char            name[0];
+} ss_filerres_t;
+
+/* content defined chunking, a FILE_CREQ is a ss_filereq_t */
+#define SS_CDC_MINCHUNK             (16 * 1024)
+#define SS_CDC_AVGCHUNK             (64 * 1024)
+#define SS_CDC_MAXCHUNK             (256 * 1024)
+#define SS_CDC_MINSIZE              (4 * 1024 * 1024)   /* smaller files are fetched whole */
+#define SS_CDC_CACHE                32                  /* srv: chunk maps kept */
+#define SS_CDC_TOKEN                0x80000000          /* FILE_RREQ token of a missing run of chunks */
+
+/* resume, the rest of a file a lost connection cut off is asked for as a range */
+#define SS_RESUME_MIN               (1024 * 1024)       /* smaller part files are fetched again */
+#define SS_RESUME_TOKEN             0x40000000          /* FILE_RREQ token of the rest of a part file */
+
+typedef struct {
+    uint64_t        hash;               /* xxh64 of the chunk */
+    uint32_t        len;
+    uint32_t        rsv;
+} ss_cdcent_t;
+
+typedef struct {
+    uint32_t        flag;               /* SS_FILERES_* */
+    uint32_t        n_chunk;
+    uint64_t        size;
+    time_t          mtime;
+    uint64_t        hash;               /* xxh64 of the whole file */
+    uint32_t        name_len;
+    uint32_t        rsv;
+    ss_cdcent_t     ent[0];             /* n_chunk chunks in file order, then name */
+} ss_filecres_t;
+
+/* subscriptions, n_match then n_ignore NUL terminated patterns follow */
+typedef struct {
+    uint32_t        n_match;
+    uint32_t        n_ignore;
+    char            pat[0];
+} ss_subscribe_t;
+
+/* swarm */
+#define SS_SWARM_CHUNK              (512 * 1024)    /* one CHUNK_RES always fits in one frame */
+#define SS_SWARM_MINSIZE            (4 * SS_SWARM_CHUNK)
+#define SS_SWARM_WINDOW             8               /* chunk requests in flight per file */
+#define SS_SWARM_MAXHOLDER          8
+#define SS_SWARM_MAXFILE            64
+#define SS_SWARM_MAXPEER            64
+
+typedef struct {
+    uint16_t        port;
+    uint16_t        rsv;
+} ss_peerhello_t;
+
+typedef struct {
+    uint64_t        hash;               /* file version, hash of the chunk hashes */
+    uint64_t        size;
+    time_t          mtime;
+    uint32_t        n_chunk;
+    uint32_t        name_len;
+    uint64_t        chash[0];           /* n_chunk chunk hashes, then name */
+} ss_swarmmap_t;
+
+#define SS_CHUNKREQ_ORIGIN          0x1     /* do not redirect to a peer */
+#define SS_CHUNKREQ_NORETRY         0x2     /* asked before, do not answer RETRY again */
+
+typedef struct {
+    uint64_t        hash;
+    uint32_t        idx;
+    uint32_t        flag;
+} ss_chunkreq_t;
+
+#define SS_CHUNKRES_VALID           0x1
+#define SS_CHUNKRES_REDIRECT        0x2     /* fetch from peer_ip:peer_port instead */
+#define SS_CHUNKRES_RETRY           0x4     /* on its way to another peer, ask again later */
+
+typedef struct {
+    uint64_t        hash;
+    uint32_t        idx;
+    uint32_t        flag;
+    uint32_t        len;
+    uint32_t        peer_ip;            /* network order */
+    uint16_t        peer_port;
+    uint16_t        rsv;
+    char            data[0];
+} ss_chunkres_t;
+
+typedef struct {
+    uint64_t        hash;
+    uint32_t        idx;
+    uint32_t        rsv;
+} ss_chunkhave_t;
+
+void ss_send_msg(ss_com_inst_t *inst, ss_msgtype_e type, void *buf, uint32_t len);
+void ss_tx_swarmreq(ss_com_inst_t *inst, char *name);
+void ss_tx_msg(ss_com_inst_t *inst, ss_msgtype_e type, void *buf, uint32_t len);
+void ss_tx_filebreq(ss_com_inst_t *inst, ss_filebreq_t *breq, uint32_t len);
+void ss_tx_filerreq(ss_com_inst_t *inst, ss_filerreq_t *rreq);
+void ss_tx_filecreq(ss_com_inst_t *inst, char *name);
+
+void ss_cdc_srv_init(ss_ctx_t *ctx);
+void *ss_cdc_srv_map(ss_ctx_t *ctx, char *name, int valid, time_t mtime, uint32_t *len);
+int ss_cdc_cli_file(ss_ctx_t *ctx, ss_filemeta_t *fm);
+void ss_cdc_cli_map(ss_com_inst_t *inst, ss_filecres_t *cres, uint32_t len);
+int ss_cdc_cli_res(ss_com_inst_t *inst, ss_msghead_t *msghead, void *body);
+void ss_cdc_cli_reset(ss_ctx_t *ctx);
+void ss_cdc_cli_pickup(ss_ctx_t *ctx);
+
+void ss_resume_cli_keep(ss_ctx_t *ctx, char *name, int fd, time_t mtime, uint64_t got);
+void ss_resume_cli_lost(ss_ctx_t *ctx);
+void ss_resume_cli_plan(ss_ctx_t *ctx, ss_dirmeta_t *newdm);
+int ss_resume_cli_file(ss_ctx_t *ctx, ss_filemeta_t *fm);
+int ss_resume_cli_res(ss_com_inst_t *inst, ss_msghead_t *msghead, void *body);
+
+void ss_sub_cli_send(ss_com_inst_t *inst);
+void ss_sub_srv_join(ss_com_inst_t *inst, ss_subscribe_t *s, uint32_t len);
+void ss_sub_srv_leave(ss_com_inst_t *inst);
+ss_dirmeta_t *ss_sub_srv_dm(ss_com_inst_t *inst);
+void ss_sub_srv_refresh(ss_ctx_t *ctx);
+int ss_sub_srv_changed(ss_com_inst_t *inst);
+
+int ss_swarm_srv_filereq(ss_com_inst_t *inst, char *name);
+void *ss_swarm_srv_map(ss_ctx_t *ctx, char *name, time_t mtime, uint32_t *len);
+void ss_swarm_srv_chunkreq(ss_com_inst_t *inst, ss_chunkreq_t *req);
+void ss_swarm_srv_chunkhave(ss_com_inst_t *inst, ss_chunkhave_t *have);
+void ss_swarm_srv_drop(ss_com_inst_t *inst);
+
+int ss_swarm_cli_start(ss_ctx_t *ctx);
+void ss_swarm_cli_hello(ss_com_inst_t *inst);
+void ss_swarm_cli_map(ss_com_inst_t *inst, ss_swarmmap_t *map, uint32_t len);
+void ss_swarm_cli_connect(ss_com_inst_t *inst);
+void ss_swarm_cli_chunkres(ss_com_inst_t *inst, ss_chunkres_t *res);
+void ss_swarm_cli_close(ss_com_inst_t *inst);
+void ss_swarm_cli_reset(ss_ctx_t *ctx);
+
+void ss_stripe_cli_start(ss_com_inst_t *inst);
+int ss_stripe_cli_connect(ss_com_inst_t *inst);
+int ss_stripe_cli_file(ss_ctx_t *ctx, ss_filemeta_t *fm);
+void ss_stripe_cli_res(ss_com_inst_t *inst, ss_msghead_t *msghead, void *body);
+int ss_stripe_cli_close(ss_com_inst_t *inst);
+void ss_stripe_cli_reset(ss_ctx_t *ctx);
+
 #endif
 
@@ -0,0 +1,272 @@
+#include "pub.h"
+
+/*
+ * resume of part files
+ *
+ * when the connection to the srv is lost, a FILE_RES that was half way is
+ * not thrown away: its part file is kept open, with the version of the
+ * file it is of and the bytes in it. once connected again, if the next
+ * update still wants that same version, only the rest of it is asked for
+ * with a FILE_RREQ and appended. a version that changed meanwhile, or a
+ * range that does not come back as asked, or a file that does not match
+ * its hash once put together, and it is fetched whole.
+ * sparse streams, stripes, chunk assemblies and swarm downloads are not
+ * kept, they start over.
+ */
+
+typedef struct _ss_resume {
+    struct _ss_resume       *next;
+    int                     fd;
+    uint32_t                token;
+    uint64_t                size, got;
+    time_t                  mtime;          /* of the version in the part file, as in the dm */
+    uint32_t                mtime_ns;
+    uint64_t                hash;
+
+    /* the rest is in flight */
+    int                     busy;
+    int                     failed;
+    uint32_t                sid;
+    uint64_t                off;            /* where it started */
+    char                    name[SS_MAXPATH_LEN];
+} ss_resume_t;
+
+static uint32_t g_resume_token;
+
+static void ss_resume_drop(ss_ctx_t *ctx, ss_resume_t *rs)
+{
+    ss_resume_t **pp;
+
+    for (pp = &(ctx->u.cli.resume); *pp; pp = &((*pp)->next)) {
+        if (*pp == rs) {
+            *pp = rs->next;
+            break;
+        }
+    }
+
+    if (rs->fd >= 0) {
+        ss_wr_abort(ctx, rs->fd, rs->name);
+    }
+    free(rs);
+}
+
+/* the connection is lost with got bytes of name in the part file fd, the data is of mtime */
+void ss_resume_cli_keep(ss_ctx_t *ctx, char *name, int fd, time_t mtime, uint64_t got)
+{
+    ss_filemeta_t *fm = ctx->dm ? ss_dm_find(ctx->dm, name) : NULL;
+    ss_resume_t *rs;
+
+    /* zero blocks of the rest are skipped as they come, the part file must be full length */
+    if ((fm == NULL) || (fm->mtime != mtime) || (got < SS_RESUME_MIN) || (got >= fm->size) ||
+        ftruncate(fd, fm->size)) {
+        ss_wr_abort(ctx, fd, name);
+        return;
+    }
+
+    rs = (ss_resume_t *)calloc(1, sizeof(ss_resume_t));
+    SS_ASSERT(rs);
+    rs->fd = fd;
+    rs->token = SS_RESUME_TOKEN | (g_resume_token++ & 0xffff);
+    rs->size = fm->size;
+    rs->got = got;
+    rs->mtime = fm->mtime;
+    rs->mtime_ns = fm->mtime_ns;
+    rs->hash = fm->hash;
+    strcpy(rs->name, name);
+
+    rs->next = ctx->u.cli.resume;
+    ctx->u.cli.resume = rs;
+
+    printf("resume: keep %s, %llu of %llu bytes\n", name, (unsigned long long)got, (unsigned long long)rs->size);
+}
+
+/* lost again, what came of a range in flight is kept, unless it went wrong */
+void ss_resume_cli_lost(ss_ctx_t *ctx)
+{
+    ss_resume_t *rs, *next;
+
+    for (rs = ctx->u.cli.resume; rs; rs = next) {
+        next = rs->next;
+        if (rs->failed || (rs->got < SS_RESUME_MIN)) {
+            ss_resume_drop(ctx, rs);
+            continue;
+        }
+        rs->busy = 0;
+        rs->sid = 0;
+    }
+}
+
+/* after ss_do_fileupdate: keep what newdm still wants in the same version */
+void ss_resume_cli_plan(ss_ctx_t *ctx, ss_dirmeta_t *newdm)
+{
+    ss_resume_t *rs, *next;
+    ss_filemeta_t *fm;
+    uint32_t i;
+
+    for (rs = ctx->u.cli.resume; rs; rs = next) {
+        next = rs->next;
+
+        if (rs->busy) {
+            continue;
+        }
+
+        fm = ss_dm_find(newdm, rs->name);
+        for (i = 0; fm && (i < ctx->u.cli.n_pend); i++) {
+            if (&(newdm->fml[ctx->u.cli.pend[i]]) == fm) {
+                break;
+            }
+        }
+
+        if ((fm == NULL) || (i == ctx->u.cli.n_pend) || (fm->size != rs->size) ||
+            (fm->mtime != rs->mtime) || (fm->mtime_ns != rs->mtime_ns) || (fm->hash != rs->hash)) {
+            printf("resume: %s changed, fetch it whole.\n", rs->name);
+            ss_resume_drop(ctx, rs);
+        }
+    }
+}
+
+static void ss_resume_send_req(ss_ctx_t *ctx, ss_msgtype_e type, ss_resume_t *rs)
+{
+    char buf[sizeof(ss_filerreq_t) + SS_MAXPATH_LEN];
+    ss_filerreq_t *rreq = (ss_filerreq_t *)buf;
+    ss_filereq_t *req = (ss_filereq_t *)buf;
+    uint32_t len_name = strlen(rs->name) + 1;
+
+    if (type == SS_MSGTYPE_FILE_RREQ) {
+        memset(rreq, 0, sizeof(ss_filerreq_t));
+        rreq->off = rs->got;
+        rreq->len = rs->size - rs->got;
+        rreq->token = rs->token;
+        memcpy(rreq->name, rs->name, len_name);
+        ss_send_msg(ctx->com.main_inst, type, rreq, sizeof(ss_filerreq_t) + len_name);
+    } else {
+        memset(req, 0, sizeof(ss_filereq_t));
+        memcpy(req->name, rs->name, len_name);
+        ss_send_msg(ctx->com.main_inst, type, req, sizeof(ss_filereq_t) + len_name);
+    }
+}
+
+/* ask for the rest of fm if its part file is kept, -1: there is none */
+int ss_resume_cli_file(ss_ctx_t *ctx, ss_filemeta_t *fm)
+{
+    ss_resume_t *rs;
+
+    for (rs = ctx->u.cli.resume; rs; rs = rs->next) {
+        if (!rs->busy && (strcmp(rs->name, fm->name) == 0)) {
+            break;
+        }
+    }
+    if (rs == NULL) {
+        return -1;
+    }
+
+    printf("resume: %s from %llu\n", rs->name, (unsigned long long)rs->got);
+
+    rs->busy = 1;
+    rs->off = rs->got;
+    ss_resume_send_req(ctx, SS_MSGTYPE_FILE_RREQ, rs);
+
+    return 0;
+}
+
+/*
+ * the range is in, or failed: put the file in place, or ask for it whole.
+ * the two halves came over two connections, the whole is checked against
+ * the hash of the version, when the srv sent one.
+ */
+static void ss_resume_finish(ss_ctx_t *ctx, ss_resume_t *rs)
+{
+    int fd = rs->fd;
+    uint64_t hash;
+
+    if (!rs->failed && (rs->got == rs->size) && rs->hash &&
+        (ss_file_xxh64(fd, rs->size, &hash) || (hash != rs->hash))) {
+        printf("resume: %s does not match its hash.\n", rs->name);
+        rs->failed = 1;
+    }
+
+    if (rs->failed || (rs->got != rs->size)) {
+        printf("resume: %s faild, fetch it whole.\n", rs->name);
+        ss_resume_send_req(ctx, SS_MSGTYPE_FILE_REQ, rs);
+        ss_resume_drop(ctx, rs);
+        return;
+    }
+
+    rs->fd = -1;
+    if (ss_wr_commit(ctx, fd, rs->name)) {
+        ss_cli_file_done(ctx, rs->name, SS_FILEDONE_FAILED, 0, 0);
+    } else {
+        printf("resume: %s done, %llu bytes fetched again\n", rs->name, (unsigned long long)(rs->size - rs->off));
+        ss_cli_file_done(ctx, rs->name, SS_FILEDONE_SAVED, rs->mtime, rs->size);
+    }
+    ss_resume_drop(ctx, rs);
+}
+
+/* a FILE_RRES frame, 0 if it was the rest of a part file, -1 if it is not ours */
+int ss_resume_cli_res(ss_com_inst_t *inst, ss_msghead_t *msghead, void *body)
+{
+    ss_ctx_t *ctx = (ss_ctx_t *)inst->com->param;
+    ss_filerres_t *res = (ss_filerres_t *)body;
+    ss_resume_t *rs;
+    uint32_t off = 0;
+    ssize_t ret;
+
+    if ((ctx->u.cli.resume == NULL) || (inst != ctx->com.main_inst)) {
+        return -1;
+    }
+
+    if (msghead->sop) {
+        if ((msghead->len < sizeof(ss_filerres_t)) ||
+            ((res->token & (SS_CDC_TOKEN | SS_RESUME_TOKEN)) != SS_RESUME_TOKEN)) {
+            return -1;
+        }
+        for (rs = ctx->u.cli.resume; rs; rs = rs->next) {
+            if (rs->busy && (rs->token == res->token)) {
+                break;
+            }
+        }
+        if (rs == NULL) {
+            printf("resume: unknown range, drop.\n");
+            return 0;
+        }
+        rs->sid = msghead->sid;
+
+        off = sizeof(ss_filerres_t) + strnlen(res->name, msghead->len - sizeof(ss_filerres_t)) + 1;
+        if (!(res->flag & SS_FILERES_VALID) || !(res->flag & SS_FILERES_EXIST) ||
+            (res->size != rs->size) || (res->mtime != rs->mtime) ||
+            (res->off != rs->got) || (res->len != rs->size - rs->got)) {
+            /* not the version in the part file any more */
+            rs->failed = 1;
+        }
+    } else {
+        for (rs = ctx->u.cli.resume; rs; rs = rs->next) {
+            if (rs->busy && rs->sid && (rs->sid == msghead->sid)) {
+                break;
+            }
+        }
+        if (rs == NULL) {
+            return -1;
+        }
+    }
+
+    while ((off < msghead->len) && !rs->failed) {
+        if (rs->got + (msghead->len - off) > rs->size) {
+            rs->failed = 1;
+            break;
+        }
+        ret = ss_pwrite_sparse(rs->fd, (char *)body + off, msghead->len - off, rs->got);
+        if (ret <= 0) {
+            printf("resume: write %s faild.\n", rs->name);
+            rs->failed = 1;
+            break;
+        }
+        off += ret;
+        rs->got += ret;
+    }
+
+    if (msghead->eop) {
+        ss_resume_finish(ctx, rs);
+    }
+
+    return 0;
+}
@@ -0,0 +1,282 @@
+#include "pub.h"
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+/*
+ * low impact scanning
+ *
+ * by default the srv rescans the tree every SS_PATH_RESCAN_CYCLE ticks and
+ * stats every file each tick, and an idle cli stats every file each tick,
+ * all of it on the epoll thread, as fast as the disk answers. with a
+ * budget set (--scan-rate stats a second, --scan-cpu ms of CPU a tick) the
+ * srv hands its scans to a thread of their own: a pass is a path_scan and
+ * a refresh, paced entry by entry, and the dm goes to the epoll thread once
+ * the pass is over, however many ticks it took. the cpu the pass used
+ * beyond its share of the time since it started is slept off, so what is
+ * not paced itself (sort, crc) is paid for too. only the periodic passes
+ * are paced: the first one, and one for a change inotify saw, go as fast
+ * as they can, a pass that is under way when a change comes speeds up.
+ * --scan-low puts the thread at the lowest nice and in the idle I/O class.
+ * the cli can not sleep on its epoll thread, it stats a slice of its dm
+ * each tick instead, as much as the budget of the tick allows, and goes on
+ * from there the next tick.
+ */
+
+#define SS_SCAN_SLACK               (10 * 1000000ull)   /* ns, a pace this far behind is not slept for */
+#define SS_SCAN_CPU_CHECK           64                  /* entries between two looks at the cpu clock */
+#define SS_SCAN_NICE                19
+#define SS_IOPRIO_WHO_PROCESS       1
+#define SS_IOPRIO_CLASS_IDLE        3
+#define SS_IOPRIO_CLASS_SHIFT       13
+
+typedef struct {
+    uint64_t                gap;            /* ns between two entries, 0: no rate */
+    uint64_t                next;           /* when the next entry is due */
+    double                  share;          /* of a cpu, 0: no limit */
+    uint64_t                start, cpu;     /* of the pass */
+    uint32_t                n;
+    volatile int            off;            /* not paced, a change is waiting */
+} ss_scanpace_t;
+
+typedef struct _ss_scan {
+    ss_ctx_t                *ctx;
+    pthread_t               thread;
+    pthread_mutex_t         lock;
+    pthread_cond_t          cond;
+    int                     kick;           /* the tree changed, a pass is due now */
+    ss_dirmeta_t            *done;          /* of the last pass, not picked up yet */
+    ss_scanpace_t           pace;
+} ss_scan_t;
+
+/* the pace of the scans of this thread, NULL: as fast as they go */
+static __thread ss_scanpace_t *g_scan_pace;
+
+static uint64_t ss_scan_ns(clockid_t clk)
+{
+    struct timespec ts;
+
+    clock_gettime(clk, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void ss_scan_sleep(uint64_t ns)
+{
+    struct timespec ts;
+
+    ts.tv_sec = ns / 1000000000ull;
+    ts.tv_nsec = ns % 1000000000ull;
+    nanosleep(&ts, NULL);
+}
+
+/* sleep off the cpu used beyond the share */
+static void ss_scan_settle(ss_scanpace_t *p)
+{
+    double over;
+
+    over = (double)(ss_scan_ns(CLOCK_THREAD_CPUTIME_ID) - p->cpu) -
+           (double)(ss_scan_ns(CLOCK_MONOTONIC) - p->start) * p->share;
+    if (over > 0) {
+        ss_scan_sleep((uint64_t)(over / p->share));
+    }
+}
+
+/* path_scan and ss_dmstate_refresh, before each entry they look at */
+void ss_scan_pace(void)
+{
+    ss_scanpace_t *p = g_scan_pace;
+    uint64_t now;
+
+    if ((p == NULL) || p->off) {
+        return;
+    }
+
+    if (p->gap) {
+        now = ss_scan_ns(CLOCK_MONOTONIC);
+        /* time not used by a slow disk is not made up for with a burst */
+        if (p->next + SS_SCAN_SLACK < now) {
+            p->next = now - SS_SCAN_SLACK;
+        }
+        p->next += p->gap;
+        if (p->next > now + SS_SCAN_SLACK) {
+            ss_scan_sleep(p->next - now);
+        }
+    }
+
+    if ((p->share > 0) && ((++p->n % SS_SCAN_CPU_CHECK) == 0)) {
+        ss_scan_settle(p);
+    }
+}
+
+static void ss_scan_low(void)
+{
+    pid_t tid = (pid_t)syscall(SYS_gettid);
+
+    /* both are per thread on linux, the epoll thread keeps its own */
+    if (setpriority(PRIO_PROCESS, tid, SS_SCAN_NICE)) {
+        printf("scan: setpriority faild.\n");
+    }
+    if (syscall(SYS_ioprio_set, SS_IOPRIO_WHO_PROCESS, tid, SS_IOPRIO_CLASS_IDLE << SS_IOPRIO_CLASS_SHIFT)) {
+        printf("scan: ioprio_set faild.\n");
+    }
+}
+
+static void *ss_scan_thread(void *arg)
+{
+    ss_scan_t *s = (ss_scan_t *)arg;
+    ss_ctx_t *ctx = s->ctx;
+    ss_dirmeta_t *dm;
+    struct timespec ts;
+    uint64_t period = (uint64_t)ctx->cycle * 1000 * SS_PATH_RESCAN_CYCLE, start;
+
+    if (ctx->scan_low) {
+        ss_scan_low();
+    }
+    g_scan_pace = &(s->pace);
+
+    while (ctx->com.loop) {
+        start = ss_scan_ns(CLOCK_MONOTONIC);
+        s->pace.start = start;
+        s->pace.cpu = ss_scan_ns(CLOCK_THREAD_CPUTIME_ID);
+
+        dm = path_scan(ctx->localpath, &(ctx->ff));
+        if (dm) {
+            ss_dmstate_refresh(ctx, dm, 1);
+        }
+        if ((s->pace.share > 0) && !s->pace.off) {
+            ss_scan_settle(&(s->pace));
+        }
+
+        pthread_mutex_lock(&(s->lock));
+        ss_pool_put(s->done);
+        s->done = dm;
+        pthread_mutex_unlock(&(s->lock));
+        ss_com_notify(&(ctx->com));
+
+        /* the next pass a period after this one started, or once the tree changes */
+        clock_gettime(CLOCK_REALTIME, &ts);
+        start = ss_scan_ns(CLOCK_MONOTONIC) - start;
+        if (start < period) {
+            start = period - start + ts.tv_nsec;
+            ts.tv_sec += start / 1000000000ull;
+            ts.tv_nsec = start % 1000000000ull;
+        }
+        pthread_mutex_lock(&(s->lock));
+        while (!s->kick && ctx->com.loop) {
+            if (pthread_cond_timedwait(&(s->cond), &(s->lock), &ts)) {
+                break;
+            }
+        }
+        s->pace.off = s->kick;
+        s->kick = 0;
+        pthread_mutex_unlock(&(s->lock));
+    }
+
+    return NULL;
+}
+
+/* scans go to a paced thread if a budget is set, -1: they stay on the epoll thread */
+int ss_scan_srv_start(ss_ctx_t *ctx)
+{
+    ss_scan_t *s;
+
+    if (!ctx->scan_rate && !ctx->scan_cpu && !ctx->scan_low) {
+        return -1;
+    }
+
+    s = (ss_scan_t *)calloc(1, sizeof(ss_scan_t));
+    SS_ASSERT(s);
+    s->ctx = ctx;
+    pthread_mutex_init(&(s->lock), NULL);
+    pthread_cond_init(&(s->cond), NULL);
+    s->pace.gap = ctx->scan_rate ? 1000000000ull / ctx->scan_rate : 0;
+    s->pace.share = (double)ctx->scan_cpu * 1000 / ctx->cycle;
+    s->pace.off = 1;
+
+    if (pthread_create(&(s->thread), NULL, ss_scan_thread, s)) {
+        printf("scan: thread create faild, scan on the epoll thread.\n");
+        free(s);
+        return -1;
+    }
+    ctx->u.srv.scan = s;
+
+    return 0;
+}
+
+/* the tree changed, from the watch thread */
+void ss_scan_srv_kick(ss_ctx_t *ctx)
+{
+    ss_scan_t *s = ctx->u.srv.scan;
+
+    pthread_mutex_lock(&(s->lock));
+    s->kick = 1;
+    s->pace.off = 1;
+    pthread_cond_signal(&(s->cond));
+    pthread_mutex_unlock(&(s->lock));
+}
+
+/* epoll thread, on SS_CBTYPE_EVENT: the dm of the last pass replaces ctx->dm */
+void ss_scan_srv_pickup(ss_ctx_t *ctx)
+{
+    ss_scan_t *s = ctx->u.srv.scan;
+    ss_dirmeta_t *dm;
+
+    pthread_mutex_lock(&(s->lock));
+    dm = s->done;
+    s->done = NULL;
+    pthread_mutex_unlock(&(s->lock));
+
+    if (dm) {
+        ss_pool_put(ctx->dm);
+        ctx->dm = dm;
+    }
+}
+
+/*
+ * cli epoll thread, on a tick while idle: stat the next slice of ctx->dm,
+ * returns the number of files that are gone.
+ */
+int ss_scan_cli_tick(ss_ctx_t *ctx)
+{
+    ss_dirmeta_t *dm = ctx->dm;
+    uint64_t left, cpu = 0;
+    int from, to, n_gone = 0, gone;
+
+    left = ctx->scan_rate ? (uint64_t)ctx->scan_rate * ctx->cycle / 1000000 : dm->n_file;
+    if (left == 0) {
+        left = 1;
+    }
+    if (ctx->scan_cpu) {
+        cpu = ss_scan_ns(CLOCK_THREAD_CPUTIME_ID) + (uint64_t)ctx->scan_cpu * 1000000;
+    }
+
+    from = ctx->u.cli.scan_pos;
+    if (from >= dm->n_file) {
+        from = 0;
+    }
+    while ((left > 0) && (from < dm->n_file)) {
+        to = from + SS_SCAN_CPU_CHECK;
+        if (to > dm->n_file) {
+            to = dm->n_file;
+        }
+        if (to - from > left) {
+            to = from + left;
+        }
+        left -= to - from;
+
+        gone = ss_dmstate_refresh_part(ctx, dm, 0, from, to);
+        n_gone += gone;
+        from = to - gone;
+
+        if (cpu && (ss_scan_ns(CLOCK_THREAD_CPUTIME_ID) >= cpu)) {
+            break;
+        }
+    }
+    if ((from >= dm->n_file) && (n_gone == 0)) {
+        /* once a pass, as the full refresh does each tick: a failed file is fetched again */
+        dm->crc = alg_crc32(dm->fml, dm->n_file * sizeof(ss_filemeta_t));
+    }
+    ctx->u.cli.scan_pos = from;
+
+    return n_gone;
+}
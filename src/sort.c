@@ -0,0 +1,241 @@
+#include "pub.h"
+
+/*
+ * sorting of file lists
+ *
+ * a scan comes out of readdir in no order, path_scan sorts it by name.
+ * rather than qsort moving 272 byte records around, a 16 byte key of each
+ * is sorted: 8 bytes of the name, big endian, and the record. all keys
+ * are sorted by the first 8 bytes, each run of keys that agree on them by
+ * the next 8, and so on, so a step is one integer compare, and the shared
+ * directory part of the names is gone through once a level, not once a
+ * compare. a large list is cut into runs sorted by threads of their own,
+ * then merged. at last the records are moved once, cycle by cycle.
+ */
+
+#define SS_SORT_INSERT              16          /* runs this short are insertion sorted */
+#define SS_SORT_PAR_MIN             32768       /* lists shorter than this are sorted by the caller alone */
+#define SS_SORT_THREADS             4
+
+typedef struct {
+    uint64_t                pfx;
+    ss_filemeta_t           *fm;
+} ss_sortkey_t;
+
+typedef struct {
+    ss_sortkey_t            *key, *tmp;
+    uint32_t                n;
+    pthread_t               thread;
+} ss_sortrun_t;
+
+/* the 8 bytes of name from depth on, big endian, 0 past its end */
+static uint64_t ss_sort_pfx(const char *name, uint32_t depth)
+{
+    uint64_t pfx = 0;
+    int i;
+
+    name += depth;
+    for (i = 0; i < 8; i++) {
+        pfx <<= 8;
+        if (*name) {
+            pfx |= (uint8_t)*name++;
+        }
+    }
+
+    return pfx;
+}
+
+/* a[0..na) and b[0..nb) are sorted by pfx, out gets both */
+static void ss_sort_merge(ss_sortkey_t *out, ss_sortkey_t *a, uint32_t na, ss_sortkey_t *b, uint32_t nb)
+{
+    ss_sortkey_t *aend = a + na, *bend = b + nb;
+
+    while ((a < aend) && (b < bend)) {
+        *out++ = (b->pfx < a->pfx) ? *b++ : *a++;
+    }
+    memcpy(out, a, (aend - a) * sizeof(ss_sortkey_t));
+    out += aend - a;
+    memcpy(out, b, (bend - b) * sizeof(ss_sortkey_t));
+}
+
+/* merge sort of key[0..n) by pfx, tmp as large */
+static void ss_sort_pfx_keys(ss_sortkey_t *key, ss_sortkey_t *tmp, uint32_t n)
+{
+    ss_sortkey_t k;
+    uint32_t i, j, h;
+
+    if (n <= SS_SORT_INSERT) {
+        for (i = 1; i < n; i++) {
+            k = key[i];
+            for (j = i; (j > 0) && (k.pfx < key[j - 1].pfx); j--) {
+                key[j] = key[j - 1];
+            }
+            key[j] = k;
+        }
+        return;
+    }
+
+    h = n / 2;
+    ss_sort_pfx_keys(key, tmp, h);
+    ss_sort_pfx_keys(key + h, tmp + h, n - h);
+    if (key[h - 1].pfx <= key[h].pfx) {
+        /* in order already */
+        return;
+    }
+    ss_sort_merge(tmp, key, h, key + h, n - h);
+    memcpy(key, tmp, n * sizeof(ss_sortkey_t));
+}
+
+/*
+ * key[0..n) agree on the names up to depth, pfx holds the 8 bytes from
+ * there. sorted by pfx, each run of the same pfx goes on 8 bytes deeper.
+ */
+static void ss_sort_keys(ss_sortkey_t *key, ss_sortkey_t *tmp, uint32_t n, uint32_t depth)
+{
+    ss_sortkey_t k;
+    uint32_t i, j, m;
+
+    if (n <= SS_SORT_INSERT) {
+        for (i = 1; i < n; i++) {
+            k = key[i];
+            for (j = i; (j > 0) && (strcmp(k.fm->name + depth, key[j - 1].fm->name + depth) < 0); j--) {
+                key[j] = key[j - 1];
+            }
+            key[j] = k;
+        }
+        return;
+    }
+
+    ss_sort_pfx_keys(key, tmp, n);
+
+    for (i = 0; i < n; i = j) {
+        for (j = i + 1; (j < n) && (key[j].pfx == key[i].pfx); j++);
+        /* the same 8 bytes, and none of them ends the name */
+        if ((j - i > 1) && (key[i].pfx & 0xff)) {
+            for (m = i; m < j; m++) {
+                key[m].pfx = ss_sort_pfx(key[m].fm->name, depth + 8);
+            }
+            ss_sort_keys(key + i, tmp + i, j - i, depth + 8);
+        }
+    }
+}
+
+/* as ss_sort_merge, but of runs sorted by name */
+static void ss_sort_merge_names(ss_sortkey_t *out, ss_sortkey_t *a, uint32_t na, ss_sortkey_t *b, uint32_t nb)
+{
+    ss_sortkey_t *aend = a + na, *bend = b + nb;
+
+    while ((a < aend) && (b < bend)) {
+        *out++ = (strcmp(b->fm->name, a->fm->name) < 0) ? *b++ : *a++;
+    }
+    memcpy(out, a, (aend - a) * sizeof(ss_sortkey_t));
+    out += aend - a;
+    memcpy(out, b, (bend - b) * sizeof(ss_sortkey_t));
+}
+
+static void *ss_sort_thread(void *arg)
+{
+    ss_sortrun_t *run = (ss_sortrun_t *)arg;
+
+    ss_sort_keys(run->key, run->tmp, run->n, 0);
+
+    return NULL;
+}
+
+/* sorts key[0..n), the result is in key or in tmp, whichever is returned */
+static ss_sortkey_t *ss_sort_par(ss_sortkey_t *key, ss_sortkey_t *tmp, uint32_t n)
+{
+    ss_sortrun_t run[SS_SORT_THREADS];
+    ss_sortkey_t *t;
+    uint32_t n_run, i, j, off;
+    long n_cpu = sysconf(_SC_NPROCESSORS_ONLN);
+
+    n_run = (n_cpu < SS_SORT_THREADS) ? (n_cpu > 1 ? n_cpu : 1) : SS_SORT_THREADS;
+    if ((n < SS_SORT_PAR_MIN) || (n_run == 1)) {
+        ss_sort_keys(key, tmp, n, 0);
+        return key;
+    }
+
+    for (i = 0, off = 0; i < n_run; i++) {
+        run[i].key = key + off;
+        run[i].tmp = tmp + off;
+        run[i].n = (n - off) / (n_run - i);
+        off += run[i].n;
+    }
+    /* run 0 on this thread, the others on their own, or here too if that fails */
+    for (i = 1; i < n_run; i++) {
+        if (pthread_create(&(run[i].thread), NULL, ss_sort_thread, &(run[i]))) {
+            ss_sort_thread(&(run[i]));
+            run[i].thread = 0;
+        }
+    }
+    ss_sort_thread(&(run[0]));
+    for (i = 1; i < n_run; i++) {
+        if (run[i].thread) {
+            pthread_join(run[i].thread, NULL);
+        }
+    }
+
+    /* merge neighbours pairwise, back and forth between key and tmp */
+    while (n_run > 1) {
+        for (i = 0, j = 0; i < n_run; i += 2, j++) {
+            off = run[i].key - key;
+            if (i + 1 < n_run) {
+                ss_sort_merge_names(tmp + off, run[i].key, run[i].n, run[i + 1].key, run[i + 1].n);
+                run[j].n = run[i].n + run[i + 1].n;
+            } else {
+                memcpy(tmp + off, run[i].key, run[i].n * sizeof(ss_sortkey_t));
+                run[j].n = run[i].n;
+            }
+            run[j].key = tmp + off;
+        }
+        n_run = j;
+        t = key;
+        key = tmp;
+        tmp = t;
+    }
+
+    return key;
+}
+
+/* dm->fml sorted by name, in place */
+void ss_dm_sort(ss_dirmeta_t *dm)
+{
+    ss_sortkey_t *key, *tmp, *sorted;
+    ss_filemeta_t t;
+    uint32_t *src, i, j, k;
+
+    if (dm->n_file < 2) {
+        return;
+    }
+
+    key = (ss_sortkey_t *)ss_pool_get(2 * dm->n_file * sizeof(ss_sortkey_t));
+    tmp = key + dm->n_file;
+    for (i = 0; i < dm->n_file; i++) {
+        key[i].pfx = ss_sort_pfx(dm->fml[i].name, 0);
+        key[i].fm = &(dm->fml[i]);
+    }
+
+    sorted = ss_sort_par(key, tmp, dm->n_file);
+
+    /* the record going to slot i is at src[i], each cycle of that is moved round once */
+    src = (uint32_t *)(sorted == key ? tmp : key);
+    for (i = 0; i < dm->n_file; i++) {
+        src[i] = sorted[i].fm - dm->fml;
+    }
+    for (i = 0; i < dm->n_file; i++) {
+        if (src[i] == i) {
+            continue;
+        }
+        t = dm->fml[i];
+        for (j = i; src[j] != i; j = k) {
+            k = src[j];
+            dm->fml[j] = dm->fml[k];
+            src[j] = j;
+        }
+        dm->fml[j] = t;
+        src[j] = j;
+    }
+
+    ss_pool_put(key);
+}
@@ -0,0 +1,357 @@
+#include "pub.h"
+
+/*
+ * striping
+ *
+ * one TCP connection does not fill a long fat link. with --stripes n the
+ * cli opens n - 1 data connections to the srv next to the main one, and a
+ * file of at least stripe_min bytes is split into one byte range per
+ * connection, asked for with FILE_RREQ. each FILE_RRES is written at its
+ * offset as its frames arrive, the file is done once all of its ranges
+ * are. everything but ranges stays on the main connection, and all of it
+ * runs in the epoll thread of ctx->com. the data connections are dialed
+ * without waiting, ranges go only to the ones that are up.
+ */
+
+typedef struct _ss_stripe_file {
+    struct _ss_stripe_file  *next;
+    uint64_t                size;
+    time_t                  mtime;          /* of the first range, the others must match */
+    int                     fd;
+    int                     n_left;         /* ranges not done yet */
+    int                     failed;
+    char                    name[SS_MAXPATH_LEN];
+} ss_stripe_file_t;
+
+/* one range in flight, the token of its FILE_RREQ is the index */
+typedef struct {
+    ss_stripe_file_t        *file;          /* NULL: free slot */
+    ss_com_inst_t           *inst;
+    uint32_t                sid;            /* of the FILE_RRES, 0 until its first frame */
+    uint64_t                off, len, got;
+} ss_stripe_part_t;
+
+typedef struct _ss_stripe_cli {
+    ss_com_inst_t           *conn[SS_STRIPE_MAX];   /* up, the main one first */
+    int                     n_conn;
+    ss_com_inst_t           *dial[SS_STRIPE_MAX];   /* not up yet */
+    int                     n_dial;
+    ss_stripe_file_t        *list;
+    ss_stripe_part_t        *part;
+    uint32_t                n_part;
+} ss_stripe_cli_t;
+
+static uint32_t ss_stripe_part_get(ss_stripe_cli_t *st)
+{
+    uint32_t i;
+
+    for (i = 0; i < st->n_part; i++) {
+        if (st->part[i].file == NULL) {
+            return i;
+        }
+    }
+
+    st->part = (ss_stripe_part_t *)realloc(st->part, (st->n_part + SS_STRIPE_MAX) * sizeof(ss_stripe_part_t));
+    SS_ASSERT(st->part);
+    memset(st->part + st->n_part, 0, SS_STRIPE_MAX * sizeof(ss_stripe_part_t));
+    st->n_part += SS_STRIPE_MAX;
+
+    return i;
+}
+
+static void ss_stripe_send_rreq(ss_com_inst_t *inst, char *name, uint64_t off, uint64_t len, uint32_t token)
+{
+    char buf[sizeof(ss_filerreq_t) + SS_MAXPATH_LEN];
+    ss_filerreq_t *rreq = (ss_filerreq_t *)buf;
+    uint32_t len_name = strlen(name) + 1;
+
+    memset(rreq, 0, sizeof(ss_filerreq_t));
+    rreq->off = off;
+    rreq->len = len;
+    rreq->token = token;
+    memcpy(rreq->name, name, len_name);
+
+    ss_send_msg(inst, SS_MSGTYPE_FILE_RREQ, rreq, sizeof(ss_filerreq_t) + len_name);
+}
+
+/* a range is over, the file is once it was the last one */
+static void ss_stripe_part_done(ss_ctx_t *ctx, ss_stripe_part_t *part, int ok)
+{
+    ss_stripe_cli_t *st = ctx->u.cli.stripe;
+    ss_stripe_file_t *f = part->file, **pp;
+
+    if (!ok) {
+        f->failed = 1;
+    }
+    memset(part, 0, sizeof(ss_stripe_part_t));
+
+    if (--(f->n_left)) {
+        return;
+    }
+
+    for (pp = &(st->list); *pp; pp = &((*pp)->next)) {
+        if (*pp == f) {
+            *pp = f->next;
+            break;
+        }
+    }
+    if (f->failed) {
+        ss_wr_abort(ctx, f->fd, f->name);
+    } else if (ss_wr_commit(ctx, f->fd, f->name)) {
+        f->failed = 1;
+    }
+
+    if (f->failed) {
+        printf("stripe: %s faild.\n", f->name);
+        ss_cli_file_done(ctx, f->name, SS_FILEDONE_FAILED, 0, 0);
+    } else {
+        printf("stripe: %s done.\n", f->name);
+        ss_cli_file_done(ctx, f->name, SS_FILEDONE_SAVED, f->mtime, f->size);
+    }
+
+    free(f);
+}
+
+/* CONNECT of the main connection, the first one or one after a reconnect */
+void ss_stripe_cli_start(ss_com_inst_t *inst)
+{
+    ss_ctx_t *ctx = (ss_ctx_t *)inst->com->param;
+    ss_stripe_cli_t *st;
+    ss_com_inst_t *conn;
+    uint32_t i;
+
+    st = (ss_stripe_cli_t *)calloc(1, sizeof(ss_stripe_cli_t));
+    SS_ASSERT(st);
+    ctx->u.cli.stripe = st;
+
+    st->conn[st->n_conn++] = inst;
+    for (i = 1; (i < ctx->stripes) && (i < SS_STRIPE_MAX); i++) {
+        conn = ss_com_dial(inst->com, &(inst->addr), SS_CONNECT_TIMEOUT, 0);
+        if (conn == NULL) {
+            break;
+        }
+        st->dial[st->n_dial++] = conn;
+    }
+
+    printf("stripe: dial %d data connections\n", st->n_dial);
+}
+
+/* CONNECT of another connection, returns 1 if it was a data connection, it takes ranges now */
+int ss_stripe_cli_connect(ss_com_inst_t *inst)
+{
+    ss_ctx_t *ctx = (ss_ctx_t *)inst->com->param;
+    ss_stripe_cli_t *st = ctx->u.cli.stripe;
+    int i;
+
+    if (st == NULL) {
+        return 0;
+    }
+
+    for (i = 0; i < st->n_dial; i++) {
+        if (st->dial[i] == inst) {
+            st->dial[i] = st->dial[--(st->n_dial)];
+            st->conn[st->n_conn++] = inst;
+            printf("stripe: %d connections\n", st->n_conn);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/* ask for the ranges of a large file, -1: not striped, use FILE_REQ */
+int ss_stripe_cli_file(ss_ctx_t *ctx, ss_filemeta_t *fm)
+{
+    ss_stripe_cli_t *st = ctx->u.cli.stripe;
+    ss_stripe_file_t *f;
+    ss_stripe_part_t *part;
+    uint64_t off, step;
+    uint32_t idx;
+    int i;
+
+    if ((st == NULL) || (st->n_conn < 2) || (fm->size < ctx->stripe_min) ||
+        (ctx->swarm && (fm->size >= SS_SWARM_MINSIZE))) {
+        return -1;
+    }
+
+    f = (ss_stripe_file_t *)calloc(1, sizeof(ss_stripe_file_t));
+    SS_ASSERT(f);
+    f->size = fm->size;
+    strcpy(f->name, fm->name);
+
+    /* zero blocks of the ranges are left as holes */
+    f->fd = ss_wr_open(ctx, f->name, f->size, 1);
+    if (f->fd < 0) {
+        free(f);
+        return -1;
+    }
+
+    f->next = st->list;
+    st->list = f;
+
+    step = (fm->size + st->n_conn - 1) / st->n_conn;
+    step = (step + SS_STRIPE_ALIGN - 1) & ~((uint64_t)SS_STRIPE_ALIGN - 1);
+
+    for (i = 0, off = 0; off < fm->size; i++, off += step) {
+        idx = ss_stripe_part_get(st);
+        part = &(st->part[idx]);
+        part->file = f;
+        part->inst = st->conn[i];
+        part->off = off;
+        part->len = (fm->size - off) < step ? (fm->size - off) : step;
+        f->n_left++;
+
+        ss_stripe_send_rreq(part->inst, f->name, part->off, part->len, idx);
+    }
+
+    return 0;
+}
+
+/* a FILE_RRES frame, on any of the connections */
+void ss_stripe_cli_res(ss_com_inst_t *inst, ss_msghead_t *msghead, void *body)
+{
+    ss_ctx_t *ctx = (ss_ctx_t *)inst->com->param;
+    ss_stripe_cli_t *st = ctx->u.cli.stripe;
+    ss_stripe_part_t *part = NULL;
+    ss_filerres_t *res = (ss_filerres_t *)body;
+    ss_stripe_file_t *f;
+    uint32_t i, off = 0, subh_len;
+    ssize_t ret;
+
+    if (st == NULL) {
+        return;
+    }
+
+    if (msghead->sop) {
+        if ((msghead->len < sizeof(ss_filerres_t)) || (res->token >= st->n_part) ||
+            (st->part[res->token].file == NULL) || (st->part[res->token].inst != inst)) {
+            printf("stripe: unknown range, drop.\n");
+            return;
+        }
+        part = &(st->part[res->token]);
+        part->sid = msghead->sid;
+        f = part->file;
+
+        subh_len = sizeof(ss_filerres_t) + strnlen(res->name, msghead->len - sizeof(ss_filerres_t)) + 1;
+        off = subh_len;
+
+        if (!(res->flag & SS_FILERES_VALID) || !(res->flag & SS_FILERES_EXIST) ||
+            (res->size != f->size) || (res->off != part->off) || (res->len != part->len) ||
+            (f->mtime && (f->mtime != res->mtime))) {
+            /* gone or changed meanwhile, the next digest sorts it out */
+            f->failed = 1;
+        }
+        f->mtime = res->mtime;
+    } else {
+        for (i = 0; i < st->n_part; i++) {
+            if (st->part[i].file && (st->part[i].inst == inst) && (st->part[i].sid == msghead->sid)) {
+                part = &(st->part[i]);
+                break;
+            }
+        }
+        if (part == NULL) {
+            printf("stripe: frame of unknown range, drop.\n");
+            return;
+        }
+        f = part->file;
+    }
+
+    while ((off < msghead->len) && !f->failed) {
+        if (part->got + (msghead->len - off) > part->len) {
+            f->failed = 1;
+            break;
+        }
+        ret = ss_pwrite_sparse(f->fd, (char *)body + off, msghead->len - off, part->off + part->got);
+        if (ret <= 0) {
+            printf("stripe: write %s faild.\n", f->name);
+            f->failed = 1;
+            break;
+        }
+        off += ret;
+        part->got += ret;
+    }
+
+    if (msghead->eop) {
+        ss_stripe_part_done(ctx, part, part->got == part->len);
+    }
+}
+
+/* returns 1 if inst was a data connection, its ranges fail */
+int ss_stripe_cli_close(ss_com_inst_t *inst)
+{
+    ss_ctx_t *ctx = (ss_ctx_t *)inst->com->param;
+    ss_stripe_cli_t *st = ctx->u.cli.stripe;
+    uint32_t i;
+    int found = 0;
+
+    if (st == NULL) {
+        return 0;
+    }
+
+    for (i = 0; i < st->n_dial; i++) {
+        if (st->dial[i] == inst) {
+            /* the dial failed or timed out, nothing was sent on it */
+            st->dial[i] = st->dial[--(st->n_dial)];
+            return 1;
+        }
+    }
+
+    for (i = 1; i < st->n_conn; i++) {
+        if (st->conn[i] == inst) {
+            st->conn[i] = st->conn[--(st->n_conn)];
+            found = 1;
+            break;
+        }
+    }
+
+    if (!found) {
+        return 0;
+    }
+
+    printf("stripe: data connection lost, %d left\n", st->n_conn);
+
+    for (i = 0; i < st->n_part; i++) {
+        if (st->part[i].file && (st->part[i].inst == inst)) {
+            ss_stripe_part_done(ctx, &(st->part[i]), 0);
+        }
+    }
+
+    return 1;
+}
+
+/*
+ * the main connection is lost: drop the files being fetched, without a
+ * callback, and hang up the data connections. a new set is opened with the
+ * next main connection.
+ */
+void ss_stripe_cli_reset(ss_ctx_t *ctx)
+{
+    ss_stripe_cli_t *st = ctx->u.cli.stripe;
+    ss_stripe_file_t *f;
+    int i;
+
+    if (st == NULL) {
+        return;
+    }
+
+    while ((f = st->list) != NULL) {
+        st->list = f->next;
+        ss_wr_abort(ctx, f->fd, f->name);
+        free(f);
+    }
+
+    /*
+     * closed by the epoll thread once it reads the end of them, then they
+     * are not ours. a dial still in progress is reset by it and fails.
+     */
+    for (i = 1; i < st->n_conn; i++) {
+        shutdown(st->conn[i]->fd, SHUT_RDWR);
+    }
+    for (i = 0; i < st->n_dial; i++) {
+        shutdown(st->dial[i]->fd, SHUT_RDWR);
+    }
+
+    free(st->part);
+    free(st);
+    ctx->u.cli.stripe = NULL;
+}
@@ -0,0 +1,292 @@
+#include "pub.h"
+
+/*
+ * subscriptions
+ *
+ * a cli started with -m / -i hands its lists to the srv, which then keeps
+ * the view of dm through that filter for it: the digest it gets and the
+ * META_RES it asks for only hold the files it mirrors. clients with the
+ * same lists, in whatever order, share one view. a view is filtered again
+ * only when dm changes, which a cli tells from the digest the same way.
+ * a change of dm that leaves a view as it was sends its clients nothing,
+ * they get the digest of the heartbeat only.
+ */
+
+typedef struct _ss_sub {
+    struct _ss_sub          *next;
+    int                     ref;
+    uint32_t                key_len;
+    char                    *key;           /* the sorted lists, see ss_sub_key */
+    ss_filefilter_t         ff;
+    ss_dirmeta_t            *dm;            /* view of the srv dm, NULL until there is one */
+    uint32_t                src_crc;        /* of the srv dm the view was taken from */
+    int                     src_n_file;
+    uint32_t                md_crc;         /* of the view in the last digest round */
+    int                     md_n_file;
+    int                     md_new;         /* the view changed in this digest round */
+} ss_sub_t;
+
+/* cli: what ff holds as a SUBSCRIBE body, 0 if there is nothing to filter */
+static uint32_t ss_sub_seri(ss_filefilter_t *ff, void *buf)
+{
+    ss_subscribe_t *s = (ss_subscribe_t *)buf;
+    uint32_t len = sizeof(ss_subscribe_t), n;
+    char *pat;
+    int i;
+
+    if ((ff->n_match == 0) && (ff->n_ignore == 0)) {
+        return 0;
+    }
+
+    if (s) {
+        s->n_match = ff->n_match;
+        s->n_ignore = ff->n_ignore;
+    }
+
+    for (i = 0; i < ff->n_match + ff->n_ignore; i++) {
+        pat = i < ff->n_match ? ff->match[i] : ff->ignore[i - ff->n_match];
+
+        n = strlen(pat) + 1;
+        if (s) {
+            memcpy((char *)buf + len, pat, n);
+        }
+        len += n;
+    }
+
+    return len;
+}
+
+void ss_sub_cli_send(ss_com_inst_t *inst)
+{
+    ss_ctx_t *ctx = (ss_ctx_t *)inst->com->param;
+    uint32_t len = ss_sub_seri(&(ctx->ff), NULL);
+    void *buf;
+
+    if (len == 0) {
+        return;
+    }
+
+    buf = malloc(len);
+    SS_ASSERT(buf);
+    ss_sub_seri(&(ctx->ff), buf);
+
+    ss_send_msg(inst, SS_MSGTYPE_SUBSCRIBE, buf, len);
+
+    free(buf);
+}
+
+static int ss_sub_strcmp(const void *a, const void *b)
+{
+    return strcmp(*(char **)a, *(char **)b);
+}
+
+/* the lists sorted and NUL separated, behind the two counts */
+static char *ss_sub_key(ss_filefilter_t *ff, uint32_t *len)
+{
+    char *key, *p;
+    int i;
+
+    qsort(ff->match, ff->n_match, sizeof(char *), ss_sub_strcmp);
+    qsort(ff->ignore, ff->n_ignore, sizeof(char *), ss_sub_strcmp);
+
+    *len = 2 * sizeof(uint32_t);
+    for (i = 0; i < ff->n_match; i++) {
+        *len += strlen(ff->match[i]) + 1;
+    }
+    for (i = 0; i < ff->n_ignore; i++) {
+        *len += strlen(ff->ignore[i]) + 1;
+    }
+
+    key = (char *)malloc(*len);
+    SS_ASSERT(key);
+    ((uint32_t *)key)[0] = ff->n_match;
+    ((uint32_t *)key)[1] = ff->n_ignore;
+    p = key + 2 * sizeof(uint32_t);
+    for (i = 0; i < ff->n_match; i++) {
+        p = stpcpy(p, ff->match[i]) + 1;
+    }
+    for (i = 0; i < ff->n_ignore; i++) {
+        p = stpcpy(p, ff->ignore[i]) + 1;
+    }
+
+    return key;
+}
+
+static void ss_sub_free(ss_sub_t *sub)
+{
+    int i;
+
+    for (i = 0; i < sub->ff.n_match; i++) {
+        free(sub->ff.match[i]);
+    }
+    for (i = 0; i < sub->ff.n_ignore; i++) {
+        free(sub->ff.ignore[i]);
+    }
+    ss_filter_free(&(sub->ff));
+
+    ss_pool_put(sub->dm);
+    free(sub->key);
+    free(sub);
+}
+
+/* filter the srv dm again if it is not the one the view was taken from */
+static void ss_sub_view(ss_ctx_t *ctx, ss_sub_t *sub)
+{
+    ss_dirmeta_t *dm = ctx->dm, *view;
+    char path[SS_MAXPATH_LEN + 1];
+    int i;
+
+    if (dm == NULL) {
+        return;
+    }
+    if (sub->dm && (sub->src_crc == dm->crc) && (sub->src_n_file == dm->n_file)) {
+        return;
+    }
+
+    view = (ss_dirmeta_t *)ss_pool_zget(sizeof(ss_dirmeta_t) + dm->n_file * sizeof(ss_filemeta_t));
+    view->n_slot = dm->n_file;
+
+    /* dm is sorted, so is the view */
+    path[0] = '/';
+    for (i = 0; i < dm->n_file; i++) {
+        strcpy(path + 1, dm->fml[i].name);
+        if (ss_filter_path(&(sub->ff), path)) {
+            memcpy(&(view->fml[view->n_file]), &(dm->fml[i]), sizeof(ss_filemeta_t));
+            view->n_file++;
+        }
+    }
+    view->crc = alg_crc32(view->fml, view->n_file * sizeof(ss_filemeta_t));
+
+    ss_pool_put(sub->dm);
+    sub->dm = view;
+    sub->src_crc = dm->crc;
+    sub->src_n_file = dm->n_file;
+}
+
+/* srv: inst drops its subscription, if it has one */
+void ss_sub_srv_leave(ss_com_inst_t *inst)
+{
+    ss_ctx_t *ctx = (ss_ctx_t *)inst->com->param;
+    ss_srvcli_t *sc = (ss_srvcli_t *)inst->payload;
+    ss_sub_t *sub = sc ? sc->sub : NULL, **pp;
+
+    if (sub == NULL) {
+        return;
+    }
+    sc->sub = NULL;
+
+    if (--(sub->ref)) {
+        return;
+    }
+
+    for (pp = &(ctx->u.srv.sub); *pp; pp = &((*pp)->next)) {
+        if (*pp == sub) {
+            *pp = sub->next;
+            break;
+        }
+    }
+    ss_sub_free(sub);
+}
+
+/* srv: SUBSCRIBE of inst, len bytes */
+void ss_sub_srv_join(ss_com_inst_t *inst, ss_subscribe_t *s, uint32_t len)
+{
+    ss_ctx_t *ctx = (ss_ctx_t *)inst->com->param;
+    ss_srvcli_t *sc = (ss_srvcli_t *)inst->payload;
+    ss_sub_t *sub, *same;
+    char *p = (char *)(s + 1), *end = (char *)s + len;
+    uint32_t i, n;
+
+    if ((len < sizeof(ss_subscribe_t)) ||
+        (s->n_match > SS_MAX_STRARG) || (s->n_ignore > SS_MAX_STRARG)) {
+        printf("\tbroken subscribe, drop.\n");
+        return;
+    }
+
+    sub = (ss_sub_t *)calloc(1, sizeof(ss_sub_t));
+    SS_ASSERT(sub);
+
+    for (i = 0; i < s->n_match + s->n_ignore; i++) {
+        n = strnlen(p, end - p);
+        if ((n == end - p) || (n >= SS_MAXPATH_LEN)) {
+            printf("\tbroken subscribe, drop.\n");
+            ss_sub_free(sub);
+            return;
+        }
+        if (i < s->n_match) {
+            sub->ff.match[sub->ff.n_match++] = strdup(p);
+        } else {
+            sub->ff.ignore[sub->ff.n_ignore++] = strdup(p);
+        }
+        p += n + 1;
+    }
+    sub->key = ss_sub_key(&(sub->ff), &(sub->key_len));
+
+    ss_sub_srv_leave(inst);
+
+    /* one view per filter, however many clients use it */
+    for (same = ctx->u.srv.sub; same; same = same->next) {
+        if ((same->key_len == sub->key_len) && (memcmp(same->key, sub->key, sub->key_len) == 0)) {
+            break;
+        }
+    }
+
+    if (same) {
+        ss_sub_free(sub);
+        sub = same;
+    } else {
+        ss_filter_compile(&(sub->ff));
+        sub->next = ctx->u.srv.sub;
+        ctx->u.srv.sub = sub;
+    }
+
+    sub->ref++;
+    sc->sub = sub;
+    ss_sub_view(ctx, sub);
+    /* the cli asks for the view right after, that is its first digest */
+    if ((sub->ref == 1) && sub->dm) {
+        sub->md_crc = sub->dm->crc;
+        sub->md_n_file = sub->dm->n_file;
+    }
+
+    printf("\tsubscribe: %d match, %d ignore, %d clients on it\n", sub->ff.n_match, sub->ff.n_ignore, sub->ref);
+}
+
+/* srv: the dm inst is to see */
+ss_dirmeta_t *ss_sub_srv_dm(ss_com_inst_t *inst)
+{
+    ss_ctx_t *ctx = (ss_ctx_t *)inst->com->param;
+    ss_srvcli_t *sc = (ss_srvcli_t *)inst->payload;
+
+    if (sc && sc->sub) {
+        ss_sub_view(ctx, sc->sub);
+        return sc->sub->dm;
+    }
+
+    return ctx->dm;
+}
+
+/* srv, a digest round: dm may have changed, bring the views up to date and tell which did change */
+void ss_sub_srv_refresh(ss_ctx_t *ctx)
+{
+    ss_sub_t *sub;
+
+    for (sub = ctx->u.srv.sub; sub; sub = sub->next) {
+        ss_sub_view(ctx, sub);
+        if (sub->dm == NULL) {
+            sub->md_new = 0;
+            continue;
+        }
+        sub->md_new = (sub->dm->crc != sub->md_crc) || (sub->dm->n_file != sub->md_n_file);
+        sub->md_crc = sub->dm->crc;
+        sub->md_n_file = sub->dm->n_file;
+    }
+}
+
+/* srv: whether the view of inst changed in this digest round, 1 for a cli with no view */
+int ss_sub_srv_changed(ss_com_inst_t *inst)
+{
+    ss_srvcli_t *sc = (ss_srvcli_t *)inst->payload;
+
+    return (sc && sc->sub) ? sc->sub->md_new : 1;
+}
@@ -0,0 +1,949 @@
+#include "pub.h"
+
+/*
+ * swarm mode
+ *
+ * FILE_REQ of a large file is answered with a SWARM_MAP instead of FILE_RES:
+ * the chunk hashes of the current file version. the cli then asks the srv
+ * for each chunk with CHUNK_REQ. the srv either sends the chunk itself or,
+ * when another cli has announced it with CHUNK_HAVE, redirects to that peer.
+ * a chunk the srv is still sending to another cli is answered with RETRY
+ * once, so the requester moves on and comes back when a peer holds it.
+ * clients fetch chunks in a rotated order so concurrent downloads start on
+ * different chunks, and the srv ends up sending each chunk roughly once.
+ */
+
+typedef enum {
+    SS_CHUNK_MISSING,
+    SS_CHUNK_PENDING,
+    SS_CHUNK_HAVE,
+} ss_chunkstate_e;
+
+/* srv: one file version offered to the swarm */
+typedef struct _ss_swarm_file {
+    struct _ss_swarm_file   *next;
+    uint64_t                hash;
+    uint64_t                size;
+    time_t                  mtime;
+    uint32_t                n_chunk;
+    uint64_t                *chash;
+    ss_com_inst_t           **holder;       /* n_chunk x SS_SWARM_MAXHOLDER */
+    ss_com_inst_t           **inflight;     /* sent by the srv, not yet announced */
+    uint8_t                 *n_holder;
+    uint8_t                 *rr;
+    char                    name[SS_MAXPATH_LEN];
+} ss_swarm_file_t;
+
+typedef struct _ss_swarm_srv {
+    pthread_mutex_t         lock;           /* list is shared with the tx workers building maps */
+    ss_swarm_file_t         *list;
+    int                     n_file;
+} ss_swarm_srv_t;
+
+/* cli: one file version held or being fetched */
+typedef struct _ss_swarm_dl {
+    struct _ss_swarm_dl     *next;
+    uint64_t                hash;
+    uint64_t                size;
+    time_t                  mtime;
+    uint32_t                n_chunk, n_have, n_pending, next_idx;
+    uint64_t                *chash;
+    uint8_t                 *state;
+    uint8_t                 *retried;
+    ss_com_inst_t           **src;          /* where a pending chunk has been asked for */
+    int                     fd;
+    int                     done;
+    char                    name[SS_MAXPATH_LEN];
+    char                    path[SS_MAXPATH_LEN + 16];  /* part file, final path once done */
+} ss_swarm_dl_t;
+
+typedef struct {
+    struct sockaddr_in      addr;
+    ss_com_inst_t           *inst;
+} ss_swarm_peer_t;
+
+typedef struct _ss_swarm_cli {
+    pthread_mutex_t         lock;           /* dl list is shared with the peer_com thread */
+    ss_swarm_dl_t           *list;
+    int                     n_dl;
+    ss_swarm_peer_t         peer[SS_SWARM_MAXPEER];
+} ss_swarm_cli_t;
+
+static uint32_t ss_swarm_chunk_len(uint64_t size, uint32_t idx)
+{
+    uint64_t off = (uint64_t)idx * SS_SWARM_CHUNK;
+
+    return (size - off) < SS_SWARM_CHUNK ? (uint32_t)(size - off) : SS_SWARM_CHUNK;
+}
+
+static void ss_swarm_send_chunkres(ss_com_inst_t *inst, ss_chunkres_t *res)
+{
+    ss_send_msg(inst, SS_MSGTYPE_CHUNK_RES, res, sizeof(ss_chunkres_t) + res->len);
+}
+
+/***************************************************************************/
+/* srv                                                                     */
+/***************************************************************************/
+
+static void ss_swarm_file_free(ss_swarm_file_t *f)
+{
+    free(f->chash);
+    free(f->holder);
+    free(f->inflight);
+    free(f->n_holder);
+    free(f->rr);
+    free(f);
+}
+
+static ss_swarm_file_t *ss_swarm_srv_find_hash(ss_swarm_srv_t *sw, uint64_t hash)
+{
+    ss_swarm_file_t *f;
+
+    for (f = sw->list; f; f = f->next) {
+        if (f->hash == hash) {
+            return f;
+        }
+    }
+
+    return NULL;
+}
+
+static void ss_swarm_srv_unlink(ss_swarm_srv_t *sw, ss_swarm_file_t *f)
+{
+    ss_swarm_file_t **pp;
+
+    for (pp = &(sw->list); *pp; pp = &((*pp)->next)) {
+        if (*pp == f) {
+            *pp = f->next;
+            sw->n_file--;
+            return;
+        }
+    }
+}
+
+static ss_swarm_file_t *ss_swarm_srv_find_name(ss_swarm_srv_t *sw, char *name)
+{
+    ss_swarm_file_t *f;
+
+    for (f = sw->list; f; f = f->next) {
+        if (strcmp(f->name, name) == 0) {
+            return f;
+        }
+    }
+
+    return NULL;
+}
+
+/* tx worker: chunk hashes of the file fd is open on, NULL if it shrank under us */
+static ss_swarm_file_t *ss_swarm_file_build(int fd, struct stat *st, char *name)
+{
+    ss_swarm_file_t *f;
+    char *buf;
+    uint32_t i, len;
+
+    f = (ss_swarm_file_t *)calloc(1, sizeof(ss_swarm_file_t));
+    SS_ASSERT(f);
+
+    strcpy(f->name, name);
+    f->size = st->st_size;
+    f->mtime = st->st_mtime;
+    f->n_chunk = (f->size + SS_SWARM_CHUNK - 1) / SS_SWARM_CHUNK;
+    f->chash = (uint64_t *)calloc(f->n_chunk, sizeof(uint64_t));
+    f->holder = (ss_com_inst_t **)calloc(f->n_chunk * SS_SWARM_MAXHOLDER, sizeof(ss_com_inst_t *));
+    f->inflight = (ss_com_inst_t **)calloc(f->n_chunk, sizeof(ss_com_inst_t *));
+    f->n_holder = (uint8_t *)calloc(f->n_chunk, 1);
+    f->rr = (uint8_t *)calloc(f->n_chunk, 1);
+    SS_ASSERT(f->chash && f->holder && f->inflight && f->n_holder && f->rr);
+
+    buf = (char *)ss_pool_get(SS_SWARM_CHUNK);
+    posix_fadvise(fd, 0, f->size, POSIX_FADV_SEQUENTIAL);
+    for (i = 0; i < f->n_chunk; i++) {
+        len = ss_swarm_chunk_len(f->size, i);
+        if (pread(fd, buf, len, (off_t)i * SS_SWARM_CHUNK) != len) {
+            break;
+        }
+        f->chash[i] = alg_xxh64(buf, len, 0);
+    }
+    ss_pool_put(buf);
+
+    if (i != f->n_chunk) {
+        ss_swarm_file_free(f);
+        return NULL;
+    }
+
+    f->hash = alg_xxh64(f->chash, f->n_chunk * sizeof(uint64_t), f->size);
+
+    return f;
+}
+
+/* sw locked, the SWARM_MAP of f */
+static ss_swarmmap_t *ss_swarm_map_msg(ss_ctx_t *ctx, ss_swarm_file_t *f, time_t mtime, uint32_t *len)
+{
+    ss_swarmmap_t *map;
+    uint32_t name_len = strlen(f->name) + 1;
+
+    *len = sizeof(ss_swarmmap_t) + f->n_chunk * sizeof(uint64_t) + name_len;
+    map = (ss_swarmmap_t *)ss_pool_get(*len);
+
+    map->hash = f->hash;
+    map->size = f->size;
+    /* a relay serves the upstream time stamp */
+    map->mtime = ctx->relay ? mtime : f->mtime;
+    map->n_chunk = f->n_chunk;
+    map->name_len = name_len;
+    memcpy(map->chash, f->chash, f->n_chunk * sizeof(uint64_t));
+    memcpy(map->chash + f->n_chunk, f->name, name_len);
+
+    return map;
+}
+
+/*
+ * tx worker, the SWARM_MAP of the current version of name, *len is set to
+ * its length. the chunk hashes are reused while size and mtime hold, the
+ * file is read outside the lock. NULL: it is gone or too small now.
+ */
+void *ss_swarm_srv_map(ss_ctx_t *ctx, char *name, time_t mtime, uint32_t *len)
+{
+    ss_swarm_srv_t *sw = ctx->u.srv.swarm;
+    ss_swarm_file_t *f, *nf, *last;
+    char pathname[SS_MAXPATH_LEN];
+    ss_swarmmap_t *map = NULL;
+    struct stat st;
+    int fd;
+
+    if (snprintf(pathname, sizeof(pathname), "%s/%s", ctx->localpath, name) >= (int)sizeof(pathname)) {
+        printf("swarm: path of %s too long.\n", name);
+        return NULL;
+    }
+
+    fd = open(pathname, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    if (fstat(fd, &st) || (st.st_size < SS_SWARM_MINSIZE)) {
+        close(fd);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&(sw->lock));
+    f = ss_swarm_srv_find_name(sw, name);
+    if (f && (f->size == st.st_size) && (f->mtime == st.st_mtime)) {
+        map = ss_swarm_map_msg(ctx, f, mtime, len);
+    }
+    pthread_mutex_unlock(&(sw->lock));
+    if (map) {
+        close(fd);
+        return map;
+    }
+
+    nf = ss_swarm_file_build(fd, &st, name);
+    close(fd);
+    if (nf == NULL) {
+        /* file shrank under us, let the normal path deal with it */
+        return NULL;
+    }
+
+    pthread_mutex_lock(&(sw->lock));
+    f = ss_swarm_srv_find_name(sw, name);
+    if (f && (f->hash == nf->hash)) {
+        /* another worker was quicker, its holders count */
+        ss_swarm_file_free(nf);
+    } else {
+        if (f) {
+            /* stale version, holders of it are of no use any more */
+            ss_swarm_srv_unlink(sw, f);
+            ss_swarm_file_free(f);
+        }
+        f = nf;
+        f->next = sw->list;
+        sw->list = f;
+        sw->n_file++;
+
+        if (sw->n_file > SS_SWARM_MAXFILE) {
+            for (last = sw->list; last->next; last = last->next);
+            ss_swarm_srv_unlink(sw, last);
+            ss_swarm_file_free(last);
+        }
+    }
+    map = ss_swarm_map_msg(ctx, f, mtime, len);
+    pthread_mutex_unlock(&(sw->lock));
+
+    return map;
+}
+
+/* return 0 if the request is to be answered with a swarm map */
+int ss_swarm_srv_filereq(ss_com_inst_t *inst, char *name)
+{
+    ss_ctx_t *ctx = (ss_ctx_t *)inst->com->param;
+    ss_srvcli_t *sc = (ss_srvcli_t *)inst->payload;
+    ss_filemeta_t *fm;
+
+    if ((ctx->swarm == 0) || (sc == NULL) || (sc->peer_port == 0)) {
+        return -1;
+    }
+
+    if (ctx->u.srv.swarm == NULL) {
+        ctx->u.srv.swarm = (ss_swarm_srv_t *)calloc(1, sizeof(ss_swarm_srv_t));
+        SS_ASSERT(ctx->u.srv.swarm);
+        pthread_mutex_init(&(ctx->u.srv.swarm->lock), NULL);
+    }
+
+    /* only files the client may ask for */
+    fm = ss_dm_find(ctx->dm, name);
+    if ((fm == NULL) || (fm->size < SS_SWARM_MINSIZE)) {
+        return -1;
+    }
+
+    /* a tx worker reads the file, behind the FILE_RES already queued for this client */
+    ss_tx_swarmreq(inst, name);
+
+    return 0;
+}
+
+/* some other client that announced the chunk, round robin over the holders */
+static ss_com_inst_t *ss_swarm_srv_pick(ss_swarm_file_t *f, uint32_t idx, ss_com_inst_t *self)
+{
+    ss_com_inst_t **holder = f->holder + idx * SS_SWARM_MAXHOLDER;
+    ss_com_inst_t *inst;
+    int i, n = f->n_holder[idx];
+
+    for (i = 0; i < n; i++) {
+        inst = holder[(f->rr[idx] + i) % n];
+        if (inst != self) {
+            f->rr[idx] = (f->rr[idx] + i + 1) % n;
+            return inst;
+        }
+    }
+
+    return NULL;
+}
+
+/* an answer without data, sent by the tx workers like the chunks */
+static void ss_swarm_srv_nores(ss_com_inst_t *inst, ss_chunkres_t *nores)
+{
+    ss_chunkres_t *res;
+
+    res = (ss_chunkres_t *)ss_pool_get(sizeof(ss_chunkres_t));
+    memcpy(res, nores, sizeof(ss_chunkres_t));
+    ss_tx_msg(inst, SS_MSGTYPE_CHUNK_RES, res, sizeof(ss_chunkres_t));
+}
+
+void ss_swarm_srv_chunkreq(ss_com_inst_t *inst, ss_chunkreq_t *req)
+{
+    ss_ctx_t *ctx = (ss_ctx_t *)inst->com->param;
+    ss_swarm_srv_t *sw = ctx->u.srv.swarm;
+    ss_swarm_file_t *f = NULL;
+    ss_com_inst_t *peer;
+    ss_chunkres_t *res, nores;
+    char pathname[SS_MAXPATH_LEN];
+    uint64_t chash;
+    uint32_t len;
+    int fd = -1;
+
+    memset(&nores, 0, sizeof(nores));
+    nores.hash = req->hash;
+    nores.idx = req->idx;
+
+    if (sw == NULL) {
+        ss_swarm_srv_nores(inst, &nores);
+        return;
+    }
+
+    pthread_mutex_lock(&(sw->lock));
+    f = ss_swarm_srv_find_hash(sw, req->hash);
+    if ((f == NULL) || (req->idx >= f->n_chunk)) {
+        pthread_mutex_unlock(&(sw->lock));
+        ss_swarm_srv_nores(inst, &nores);
+        return;
+    }
+
+    if (!(req->flag & SS_CHUNKREQ_ORIGIN)) {
+        peer = ss_swarm_srv_pick(f, req->idx, inst);
+        if (peer) {
+            printf("\tchunk %u of %s, redirect to [%d]\n", req->idx, f->name, peer->id);
+            pthread_mutex_unlock(&(sw->lock));
+            nores.flag = SS_CHUNKRES_REDIRECT;
+            nores.peer_ip = peer->addr.sin_addr.s_addr;
+            nores.peer_port = ((ss_srvcli_t *)peer->payload)->peer_port;
+            ss_swarm_srv_nores(inst, &nores);
+            return;
+        }
+
+        if (f->inflight[req->idx] && (f->inflight[req->idx] != inst) &&
+            !(req->flag & SS_CHUNKREQ_NORETRY)) {
+            pthread_mutex_unlock(&(sw->lock));
+            nores.flag = SS_CHUNKRES_RETRY;
+            ss_swarm_srv_nores(inst, &nores);
+            return;
+        }
+    }
+
+    printf("\tchunk %u of %s\n", req->idx, f->name);
+
+    len = ss_swarm_chunk_len(f->size, req->idx);
+    chash = f->chash[req->idx];
+    if (snprintf(pathname, sizeof(pathname), "%s/%s", ctx->localpath, f->name) < (int)sizeof(pathname)) {
+        fd = open(pathname, O_RDONLY);
+    }
+    pthread_mutex_unlock(&(sw->lock));
+
+    res = (ss_chunkres_t *)ss_pool_get(sizeof(ss_chunkres_t) + len);
+    memcpy(res, &nores, sizeof(nores));
+
+    if ((fd >= 0) &&
+        (pread(fd, res->data, len, (off_t)req->idx * SS_SWARM_CHUNK) == len) &&
+        (alg_xxh64(res->data, len, 0) == chash)) {
+        res->flag = SS_CHUNKRES_VALID;
+        res->len = len;
+
+        /* a worker may have replaced the version meanwhile */
+        pthread_mutex_lock(&(sw->lock));
+        f = ss_swarm_srv_find_hash(sw, req->hash);
+        if (f && (req->idx < f->n_chunk)) {
+            f->inflight[req->idx] = inst;
+        }
+        pthread_mutex_unlock(&(sw->lock));
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    /* the tx workers send it and free res */
+    ss_tx_msg(inst, SS_MSGTYPE_CHUNK_RES, res, sizeof(ss_chunkres_t) + res->len);
+}
+
+void ss_swarm_srv_chunkhave(ss_com_inst_t *inst, ss_chunkhave_t *have)
+{
+    ss_ctx_t *ctx = (ss_ctx_t *)inst->com->param;
+    ss_swarm_srv_t *sw = ctx->u.srv.swarm;
+    ss_swarm_file_t *f;
+    ss_com_inst_t **holder;
+    int i;
+
+    if (sw == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&(sw->lock));
+    f = ss_swarm_srv_find_hash(sw, have->hash);
+    if ((f == NULL) || (have->idx >= f->n_chunk)) {
+        pthread_mutex_unlock(&(sw->lock));
+        return;
+    }
+
+    if (f->inflight[have->idx] == inst) {
+        f->inflight[have->idx] = NULL;
+    }
+
+    holder = f->holder + have->idx * SS_SWARM_MAXHOLDER;
+    for (i = 0; i < f->n_holder[have->idx]; i++) {
+        if (holder[i] == inst) {
+            break;
+        }
+    }
+    if ((i == f->n_holder[have->idx]) && (i < SS_SWARM_MAXHOLDER)) {
+        holder[i] = inst;
+        f->n_holder[have->idx]++;
+    }
+    pthread_mutex_unlock(&(sw->lock));
+}
+
+/* client went away, forget every chunk it held */
+void ss_swarm_srv_drop(ss_com_inst_t *inst)
+{
+    ss_ctx_t *ctx = (ss_ctx_t *)inst->com->param;
+    ss_swarm_file_t *f;
+    ss_com_inst_t **holder;
+    uint32_t idx;
+    int i;
+
+    if (ctx->u.srv.swarm == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&(ctx->u.srv.swarm->lock));
+    for (f = ctx->u.srv.swarm->list; f; f = f->next) {
+        for (idx = 0; idx < f->n_chunk; idx++) {
+            if (f->inflight[idx] == inst) {
+                f->inflight[idx] = NULL;
+            }
+            holder = f->holder + idx * SS_SWARM_MAXHOLDER;
+            for (i = 0; i < f->n_holder[idx]; i++) {
+                if (holder[i] == inst) {
+                    holder[i] = holder[f->n_holder[idx] - 1];
+                    f->n_holder[idx]--;
+                    f->rr[idx] = 0;
+                    break;
+                }
+            }
+        }
+    }
+    pthread_mutex_unlock(&(ctx->u.srv.swarm->lock));
+}
+
+/***************************************************************************/
+/* cli                                                                     */
+/***************************************************************************/
+
+static void ss_swarm_dl_free(ss_swarm_dl_t *dl)
+{
+    if (dl->fd >= 0) {
+        close(dl->fd);
+    }
+    free(dl->chash);
+    free(dl->state);
+    free(dl->retried);
+    free(dl->src);
+    free(dl);
+}
+
+/* caller holds the lock */
+static ss_swarm_dl_t *ss_swarm_cli_find(ss_swarm_cli_t *sw, uint64_t hash)
+{
+    ss_swarm_dl_t *dl;
+
+    for (dl = sw->list; dl; dl = dl->next) {
+        if (dl->hash == hash) {
+            return dl;
+        }
+    }
+
+    return NULL;
+}
+
+static void ss_swarm_cli_remove(ss_swarm_cli_t *sw, ss_swarm_dl_t *dl)
+{
+    ss_swarm_dl_t **pp;
+
+    pthread_mutex_lock(&(sw->lock));
+    for (pp = &(sw->list); *pp; pp = &((*pp)->next)) {
+        if (*pp == dl) {
+            *pp = dl->next;
+            sw->n_dl--;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&(sw->lock));
+
+    ss_swarm_dl_free(dl);
+}
+
+static void ss_swarm_send_chunkreq(ss_com_inst_t *inst, ss_swarm_dl_t *dl, uint32_t idx, uint32_t flag)
+{
+    ss_chunkreq_t req;
+
+    req.hash = dl->hash;
+    req.idx = idx;
+    req.flag = flag;
+
+    dl->state[idx] = SS_CHUNK_PENDING;
+    dl->src[idx] = inst;
+
+    /* a peer still connecting gets it once it is up, see ss_swarm_cli_connect */
+    if (inst->dial_end == 0) {
+        ss_send_msg(inst, SS_MSGTYPE_CHUNK_REQ, &req, sizeof(req));
+    }
+}
+
+static void ss_swarm_cli_fill(ss_ctx_t *ctx, ss_swarm_dl_t *dl)
+{
+    uint32_t n;
+
+    for (n = 0; (n < dl->n_chunk) && (dl->n_pending < SS_SWARM_WINDOW); n++) {
+        if (dl->state[dl->next_idx] == SS_CHUNK_MISSING) {
+            ss_swarm_send_chunkreq(ctx->com.main_inst, dl, dl->next_idx,
+                dl->retried[dl->next_idx] ? SS_CHUNKREQ_NORETRY : 0);
+            dl->n_pending++;
+        }
+        dl->next_idx = (dl->next_idx + 1) % dl->n_chunk;
+    }
+}
+
+static void ss_swarm_cli_finish(ss_ctx_t *ctx, ss_swarm_dl_t *dl)
+{
+    ss_swarm_cli_t *sw = ctx->u.cli.swarm;
+
+    pthread_mutex_lock(&(sw->lock));
+    if (ss_wr_commit(ctx, dl->fd, dl->name) == 0) {
+        /* peers are served from the final path now */
+        dl->path[strlen(dl->path) - strlen(SS_PART_SUFFIX)] = '\0';
+        dl->done = 1;
+    }
+    dl->fd = -1;
+    pthread_mutex_unlock(&(sw->lock));
+
+    if (dl->done) {
+        printf("swarm: %s done, %d chunks\n", dl->name, dl->n_chunk);
+        ss_cli_file_done(ctx, dl->name, SS_FILEDONE_SAVED, dl->mtime, dl->size);
+    } else {
+        printf("swarm: rename %s faild.\n", dl->path);
+        unlink(dl->path);
+        ss_cli_file_done(ctx, dl->name, SS_FILEDONE_FAILED, 0, 0);
+        ss_swarm_cli_remove(sw, dl);
+    }
+}
+
+/* the srv no longer has this version, drop it, the next digest starts over */
+static void ss_swarm_cli_abort(ss_ctx_t *ctx, ss_swarm_dl_t *dl)
+{
+    printf("swarm: %s aborted.\n", dl->name);
+
+    unlink(dl->path);
+    ss_cli_file_done(ctx, dl->name, SS_FILEDONE_FAILED, 0, 0);
+    ss_swarm_cli_remove(ctx->u.cli.swarm, dl);
+}
+
+void ss_swarm_cli_map(ss_com_inst_t *inst, ss_swarmmap_t *map, uint32_t len)
+{
+    ss_ctx_t *ctx = (ss_ctx_t *)inst->com->param;
+    ss_swarm_cli_t *sw = ctx->u.cli.swarm;
+    ss_swarm_dl_t *dl, *old, **pp;
+    char *name;
+
+    if ((sw == NULL) || (len < sizeof(ss_swarmmap_t)) ||
+        ((uint64_t)map->n_chunk * sizeof(uint64_t) + map->name_len > len - sizeof(ss_swarmmap_t)) ||
+        (map->name_len == 0) || (map->name_len > SS_MAXPATH_LEN) || (map->n_chunk == 0) ||
+        (map->n_chunk != (map->size + SS_SWARM_CHUNK - 1) / SS_SWARM_CHUNK)) {
+        printf("\tbroken swarm map, drop.\n");
+        return;
+    }
+    name = (char *)(map->chash + map->n_chunk);
+    name[map->name_len - 1] = '\0';
+    if (ss_dm_find(ctx->dm, name) == NULL) {
+        return;
+    }
+
+    dl = (ss_swarm_dl_t *)calloc(1, sizeof(ss_swarm_dl_t));
+    SS_ASSERT(dl);
+    dl->hash = map->hash;
+    dl->size = map->size;
+    dl->mtime = map->mtime;
+    dl->n_chunk = map->n_chunk;
+    dl->chash = (uint64_t *)malloc(map->n_chunk * sizeof(uint64_t));
+    dl->state = (uint8_t *)calloc(map->n_chunk, 1);
+    dl->retried = (uint8_t *)calloc(map->n_chunk, 1);
+    dl->src = (ss_com_inst_t **)calloc(map->n_chunk, sizeof(ss_com_inst_t *));
+    SS_ASSERT(dl->chash && dl->state && dl->retried && dl->src);
+    memcpy(dl->chash, map->chash, map->n_chunk * sizeof(uint64_t));
+    strcpy(dl->name, name);
+    if (snprintf(dl->path, sizeof(dl->path), "%s/%s%s", ctx->localpath, name, SS_PART_SUFFIX) >= (int)sizeof(dl->path)) {
+        printf("swarm: path of %s too long.\n", name);
+        ss_swarm_dl_free(dl);
+        ss_cli_file_done(ctx, name, SS_FILEDONE_FAILED, 0, 0);
+        return;
+    }
+
+    /* rotated start, concurrent clients begin on different chunks */
+    dl->next_idx = (uint32_t)((rand() ^ getpid()) % dl->n_chunk);
+
+    dl->fd = ss_wr_open(ctx, name, dl->size, 1);
+    if (dl->fd < 0) {
+        ss_swarm_dl_free(dl);
+        ss_cli_file_done(ctx, name, SS_FILEDONE_FAILED, 0, 0);
+        return;
+    }
+
+    pthread_mutex_lock(&(sw->lock));
+    dl->next = sw->list;
+    sw->list = dl;
+    sw->n_dl++;
+
+    /* keep a bounded number of files to serve from, drop the oldest finished one */
+    old = NULL;
+    if (sw->n_dl > SS_SWARM_MAXFILE) {
+        for (pp = &(sw->list); *pp; pp = &((*pp)->next)) {
+            if ((*pp)->done) {
+                old = *pp;
+            }
+        }
+        if (old) {
+            for (pp = &(sw->list); *pp != old; pp = &((*pp)->next));
+            *pp = old->next;
+            sw->n_dl--;
+        }
+    }
+    pthread_mutex_unlock(&(sw->lock));
+
+    if (old) {
+        ss_swarm_dl_free(old);
+    }
+
+    printf("swarm: %s, %d chunks\n", dl->name, dl->n_chunk);
+
+    ss_swarm_cli_fill(ctx, dl);
+}
+
+static ss_com_inst_t *ss_swarm_peer_get(ss_ctx_t *ctx, uint32_t ip, uint16_t port)
+{
+    ss_swarm_cli_t *sw = ctx->u.cli.swarm;
+    ss_swarm_peer_t *peer, *free_peer = NULL;
+    int i;
+
+    for (i = 0; i < SS_SWARM_MAXPEER; i++) {
+        peer = &(sw->peer[i]);
+        if (peer->inst == NULL) {
+            if (free_peer == NULL) {
+                free_peer = peer;
+            }
+        } else if ((peer->addr.sin_addr.s_addr == ip) && (peer->addr.sin_port == htons(port))) {
+            return peer->inst;
+        }
+    }
+
+    if (free_peer == NULL) {
+        return NULL;
+    }
+
+    memset(&(free_peer->addr), 0, sizeof(struct sockaddr_in));
+    free_peer->addr.sin_family = AF_INET;
+    free_peer->addr.sin_addr.s_addr = ip;
+    free_peer->addr.sin_port = htons(port);
+    /* not waited for on the epoll thread, requests to it go out once it is up */
+    free_peer->inst = ss_com_dial(&(ctx->com), &(free_peer->addr), SS_CONNECT_TIMEOUT, 0);
+
+    return free_peer->inst;
+}
+
+/* a peer is up, the chunks asked of it meanwhile go out */
+void ss_swarm_cli_connect(ss_com_inst_t *inst)
+{
+    ss_ctx_t *ctx = (ss_ctx_t *)inst->com->param;
+    ss_swarm_cli_t *sw = ctx->u.cli.swarm;
+    ss_swarm_dl_t *dl;
+    uint32_t idx;
+
+    if (sw == NULL) {
+        return;
+    }
+
+    for (dl = sw->list; dl; dl = dl->next) {
+        if (dl->done) {
+            continue;
+        }
+        for (idx = 0; idx < dl->n_chunk; idx++) {
+            if ((dl->state[idx] == SS_CHUNK_PENDING) && (dl->src[idx] == inst)) {
+                ss_swarm_send_chunkreq(inst, dl, idx, 0);
+            }
+        }
+    }
+}
+
+void ss_swarm_cli_chunkres(ss_com_inst_t *inst, ss_chunkres_t *res)
+{
+    ss_ctx_t *ctx = (ss_ctx_t *)inst->com->param;
+    ss_swarm_cli_t *sw = ctx->u.cli.swarm;
+    ss_com_inst_t *up = ctx->com.main_inst, *peer;
+    ss_chunkhave_t have;
+    ss_swarm_dl_t *dl;
+
+    if (sw == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&(sw->lock));
+    dl = ss_swarm_cli_find(sw, res->hash);
+    pthread_mutex_unlock(&(sw->lock));
+
+    if ((dl == NULL) || dl->done || (res->idx >= dl->n_chunk) ||
+        (dl->state[res->idx] != SS_CHUNK_PENDING) || (dl->src[res->idx] != inst)) {
+        /* stale answer */
+        return;
+    }
+
+    if (res->flag & SS_CHUNKRES_RETRY) {
+        /* move on to other chunks, this one comes round again */
+        dl->state[res->idx] = SS_CHUNK_MISSING;
+        dl->src[res->idx] = NULL;
+        dl->retried[res->idx] = 1;
+        dl->n_pending--;
+        ss_swarm_cli_fill(ctx, dl);
+        return;
+    }
+
+    if (res->flag & SS_CHUNKRES_REDIRECT) {
+        peer = ss_swarm_peer_get(ctx, res->peer_ip, res->peer_port);
+        ss_swarm_send_chunkreq(peer ? peer : up, dl, res->idx, peer ? 0 : SS_CHUNKREQ_ORIGIN);
+        return;
+    }
+
+    if (!(res->flag & SS_CHUNKRES_VALID) ||
+        (res->len != ss_swarm_chunk_len(dl->size, res->idx)) ||
+        (alg_xxh64(res->data, res->len, 0) != dl->chash[res->idx])) {
+        if (inst == up) {
+            ss_swarm_cli_abort(ctx, dl);
+        } else {
+            ss_swarm_send_chunkreq(up, dl, res->idx, SS_CHUNKREQ_ORIGIN);
+        }
+        return;
+    }
+
+    if (ss_pwrite_sparse(dl->fd, res->data, res->len, (off_t)res->idx * SS_SWARM_CHUNK) != res->len) {
+        printf("swarm: write %s faild.\n", dl->path);
+        ss_swarm_cli_abort(ctx, dl);
+        return;
+    }
+
+    pthread_mutex_lock(&(sw->lock));
+    dl->state[res->idx] = SS_CHUNK_HAVE;
+    pthread_mutex_unlock(&(sw->lock));
+    dl->src[res->idx] = NULL;
+    dl->n_have++;
+    dl->n_pending--;
+
+    have.hash = dl->hash;
+    have.idx = res->idx;
+    have.rsv = 0;
+    ss_send_msg(up, SS_MSGTYPE_CHUNK_HAVE, &have, sizeof(have));
+
+    if (dl->n_have == dl->n_chunk) {
+        ss_swarm_cli_finish(ctx, dl);
+    } else {
+        ss_swarm_cli_fill(ctx, dl);
+    }
+}
+
+/* peer connection closed, whatever was asked from it goes to the srv */
+void ss_swarm_cli_close(ss_com_inst_t *inst)
+{
+    ss_ctx_t *ctx = (ss_ctx_t *)inst->com->param;
+    ss_swarm_cli_t *sw = ctx->u.cli.swarm;
+    ss_swarm_dl_t *dl;
+    uint32_t idx;
+    int i;
+
+    if (sw == NULL) {
+        return;
+    }
+
+    for (i = 0; i < SS_SWARM_MAXPEER; i++) {
+        if (sw->peer[i].inst == inst) {
+            sw->peer[i].inst = NULL;
+        }
+    }
+
+    for (dl = sw->list; dl; dl = dl->next) {
+        if (dl->done) {
+            continue;
+        }
+        for (idx = 0; idx < dl->n_chunk; idx++) {
+            if ((dl->state[idx] == SS_CHUNK_PENDING) && (dl->src[idx] == inst)) {
+                ss_swarm_send_chunkreq(ctx->com.main_inst, dl, idx, SS_CHUNKREQ_ORIGIN);
+            }
+        }
+    }
+}
+
+/*
+ * the main connection is lost: drop the files being fetched, without a
+ * callback. finished ones are kept to serve peers from.
+ */
+void ss_swarm_cli_reset(ss_ctx_t *ctx)
+{
+    ss_swarm_cli_t *sw = ctx->u.cli.swarm;
+    ss_swarm_dl_t *dl, **pp, *drop = NULL;
+
+    if (sw == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&(sw->lock));
+    for (pp = &(sw->list); (dl = *pp) != NULL; ) {
+        if (dl->done) {
+            pp = &(dl->next);
+            continue;
+        }
+        *pp = dl->next;
+        sw->n_dl--;
+        dl->next = drop;
+        drop = dl;
+    }
+    pthread_mutex_unlock(&(sw->lock));
+
+    while ((dl = drop) != NULL) {
+        drop = dl->next;
+        unlink(dl->path);
+        ss_swarm_dl_free(dl);
+    }
+}
+
+/* peer_com thread, serve a chunk we hold */
+static void ss_swarm_peer_chunkreq(ss_com_inst_t *inst, ss_ctx_t *ctx, ss_chunkreq_t *req)
+{
+    ss_swarm_cli_t *sw = ctx->u.cli.swarm;
+    ss_swarm_dl_t *dl;
+    ss_chunkres_t *res;
+    uint32_t len = 0;
+    int fd = -1;
+
+    res = (ss_chunkres_t *)malloc(sizeof(ss_chunkres_t) + SS_SWARM_CHUNK);
+    SS_ASSERT(res);
+    memset(res, 0, sizeof(ss_chunkres_t));
+    res->hash = req->hash;
+    res->idx = req->idx;
+
+    pthread_mutex_lock(&(sw->lock));
+    dl = ss_swarm_cli_find(sw, req->hash);
+    if (dl && (req->idx < dl->n_chunk) && (dl->state[req->idx] == SS_CHUNK_HAVE)) {
+        len = ss_swarm_chunk_len(dl->size, req->idx);
+        fd = open(dl->path, O_RDONLY);
+    }
+    pthread_mutex_unlock(&(sw->lock));
+
+    if (fd >= 0) {
+        if (pread(fd, res->data, len, (off_t)req->idx * SS_SWARM_CHUNK) == len) {
+            /* the requester checks the chunk hash, a replaced file is caught there */
+            res->flag = SS_CHUNKRES_VALID;
+            res->len = len;
+        }
+        close(fd);
+    }
+
+    ss_swarm_send_chunkres(inst, res);
+    free(res);
+}
+
+static void ss_com_cb_peer(ss_com_inst_t *inst, ss_cbtype_e cbt, void *head, void *body)
+{
+    ss_ctx_t *ctx = (ss_ctx_t *)inst->com->param;
+    ss_msghead_t *msghead = (ss_msghead_t *)head;
+
+    if (cbt != SS_CBTYPE_RECV) {
+        return;
+    }
+
+    if ((msghead->magic != SS_MSGHEAD_MAGIC) || (msghead->type != SS_MSGTYPE_CHUNK_REQ) ||
+        !msghead->sop || !msghead->eop || (msghead->len < sizeof(ss_chunkreq_t))) {
+        printf("swarm: peer sent invalid msg.\n");
+        return;
+    }
+
+    ss_swarm_peer_chunkreq(inst, ctx, (ss_chunkreq_t *)body);
+}
+
+int ss_swarm_cli_start(ss_ctx_t *ctx)
+{
+    ss_swarm_cli_t *sw;
+
+    sw = (ss_swarm_cli_t *)calloc(1, sizeof(ss_swarm_cli_t));
+    SS_ASSERT(sw);
+    pthread_mutex_init(&(sw->lock), NULL);
+    ctx->u.cli.swarm = sw;
+
+    srand(time(NULL) ^ getpid());
+
+    return ss_com_init(&(ctx->u.cli.peer_com), SS_NODE_SRV, "0.0.0.0", ctx->swarm_port,
+        ss_com_cb_peer, SS_FRAME_MAXLEN, ctx, 0);
+}
+
+void ss_swarm_cli_hello(ss_com_inst_t *inst)
+{
+    ss_ctx_t *ctx = (ss_ctx_t *)inst->com->param;
+    ss_peerhello_t hello;
+
+    hello.port = ntohs(ctx->u.cli.peer_com.main_inst->addr.sin_port);
+    hello.rsv = 0;
+
+    printf("swarm: serving chunks on port %d\n", hello.port);
+
+    ss_send_msg(inst, SS_MSGTYPE_PEER_HELLO, &hello, sizeof(hello));
+}
@@ -25,46 +25,31 @@ uint32_t alg_crc32(const void *pv, uint32_t size)
 			(((crc >> 8) & 0xFF) << 16) | (crc << 24));
 }
 
-static int path_scan_sort_comp(const void *a, const void *b)
+static int ss_dm_find_comp(const void *key, const void *b)
 {
-    const ss_filemeta_t *pa = (ss_filemeta_t *)a;
     const ss_filemeta_t *pb = (ss_filemeta_t *)b;
 
-    return strcmp(pa->name, pb->name);
+    return strcmp((const char *)key, pb->name);
 }
 
-static int do_filefilter(char *path, ss_filefilter_t *ff)
+/* fml is sorted by name */
+ss_filemeta_t *ss_dm_find(ss_dirmeta_t *dm, char *name)
 {
-    int i;
-
-    if (ff->n_ignore) {
-       for (i = 0; i < ff->n_ignore; i++) {
-           if (strstr(path, ff->ignore[i])) {
-               return 0;
-           }
-       }
-    }
-
-    if (ff->n_match) {
-        for (i = 0; i < ff->n_match; i++) {
-            /* do reg match */
-            if (strstr(path, ff->match[i])) {
-                return 1;
-            }
-        }
-
-        return 0;
+    if (dm == NULL) {
+        return NULL;
     }
 
-    return 1;
+    return (ss_filemeta_t *)bsearch(name, dm->fml, dm->n_file, sizeof(ss_filemeta_t), ss_dm_find_comp);
 }
 
-static int path_scan_rec(char *path, int rpath_len, ss_dirmeta_t *dm, ss_filefilter_t *ff)
+/* pos is where ff stands after the relative path of path and a '/' */
+static int path_scan_rec(char *path, int rpath_len, ss_dirmeta_t *dm, ss_filefilter_t *ff, ss_filterpos_t *pos)
 {
     DIR *dr;
     struct dirent *de;
+    ss_filterpos_t sub;
     char subpath[1024] = {0}, *p;
-    int len = strlen(path), cnt = 0, ret;
+    int len = strlen(path), cnt = 0, ret, n;
 
     memcpy(subpath, path, len);
 
@@ -81,16 +66,30 @@ static int path_scan_rec(char *path, int rpath_len, ss_dirmeta_t *dm, ss_filefil
             (strcmp(de->d_name, "..") == 0)) {
             continue;
         }
+        ss_scan_pace();
 
         if (de->d_type & DT_DIR) {
-            ret = path_scan_rec(subpath, rpath_len, dm, ff);
-            if (ret < 0) {
-                return ret;
+            /* ignored as a whole, not even opened */
+            if (ss_filter_dir(ff, pos, de->d_name, &sub)) {
+                ret = path_scan_rec(subpath, rpath_len, dm, ff, &sub);
+                if (ret < 0) {
+                    closedir(dr);
+                    return ret;
+                }
+                cnt += ret;
             }
-            cnt += ret;
         }
         if (de->d_type & DT_REG) {
-            if (dm && (dm->n_file < dm->n_slot) && (do_filefilter(subpath + rpath_len, ff) == 1)) {
+            /* a file being fetched into by a cli on this mirror */
+            n = strlen(de->d_name);
+            if ((n > strlen(SS_PART_SUFFIX)) &&
+                (strcmp(de->d_name + n - strlen(SS_PART_SUFFIX), SS_PART_SUFFIX) == 0)) {
+                continue;
+            }
+            if (ss_filter_file(ff, pos, de->d_name) == 0) {
+                continue;
+            }
+            if (dm && (dm->n_file < dm->n_slot)) {
                 p = subpath + rpath_len;
                 while (*p == '/') p++;
                 strcpy(dm->fml[dm->n_file].name, p);
@@ -108,76 +107,110 @@ static int path_scan_rec(char *path, int rpath_len, ss_dirmeta_t *dm, ss_filefil
 ss_dirmeta_t* path_scan(char *path, ss_filefilter_t *ff)
 {
     ss_dirmeta_t *dm;
+    ss_filterpos_t root;
     int n_file, n_slot;
 
+    /* every path is ignored */
+    if (ss_filter_root(ff, &root) == 0) {
+        return (ss_dirmeta_t *)ss_pool_zget(sizeof(ss_dirmeta_t));
+    }
 
 _retry:
-    n_file = path_scan_rec(path, strlen(path), NULL, ff);
+    n_file = path_scan_rec(path, strlen(path), NULL, ff, &root);
     if (n_file < 0) {
         return NULL;
     }
 
     n_slot = n_file + 32;
-    dm = (ss_dirmeta_t *)malloc(n_slot * sizeof(ss_filemeta_t) + sizeof(ss_dirmeta_t));
-    if (dm == NULL) {
-        return NULL;
-    }
-    memset(dm, 0, n_slot * sizeof(ss_filemeta_t) + sizeof(ss_dirmeta_t));
+    dm = (ss_dirmeta_t *)ss_pool_zget(n_slot * sizeof(ss_filemeta_t) + sizeof(ss_dirmeta_t));
     dm->n_file = 0;
     dm->n_slot = n_slot;
 
-    n_file = path_scan_rec(path, strlen(path), dm, ff);
+    n_file = path_scan_rec(path, strlen(path), dm, ff, &root);
     if (n_file > dm->n_slot) {
-        free(dm);
+        ss_pool_put(dm);
         goto _retry;
     }
 
-    qsort(dm->fml, dm->n_file, sizeof(ss_filemeta_t), path_scan_sort_comp);
+    ss_dm_sort(dm);
 
     return dm;
 }
 
-void ss_dmstate_refresh(ss_ctx_t *ctx, ss_dirmeta_t *dm, int ts_srv)
+/* stat dm->fml[from..to), returns the number of files that are gone, they are dropped */
+int ss_dmstate_refresh_part(ss_ctx_t *ctx, ss_dirmeta_t *dm, int ts_srv, int from, int to)
 {
     char pathname[SS_MAXPATH_LEN];
-    int i;
+    int i, j, n_gone = 0;
     struct stat fstat;
 
-    for (i = 0; i < dm->n_file; i++) {
+    for (i = from; i < to; i++) {
+        ss_scan_pace();
+
         memset(pathname, 0, sizeof(pathname));
         sprintf(pathname, "%s/%s", ctx->localpath, dm->fml[i].name);
 
         if (stat(pathname, &fstat)) {
             /* file has been removed */
             memset(&(dm->fml[i]), 0, sizeof(ss_filemeta_t));
+            n_gone++;
         } else {
             if (ts_srv) {
-                dm->fml[i].mtime = fstat.st_mtime;
+                dm->fml[i].mtime = fstat.st_mtim.tv_sec;
+                dm->fml[i].mtime_ns = fstat.st_mtim.tv_nsec;
+                dm->fml[i].size = fstat.st_size;
+                dm->fml[i].hash = ss_hcache_get(ctx, pathname, &fstat);
             }
         }
     }
 
     /* remote empty slot */
-    for (i = 0; i < dm->n_file; i++) {
-        if (dm->fml[i].name[0] == '\0') {
-            memcpy(&(dm->fml[i]), &(dm->fml[i + 1]),
-                (dm->n_file - i - 1) * sizeof(ss_filemeta_t));
+    if (n_gone) {
+        for (i = j = from; i < dm->n_file; i++) {
+            if (dm->fml[i].name[0] == '\0') {
+                continue;
+            }
+            if (i != j) {
+                memcpy(&(dm->fml[j]), &(dm->fml[i]), sizeof(ss_filemeta_t));
+            }
+            j++;
+        }
+        memset(&(dm->fml[j]), 0, (dm->n_file - j) * sizeof(ss_filemeta_t));
+        dm->n_file = j;
+    }
 
-                dm->n_file--;
+    if (ts_srv || n_gone) {
+        dm->crc = alg_crc32(dm->fml, dm->n_file * sizeof(ss_filemeta_t));
+    }
 
-            memset(&(dm->fml[dm->n_file]), 0, sizeof(ss_filemeta_t));
-        }
+    return n_gone;
+}
+
+/* returns the number of files that are gone */
+int ss_dmstate_refresh(ss_ctx_t *ctx, ss_dirmeta_t *dm, int ts_srv)
+{
+    int n_gone = ss_dmstate_refresh_part(ctx, dm, ts_srv, 0, dm->n_file);
+
+    if (ts_srv) {
+        ss_hcache_sweep(ctx);
+    } else if (n_gone == 0) {
+        dm->crc = alg_crc32(dm->fml, dm->n_file * sizeof(ss_filemeta_t));
     }
 
-    dm->crc = alg_crc32(dm->fml, dm->n_file * sizeof(ss_filemeta_t));
+    return n_gone;
 }
 
-/* Serialization */
-static uint32_t ss_metalist_seri(ss_dirmeta_t *dm, void *buf)
+/*
+ * Serialization. the hash and mtime_ns arrays go only to a cli of
+ * SS_VER_HASH on, an older one gets mtime, size and names as before
+ */
+static uint32_t ss_metalist_seri(ss_dirmeta_t *dm, void *buf, uint32_t ver)
 {
     uint32_t i, len = 0;
     ss_msgmetares_t *mh;
     time_t *tp;
+    uint64_t *sp, *hp;
+    uint32_t *np;
     char *p;
 
     mh = (ss_msgmetares_t *)buf;
@@ -197,7 +230,37 @@ static uint32_t ss_metalist_seri(ss_dirmeta_t *dm, void *buf)
         len += sizeof(time_t);
     }
 
-    p = (char *)tp;
+    sp = (uint64_t *)tp;
+    for (i = 0; i < dm->n_file; i++) {
+        if (sp) {
+            *sp = dm->fml[i].size;
+            sp++;
+        }
+        len += sizeof(uint64_t);
+    }
+
+    np = (uint32_t *)sp;
+    if (ver >= SS_VER_HASH) {
+        hp = sp;
+        for (i = 0; i < dm->n_file; i++) {
+            if (hp) {
+                *hp = dm->fml[i].hash;
+                hp++;
+            }
+            len += sizeof(uint64_t);
+        }
+
+        np = (uint32_t *)hp;
+        for (i = 0; i < dm->n_file; i++) {
+            if (np) {
+                *np = dm->fml[i].mtime_ns;
+                np++;
+            }
+            len += sizeof(uint32_t);
+        }
+    }
+
+    p = (char *)np;
     for (i = 0; i < dm->n_file; i++) {
         if (p) {
             memcpy(p, dm->fml[i].name, dm->fml[i].name_len);
@@ -211,19 +274,18 @@ static uint32_t ss_metalist_seri(ss_dirmeta_t *dm, void *buf)
     return len;
 }
 
-/* Deserialization */
-static ss_dirmeta_t* ss_metalist_deseri(void *buf, uint32_t len)
+/* Deserialization, of a srv of ver */
+static ss_dirmeta_t* ss_metalist_deseri(void *buf, uint32_t len, uint32_t ver)
 {
     ss_msgmetares_t *mh = (ss_msgmetares_t *)buf;
     int i, dmlen = sizeof(ss_dirmeta_t) + mh->n_file * sizeof(ss_filemeta_t);
-    ss_dirmeta_t *dm = (ss_dirmeta_t *)malloc(dmlen);
+    ss_dirmeta_t *dm = (ss_dirmeta_t *)ss_pool_zget(dmlen);
 
     time_t *tp;
+    uint64_t *sp, *hp;
+    uint32_t *np;
     char *p;
 
-    SS_ASSERT(dm);
-    memset(dm, 0, dmlen);
-
     dm->n_file = dm->n_slot = mh->n_file;
     dm->crc = mh->crc;
 
@@ -233,7 +295,29 @@ static ss_dirmeta_t* ss_metalist_deseri(void *buf, uint32_t len)
         tp++;
     }
 
-    p = (char *)tp;
+    sp = (uint64_t *)tp;
+    for (i = 0; i < dm->n_file; i++) {
+        dm->fml[i].size = *sp;
+        sp++;
+    }
+
+    /* an older srv sends no hash or mtime_ns, they stay 0: unknown */
+    np = (uint32_t *)sp;
+    if (ver >= SS_VER_HASH) {
+        hp = sp;
+        for (i = 0; i < dm->n_file; i++) {
+            dm->fml[i].hash = *hp;
+            hp++;
+        }
+
+        np = (uint32_t *)hp;
+        for (i = 0; i < dm->n_file; i++) {
+            dm->fml[i].mtime_ns = *np;
+            np++;
+        }
+    }
+
+    p = (char *)np;
     for (i = 0; i < dm->n_file; i++) {
         dm->fml[i].name_len = strlen(p);
         strcpy(dm->fml[i].name, p);
@@ -245,23 +329,38 @@ static ss_dirmeta_t* ss_metalist_deseri(void *buf, uint32_t len)
     return dm;
 }
 
-static int ss_do_segasm(ss_ctx_t *ctx, ss_msghead_t *msghead, void *body)
+/*
+ * a frame of a message that is put together, body may have been read in
+ * place already by ss_cli_rx_dst: the buffer of the whole message handed
+ * out for a sop frame is taken over, a later frame is at cur.
+ */
+static int ss_do_segasm(ss_com_t *com, ss_segasm_t *segasm, ss_msghead_t *msghead, void *body)
 {
     int ret = 0;
 
     if (msghead->sop) {
-        if (ctx->u.cli.segasm.buf) {
-            free(ctx->u.cli.segasm.buf);
+        ss_pool_put(segasm->buf);
+
+        if (body && (body == com->rx_hold)) {
+            segasm->buf = body;
+            com->rx_hold = NULL;
+        } else {
+            segasm->buf = ss_pool_get(msghead->total_len);
         }
+        segasm->len = msghead->total_len;
 
-        ctx->u.cli.segasm.buf = malloc(msghead->total_len);
-        ctx->u.cli.segasm.len = msghead->total_len;
+        segasm->cur = segasm->buf;
+    }
 
-        ctx->u.cli.segasm.cur = ctx->u.cli.segasm.buf;
+    if ((segasm->buf == NULL) || ((char *)(segasm->cur) + msghead->len > (char *)(segasm->buf) + segasm->len)) {
+        printf("segasm: frame out of msg, drop.\n");
+        return 0;
     }
 
-    memcpy(ctx->u.cli.segasm.cur, body, msghead->len);
-    ctx->u.cli.segasm.cur += msghead->len;
+    if (body != segasm->cur) {
+        memcpy(segasm->cur, body, msghead->len);
+    }
+    segasm->cur += msghead->len;
 
     if (msghead->eop) {
         ret = 1;
@@ -270,28 +369,120 @@ static int ss_do_segasm(ss_ctx_t *ctx, ss_msghead_t *msghead, void *body)
     return ret;
 }
 
-static void ss_send_meta_digest(ss_com_inst_t *inst, ss_dirmeta_t *dm)
+/* send one message, split into SS_FRAME_MAXLEN frames */
+void ss_send_msg(ss_com_inst_t *inst, ss_msgtype_e type, void *buf, uint32_t len)
 {
-    ss_com_t *com = inst->com;
-    char buf[sizeof(ss_msghead_t) + sizeof(ss_msgmd_t)];
-    ss_msghead_t *msghead = (ss_msghead_t *)buf;
-    ss_msgmd_t *msgmd = (ss_msgmd_t *)(msghead + 1);
+    char *p = (char *)buf;
+    uint32_t left, curlen, first;
+    ss_msghead_t msghead;
 
-    SS_ASSERT(com->type == SS_NODE_SRV);
+    memset(&msghead, 0, sizeof(msghead));
+    msghead.magic = SS_MSGHEAD_MAGIC;
+    msghead.ver = SS_VER;
+    msghead.hlen = sizeof(ss_msghead_t);
+    msghead.type = type;
+    msghead.total_len = len;
 
-    memset(buf, 0, sizeof(buf));
+    first = 1;
+    left = len;
+    do {
+        curlen = left < SS_FRAME_MAXLEN ? left : SS_FRAME_MAXLEN;
+        left -= curlen;
 
-    msghead->magic = SS_MSGHEAD_MAGIC;
-    msghead->ver = 0;
-    msghead->hlen = sizeof(ss_msghead_t);
-    msghead->type = SS_MSGTYPE_META_DIGEST;
-    msghead->total_len = msghead->len = sizeof(ss_msgmd_t);
-    msghead->sop = msghead->eop = 1;
+        msghead.sop = first;
+        if (left == 0) {
+            msghead.eop = 1;
+        }
+        msghead.len = curlen;
+        if (ss_com_send_frame(inst, &msghead, msghead.hlen, p, curlen)) {
+            return;
+        }
+
+        p += curlen;
+        first = 0;
+    } while (left);
+}
+
+/* queued to the tx workers, a client that does not read never holds up the epoll thread */
+static void ss_send_meta_digest_one(ss_com_inst_t *inst, ss_dirmeta_t *dm)
+{
+    ss_msgmd_t *msgmd;
 
+    msgmd = (ss_msgmd_t *)ss_pool_zget(sizeof(ss_msgmd_t));
     msgmd->n_file = dm->n_file;
     msgmd->crc = dm->crc;
 
-    ss_com_send(inst, buf, msghead->len + msghead->hlen);
+    ss_tx_msg(inst, SS_MSGTYPE_META_DIGEST, msgmd, sizeof(ss_msgmd_t));
+}
+
+/*
+ * every connected client gets the digest of dm, a client with a
+ * subscription gets the one of its view instead, and only if that changed
+ * or this is the heartbeat (beat)
+ */
+static void ss_send_meta_digest(ss_com_t *com, ss_dirmeta_t *dm, int beat)
+{
+    ss_ctx_t *ctx = (ss_ctx_t *)com->param;
+    ss_com_inst_t *inst;
+    ss_srvcli_t *sc;
+
+    SS_ASSERT(com->type == SS_NODE_SRV);
+
+    if (ctx->u.srv.sub) {
+        ss_sub_srv_refresh(ctx);
+    }
+
+    for (inst = com->cli_list; inst; inst = inst->next) {
+        sc = (ss_srvcli_t *)inst->payload;
+        if (sc && sc->sub) {
+            if (!beat && !ss_sub_srv_changed(inst)) {
+                continue;
+            }
+            ss_send_meta_digest_one(inst, ss_sub_srv_dm(inst));
+        } else if (sc) {
+            ss_send_meta_digest_one(inst, dm);
+        }
+    }
+}
+
+/* push the digest if dm changed since the last one, or the heartbeat is due */
+static void ss_srv_digest(ss_ctx_t *ctx)
+{
+    ss_dirmeta_t *dm = ctx->dm;
+    time_t now = time(NULL);
+    int beat;
+
+    if (dm == NULL) {
+        return;
+    }
+
+    if (((dm->crc != ctx->u.srv.md_crc) || (dm->n_file != ctx->u.srv.md_n_file) || ss_hcache_landed(ctx)) &&
+        ss_hcache_fill(ctx, dm)) {
+        /* a touch is told from an edit by the hash, a digest without it would refetch the file */
+        if (ctx->u.srv.md_hold == 0) {
+            ctx->u.srv.md_hold = now;
+        }
+        if (now - ctx->u.srv.md_hold < SS_HCACHE_HOLD) {
+            return;
+        }
+    }
+    ctx->u.srv.md_hold = 0;
+
+    if ((dm->crc == ctx->u.srv.md_crc) && (dm->n_file == ctx->u.srv.md_n_file) &&
+        (now - ctx->u.srv.md_sent < ctx->heartbeat)) {
+        return;
+    }
+
+    /* the files that changed are about to be asked for */
+    beat = (dm->crc == ctx->u.srv.md_crc) && (dm->n_file == ctx->u.srv.md_n_file);
+    if (!beat) {
+        ss_hot_srv_changed(ctx, dm);
+    }
+
+    ss_send_meta_digest(&(ctx->com), dm, beat);
+    ctx->u.srv.md_crc = dm->crc;
+    ctx->u.srv.md_n_file = dm->n_file;
+    ctx->u.srv.md_sent = now;
 }
 
 static void ss_send_meta_req(ss_com_inst_t *inst)
@@ -306,7 +497,7 @@ static void ss_send_meta_req(ss_com_inst_t *inst)
     memset(buf, 0, sizeof(buf));
 
     msghead->magic = SS_MSGHEAD_MAGIC;
-    msghead->ver = 0;
+    msghead->ver = SS_VER;
     msghead->hlen = sizeof(ss_msghead_t);
     msghead->type = SS_MSGTYPE_META_REQ;
     msghead->total_len = msghead->len = sizeof(ss_msgmd_t);
@@ -320,43 +511,20 @@ static void ss_send_meta_req(ss_com_inst_t *inst)
 static void ss_send_meta_res(ss_com_inst_t *inst, ss_dirmeta_t *dm)
 {
     ss_com_t *com = inst->com;
-    char *buf, *p;
-    uint32_t len, left, curlen, first;
-    ss_msghead_t msghead = {0};
+    ss_srvcli_t *sc = (ss_srvcli_t *)inst->payload;
+    char *buf;
+    uint32_t len, ver;
 
     SS_ASSERT(com->type == SS_NODE_SRV);
 
-    len = ss_metalist_seri(dm, NULL);
-    buf = (char *)malloc(len);
-    SS_ASSERT(buf);
-    ss_metalist_seri(dm, buf);
-
-    msghead.magic = SS_MSGHEAD_MAGIC;
-    msghead.ver = 0;
-    msghead.hlen = sizeof(ss_msghead_t);
-    msghead.type = SS_MSGTYPE_META_RES;
-    msghead.total_len = len;
-
-    first = 1;
-    p = buf;
-    left = len;
-    do {
-        curlen = left < SS_FRAME_MAXLEN ? left : SS_FRAME_MAXLEN;
-        left -= curlen;
-
-        msghead.sop = first;
-        if (left == 0) {
-            msghead.eop = 1;
-        }
-        msghead.len = curlen;
-        ss_com_send(inst, &msghead, msghead.hlen);
-        ss_com_send(inst, p, msghead.len);
-
-        p += curlen;
-        first = 0;
-    } while (left);
+    /* what both ends speak */
+    ver = (sc->ver < SS_VER) ? sc->ver : SS_VER;
+    len = ss_metalist_seri(dm, NULL, ver);
+    buf = (char *)ss_pool_get(len);
+    ss_metalist_seri(dm, buf, ver);
 
-    free(buf);
+    /* a big one is compressed by the tx workers */
+    ss_tx_msg(inst, SS_MSGTYPE_META_RES, buf, len);
 }
 
 static void ss_send_file_req(ss_com_inst_t *inst, ss_filemeta_t *fm)
@@ -372,7 +540,7 @@ static void ss_send_file_req(ss_com_inst_t *inst, ss_filemeta_t *fm)
     memset(buf, 0, sizeof(buf));
 
     msghead->magic = SS_MSGHEAD_MAGIC;
-    msghead->ver = 0;
+    msghead->ver = SS_VER;
     msghead->hlen = sizeof(ss_msghead_t);
     msghead->type = SS_MSGTYPE_FILE_REQ;
     msghead->total_len = msghead->len = sizeof(ss_filereq_t) + len;
@@ -383,94 +551,6 @@ static void ss_send_file_req(ss_com_inst_t *inst, ss_filemeta_t *fm)
     ss_com_send(inst, buf, msghead->len + msghead->hlen);
 }
 
-static void ss_send_file_res(ss_com_inst_t *inst, ss_filereq_t *filereq)
-{
-    ss_com_t *com = inst->com;
-    ss_ctx_t *ctx = (ss_ctx_t *)com->param;
-    uint32_t i, subh_len, flag = 0, left, first, curlen;
-    long sz = 0;
-    char *p, tmpbuf[sizeof(ss_fileres_t) + SS_MAXPATH_LEN], *fname = NULL;
-    ss_msghead_t msghead;
-    ss_fileres_t *fileres;
-    FILE *fp = NULL;
-    char pathname[SS_MAXPATH_LEN];
-    struct stat fstat;
-
-    SS_ASSERT(com->type == SS_NODE_SRV);
-
-    subh_len = sizeof(ss_fileres_t) + strlen(filereq->name) + 1;
-
-    for (i = 0; i < ctx->dm->n_file; i++) {
-        if (strcmp(filereq->name, ctx->dm->fml[i].name) == 0) {
-            fname = ctx->dm->fml[i].name;
-        }
-    }
-
-    if (fname) {
-        flag |= SS_FILERES_VALID;
-
-        memset(pathname, 0, sizeof(pathname));
-        sprintf(pathname, "%s/%s", ctx->localpath, fname);
-
-        stat(pathname, &fstat);
-
-        fp = fopen(pathname, "rb");
-        if (fp) {
-            flag |= SS_FILERES_EXIST;
-
-            /* get file len */
-            fseek(fp, 0, SEEK_END);
-            sz = ftell(fp);
-            fseek(fp, 0, SEEK_SET);
-        }
-    }
-
-    if (fp) {
-        fileres = (ss_fileres_t *)malloc(subh_len + sz + 1024);
-        SS_ASSERT(fileres);
-        fread(((char *)fileres) + subh_len, 1, sz, fp);
-    } else {
-        fileres = (ss_fileres_t *)tmpbuf;
-    }
-
-    memset(fileres, 0, subh_len);
-    fileres->flag = flag;
-    fileres->len = (uint32_t)sz;
-    fileres->mtime = fstat.st_mtime;
-    strcpy(fileres->name, filereq->name);
-
-    memset(&msghead, 0, sizeof(msghead));
-    msghead.magic = SS_MSGHEAD_MAGIC;
-    msghead.ver = 0;
-    msghead.hlen = sizeof(ss_msghead_t);
-    msghead.type = SS_MSGTYPE_FILE_RES;
-    msghead.total_len = (uint32_t)(subh_len + sz);
-
-    first = 1;
-    p = (char *)fileres;
-    left = msghead.total_len;
-    do {
-        curlen = left < SS_FRAME_MAXLEN ? left : SS_FRAME_MAXLEN;
-        left -= curlen;
-
-        msghead.sop = first;
-        if (left == 0) {
-            msghead.eop = 1;
-        }
-        msghead.len = curlen;
-        ss_com_send(inst, &msghead, msghead.hlen);
-        ss_com_send(inst, p, msghead.len);
-
-        p += curlen;
-        first = 0;
-    } while (left);
-
-    if (fp) {
-        fclose(fp);
-        free(fileres);
-    }
-}
-
 static void ss_srv_msgproc(ss_com_inst_t *inst, void *head, void *body)
 {
     ss_com_t *com = inst->com;
@@ -485,13 +565,32 @@ static void ss_srv_msgproc(ss_com_inst_t *inst, void *head, void *body)
         return;
     }
 
+    if (inst->payload) {
+        ((ss_srvcli_t *)(inst->payload))->ver = msghead->ver;
+    }
+
     switch (msghead->type) {
     case SS_MSGTYPE_META_REQ:
     {
+        ss_dirmeta_t *dm;
+
         SS_ASSERT((msghead->sop == 1) && (msghead->eop == 1));
         SS_ASSERT((msghead->total_len == msghead->len) && (msghead->len == sizeof(ss_msgmd_t)));
 
-        ss_send_meta_res(inst, ctx->dm);
+        dm = ss_sub_srv_dm(inst);
+        if (dm) {
+            ss_send_meta_res(inst, dm);
+        }
+        break;
+    }
+    case SS_MSGTYPE_SUBSCRIBE:
+    {
+        if (!msghead->sop || !msghead->eop) {
+            printf("	broken subscribe, drop.\n");
+            break;
+        }
+
+        ss_sub_srv_join(inst, (ss_subscribe_t *)body, msghead->len);
         break;
     }
     case SS_MSGTYPE_FILE_REQ:
@@ -502,215 +601,1138 @@ static void ss_srv_msgproc(ss_com_inst_t *inst, void *head, void *body)
 
         printf("\tfilename: %s\n", filereq->name);
 
-        ss_send_file_res(inst, filereq);
+        if (ss_swarm_srv_filereq(inst, filereq->name)) {
+            ss_tx_filereq(inst, filereq->name);
+        }
 
         ctx->u.srv.n_filereq_recv = 2;
 
         break;
     }
-    default:
-        printf("\tsrv known msgtype: %s.\n", g_msgtype_str[msghead->type]);
-        break;
-    }
-}
-
-static void ss_com_cb_srv(ss_com_inst_t *inst, ss_cbtype_e cbt, void *head, void *body)
-{
-    ss_com_t *com = inst->com;
-    ss_ctx_t *ctx = (ss_ctx_t *)com->param;
-    static int path_scan_cycle = 0;
-    int i;
+    case SS_MSGTYPE_FILE_BREQ:
+    {
+        ss_filebreq_t *breq = (ss_filebreq_t *)body;
 
-    printf("[%d][%20s]: cb %s.\n", (int)(inst - com->inst_list), g_nodetype_str[inst->type], g_cbtype_str[cbt]);
+        if (!msghead->sop || !msghead->eop || (msghead->len < sizeof(ss_filebreq_t))) {
+            printf("\tbroken file bundle req, drop.\n");
+            break;
+        }
 
-    if (cbt == SS_CBTYPE_CONNECT) {
+        printf("\tbundle of %d files\n", breq->n_file);
 
-    } else if (cbt == SS_CBTYPE_RECV) {
-        ss_srv_msgproc(inst, head, body);
-    } else if (cbt == SS_CBTYPE_CLOSE) {
+        ss_tx_filebreq(inst, breq, msghead->len);
 
-    } else if (cbt == SS_CBTYPE_TIMER) {
-        if (ctx->u.srv.n_filereq_recv) {
-            ctx->u.srv.n_filereq_recv--;
-        } else {
-            if ((path_scan_cycle % SS_PATH_RESCAN_CYCLE) == 0) {
-                if (ctx->dm) {
-                    free(ctx->dm);
-                }
-                ctx->dm = path_scan(ctx->localpath, &(ctx->ff));
-            }
-            path_scan_cycle++;
+        ctx->u.srv.n_filereq_recv = 2;
 
-            if (ctx->dm) {
-                ss_dmstate_refresh(ctx, ctx->dm, 1);
+        break;
+    }
+    case SS_MSGTYPE_FILE_RREQ:
+    {
+        ss_filerreq_t *rreq = (ss_filerreq_t *)body;
 
-                for (i = 0; i < SS_MAX_CLIINST; i++) {
-                    if (com->inst_list[i].type == SS_NODE_CLI) {
-                        ss_send_meta_digest(&(com->inst_list[i]), ctx->dm);
-                    }
-                }
-            }
+        if (!msghead->sop || !msghead->eop || (msghead->len <= sizeof(ss_filerreq_t)) ||
+            (strnlen(rreq->name, msghead->len - sizeof(ss_filerreq_t)) >= SS_MAXPATH_LEN)) {
+            printf("\tbroken file range req, drop.\n");
+            break;
         }
-    }
-}
 
-void ss_srv(ss_ctx_t *ctx)
-{
-    ss_com_init(&(ctx->com), SS_NODE_SRV, "0.0.0.0", 55443, ss_com_cb_srv, SS_FRAME_MAXLEN, ctx);
-    ss_com_init_timer(&(ctx->com), ctx->cycle);
+        printf("\trange %lu+%lu of %s\n", rreq->off, rreq->len, rreq->name);
 
-    while (ctx->com.loop) {
-        /**/
-        usleep(ctx->cycle);
+        ss_tx_filerreq(inst, rreq);
+
+        ctx->u.srv.n_filereq_recv = 2;
+
+        break;
     }
-}
+    case SS_MSGTYPE_FILE_CREQ:
+    {
+        ss_filereq_t *filereq = (ss_filereq_t *)body;
 
-static int ss_do_fileremote(ss_ctx_t *ctx, char *fname)
-{
-    char pathname[SS_MAXPATH_LEN];
+        if (!msghead->sop || !msghead->eop || (msghead->len <= sizeof(ss_filereq_t)) ||
+            (strnlen(filereq->name, msghead->len - sizeof(ss_filereq_t)) >= SS_MAXPATH_LEN)) {
+            printf("\tbroken chunk map req, drop.\n");
+            break;
+        }
 
-    memset(pathname, 0, sizeof(pathname));
-    sprintf(pathname, "%s/%s", ctx->localpath, fname);
+        printf("\tchunk map of %s\n", filereq->name);
+
+        ss_tx_filecreq(inst, filereq->name);
+
+        ctx->u.srv.n_filereq_recv = 2;
+
+        break;
+    }
+    case SS_MSGTYPE_PEER_HELLO:
+    {
+        ss_peerhello_t *hello = (ss_peerhello_t *)body;
+        ss_srvcli_t *sc = (ss_srvcli_t *)inst->payload;
+
+        if (!msghead->sop || !msghead->eop || (msghead->len < sizeof(ss_peerhello_t)) || (sc == NULL)) {
+            printf("\tbroken peer hello, drop.\n");
+            break;
+        }
+
+        sc->peer_port = hello->port;
+        break;
+    }
+    case SS_MSGTYPE_CHUNK_REQ:
+    {
+        if (!msghead->sop || !msghead->eop || (msghead->len < sizeof(ss_chunkreq_t))) {
+            printf("\tbroken chunk req, drop.\n");
+            break;
+        }
+
+        ss_swarm_srv_chunkreq(inst, (ss_chunkreq_t *)body);
+
+        ctx->u.srv.n_filereq_recv = 2;
+        break;
+    }
+    case SS_MSGTYPE_CHUNK_HAVE:
+    {
+        if (!msghead->sop || !msghead->eop || (msghead->len < sizeof(ss_chunkhave_t))) {
+            printf("\tbroken chunk have, drop.\n");
+            break;
+        }
+
+        ss_swarm_srv_chunkhave(inst, (ss_chunkhave_t *)body);
+        break;
+    }
+    default:
+        printf("\tsrv known msgtype: %s.\n", g_msgtype_str[msghead->type]);
+        break;
+    }
+}
+
+static ss_dirmeta_t *ss_dm_dup(ss_dirmeta_t *dm)
+{
+    uint32_t len = sizeof(ss_dirmeta_t) + dm->n_slot * sizeof(ss_filemeta_t);
+    ss_dirmeta_t *newdm = (ss_dirmeta_t *)ss_pool_get(len);
+
+    memcpy(newdm, dm, len);
+
+    return newdm;
+}
+
+/* cli side of a relay, hand a snapshot of the applied dm to the downstream srv */
+static void ss_relay_publish(ss_ctx_t *ctx)
+{
+    ss_ctx_t *srv = ctx->relay;
+    ss_dirmeta_t *dm;
+
+    if ((srv == NULL) || (ctx->dm == NULL)) {
+        return;
+    }
+
+    dm = ss_dm_dup(ctx->dm);
+
+    pthread_mutex_lock(&(srv->u.srv.relay_lock));
+    if (srv->u.srv.relay_dm) {
+        ss_pool_put(srv->u.srv.relay_dm);
+    }
+    srv->u.srv.relay_dm = dm;
+    pthread_mutex_unlock(&(srv->u.srv.relay_lock));
+
+    ss_com_notify(&(srv->com));
+}
+
+/* srv side of a relay, runs in the srv epoll thread */
+static void ss_relay_pickup(ss_ctx_t *ctx)
+{
+    ss_dirmeta_t *dm;
+
+    pthread_mutex_lock(&(ctx->u.srv.relay_lock));
+    dm = ctx->u.srv.relay_dm;
+    ctx->u.srv.relay_dm = NULL;
+    pthread_mutex_unlock(&(ctx->u.srv.relay_lock));
+
+    if (dm) {
+        if (ctx->dm) {
+            ss_pool_put(ctx->dm);
+        }
+        ctx->dm = dm;
+    }
+}
+
+static void ss_srv_rescan(ss_ctx_t *ctx)
+{
+    if (ctx->dm) {
+        ss_pool_put(ctx->dm);
+    }
+    ctx->dm = path_scan(ctx->localpath, &(ctx->ff));
+    if (ctx->dm) {
+        ss_dmstate_refresh(ctx, ctx->dm, 1);
+    }
+}
+
+static void ss_com_cb_srv(ss_com_inst_t *inst, ss_cbtype_e cbt, void *head, void *body)
+{
+    ss_com_t *com = inst->com;
+    ss_ctx_t *ctx = (ss_ctx_t *)com->param;
+    static int path_scan_cycle = 0;
+
+    printf("[%d][%20s]: cb %s.\n", inst->id, g_nodetype_str[inst->type], g_cbtype_str[cbt]);
+
+    if (cbt == SS_CBTYPE_CONNECT) {
+        inst->payload = calloc(1, sizeof(ss_srvcli_t));
+        SS_ASSERT(inst->payload);
+        ((ss_srvcli_t *)inst->payload)->inst = inst;
+        ((ss_srvcli_t *)inst->payload)->out_fd = -1;
+
+        /* a new cli need not wait for a change or the heartbeat */
+        if (ctx->dm) {
+            ss_send_meta_digest_one(inst, ctx->dm);
+        }
+    } else if (cbt == SS_CBTYPE_WRITABLE) {
+        ss_tx_writable(inst);
+    } else if (cbt == SS_CBTYPE_RECV) {
+        ss_srv_msgproc(inst, head, body);
+    } else if (cbt == SS_CBTYPE_CLOSE) {
+        ss_tx_close(inst);
+        ss_swarm_srv_drop(inst);
+        ss_sub_srv_leave(inst);
+        free(inst->payload);
+        inst->payload = NULL;
+    } else if (cbt == SS_CBTYPE_EVENT) {
+        if (ctx->relay) {
+            /* relay: upstream finished applying a change, forward it right away */
+            ss_relay_pickup(ctx);
+        } else if (ctx->u.srv.scan) {
+            /* a pass of the scan thread is over */
+            ss_scan_srv_pickup(ctx);
+        } else if (ss_watch_take(ctx)) {
+            /* the tree changed, a burst of changes is one event */
+            ss_srv_rescan(ctx);
+        }
+        /* or the hash thread has hashes for dm, ss_srv_digest puts them in */
+        ss_srv_digest(ctx);
+    } else if (cbt == SS_CBTYPE_TIMER) {
+        if (ctx->u.srv.n_filereq_recv) {
+            ctx->u.srv.n_filereq_recv--;
+        } else if (!ctx->relay && !ctx->u.srv.scan) {
+            if ((path_scan_cycle % SS_PATH_RESCAN_CYCLE) == 0) {
+                if (ctx->dm) {
+                    ss_pool_put(ctx->dm);
+                }
+                ctx->dm = path_scan(ctx->localpath, &(ctx->ff));
+            }
+            path_scan_cycle++;
+
+            if (ctx->dm && ss_dmstate_refresh(ctx, ctx->dm, 1)) {
+                /* files went away, maybe moved: rescan now so a move is one change, not two */
+                ss_srv_rescan(ctx);
+            }
+        }
+
+        ss_srv_digest(ctx);
+    }
+}
+
+static int ss_srv_start(ss_ctx_t *ctx)
+{
+    if (ss_tx_init(ctx)) {
+        return -1;
+    }
+    if (ss_com_init(&(ctx->com), SS_NODE_SRV, "0.0.0.0", ctx->port, ss_com_cb_srv, SS_FRAME_MAXLEN, ctx,
+                    ctx->tcp ? 0 : SS_COM_LOCAL)) {
+        return -1;
+    }
+    if (ss_com_init_timer(&(ctx->com), ctx->cycle)) {
+        return -1;
+    }
+    if (ss_com_init_event(&(ctx->com))) {
+        return -1;
+    }
+    if (!ctx->relay) {
+        /* content hashes are computed off the epoll thread */
+        ss_hcache_start(ctx);
+        /* scans paced on a thread of their own, if a budget is set */
+        ss_scan_srv_start(ctx);
+        /* without it changes are still seen, by the periodic scan */
+        ss_watch_start(ctx);
+    }
+
+    return 0;
+}
+
+void ss_srv(ss_ctx_t *ctx)
+{
+    if (ss_srv_start(ctx)) {
+        return;
+    }
+
+    while (ctx->com.loop) {
+        /**/
+        usleep(ctx->cycle);
+    }
+}
+
+static int ss_do_fileremote(ss_ctx_t *ctx, char *fname)
+{
+    char pathname[SS_MAXPATH_LEN];
+
+    memset(pathname, 0, sizeof(pathname));
+    sprintf(pathname, "%s/%s", ctx->localpath, fname);
 
     printf("remote %s\n", pathname);
 
-    remove(pathname);
+    remove(pathname);
+
+    return 0;
+}
+
+/* a file whose FILE_RES fits in one frame */
+static int ss_cli_file_small(ss_filemeta_t *fm)
+{
+    return (sizeof(ss_fileres_t) + SS_MAXPATH_LEN + fm->size) <= SS_FRAME_MAXLEN;
+}
+
+typedef struct {
+    uint32_t            prio;               /* index of the first priority pattern in the path */
+    uint32_t            bulk;
+    uint64_t            key;                /* of ctx->order, ascending */
+    uint32_t            idx;                /* dm index, dm is sorted by name */
+} ss_pendkey_t;
+
+static int ss_cli_pend_comp(const void *a, const void *b)
+{
+    const ss_pendkey_t *pa = (ss_pendkey_t *)a, *pb = (ss_pendkey_t *)b;
+
+    if (pa->prio != pb->prio) {
+        return pa->prio < pb->prio ? -1 : 1;
+    }
+    if (pa->bulk != pb->bulk) {
+        return pa->bulk < pb->bulk ? -1 : 1;
+    }
+    if (pa->key != pb->key) {
+        return pa->key < pb->key ? -1 : 1;
+    }
+
+    return (pa->idx > pb->idx) - (pa->idx < pb->idx);
+}
+
+/*
+ * files under a --priority pattern are asked for first, an earlier pattern
+ * before a later one. within that, small files go first, the srv multiplexes
+ * their streams ahead of the bulk ones anyway, so they should not wait in
+ * the window either. then -o: smallest, most recently modified, or by name.
+ */
+static void ss_cli_pend_order(ss_ctx_t *ctx, ss_dirmeta_t *newdm)
+{
+    ss_pendkey_t *pk;
+    ss_filemeta_t *fm;
+    char path[SS_MAXPATH_LEN + 1];
+    uint32_t i;
+    int j;
+
+    if (ctx->u.cli.n_pend == 0) {
+        return;
+    }
+
+    pk = (ss_pendkey_t *)malloc(ctx->u.cli.n_pend * sizeof(ss_pendkey_t));
+    SS_ASSERT(pk);
+
+    path[0] = '/';
+    for (i = 0; i < ctx->u.cli.n_pend; i++) {
+        fm = &(newdm->fml[ctx->u.cli.pend[i]]);
+
+        pk[i].prio = ctx->n_prio;
+        if (ctx->n_prio) {
+            strcpy(path + 1, fm->name);
+            for (j = 0; j < ctx->n_prio; j++) {
+                if (strstr(path, ctx->prio[j])) {
+                    pk[i].prio = j;
+                    break;
+                }
+            }
+        }
+        pk[i].bulk = !ss_cli_file_small(fm);
+        pk[i].idx = ctx->u.cli.pend[i];
+
+        switch (ctx->order) {
+        case SS_ORDER_SIZE:
+            pk[i].key = fm->size;
+            break;
+        case SS_ORDER_MTIME:
+            /* newest first, seconds fit in 34 bits */
+            pk[i].key = ~(((uint64_t)fm->mtime << 30) | fm->mtime_ns);
+            break;
+        default:
+            pk[i].key = 0;
+            break;
+        }
+    }
+
+    qsort(pk, ctx->u.cli.n_pend, sizeof(ss_pendkey_t), ss_cli_pend_comp);
+
+    for (i = 0; i < ctx->u.cli.n_pend; i++) {
+        ctx->u.cli.pend[i] = pk[i].idx;
+    }
+
+    free(pk);
+}
+
+/* drop the directories a move left empty, up to localpath */
+static void ss_cli_rmdir_parent(ss_ctx_t *ctx, char *pathname)
+{
+    char dirname[SS_MAXPATH_LEN];
+    int len = strlen(pathname), root = strlen(ctx->localpath);
+
+    memcpy(dirname, pathname, len + 1);
+    while (1) {
+        while ((len > root) && (dirname[len] != '/')) {
+            len--;
+        }
+        if (len <= root) {
+            break;
+        }
+        dirname[len] = '\0';
+        if (rmdir(dirname)) {
+            break;
+        }
+        ss_wr_forget(ctx, dirname);
+    }
+}
+
+static int ss_cli_gone_comp(const void *a, const void *b)
+{
+    const ss_filemeta_t *pa = *(ss_filemeta_t **)a;
+    const ss_filemeta_t *pb = *(ss_filemeta_t **)b;
+
+    if (pa->hash != pb->hash) {
+        return pa->hash < pb->hash ? -1 : 1;
+    }
+    if (pa->size != pb->size) {
+        return pa->size < pb->size ? -1 : 1;
+    }
+
+    return 0;
+}
+
+/*
+ * a file that went away and one to fetch with the same content hash are a
+ * rename on the srv, move the local copy instead of fetching it again.
+ * what is left of gone is removed.
+ */
+static void ss_cli_file_moves(ss_ctx_t *ctx, ss_dirmeta_t *newdm, ss_filemeta_t **gone, uint32_t n_gone)
+{
+    char oldpath[SS_MAXPATH_LEN], newpath[SS_MAXPATH_LEN];
+    ss_filemeta_t *newfm, **hit;
+    uint32_t i, n_pend = 0;
+    uint8_t *used;
+
+    qsort(gone, n_gone, sizeof(ss_filemeta_t *), ss_cli_gone_comp);
+    /* by position in gone, moved already; olddm is not written to */
+    used = (uint8_t *)ss_pool_zget(n_gone + 1);
+
+    for (i = 0; i < ctx->u.cli.n_pend; i++) {
+        newfm = &(newdm->fml[ctx->u.cli.pend[i]]);
+        hit = NULL;
+        if (newfm->hash && n_gone) {
+            hit = (ss_filemeta_t **)bsearch(&newfm, gone, n_gone, sizeof(ss_filemeta_t *), ss_cli_gone_comp);
+        }
+        /* equal ones are next to each other, take one not used yet */
+        while (hit && (hit > gone) && !ss_cli_gone_comp(hit - 1, &newfm)) {
+            hit--;
+        }
+        while (hit && used[hit - gone]) {
+            hit = ((hit + 1 < gone + n_gone) && !ss_cli_gone_comp(hit + 1, &newfm)) ? hit + 1 : NULL;
+        }
+
+        if (hit && ((snprintf(oldpath, sizeof(oldpath), "%s/%s", ctx->localpath, (*hit)->name) >= (int)sizeof(oldpath)) ||
+                    (snprintf(newpath, sizeof(newpath), "%s/%s", ctx->localpath, newfm->name) >= (int)sizeof(newpath)))) {
+            printf("path of %s too long, fetch it.\n", newfm->name);
+            hit = NULL;
+        }
+        if (hit) {
+            if ((ss_mkdir_parent(ctx, newpath) == 0) && (rename(oldpath, newpath) == 0)) {
+                printf("rename %s -> %s\n", (*hit)->name, newfm->name);
+                ss_cli_rmdir_parent(ctx, oldpath);
+                used[hit - gone] = 1;
+                ctx->u.cli.n_update--;
+                continue;
+            }
+        }
+
+        ctx->u.cli.pend[n_pend++] = ctx->u.cli.pend[i];
+    }
+    ctx->u.cli.n_pend = n_pend;
+
+    for (i = 0; i < n_gone; i++) {
+        if (!used[i]) {
+            ss_do_fileremote(ctx, gone[i]->name);
+        }
+    }
+    ss_pool_put(used);
+}
+
+static int ss_do_fileupdate(ss_com_inst_t *inst, ss_ctx_t *ctx, ss_dirmeta_t *olddm, ss_dirmeta_t *newdm)
+{
+    int ret;
+    ss_filemeta_t *oldfm, *newfm, *oldend, *newend, **gone;
+    uint32_t n_gone = 0;
+
+    SS_ASSERT(inst && ctx && newdm);
+    SS_ASSERT(ctx->u.cli.n_update == 0);
+
+    if (ctx->u.cli.pend) {
+        free(ctx->u.cli.pend);
+    }
+    ctx->u.cli.pend = (uint32_t *)malloc((newdm->n_file + 1) * sizeof(uint32_t));
+    SS_ASSERT(ctx->u.cli.pend);
+    ctx->u.cli.n_pend = ctx->u.cli.pend_head = 0;
+    ss_wr_reset(ctx);
+
+    if (ctx->u.cli.settled) {
+        free(ctx->u.cli.settled);
+    }
+    ctx->u.cli.settled = (uint8_t *)calloc(newdm->n_file + 1, 1);
+    SS_ASSERT(ctx->u.cli.settled);
+    if (ctx->u.cli.bundle) {
+        free(ctx->u.cli.bundle);
+    }
+    ctx->u.cli.bundle = (uint32_t *)calloc(newdm->n_file + 1, sizeof(uint32_t));
+    SS_ASSERT(ctx->u.cli.bundle);
+
+    printf("old n_file[%3d]--->new n_file[%3d]\n",
+        olddm == NULL ? 0 : olddm->n_file,
+        newdm->n_file);
+
+    if (olddm) {
+        oldfm = olddm->fml;
+        oldend = oldfm + olddm->n_file;
+    } else {
+        oldfm = oldend = NULL;
+    }
+
+    newfm = newdm->fml;
+    newend = newfm + newdm->n_file;
+
+    gone = (ss_filemeta_t **)malloc(((olddm ? olddm->n_file : 0) + 1) * sizeof(ss_filemeta_t *));
+    SS_ASSERT(gone);
+
+    while ((oldfm != oldend) || (newfm != newend)) {
+        if (oldfm == oldend) {
+            /* no more old fm entry, just do file sync */
+            goto __do_filesync;
+        }
+        else if (newfm == newend) {
+            /* file has been removed from host, remote it unless it was moved */
+            gone[n_gone++] = oldfm;
+
+            oldfm++;
+            continue;
+        } else {
+            ret = strcmp(oldfm->name, newfm->name);
+            if (ret == 0) {
+                if ((oldfm->mtime == newfm->mtime) && (oldfm->mtime_ns == newfm->mtime_ns) &&
+                    (oldfm->size == newfm->size)) {
+                    /* no need to do update */
+                    oldfm++;
+                    newfm++;
+                    continue;
+                } else if (oldfm->hash && (oldfm->hash == newfm->hash) && (oldfm->size == newfm->size)) {
+                    /* touched, the content is the same */
+                    printf("same content %s\n", newfm->name);
+                    oldfm++;
+                    newfm++;
+                    continue;
+                } else {
+                    /* need update */
+                    oldfm++;
+                    goto __do_filesync;
+                }
+            } else if (ret < 0) {
+                /* file has been removed from host, remote it unless it was moved */
+                gone[n_gone++] = oldfm;
+
+                oldfm++;
+                continue;
+            } else {
+                goto __do_filesync;
+            }
+        }
+
+__do_filesync:
+        /* do file sync, requests go out through the window */
+        ctx->state = SS_STATE_FILE_UPDATE;
+        ctx->u.cli.pend[ctx->u.cli.n_pend++] = newfm - newdm->fml;
+        newfm++;
+        ctx->u.cli.n_update++;
+    }
+
+    ss_cli_file_moves(ctx, newdm, gone, n_gone);
+    free(gone);
+
+    ss_dedup_cli_plan(ctx, newdm);
+    ss_resume_cli_plan(ctx, newdm);
+
+    ss_cli_pend_order(ctx, newdm);
+
+    /* no file need sync */
+    if (ctx->u.cli.n_update == 0) {
+        ss_wr_flush(ctx);
+        ctx->state = SS_STATE_IDLE;
+    }
+
+    return 0;
+}
+
+/*
+ * ask for a run of small files in one FILE_BREQ, as many as the names and
+ * their contents fit into one bundle. returns the bytes asked for. the
+ * token is the pend position of the first name, plus one, the files are
+ * tagged with it.
+ */
+static uint64_t ss_cli_file_bundle(ss_ctx_t *ctx)
+{
+    ss_filebreq_t *breq;
+    ss_filemeta_t *fm;
+    uint32_t len, room, reclen;
+    uint64_t bytes = 0;
+
+    breq = (ss_filebreq_t *)ss_pool_get(sizeof(ss_filebreq_t) + SS_BUNDLE_FILES * SS_MAXPATH_LEN);
+    memset(breq, 0, sizeof(ss_filebreq_t));
+    breq->token = ctx->u.cli.pend_head + 1;
+    len = sizeof(ss_filebreq_t);
+    room = SS_BUNDLE_BYTES - sizeof(ss_filebres_t);
+
+    while ((ctx->u.cli.pend_head < ctx->u.cli.n_pend) && (breq->n_file < SS_BUNDLE_FILES)) {
+        fm = &(ctx->dm->fml[ctx->u.cli.pend[ctx->u.cli.pend_head]]);
+        if (!ss_cli_file_small(fm)) {
+            break;
+        }
+
+        reclen = SS_BUNDLE_ALIGN(sizeof(ss_fileres_t) + fm->name_len + 1 + fm->size);
+        if (breq->n_file && (reclen > room)) {
+            break;
+        }
+        room -= reclen < room ? reclen : room;
+
+        strcpy((char *)breq + len, fm->name);
+        len += strlen(fm->name) + 1;
+        breq->n_file++;
+        bytes += fm->size;
+        ctx->u.cli.bundle[fm - ctx->dm->fml] = breq->token;
+        ctx->u.cli.pend_head++;
+    }
+
+    ss_send_msg(ctx->com.main_inst, SS_MSGTYPE_FILE_BREQ, breq, len);
+    ss_pool_put(breq);
+
+    return bytes;
+}
+
+/*
+ * send FILE_REQ while the window has room, at least one is always let out.
+ * small files go out as bundles, a bundle counts as one request and does
+ * not count against the byte budget.
+ */
+static void ss_cli_file_pump(ss_ctx_t *ctx)
+{
+    ss_filemeta_t *fm;
+
+    while (ctx->u.cli.pend_head < ctx->u.cli.n_pend) {
+        fm = &(ctx->dm->fml[ctx->u.cli.pend[ctx->u.cli.pend_head]]);
+
+        if (ctx->u.cli.n_inflight &&
+            ((ctx->u.cli.n_inflight >= ctx->win_files) ||
+             (!ss_cli_file_small(fm) && (ctx->u.cli.inflight_bytes + fm->size > ctx->win_bytes)))) {
+            break;
+        }
+
+        if (ss_cli_file_small(fm)) {
+            ctx->u.cli.inflight_bytes += ss_cli_file_bundle(ctx);
+            ctx->u.cli.n_inflight++;
+            continue;
+        }
+
+        if (ss_resume_cli_file(ctx, fm) && ss_cdc_cli_file(ctx, fm) && ss_stripe_cli_file(ctx, fm)) {
+            ss_send_file_req(ctx->com.main_inst, fm);
+        }
+        ctx->u.cli.pend_head++;
+        ctx->u.cli.n_inflight++;
+        ctx->u.cli.inflight_bytes += fm->size;
+    }
+}
+
+static int ss_zero(char *p, size_t len)
+{
+    return (p[0] == 0) && (memcmp(p, p + 1, len - 1) == 0);
+}
+
+/*
+ * pwrite into a file that was truncated to its size, blocks of zeros are
+ * not written and stay holes
+ */
+ssize_t ss_pwrite_sparse(int fd, void *buf, size_t len, uint64_t off)
+{
+    char *p = (char *)buf;
+    size_t n = 0, run, blk;
+    ssize_t ret;
+
+    while (n < len) {
+        /* a run of blocks that are not all zero */
+        for (run = n; run < len; run += blk) {
+            blk = SS_SPARSE_BLOCK - ((off + run) & (SS_SPARSE_BLOCK - 1));
+            blk = (len - run) < blk ? (len - run) : blk;
+            if ((blk == SS_SPARSE_BLOCK) && ss_zero(p + run, blk)) {
+                break;
+            }
+        }
+
+        while (n < run) {
+            ret = pwrite(fd, p + n, run - n, off + n);
+            if (ret <= 0) {
+                return -1;
+            }
+            n += ret;
+        }
+
+        for (; (n < len) && (len - n >= SS_SPARSE_BLOCK) && ss_zero(p + n, SS_SPARSE_BLOCK); n += SS_SPARSE_BLOCK);
+    }
+
+    return len;
+}
+
+/* stamp the outcome of one file, the window is released by the caller */
+static void ss_cli_file_settle(ss_ctx_t *ctx, ss_filemeta_t *fm, ss_filedone_e how, time_t mtime, uint64_t size)
+{
+    SS_ASSERT(ctx->u.cli.n_update);
+
+    if (how == SS_FILEDONE_SAVED) {
+        if ((fm->mtime != mtime) || (fm->size != size)) {
+            /* changed after the META_RES, what was saved is not what the hash is of */
+            fm->mtime_ns = 0;
+            fm->hash = 0;
+        }
+        fm->mtime = mtime;
+        fm->size = size;
+    } else if (how == SS_FILEDONE_FAILED) {
+        fm->mtime = 0;
+        fm->mtime_ns = 0;
+        fm->hash = 0;
+    }
+
+    ctx->u.cli.n_update--;
+    ctx->u.cli.settled[fm - ctx->dm->fml] = 1;
+
+    ss_dedup_cli_settled(ctx, fm, how);
+}
+
+static void ss_cli_meta_check(ss_ctx_t *ctx);
+
+/* a request has been answered, go idle or let the next ones out */
+static void ss_cli_file_next(ss_ctx_t *ctx)
+{
+    if (ctx->u.cli.n_update == 0) {
+        ss_wr_flush(ctx);
+        ctx->state = SS_STATE_IDLE;
+        ss_relay_publish(ctx);
+        if (ctx->u.cli.md_new) {
+            ss_cli_meta_check(ctx);
+        }
+    } else {
+        ss_cli_file_pump(ctx);
+    }
+}
+
+/* one FILE_REQ has been answered, either by FILE_RES or through the swarm */
+void ss_cli_file_done(ss_ctx_t *ctx, char *name, ss_filedone_e how, time_t mtime, uint64_t size)
+{
+    ss_filemeta_t *fm;
+
+    SS_ASSERT(ctx->dm);
+    SS_ASSERT(ctx->u.cli.n_update && ctx->u.cli.n_inflight);
+
+    fm = ss_dm_find(ctx->dm, name);
+    SS_ASSERT(fm);
+
+    /* the window accounts the size the request went out with */
+    ctx->u.cli.n_inflight--;
+    ctx->u.cli.inflight_bytes -= fm->size;
+
+    ss_cli_file_settle(ctx, fm, how, mtime, size);
+    ss_cli_file_next(ctx);
+}
+
+static void ss_rx_put(ss_ctx_t *ctx, ss_rxstream_t *rx);
+
+/* the stream of a frame, a sop frame opens a new one */
+static ss_rxstream_t *ss_rx_get(ss_ctx_t *ctx, ss_msghead_t *msghead)
+{
+    ss_rxstream_t *rx;
+
+    for (rx = ctx->u.cli.rx_list; rx; rx = rx->next) {
+        if (rx->sid == msghead->sid) {
+            break;
+        }
+    }
+
+    if (msghead->sop) {
+        if (rx) {
+            printf("\tstream %u restarted, drop the old one.\n", msghead->sid);
+            if ((rx->type == SS_MSGTYPE_FILE_RES) && rx->name[0]) {
+                ss_cli_file_done(ctx, rx->name, SS_FILEDONE_FAILED, 0, 0);
+            }
+            ss_rx_put(ctx, rx);
+        }
+        rx = (ss_rxstream_t *)ss_pool_zget(sizeof(ss_rxstream_t));
+        rx->sid = msghead->sid;
+        rx->type = msghead->type;
+        rx->fd = -1;
+        rx->next = ctx->u.cli.rx_list;
+        ctx->u.cli.rx_list = rx;
+    } else if (rx == NULL) {
+        printf("\tframe of unknown stream %u, drop.\n", msghead->sid);
+    }
+
+    return rx;
+}
+
+static void ss_rx_put(ss_ctx_t *ctx, ss_rxstream_t *rx)
+{
+    ss_rxstream_t **pp;
+
+    for (pp = &(ctx->u.cli.rx_list); *pp; pp = &((*pp)->next)) {
+        if (*pp == rx) {
+            *pp = rx->next;
+            break;
+        }
+    }
+
+    if (rx->fd >= 0) {
+        /* a FILE_RES that did not make it */
+        ss_wr_abort(ctx, rx->fd, rx->name);
+    }
+    ss_pool_put(rx->segasm.buf);
+    ss_pool_put(rx->ext);
+    ss_pool_put(rx);
+}
+
+/* a srv on this host handed the file over as an fd, nothing else of it follows */
+static void ss_rx_file_local(ss_ctx_t *ctx, ss_rxstream_t *rx)
+{
+    int src = ctx->com.rx_fd;
+    struct stat st;
+
+    ctx->com.rx_fd = -1;
+    rx->want = 0;
+
+    if (src < 0) {
+        printf("\tfileres of %s without its fd, drop.\n", rx->name);
+        rx->err = 1;
+        return;
+    }
+
+    if (rx->fd >= 0) {
+        if ((fstat(src, &st) < 0) || (st.st_size != rx->len) || ss_local_copy(src, rx->fd, rx->len)) {
+            printf("savefile: copy %s faild.\n", rx->name);
+            rx->err = 1;
+        }
+    }
+    close(src);
+}
+
+/* FILE_RES sop frame: take the fileres and open the file */
+static int ss_rx_file_open(ss_ctx_t *ctx, ss_rxstream_t *rx, void *body, uint32_t len)
+{
+    ss_fileres_t *fileres = (ss_fileres_t *)body;
+    ss_sparse_t *sparse;
+    uint32_t i, subh_len;
+
+    if ((len < sizeof(ss_fileres_t)) ||
+        (strnlen(fileres->name, len - sizeof(ss_fileres_t)) >= (len - sizeof(ss_fileres_t))) ||
+        (strlen(fileres->name) >= SS_MAXPATH_LEN)) {
+        printf("\tbroken fileres, drop.\n");
+        rx->err = 1;
+        return len;
+    }
+
+    subh_len = sizeof(ss_fileres_t) + strlen(fileres->name) + 1;
+    rx->flag = fileres->flag;
+    rx->want = rx->len = fileres->len;
+    rx->mtime = fileres->mtime;
+    strcpy(rx->name, fileres->name);
+
+    if (rx->flag & SS_FILERES_SPARSE) {
+        /* the extents that follow, the rest of the file is a hole */
+        sparse = (ss_sparse_t *)((char *)body + subh_len);
+        if ((len < subh_len + sizeof(ss_sparse_t)) || (sparse->n_ext > SS_SPARSE_MAXEXT) ||
+            (len < subh_len + sizeof(ss_sparse_t) + sparse->n_ext * sizeof(ss_extent_t))) {
+            printf("\tbroken sparse fileres, drop.\n");
+            rx->err = 1;
+            return len;
+        }
+
+        rx->n_ext = sparse->n_ext;
+        rx->ext = (ss_extent_t *)ss_pool_get((rx->n_ext + 1) * sizeof(ss_extent_t));
+        memcpy(rx->ext, sparse->ext, rx->n_ext * sizeof(ss_extent_t));
+        subh_len += sizeof(ss_sparse_t) + rx->n_ext * sizeof(ss_extent_t);
+
+        for (i = 0, rx->want = 0; i < rx->n_ext; i++) {
+            if ((rx->ext[i].off > rx->len) || (rx->ext[i].len > rx->len - rx->ext[i].off)) {
+                printf("\tbroken sparse fileres, drop.\n");
+                rx->err = 1;
+                return len;
+            }
+            rx->want += rx->ext[i].len;
+        }
+    }
+
+    if ((rx->flag & SS_FILERES_VALID) && (rx->flag & SS_FILERES_EXIST)) {
+        rx->fd = ss_wr_open(ctx, rx->name, rx->len, (rx->ext != NULL) || (rx->flag & SS_FILERES_FD));
+        if (rx->fd < 0) {
+            rx->err = 1;
+        }
+    }
+
+    if (rx->flag & SS_FILERES_FD) {
+        ss_rx_file_local(ctx, rx);
+    }
+
+    return subh_len;
+}
+
+/* the next bytes of a sparse FILE_RES, at the extent they belong to */
+static ssize_t ss_rx_file_sparse(ss_rxstream_t *rx, char *buf, uint32_t len)
+{
+    ss_extent_t *ext;
+
+    while ((rx->i_ext < rx->n_ext) && (rx->ext_got == rx->ext[rx->i_ext].len)) {
+        rx->i_ext++;
+        rx->ext_got = 0;
+    }
+    if (rx->i_ext == rx->n_ext) {
+        /* more than the extents add up to */
+        return -1;
+    }
+
+    ext = &(rx->ext[rx->i_ext]);
+    if (len > ext->len - rx->ext_got) {
+        len = ext->len - rx->ext_got;
+    }
+    if (ss_pwrite_sparse(rx->fd, buf, len, ext->off + rx->ext_got) < 0) {
+        return -1;
+    }
+    rx->ext_got += len;
 
-    return 0;
+    return len;
 }
 
-static int ss_do_fileupdate(ss_com_inst_t *inst, ss_ctx_t *ctx, ss_dirmeta_t *olddm, ss_dirmeta_t *newdm)
+/* one frame of a FILE_RES stream, data is written where it belongs right away */
+static void ss_cli_filestream(ss_ctx_t *ctx, ss_msghead_t *msghead, void *body)
 {
-    int ret;
-    ss_filemeta_t *oldfm, *newfm, *oldend, *newend;
+    ss_rxstream_t *rx;
+    uint32_t off = 0;
+    ssize_t ret;
+    int fd;
 
-    SS_ASSERT(inst && ctx && newdm);
-    SS_ASSERT(ctx->u.cli.n_update == 0);
+    rx = ss_rx_get(ctx, msghead);
+    if (rx == NULL) {
+        return;
+    }
 
-    printf("old n_file[%3d]--->new n_file[%3d]\n",
-        olddm == NULL ? 0 : olddm->n_file,
-        newdm->n_file);
+    if (msghead->sop) {
+        off = ss_rx_file_open(ctx, rx, body, msghead->len);
+    }
 
-    if (olddm) {
-        oldfm = olddm->fml;
-        oldend = oldfm + olddm->n_file;
-    } else {
-        oldfm = oldend = NULL;
+    while ((off < msghead->len) && !rx->err) {
+        if ((rx->fd >= 0) && rx->ext) {
+            ret = ss_rx_file_sparse(rx, (char *)body + off, msghead->len - off);
+            if (ret <= 0) {
+                printf("savefile: write %s faild.\n", rx->name);
+                rx->err = 1;
+                break;
+            }
+        } else if (rx->fd >= 0) {
+            ret = write(rx->fd, (char *)body + off, msghead->len - off);
+            if (ret <= 0) {
+                printf("savefile: write %s faild.\n", rx->name);
+                rx->err = 1;
+                break;
+            }
+        } else {
+            ret = msghead->len - off;
+        }
+        off += ret;
+        rx->got += ret;
     }
 
-    newfm = newdm->fml;
-    newend = newfm + newdm->n_file;
+    if (!msghead->eop) {
+        return;
+    }
 
-    while ((oldfm != oldend) || (newfm != newend)) {
-        if (oldfm == oldend) {
-            /* no more old fm entry, just do file sync */
-            goto __do_filesync;
+    if (rx->name[0] == '\0') {
+        /* the fileres never made it, nothing to account it to */
+    } else if (!(rx->flag & SS_FILERES_VALID)) {
+        printf("\tinvalid filereq name: %s\n", rx->name);
+        ss_do_fileremote(ctx, rx->name);
+        ss_cli_file_done(ctx, rx->name, SS_FILEDONE_REMOVED, 0, 0);
+    } else if (!(rx->flag & SS_FILERES_EXIST)) {
+        printf("\tfile not exist name: %s\n", rx->name);
+        ss_do_fileremote(ctx, rx->name);
+        ss_cli_file_done(ctx, rx->name, SS_FILEDONE_REMOVED, 0, 0);
+    } else if (rx->err || (rx->got != rx->want)) {
+        ss_cli_file_done(ctx, rx->name, SS_FILEDONE_FAILED, 0, 0);
+    } else {
+        fd = rx->fd;
+        rx->fd = -1;
+        if (ss_wr_commit(ctx, fd, rx->name)) {
+            ss_cli_file_done(ctx, rx->name, SS_FILEDONE_FAILED, 0, 0);
+        } else {
+            ss_cli_file_done(ctx, rx->name, SS_FILEDONE_SAVED, rx->mtime, rx->len);
         }
-        else if (newfm == newend) {
-            /* file has been removed from host, just remote it */
-            ss_do_fileremote(ctx, oldfm->name);
+    }
 
-            oldfm++;
-            continue;
-        } else {
-            ret = strcmp(oldfm->name, newfm->name);
-            if (ret == 0) {
-                if (oldfm->mtime != newfm->mtime) {
-                    /* need update */
-                    oldfm++;
-                    goto __do_filesync;
-                } else {
-                    /* no need to do update */
-                    oldfm++;
-                    newfm++;
-                    continue;
-                }
-            } else if (ret < 0) {
-                /* file has been removed from host, just remote it */
-                ss_do_fileremote(ctx, oldfm->name);
+    ss_rx_put(ctx, rx);
+}
 
-                oldfm++;
-                continue;
-            } else {
-                goto __do_filesync;
-            }
-        }
+static int ss_do_filewrite(ss_ctx_t *ctx, char *name, char *data, uint64_t len)
+{
+    uint64_t n;
+    ssize_t ret;
+    int fd;
 
-__do_filesync:
-        /* do file sync */
-        ctx->state = SS_STATE_FILE_UPDATE;
-        ss_send_file_req(inst, newfm);
-        newfm++;
-        ctx->u.cli.n_update++;
+    fd = ss_wr_open(ctx, name, len, 0);
+    if (fd < 0) {
+        return -1;
     }
 
-    /* no file need sync */
-    if (ctx->u.cli.n_update == 0) {
-        ctx->state = SS_STATE_IDLE;
+    for (n = 0; n < len; n += ret) {
+        ret = write(fd, data + n, len - n);
+        if (ret <= 0) {
+            printf("savefile: write %s faild.\n", name);
+            ss_wr_abort(ctx, fd, name);
+            return -1;
+        }
     }
 
-    return 0;
+    return ss_wr_commit(ctx, fd, name);
 }
 
-static int ss_do_filesave(ss_ctx_t *ctx, ss_fileres_t *fileres)
+/*
+ * a FILE_BRES, all the files of one FILE_BREQ. the files tagged with its
+ * token that it does not have are failed, a failed file is fetched again
+ * on the next digest.
+ */
+static void ss_cli_filebundle(ss_ctx_t *ctx, char *buf, uint32_t len)
 {
-    int len, ret, fml_idx;
-    char pathname[SS_MAXPATH_LEN];
-    char dirname[SS_MAXPATH_LEN];
-    char cmd[SS_MAXPATH_LEN + 32];
-    FILE *fp;
-    char *src;
+    ss_filebres_t *bres = (ss_filebres_t *)buf;
+    ss_fileres_t *fileres;
+    ss_filemeta_t *fm;
+    uint32_t i, off, subh_len, token = 0, idx;
+    uint64_t bytes = 0;
+    ss_filedone_e how;
 
-    SS_ASSERT(ctx->dm);
+    SS_ASSERT(ctx->u.cli.n_inflight);
 
-    for (fml_idx = 0; fml_idx < ctx->dm->n_file; fml_idx++) {
-        if (strcmp(fileres->name, ctx->dm->fml[fml_idx].name) == 0) {
+    /* 0: a srv that does not echo it */
+    if ((len >= sizeof(ss_filebres_t)) && bres->token && (bres->token <= ctx->u.cli.pend_head)) {
+        token = bres->token;
+    }
+
+    off = sizeof(ss_filebres_t);
+    for (i = 0; (len >= sizeof(ss_filebres_t)) && (i < bres->n_file); i++) {
+        fileres = (ss_fileres_t *)(buf + off);
+        if ((off + sizeof(ss_fileres_t) > len) ||
+            (strnlen(fileres->name, len - off - sizeof(ss_fileres_t)) == (len - off - sizeof(ss_fileres_t)))) {
+            printf("\tbroken file bundle, %d of %d files.\n", i, bres->n_file);
+            break;
+        }
+        subh_len = sizeof(ss_fileres_t) + strlen(fileres->name) + 1;
+        if ((uint64_t)off + subh_len + fileres->len > len) {
+            printf("\tbroken file bundle, %d of %d files.\n", i, bres->n_file);
             break;
         }
-    }
 
-    SS_ASSERT(fml_idx != ctx->dm->n_file);
+        fm = ss_dm_find(ctx->dm, fileres->name);
+        if ((fm == NULL) || ctx->u.cli.settled[fm - ctx->dm->fml] ||
+            (token && (ctx->u.cli.bundle[fm - ctx->dm->fml] != token))) {
+            printf("\tfile bundle has %s, not asked for, skip.\n", fileres->name);
+            off += SS_BUNDLE_ALIGN(subh_len + fileres->len);
+            continue;
+        }
 
-    /* save new time stamp */
-    ctx->dm->fml[fml_idx].mtime = fileres->mtime;
+        if (fileres->flag & SS_FILERES_DEFER) {
+            /* comes as a FILE_RES of its own, which releases it */
+            ctx->u.cli.bundle[fm - ctx->dm->fml] = 0;
+            ctx->u.cli.n_inflight++;
+        } else {
+            if (!(fileres->flag & SS_FILERES_VALID) || !(fileres->flag & SS_FILERES_EXIST)) {
+                printf("\tfile not exist name: %s\n", fileres->name);
+                ss_do_fileremote(ctx, fileres->name);
+                how = SS_FILEDONE_REMOVED;
+            } else if (ss_do_filewrite(ctx, fileres->name, (char *)fileres + subh_len, fileres->len)) {
+                how = SS_FILEDONE_FAILED;
+            } else {
+                how = SS_FILEDONE_SAVED;
+            }
 
-    /* savefile */
-    memset(pathname, 0, sizeof(pathname));
-    sprintf(pathname, "%s/%s", ctx->localpath, fileres->name);
+            bytes += fm->size;
+            ss_cli_file_settle(ctx, fm, how, fileres->mtime, fileres->len);
+        }
 
-    /* mkdir */
-    len = strlen(pathname) - 1;
-    while ((len) && (pathname[len] != '/')) {
-        len--;
+        off += SS_BUNDLE_ALIGN(subh_len + fileres->len);
     }
-    SS_ASSERT(len);
-    memset(dirname, 0, sizeof(dirname));
-    memcpy(dirname, pathname, len);
 
-    if (access((const char *)dirname, F_OK)) {
-        sprintf(cmd, "mkdir -p %s", dirname);
-        ret = system(cmd);
-        if (ret) {
-            printf("mkdir faild.\n");
-            return -1;
+    /* the names of a bundle are a run of pend from token - 1 on */
+    for (i = token - 1; token && (i < ctx->u.cli.pend_head) && (i < token - 1 + SS_BUNDLE_FILES); i++) {
+        idx = ctx->u.cli.pend[i];
+        if ((ctx->u.cli.bundle[idx] != token) || ctx->u.cli.settled[idx]) {
+            continue;
         }
+        fm = &(ctx->dm->fml[idx]);
+        printf("\tfile bundle has no %s, failed.\n", fm->name);
+        bytes += fm->size;
+        ss_cli_file_settle(ctx, fm, SS_FILEDONE_FAILED, 0, 0);
     }
-    src = (char *)(fileres + 1);
-    src += strlen(fileres->name) + 1;
 
-    fp = fopen(pathname, "wb");
-    if (fp == NULL) {
-        printf("savefile: open %s faild.\n", pathname);
-        return 0;
-    }
-    SS_ASSERT(fp);
-    fwrite(src, 1, fileres->len, fp);
-    fclose(fp);
+    ctx->u.cli.n_inflight--;
+    ctx->u.cli.inflight_bytes -= bytes;
+    ss_cli_file_next(ctx);
+}
 
-    /* update timestamp */
+/* idle: ask for the metadata if the mirror does not match the latest digest */
+static void ss_cli_meta_check(ss_ctx_t *ctx)
+{
+    ss_com_inst_t *inst = ctx->com.main_inst;
 
+    SS_ASSERT(ctx->state == SS_STATE_IDLE);
 
-    return 0;
+    ctx->u.cli.md_new = 0;
+    if (!ctx->u.cli.md_valid) {
+        return;
+    }
+
+    /* the first digest tells the srv version, a filter goes before the first META_REQ */
+    if (!ctx->u.cli.subscribed && (ctx->ff.n_match || ctx->ff.n_ignore)) {
+        ctx->u.cli.subscribed = 1;
+        if (ctx->u.cli.srv_ver >= SS_VER_SUB) {
+            ss_sub_cli_send(inst);
+            ctx->state = SS_STATE_META_UPDATE;
+            ss_send_meta_req(inst);
+            return;
+        }
+        printf("srv ver %d does not take -m / -i, mirror everything.\n", ctx->u.cli.srv_ver);
+    }
+
+    if (ctx->dm == NULL) {
+        ctx->state = SS_STATE_META_UPDATE;
+        ss_send_meta_req(inst);
+    } else {
+        if ((ctx->dm->crc != ctx->u.cli.md_crc) || (ctx->dm->n_file != ctx->u.cli.md_n_file)) {
+            if (ctx->dm->crc != ctx->u.cli.md_crc) {
+                printf("crc changed, need update file (0x%08x --> 0x%08x)\n", ctx->dm->crc, ctx->u.cli.md_crc);
+            }
+            if (ctx->dm->n_file != ctx->u.cli.md_n_file) {
+                printf("file number changed, need update file (%d --> %d)\n", ctx->dm->n_file, ctx->u.cli.md_n_file);
+            }
+            ctx->state = SS_STATE_META_UPDATE;
+            ss_send_meta_req(inst);
+        } else {
+            /* file meta crc no change, do nothing */
+        }
+    }
 }
 
 static void ss_cli_msgproc(ss_com_inst_t *inst, void *head, void *body)
@@ -728,6 +1750,11 @@ static void ss_cli_msgproc(ss_com_inst_t *inst, void *head, void *body)
         return;
     }
 
+    /* what the srv speaks, swarm peers may be older or newer */
+    if (inst == com->main_inst) {
+        ctx->u.cli.srv_ver = msghead->ver;
+    }
+
     switch (msghead->type) {
     case SS_MSGTYPE_META_DIGEST:
     {
@@ -736,93 +1763,172 @@ static void ss_cli_msgproc(ss_com_inst_t *inst, void *head, void *body)
         SS_ASSERT((msghead->sop == 1) && (msghead->eop == 1));
         SS_ASSERT((msghead->total_len == msghead->len) && (msghead->len == sizeof(ss_msgmd_t)));
 
-        if (ctx->state != SS_STATE_IDLE) {
-            printf("\twrong state, ignore msg.\n");
+        if (inst != inst->com->main_inst) {
+            /* the srv digests every connection, the stripe ones only carry ranges */
             break;
         }
 
-        if (ctx->dm == NULL) {
-            ctx->state = SS_STATE_META_UPDATE;
-            ss_send_meta_req(inst);
-        } else {
-            if ((ctx->dm->crc != msgmd->crc) || (ctx->dm->n_file != msgmd->n_file)) {
-                if (ctx->dm->crc != msgmd->crc) {
-                    printf("crc changed, need update file (0x%08x --> 0x%08x)\n", ctx->dm->crc, msgmd->crc);
-                }
-                if (ctx->dm->n_file != msgmd->n_file) {
-                    printf("file number changed, need update file (%d --> %d)\n", ctx->dm->n_file, msgmd->n_file);
-                }
-                ctx->state = SS_STATE_META_UPDATE;
-                ss_send_meta_req(inst);
-            } else {
-                /* file meta crc no change, do nothing */
-            }
+        ctx->u.cli.md_crc = msgmd->crc;
+        ctx->u.cli.md_n_file = msgmd->n_file;
+        ctx->u.cli.md_valid = 1;
+
+        if (ctx->state != SS_STATE_IDLE) {
+            /* looked at once the update is done, the srv does not send it again */
+            ctx->u.cli.md_new = 1;
+            break;
         }
 
+        ss_cli_meta_check(ctx);
+
         break;
     }
     case SS_MSGTYPE_META_RES:
     {
         ss_dirmeta_t *newdm;
+        ss_segasm_t *segasm;
+        ss_rxstream_t *rx;
 
         if (ctx->state != SS_STATE_META_UPDATE) {
             printf("\twrong state, ignore msg.\n");
             break;
         }
 
-        ret = ss_do_segasm(ctx, msghead, body);
+        /* the srv sends it as a stream from the tx workers */
+        if (msghead->sid) {
+            rx = ss_rx_get(ctx, msghead);
+            segasm = rx ? &(rx->segasm) : NULL;
+        } else {
+            rx = NULL;
+            segasm = &(ctx->u.cli.segasm);
+        }
+
+        ret = segasm ? ss_do_segasm(&(ctx->com), segasm, msghead, body) : 0;
         if (ret) {
-            newdm = ss_metalist_deseri(ctx->u.cli.segasm.buf, ctx->u.cli.segasm.len);
+            newdm = ss_metalist_deseri(segasm->buf, segasm->len,
+                (ctx->u.cli.srv_ver < SS_VER) ? ctx->u.cli.srv_ver : SS_VER);
+            ctx->u.cli.dm_gen++;
+
+            /* newer than the digest it was asked for on */
+            ctx->u.cli.md_crc = newdm->crc;
+            ctx->u.cli.md_n_file = newdm->n_file;
+            ctx->u.cli.md_valid = 1;
 
             /* do file update */
             ss_do_fileupdate(inst, ctx, ctx->dm, newdm);
 
             if (ctx->dm) {
-                free(ctx->dm);
+                ss_pool_put(ctx->dm);
             }
             ctx->dm = newdm;
 
-            free(ctx->u.cli.segasm.buf);
-            memset(&(ctx->u.cli.segasm), 0, sizeof(ss_segasm_t));
+            ss_cli_file_pump(ctx);
+
+            /* nothing to fetch, removals are already applied */
+            if (ctx->state == SS_STATE_IDLE) {
+                ss_relay_publish(ctx);
+                if (ctx->u.cli.md_new) {
+                    ss_cli_meta_check(ctx);
+                }
+            }
+
+            if (rx) {
+                ss_rx_put(ctx, rx);
+            } else {
+                ss_pool_put(segasm->buf);
+                memset(segasm, 0, sizeof(ss_segasm_t));
+            }
         }
 
         break;
     }
     case SS_MSGTYPE_FILE_RES:
     {
-        ss_fileres_t *fileres;
+        if (ctx->state != SS_STATE_FILE_UPDATE) {
+            printf("\twrong state, ignore msg.\n");
+            break;
+        }
+
+        ss_cli_filestream(ctx, msghead, body);
+
+        break;
+    }
+    case SS_MSGTYPE_FILE_BRES:
+    {
+        ss_rxstream_t *rx;
 
         if (ctx->state != SS_STATE_FILE_UPDATE) {
             printf("\twrong state, ignore msg.\n");
             break;
         }
 
-        ret = ss_do_segasm(ctx, msghead, body);
-        if (ret) {
-            ctx->u.cli.n_update--;
-            fileres = (ss_fileres_t *)(ctx->u.cli.segasm.buf);
+        rx = ss_rx_get(ctx, msghead);
+        if (rx && ss_do_segasm(&(ctx->com), &(rx->segasm), msghead, body)) {
+            ss_cli_filebundle(ctx, rx->segasm.buf, rx->segasm.len);
+            ss_rx_put(ctx, rx);
+        }
 
-            SS_ASSERT(msghead->total_len == ctx->u.cli.segasm.len);
-            SS_ASSERT(msghead->total_len == (fileres->len + sizeof(ss_fileres_t) + strlen(fileres->name) + 1));
+        break;
+    }
+    case SS_MSGTYPE_SWARM_MAP:
+    {
+        ss_rxstream_t *rx;
 
-            if (!(fileres->flag & SS_FILERES_VALID)) {
-                printf("\tinvalid filereq name: %s\n", fileres->name);
-                ss_do_fileremote(ctx, fileres->name);
-            } else if (!(fileres->flag & SS_FILERES_EXIST)) {
-                printf("\tfile not exist name: %s\n", fileres->name);
-                ss_do_fileremote(ctx, fileres->name);
-            } else {
-                ss_do_filesave(ctx, fileres);
-            }
+        if (ctx->state != SS_STATE_FILE_UPDATE) {
+            printf("\twrong state, ignore msg.\n");
+            break;
+        }
+
+        rx = ss_rx_get(ctx, msghead);
+        if (rx && ss_do_segasm(&(ctx->com), &(rx->segasm), msghead, body)) {
+            ss_swarm_cli_map(inst, (ss_swarmmap_t *)(rx->segasm.buf), rx->segasm.len);
+            ss_rx_put(ctx, rx);
+        }
+
+        break;
+    }
+    case SS_MSGTYPE_FILE_RRES:
+    {
+        if (ctx->state != SS_STATE_FILE_UPDATE) {
+            printf("\twrong state, ignore msg.\n");
+            break;
+        }
+
+        if (ss_resume_cli_res(inst, msghead, body) && ss_cdc_cli_res(inst, msghead, body)) {
+            ss_stripe_cli_res(inst, msghead, body);
+        }
+
+        break;
+    }
+    case SS_MSGTYPE_FILE_CRES:
+    {
+        ss_rxstream_t *rx;
+
+        if (ctx->state != SS_STATE_FILE_UPDATE) {
+            printf("\twrong state, ignore msg.\n");
+            break;
+        }
 
-            free(ctx->u.cli.segasm.buf);
-            memset(&(ctx->u.cli.segasm), 0, sizeof(ss_segasm_t));
+        rx = ss_rx_get(ctx, msghead);
+        if (rx && ss_do_segasm(&(ctx->com), &(rx->segasm), msghead, body)) {
+            ss_cdc_cli_map(inst, (ss_filecres_t *)(rx->segasm.buf), rx->segasm.len);
+            ss_rx_put(ctx, rx);
         }
 
-        if (ctx->u.cli.n_update == 0) {
-            ctx->state = SS_STATE_IDLE;
+        break;
+    }
+    case SS_MSGTYPE_CHUNK_RES:
+    {
+        ss_chunkres_t *res = (ss_chunkres_t *)body;
+
+        /* from the srv or a peer */
+        if (!msghead->sop || !msghead->eop || (msghead->len < sizeof(ss_chunkres_t)) ||
+            (res->len > msghead->len - sizeof(ss_chunkres_t))) {
+            printf("\tbroken chunk res, drop.\n");
+            break;
         }
 
+        ss_swarm_cli_chunkres(inst, res);
+
         break;
     }
     default:
@@ -831,30 +1937,212 @@ static void ss_cli_msgproc(ss_com_inst_t *inst, void *head, void *body)
     }
 }
 
+/*
+ * the main connection is closed. the mirror and dm stay, what was in
+ * flight is dropped: files of the update not settled yet are marked as
+ * failed in dm, so the META_RES after the reconnect fetches them again
+ * along with whatever changed meanwhile, and the rest of the update is
+ * not fetched twice. a FILE_RES half way is kept for ss_resume.
+ */
+static void ss_cli_lost(ss_ctx_t *ctx)
+{
+    ss_rxstream_t *rx;
+    ss_filemeta_t *fm;
+    uint32_t i, n_left = 0;
+
+    while ((rx = ctx->u.cli.rx_list) != NULL) {
+        if ((rx->type == SS_MSGTYPE_FILE_RES) && (rx->fd >= 0) && !rx->err && (rx->ext == NULL)) {
+            ss_resume_cli_keep(ctx, rx->name, rx->fd, rx->mtime, rx->got);
+            rx->fd = -1;
+        }
+        ss_rx_put(ctx, rx);
+    }
+    ss_pool_put(ctx->u.cli.segasm.buf);
+    memset(&(ctx->u.cli.segasm), 0, sizeof(ss_segasm_t));
+
+    ss_resume_cli_lost(ctx);
+    ss_stripe_cli_reset(ctx);
+    ss_cdc_cli_reset(ctx);
+    ss_swarm_cli_reset(ctx);
+    ss_dedup_cli_reset(ctx);
+
+    if (ctx->dm && ctx->u.cli.settled && ctx->u.cli.n_update) {
+        for (i = 0; i < ctx->u.cli.n_pend; i++) {
+            if (ctx->u.cli.settled[ctx->u.cli.pend[i]]) {
+                continue;
+            }
+            fm = &(ctx->dm->fml[ctx->u.cli.pend[i]]);
+            fm->mtime = 0;
+            fm->mtime_ns = 0;
+            fm->hash = 0;
+            n_left++;
+        }
+        ctx->dm->crc = alg_crc32(ctx->dm->fml, ctx->dm->n_file * sizeof(ss_filemeta_t));
+    }
+    ss_wr_flush(ctx);
+
+    ctx->u.cli.n_update = 0;
+    ctx->u.cli.n_pend = ctx->u.cli.pend_head = 0;
+    ctx->u.cli.n_inflight = 0;
+    ctx->u.cli.inflight_bytes = 0;
+    ctx->state = SS_STATE_IDLE;
+
+    /* the next srv may be another version, with no subscription */
+    ctx->u.cli.srv_ver = 0;
+    ctx->u.cli.subscribed = 0;
+    ctx->u.cli.md_valid = 0;
+    ctx->u.cli.md_new = 0;
+
+    ctx->u.cli.lost = 1;
+    ctx->u.cli.backoff = 1;
+    ctx->u.cli.retry_at = 0;
+
+    printf("connection to the srv lost, %d files of the update left, reconnect.\n", n_left);
+}
+
+/* an attempt failed, the wait to the next one doubles up to SS_RECONNECT_MAX */
+static void ss_cli_retry_later(ss_ctx_t *ctx)
+{
+    ctx->u.cli.retry_at = time(NULL) + ctx->u.cli.backoff;
+    ctx->u.cli.backoff = ctx->u.cli.backoff * 2 < SS_RECONNECT_MAX ? ctx->u.cli.backoff * 2 : SS_RECONNECT_MAX;
+}
+
+/* epoll timer, one attempt when it is due, the epoll thread does not wait for it */
+static void ss_cli_reconnect(ss_ctx_t *ctx)
+{
+    /* a dial is under way, its CONNECT or CLOSE is to come */
+    if (ctx->com.main_inst || (time(NULL) < ctx->u.cli.retry_at)) {
+        return;
+    }
+
+    if (ss_com_reconnect(&(ctx->com))) {
+        ss_cli_retry_later(ctx);
+    }
+}
+
+/*
+ * epoll thread, the head of a frame is in. the body of a message that is
+ * put together goes straight to its place instead of through recv_buf: a
+ * sop frame into a pool buffer of the whole message, ss_do_segasm takes it
+ * over, a later one to cur of the message it belongs to, the same one
+ * ss_cli_msgproc finds. a frame the cb then drops leaves cur as it was.
+ */
+static void *ss_cli_rx_dst(ss_com_inst_t *inst, void *head)
+{
+    ss_ctx_t *ctx = (ss_ctx_t *)inst->com->param;
+    ss_msghead_t *msghead = (ss_msghead_t *)head;
+    uint32_t len = msghead->lz ? msghead->rlen : msghead->len;
+    ss_segasm_t *segasm = NULL;
+    ss_rxstream_t *rx;
+
+    switch (msghead->type) {
+    case SS_MSGTYPE_META_RES:
+    case SS_MSGTYPE_FILE_BRES:
+    case SS_MSGTYPE_SWARM_MAP:
+    case SS_MSGTYPE_FILE_CRES:
+        break;
+    default:
+        return NULL;
+    }
+
+    if (msghead->sop) {
+        if ((msghead->total_len < len) || inst->com->rx_hold) {
+            return NULL;
+        }
+        inst->com->rx_hold = ss_pool_get(msghead->total_len);
+        return inst->com->rx_hold;
+    }
+
+    if ((msghead->type == SS_MSGTYPE_META_RES) && (msghead->sid == 0)) {
+        segasm = &(ctx->u.cli.segasm);
+    } else {
+        for (rx = ctx->u.cli.rx_list; rx; rx = rx->next) {
+            if (rx->sid == msghead->sid) {
+                segasm = &(rx->segasm);
+                break;
+            }
+        }
+    }
+
+    if ((segasm == NULL) || (segasm->buf == NULL) ||
+        ((char *)(segasm->cur) + len > (char *)(segasm->buf) + segasm->len)) {
+        return NULL;
+    }
+
+    return segasm->cur;
+}
+
 static void ss_com_cb_cli(ss_com_inst_t *inst, ss_cbtype_e cbt, void *head, void *body)
 {
     ss_com_t *com = inst->com;
     ss_ctx_t *ctx = (ss_ctx_t *)com->param;
 
-    printf("[%d][%20s]: cb %s.\n", (int)(inst - com->inst_list), g_nodetype_str[inst->type], g_cbtype_str[cbt]);
-
-    if (cbt == SS_CBTYPE_CONNECT) {
+    printf("[%d][%20s]: cb %s.\n", inst->id, g_nodetype_str[inst->type], g_cbtype_str[cbt]);
 
+    if ((cbt == SS_CBTYPE_CONNECT) && (inst != com->main_inst)) {
+        /* a stripe data connection or a swarm peer is up */
+        if (!ss_stripe_cli_connect(inst)) {
+            ss_swarm_cli_connect(inst);
+        }
+    } else if (cbt == SS_CBTYPE_CONNECT) {
+        /* the first CONNECT comes before the epoll thread reads anything */
+        if (ctx->u.cli.lost) {
+            printf("reconnected to the srv.\n");
+            ctx->u.cli.lost = 0;
+        }
+        com->rx_dst = ss_cli_rx_dst;
+        if (ctx->swarm) {
+            ss_swarm_cli_hello(inst);
+        }
+        if (ctx->stripes > 1) {
+            ss_stripe_cli_start(inst);
+        }
     } else if (cbt == SS_CBTYPE_RECV) {
         ss_cli_msgproc(inst, head, body);
     } else if (cbt == SS_CBTYPE_CLOSE) {
-        com->loop = 0;
+        if ((inst == com->main_inst) && ctx->u.cli.lost) {
+            /* the dial of a reconnect failed, there was nothing in flight */
+            com->main_inst = NULL;
+            ss_cli_retry_later(ctx);
+        } else if (inst == com->main_inst) {
+            ss_cli_lost(ctx);
+            com->main_inst = NULL;
+        } else if (!ss_stripe_cli_close(inst)) {
+            /* a swarm peer went away */
+            ss_swarm_cli_close(inst);
+        }
+    } else if (cbt == SS_CBTYPE_EVENT) {
+        /* the cdc thread is done with a file */
+        ss_cdc_cli_pickup(ctx);
     } else if (cbt == SS_CBTYPE_TIMER) {
-        if ((ctx->dm) && (ctx->state == SS_STATE_IDLE)) {
-            ss_dmstate_refresh(ctx, ctx->dm, 0);
+        if (ctx->u.cli.lost) {
+            ss_cli_reconnect(ctx);
+        } else if ((ctx->dm) && (ctx->state == SS_STATE_IDLE)) {
+            if (ctx->scan_rate || ctx->scan_cpu) {
+                ss_scan_cli_tick(ctx);
+            } else {
+                ss_dmstate_refresh(ctx, ctx->dm, 0);
+            }
+
+            /* a failed file or one removed here is fetched again */
+            ss_cli_meta_check(ctx);
         }
     }
 }
 
-void ss_cli(ss_ctx_t *ctx, char *ip)
+void ss_cli(ss_ctx_t *ctx, char *ip, uint16_t port)
 {
-    ss_com_init(&(ctx->com), SS_NODE_CLI, ip, 55443, ss_com_cb_cli, SS_FRAME_MAXLEN, ctx);
+    if (ctx->swarm && ss_swarm_cli_start(ctx)) {
+        printf("swarm: start faild, fetch everything from the server.\n");
+        ctx->swarm = 0;
+    }
+
+    if (ss_com_init(&(ctx->com), SS_NODE_CLI, ip, port, ss_com_cb_cli, SS_FRAME_MAXLEN, ctx,
+                    ctx->tcp ? 0 : SS_COM_LOCAL)) {
+        return;
+    }
     ss_com_init_timer(&(ctx->com), ctx->cycle);
+    ss_com_init_event(&(ctx->com));
 
     while (ctx->com.loop) {
         /**/
@@ -862,3 +2150,33 @@ void ss_cli(ss_ctx_t *ctx, char *ip)
     }
 }
 
+
+/*
+ * cli towards the upstream, srv towards downstream clients. the srv side
+ * serves the local mirror with the upstream metadata, which the cli side
+ * publishes each time a change has been applied.
+ */
+void ss_relay(ss_ctx_t *ctx, char *ip, uint16_t port)
+{
+    static ss_ctx_t srv;
+
+    memset(&srv, 0, sizeof(srv));
+    srv.cycle = ctx->cycle;
+    srv.nt = SS_NODE_SRV;
+    srv.port = ctx->port;
+    srv.lz = ctx->lz;
+    srv.debounce = ctx->debounce;
+    srv.heartbeat = ctx->heartbeat;
+    srv.tcp = ctx->tcp;
+    strcpy(srv.localpath, ctx->localpath);
+    srv.relay = ctx;
+    pthread_mutex_init(&(srv.u.srv.relay_lock), NULL);
+
+    if (ss_srv_start(&srv)) {
+        printf("relay: downstream srv start faild.\n");
+        return;
+    }
+    ctx->relay = &srv;
+
+    ss_cli(ctx, ip, port);
+}
@@ -1,17 +1,86 @@
 #include "pub.h"
+#include <stddef.h>
+#include <errno.h>
 
-static ss_com_inst_t *ss_get_free_inst(ss_com_t *com)
+/* grow the instance table by one block, instances never move once allocated */
+static int ss_inst_grow(ss_com_t *com)
 {
+    ss_com_inst_t *blk, **blk_list;
     int i;
-    ss_com_inst_t *inst = &(com->inst_list[1]);
-    for (i = 1; i < SS_MAX_CLIINST; i++) {
-        if (inst->type == SS_NODE_NONE) {
-            return inst;
-        }
-        inst++;
+
+    blk = (ss_com_inst_t *)calloc(SS_INST_BLKSZ, sizeof(ss_com_inst_t));
+    if (blk == NULL) {
+        return -1;
+    }
+    blk_list = (ss_com_inst_t **)realloc(com->blk_list, (com->n_blk + 1) * sizeof(ss_com_inst_t *));
+    if (blk_list == NULL) {
+        free(blk);
+        return -1;
     }
+    com->blk_list = blk_list;
+    com->blk_list[com->n_blk++] = blk;
 
-    return NULL;
+    for (i = SS_INST_BLKSZ - 1; i >= 0; i--) {
+        blk[i].id = com->n_slot + i;
+        blk[i].next = com->free_list;
+        com->free_list = &(blk[i]);
+    }
+    com->n_slot += SS_INST_BLKSZ;
+
+    return 0;
+}
+
+static ss_com_inst_t *ss_get_free_inst(ss_com_t *com)
+{
+    ss_com_inst_t *inst;
+
+    if ((com->free_list == NULL) && ss_inst_grow(com)) {
+        return NULL;
+    }
+
+    inst = com->free_list;
+    com->free_list = inst->next;
+    inst->next = NULL;
+    pthread_mutex_init(&(inst->send_lock), NULL);
+    com->n_inst++;
+
+    return inst;
+}
+
+static void ss_put_free_inst(ss_com_t *com, ss_com_inst_t *inst)
+{
+    int id = inst->id;
+
+    memset(inst, 0, sizeof(ss_com_inst_t));
+    inst->id = id;
+    inst->next = com->free_list;
+    com->free_list = inst;
+    com->n_inst--;
+}
+
+static void ss_cli_link(ss_com_t *com, ss_com_inst_t *inst)
+{
+    inst->prev = NULL;
+    inst->next = com->cli_list;
+    if (com->cli_list) {
+        com->cli_list->prev = inst;
+    }
+    com->cli_list = inst;
+    com->n_cli++;
+}
+
+static void ss_cli_unlink(ss_com_t *com, ss_com_inst_t *inst)
+{
+    if (inst->prev) {
+        inst->prev->next = inst->next;
+    } else {
+        com->cli_list = inst->next;
+    }
+    if (inst->next) {
+        inst->next->prev = inst->prev;
+    }
+    inst->prev = inst->next = NULL;
+    com->n_cli--;
 }
 
 static void ss_cli_inst_close(ss_com_t *com, ss_com_inst_t *inst)
@@ -20,7 +89,7 @@ static void ss_cli_inst_close(ss_com_t *com, ss_com_inst_t *inst)
 
     ret = epoll_ctl(com->ep, EPOLL_CTL_DEL, inst->fd, NULL);
     if (ret < 0) {
-        printf("[%d] epoll del faild.\n", (int)(inst - com->inst_list));
+        printf("[%d] epoll del faild.\n", inst->id);
     }
 
     if (com->cb) {
@@ -28,7 +97,8 @@ static void ss_cli_inst_close(ss_com_t *com, ss_com_inst_t *inst)
     }
 
     close(inst->fd);
-    memset(inst, 0, sizeof(ss_com_inst_t));
+    ss_cli_unlink(com, inst);
+    ss_put_free_inst(com, inst);
 }
 
 static int ss_inst_recv_exactlen(int fd, void *buf, uint32_t len)
@@ -50,6 +120,86 @@ __go_on:
     return len;
 }
 
+/* as ss_inst_recv_exactlen, an fd passed along with the bytes is left in com->rx_fd */
+static int ss_inst_recv_fd(ss_com_inst_t *inst, void *buf, uint32_t len)
+{
+    ss_com_t *com = inst->com;
+    char ctl[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr *cmsg;
+    struct msghdr msg;
+    struct iovec iov;
+    uint32_t curoff = 0;
+    int ret, fd;
+
+    while (curoff < len) {
+        iov.iov_base = (char *)buf + curoff;
+        iov.iov_len = len - curoff;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = ctl;
+        msg.msg_controllen = sizeof(ctl);
+
+        ret = recvmsg(inst->fd, &msg, MSG_CMSG_CLOEXEC);
+        if (ret <= 0) {
+            return ret;
+        }
+        curoff += ret;
+
+        for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if ((cmsg->cmsg_level != SOL_SOCKET) || (cmsg->cmsg_type != SCM_RIGHTS) ||
+                (cmsg->cmsg_len < CMSG_LEN(sizeof(int)))) {
+                continue;
+            }
+            memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+            if (com->rx_fd >= 0) {
+                close(com->rx_fd);
+            }
+            com->rx_fd = fd;
+        }
+    }
+
+    return len;
+}
+
+/* expand an lz frame into dst, or lz_buf, it turns into a plain one */
+static void *ss_inst_unlz(ss_com_t *com, ss_msghead_t *msghead, void *dst)
+{
+    if (dst == NULL) {
+        if (com->lz_buf == NULL) {
+            com->lz_buf = malloc(SS_FRAME_MAXLEN);
+            SS_ASSERT(com->lz_buf);
+        }
+        dst = com->lz_buf;
+    }
+
+    if (alg_lz_decompress(com->recv_buf, msghead->len, dst, msghead->rlen) != msghead->rlen) {
+        return NULL;
+    }
+
+    msghead->len = msghead->rlen;
+    msghead->lz = 0;
+
+    return dst;
+}
+
+/* what came with a frame and was not taken by the cb */
+static void ss_inst_rx_done(ss_com_t *com)
+{
+    if (com->rx_fd >= 0) {
+        close(com->rx_fd);
+        com->rx_fd = -1;
+    }
+    if (com->rx_hold) {
+        ss_pool_put(com->rx_hold);
+        com->rx_hold = NULL;
+    }
+}
+
+static void ss_inst_dialed(ss_com_inst_t *inst);
+static void ss_inst_dial_expire(ss_com_t *com);
+static void ss_inst_writable(ss_com_inst_t *inst);
+
 static int ss_inst_proc(ss_com_inst_t *inst)
 {
     ss_com_inst_t *new_cli;
@@ -81,49 +231,99 @@ static int ss_inst_proc(ss_com_inst_t *inst)
         new_cli->fd = accept(inst->fd, (struct sockaddr *)&(new_cli->addr), &clilen);
         if (new_cli->fd < 0) {
             printf("accept faild.\n");
+            ss_put_free_inst(com, new_cli);
             return -1;
         }
 
         /* add this new cli inst into epoll */
         new_cli->com = com;
         new_cli->type = SS_NODE_CLI;
+        if (inst->local) {
+            /* a peer on this host, as if it came over loopback */
+            new_cli->local = 1;
+            memset(&(new_cli->addr), 0, sizeof(struct sockaddr_in));
+            new_cli->addr.sin_family = AF_INET;
+            new_cli->addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        }
 
         memset(&event, 0, sizeof(struct epoll_event));
         event.events = EPOLLIN;
         event.data.ptr = new_cli;
         ret = epoll_ctl(com->ep, EPOLL_CTL_ADD, new_cli->fd, &event);
         if (ret < 0) {
-            printf("[%d] epoll add faild.\n", (int)(new_cli - com->inst_list));
+            printf("[%d] epoll add faild.\n", new_cli->id);
+            close(new_cli->fd);
+            ss_put_free_inst(com, new_cli);
             return -1;
         }
+        ss_cli_link(com, new_cli);
 
         if (com->cb) {
             com->cb(new_cli, SS_CBTYPE_CONNECT, NULL, NULL);
         }
     } else if (inst->type == SS_NODE_CLI) {
         ss_msghead_t msghead;
+        void *body, *dst;
 
-        /* recv head */
-        ret = ss_inst_recv_exactlen(inst->fd, &msghead, sizeof(ss_msghead_t));
+        /* recv head, on the local socket an fd may come along with it */
+        if (inst->local) {
+            ret = ss_inst_recv_fd(inst, &msghead, sizeof(ss_msghead_t));
+        } else {
+            ret = ss_inst_recv_exactlen(inst->fd, &msghead, sizeof(ss_msghead_t));
+        }
         if (ret <= 0) {
             ss_cli_inst_close(com, inst);
         } else {
-            if (msghead.len > SS_FRAME_MAXLEN) {
+            /* a peer of the older 16 byte head would be misframed from here on */
+            if ((msghead.magic != SS_MSGHEAD_MAGIC) || (msghead.hlen != sizeof(ss_msghead_t))) {
+                printf("[%d] msghead magic 0x%08x hlen %d, peer speaks another protocol, close.\n",
+                    inst->id, msghead.magic, (int)msghead.hlen);
+                ss_inst_rx_done(com);
+                ss_cli_inst_close(com, inst);
+                return -1;
+            }
+
+            if ((msghead.len > SS_FRAME_MAXLEN) || (msghead.lz && (msghead.rlen > SS_FRAME_MAXLEN))) {
                 printf("invalid msg len: %d.\n", msghead.len);
+                ss_inst_rx_done(com);
+                ss_cli_inst_close(com, inst);
+                return -1;
             }
 
-            ret = ss_inst_recv_exactlen(inst->fd, com->recv_buf, msghead.len);
+            /* a body the cb has a place for is read, or expanded, right there */
+            dst = com->rx_dst ? com->rx_dst(inst, &msghead) : NULL;
+            body = (dst && !msghead.lz) ? dst : com->recv_buf;
+
+            ret = ss_inst_recv_exactlen(inst->fd, body, msghead.len);
             if (ret <= 0) {
+                ss_inst_rx_done(com);
                 ss_cli_inst_close(com, inst);
+                return -1;
+            }
+
+            if (msghead.lz) {
+                body = ss_inst_unlz(com, &msghead, dst);
+                if (body == NULL) {
+                    printf("invalid lz frame, len %d rlen %d.\n", msghead.len, msghead.rlen);
+                    ss_inst_rx_done(com);
+                    ss_cli_inst_close(com, inst);
+                    return -1;
+                }
             }
 
             if (com->cb) {
-                com->cb(inst, SS_CBTYPE_RECV, &msghead, com->recv_buf);
+                com->cb(inst, SS_CBTYPE_RECV, &msghead, body);
             }
         }
+
+        ss_inst_rx_done(com);
     } else if (inst->type == SS_NODE_TIMER) {
         read(inst->fd, &n_times, sizeof(n_times));
+        ss_inst_dial_expire(com);
         com->cb(inst, SS_CBTYPE_TIMER, NULL, NULL);
+    } else if (inst->type == SS_NODE_EVENT) {
+        read(inst->fd, &n_times, sizeof(n_times));
+        com->cb(inst, SS_CBTYPE_EVENT, NULL, NULL);
     } else {
         printf("epoll thread, invalid instance type %d.\n", inst->type);
     }
@@ -134,13 +334,14 @@ static int ss_inst_proc(ss_com_inst_t *inst)
 static void *ss_epoll_loop(void *arg)
 {
     ss_com_t *com = (ss_com_t *)arg;
-    struct epoll_event wait_event[SS_MAX_CLIINST + 2];
+    struct epoll_event wait_event[SS_EPOLL_BATCH];
+    ss_com_inst_t *inst;
     int i, ret;
 
     printf("[%s]epoll_loop start...\n", g_nodetype_str[com->type]);
 
     while (com->loop) {
-        ret = epoll_wait(com->ep, wait_event, com->n_inst + 2, -1);
+        ret = epoll_wait(com->ep, wait_event, SS_EPOLL_BATCH, -1);
         if (ret < 0) {
             printf("epoll_wait return %d, exit.\n", ret);
         } else if (ret == 0) {
@@ -148,8 +349,17 @@ static void *ss_epoll_loop(void *arg)
         }
         else {
             for(i = 0; i < ret; i++) {
+                inst = (ss_com_inst_t *)(wait_event[i].data.ptr);
+                if (inst->dial_end) {
+                    ss_inst_dialed(inst);
+                    continue;
+                }
+                /* before the read, which may close inst */
+                if (wait_event[i].events & EPOLLOUT) {
+                    ss_inst_writable(inst);
+                }
                 if (wait_event[i].events & EPOLLIN) {
-                    ss_inst_proc(wait_event[i].data.ptr);
+                    ss_inst_proc(inst);
                 }
             }
         }
@@ -162,7 +372,7 @@ static void *ss_epoll_loop(void *arg)
 
 int ss_com_init_timer(ss_com_t *com, int usec)
 {
-    int i, ret;
+    int ret;
     ss_com_inst_t *timer_inst;
     struct epoll_event event;
     struct itimerspec its;
@@ -171,13 +381,8 @@ int ss_com_init_timer(ss_com_t *com, int usec)
     its.it_interval.tv_sec = usec / 1000000;
     its.it_interval.tv_nsec = (usec % 1000000) * 1000;
 
-    for (i = 0; i < SS_MAX_CLIINST; i++) {
-        timer_inst = &(com->inst_list[i]);
-        if (timer_inst->type == SS_NODE_NONE) {
-            break;
-        }
-    }
-    if (i == SS_MAX_CLIINST) {
+    timer_inst = ss_get_free_inst(com);
+    if (timer_inst == NULL) {
         printf("no enough free com instance.\n");
         return -1;
     }
@@ -209,7 +414,134 @@ int ss_com_init_timer(ss_com_t *com, int usec)
     return 0;
 }
 
-int ss_com_init(ss_com_t *com, ss_nodetype_e type, char *ip, uint16_t port, ss_com_cb cb, int max_recv_len, void *param)
+int ss_com_init_event(ss_com_t *com)
+{
+    int ret;
+    ss_com_inst_t *event_inst;
+    struct epoll_event event;
+
+    event_inst = ss_get_free_inst(com);
+    if (event_inst == NULL) {
+        printf("no enough free com instance.\n");
+        return -1;
+    }
+
+    event_inst->type = SS_NODE_EVENT;
+    event_inst->com = com;
+    event_inst->fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (event_inst->fd < 0) {
+        printf("eventfd create faild.\n");
+        return -1;
+    }
+
+    memset(&event, 0, sizeof(struct epoll_event));
+    event.events = EPOLLIN;
+    event.data.ptr = event_inst;
+    ret = epoll_ctl(com->ep, EPOLL_CTL_ADD, event_inst->fd, &event);
+    if (ret < 0) {
+        printf("eventfd add into epoll faild.\n");
+        return -1;
+    }
+
+    com->event_inst = event_inst;
+
+    return 0;
+}
+
+/* may be called from any thread, the epoll thread gets SS_CBTYPE_EVENT */
+int ss_com_notify(ss_com_t *com)
+{
+    uint64_t one = 1;
+
+    if (com->event_inst == NULL) {
+        return -1;
+    }
+
+    if (write(com->event_inst->fd, &one, sizeof(one)) != sizeof(one)) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * same-host peers
+ *
+ * a srv of SS_COM_LOCAL also listens on an abstract unix socket named
+ * after its port, and a cli of SS_COM_LOCAL dialing a loopback address
+ * tries that first. nothing is left on the fs, another network namespace
+ * does not see it and goes over tcp. on a local connection frames are not
+ * compressed, and the file of a FILE_RES is handed over as an fd with
+ * SCM_RIGHTS instead of being streamed through the socket.
+ */
+static int ss_sock_local(uint16_t port, int srv)
+{
+    struct sockaddr_un un;
+    socklen_t len;
+    int fd, ret;
+
+    memset(&un, 0, sizeof(un));
+    un.sun_family = AF_UNIX;
+    len = offsetof(struct sockaddr_un, sun_path) + 1 +
+          snprintf(un.sun_path + 1, sizeof(un.sun_path) - 1, SS_LOCAL_NAME, port);
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+
+    if (srv) {
+        ret = bind(fd, (struct sockaddr *)&un, len);
+        if (ret == 0) {
+            ret = listen(fd, SOMAXCONN);
+        }
+    } else {
+        ret = connect(fd, (struct sockaddr *)&un, len);
+    }
+    if (ret < 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/* srv: the local socket goes on the epoll as a second listening instance */
+static void ss_com_listen_local(ss_com_t *com, uint16_t port)
+{
+    ss_com_inst_t *inst;
+    struct epoll_event event;
+
+    inst = ss_get_free_inst(com);
+    if (inst == NULL) {
+        return;
+    }
+    inst->com = com;
+    inst->type = SS_NODE_SRV;
+    inst->local = 1;
+    inst->fd = ss_sock_local(port, 1);
+    if (inst->fd < 0) {
+        printf("local socket of port %d faild, same-host peers use tcp.\n", port);
+        ss_put_free_inst(com, inst);
+        return;
+    }
+
+    memset(&event, 0, sizeof(struct epoll_event));
+    event.events = EPOLLIN;
+    event.data.ptr = inst;
+    if (epoll_ctl(com->ep, EPOLL_CTL_ADD, inst->fd, &event) < 0) {
+        printf("[%d] epoll add faild.\n", inst->id);
+        close(inst->fd);
+        ss_put_free_inst(com, inst);
+    }
+}
+
+static int ss_addr_loopback(struct sockaddr_in *addr)
+{
+    return (ntohl(addr->sin_addr.s_addr) >> 24) == 127;
+}
+
+int ss_com_init(ss_com_t *com, ss_nodetype_e type, char *ip, uint16_t port, ss_com_cb cb, int max_recv_len, void *param, int flags)
 {
     int ret;
     struct epoll_event event;
@@ -221,6 +553,8 @@ int ss_com_init(ss_com_t *com, ss_nodetype_e type, char *ip, uint16_t port, ss_c
 
     com->param = param;
     com->type = type;
+    com->flags = flags;
+    com->rx_fd = -1;
     com->cb = cb;
     com->max_recv_len = max_recv_len;
     com->recv_buf = malloc(max_recv_len);
@@ -231,37 +565,68 @@ int ss_com_init(ss_com_t *com, ss_nodetype_e type, char *ip, uint16_t port, ss_c
         return -1;
     }
 
-    inst = &(com->inst_list[0]);
+    inst = ss_get_free_inst(com);
+    if (inst == NULL) {
+        printf("no enough free com instance.\n");
+        return -1;
+    }
     inst->com = com;
     inst->type = type;
+    com->main_inst = inst;
     sock = &(inst->fd);
     addr = &(inst->addr);
 
-    *sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (*sock < 0) {
-        printf("sock open faild.\n");
-        return -1;
-    }
-
     memset(addr, 0, sizeof(struct sockaddr_in));
     addr->sin_family = AF_INET;
     addr->sin_port = htons(port);
     inet_pton(AF_INET, ip, &(addr->sin_addr));
 
+    *sock = -1;
+    if ((type == SS_NODE_CLI) && (flags & SS_COM_LOCAL) && ss_addr_loopback(addr)) {
+        *sock = ss_sock_local(port, 0);
+        inst->local = (*sock >= 0);
+        if (inst->local) {
+            printf("server on this host, over the local socket.\n");
+        }
+    }
+    if (*sock < 0) {
+        *sock = socket(AF_INET, SOCK_STREAM, 0);
+    }
+    if (*sock < 0) {
+        printf("sock open faild.\n");
+        return -1;
+    }
+
     if (type == SS_NODE_SRV) {
+        /* restart right away, do not wait for TIME_WAIT of the old connections */
+        ret = 1;
+        setsockopt(*sock, SOL_SOCKET, SO_REUSEADDR, &ret, sizeof(ret));
+
         ret = bind(*sock, (struct sockaddr *)addr, sizeof(struct sockaddr));
         if (ret < 0) {
             printf("sock bind faild.\n");
             return -1;
         }
 
-        ret = listen(*sock, 10);
+        ret = listen(*sock, SOMAXCONN);
         if (ret < 0) {
             printf("sock listen faild.\n");
             return -1;
         }
+
+        /* port 0, pick up the one the kernel chose */
+        if (port == 0) {
+            socklen_t addrlen = sizeof(struct sockaddr_in);
+            getsockname(*sock, (struct sockaddr *)addr, &addrlen);
+        }
+
+        if (flags & SS_COM_LOCAL) {
+            ss_com_listen_local(com, ntohs(addr->sin_port));
+        }
     } else {
-        ret = connect(*sock, (struct sockaddr *)addr, sizeof(struct sockaddr));
+        memcpy(&(com->srv_addr), addr, sizeof(struct sockaddr_in));
+
+        ret = inst->local ? 0 : connect(*sock, (struct sockaddr *)addr, sizeof(struct sockaddr));
         if (ret < 0) {
             printf("connect to server faild.\n");
             return -1;
@@ -280,7 +645,9 @@ int ss_com_init(ss_com_t *com, ss_nodetype_e type, char *ip, uint16_t port, ss_c
         printf("[%d] epoll add faild.\n", 0);
         return -1;
     }
-    com->n_inst = 1;
+    if (type == SS_NODE_CLI) {
+        ss_cli_link(com, inst);
+    }
     com->loop = 1;
 
     pthread_create(&(com->epoll_thread), NULL, ss_epoll_loop, com);
@@ -288,17 +655,306 @@ int ss_com_init(ss_com_t *com, ss_nodetype_e type, char *ip, uint16_t port, ss_c
     return 0;
 }
 
-int ss_com_send(ss_com_inst_t *inst, void *buf, uint32_t len)
+/* a new instance with a socket towards addr, local: the local socket of a loopback addr is tried first */
+static ss_com_inst_t *ss_inst_open(ss_com_t *com, struct sockaddr_in *addr, int local)
+{
+    ss_com_inst_t *inst;
+
+    inst = ss_get_free_inst(com);
+    if (inst == NULL) {
+        printf("no enough free com instance.\n");
+        return NULL;
+    }
+
+    inst->com = com;
+    inst->type = SS_NODE_CLI;
+    memcpy(&(inst->addr), addr, sizeof(struct sockaddr_in));
+
+    if (local && ss_addr_loopback(addr)) {
+        inst->fd = ss_sock_local(ntohs(addr->sin_port), 0);
+        inst->local = (inst->fd >= 0);
+    } else {
+        inst->fd = -1;
+    }
+    if (inst->fd < 0) {
+        inst->fd = socket(AF_INET, SOCK_STREAM, 0);
+    }
+    if (inst->fd < 0) {
+        printf("sock open faild.\n");
+        ss_put_free_inst(com, inst);
+        return NULL;
+    }
+
+    return inst;
+}
+
+/*
+ * epoll thread: an outgoing connection that does not wait for the connect.
+ * the instance is returned right away, SS_CBTYPE_CONNECT comes once it is
+ * up, SS_CBTYPE_CLOSE if it fails or is not up within tmo s. nothing may
+ * be sent on it before.
+ */
+ss_com_inst_t *ss_com_dial(ss_com_t *com, struct sockaddr_in *addr, int tmo, int local)
+{
+    ss_com_inst_t *inst;
+    struct epoll_event event;
+    int ret = 0;
+
+    inst = ss_inst_open(com, addr, local);
+    if (inst == NULL) {
+        return NULL;
+    }
+
+    /* the local socket is connected already, it is reported the same way */
+    if (!inst->local) {
+        fcntl(inst->fd, F_SETFL, fcntl(inst->fd, F_GETFL) | O_NONBLOCK);
+        ret = connect(inst->fd, (struct sockaddr *)addr, sizeof(struct sockaddr));
+        if ((ret < 0) && (errno == EINPROGRESS)) {
+            ret = 0;
+        }
+    }
+    if (ret < 0) {
+        printf("connect to %s:%d faild.\n", inet_ntoa(addr->sin_addr), ntohs(addr->sin_port));
+        close(inst->fd);
+        ss_put_free_inst(com, inst);
+        return NULL;
+    }
+
+    inst->dial_end = time(NULL) + tmo;
+
+    memset(&event, 0, sizeof(struct epoll_event));
+    event.events = EPOLLOUT;
+    event.data.ptr = inst;
+    ret = epoll_ctl(com->ep, EPOLL_CTL_ADD, inst->fd, &event);
+    if (ret < 0) {
+        printf("[%d] epoll add faild.\n", inst->id);
+        close(inst->fd);
+        ss_put_free_inst(com, inst);
+        return NULL;
+    }
+    ss_cli_link(com, inst);
+
+    return inst;
+}
+
+/* a dial of ss_com_dial is writable: connected, or failed */
+static void ss_inst_dialed(ss_com_inst_t *inst)
+{
+    ss_com_t *com = inst->com;
+    struct epoll_event event;
+    socklen_t len = sizeof(int);
+    int err = 0;
+
+    if (getsockopt(inst->fd, SOL_SOCKET, SO_ERROR, &err, &len) || err) {
+        printf("connect to %s:%d faild.\n", inet_ntoa(inst->addr.sin_addr), ntohs(inst->addr.sin_port));
+        ss_cli_inst_close(com, inst);
+        return;
+    }
+
+    /* the sends and receives of an instance block, as on any other */
+    fcntl(inst->fd, F_SETFL, fcntl(inst->fd, F_GETFL) & ~O_NONBLOCK);
+
+    memset(&event, 0, sizeof(struct epoll_event));
+    event.events = EPOLLIN;
+    event.data.ptr = inst;
+    if (epoll_ctl(com->ep, EPOLL_CTL_MOD, inst->fd, &event) < 0) {
+        printf("[%d] epoll mod faild.\n", inst->id);
+        ss_cli_inst_close(com, inst);
+        return;
+    }
+    inst->dial_end = 0;
+
+    if (com->cb) {
+        com->cb(inst, SS_CBTYPE_CONNECT, NULL, NULL);
+    }
+}
+
+/* on each tick, dials that are not up in time are given up */
+static void ss_inst_dial_expire(ss_com_t *com)
+{
+    ss_com_inst_t *inst, *next;
+    time_t now = time(NULL);
+
+    for (inst = com->cli_list; inst; inst = next) {
+        next = inst->next;
+        if (inst->dial_end && (now >= inst->dial_end)) {
+            printf("connect to %s:%d timed out.\n", inet_ntoa(inst->addr.sin_addr), ntohs(inst->addr.sin_port));
+            ss_cli_inst_close(com, inst);
+        }
+    }
+}
+
+/*
+ * cli, epoll thread: the main connection was closed, dial the srv again.
+ * the dial is main_inst from now on, SS_CBTYPE_CONNECT is called for it
+ * once it is up, as it was for the first one, SS_CBTYPE_CLOSE if it fails.
+ */
+int ss_com_reconnect(ss_com_t *com)
+{
+    ss_com_inst_t *inst;
+
+    inst = ss_com_dial(com, &(com->srv_addr), SS_CONNECT_TIMEOUT, com->flags & SS_COM_LOCAL);
+    if (inst == NULL) {
+        return -1;
+    }
+    com->main_inst = inst;
+
+    return 0;
+}
+
+/*
+ * pass_fd >= 0 goes along with the first byte, over a unix socket.
+ * returns the bytes sent, with MSG_DONTWAIT in flags it stops once the
+ * socket is full. -1 on an error.
+ */
+static ssize_t ss_inst_sendv(int fd, struct iovec *iov, int n_iov, int pass_fd, int flags)
+{
+    char ctl[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr *cmsg;
+    struct msghdr msg;
+    ssize_t ret, sent = 0;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = n_iov;
+
+    if (pass_fd >= 0) {
+        memset(ctl, 0, sizeof(ctl));
+        msg.msg_control = ctl;
+        msg.msg_controllen = sizeof(ctl);
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &pass_fd, sizeof(int));
+    }
+
+    while (n_iov) {
+        ret = sendmsg(fd, &msg, MSG_NOSIGNAL | flags);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if ((flags & MSG_DONTWAIT) && ((errno == EAGAIN) || (errno == EWOULDBLOCK))) {
+                break;
+            }
+            return -1;
+        }
+        sent += ret;
+
+        /* partial send, skip what went out */
+        while (n_iov && (ret >= (ssize_t)iov->iov_len)) {
+            ret -= iov->iov_len;
+            iov++;
+            n_iov--;
+        }
+        if (n_iov) {
+            iov->iov_base = (char *)iov->iov_base + ret;
+            iov->iov_len -= ret;
+        }
+        msg.msg_iov = iov;
+        msg.msg_iovlen = n_iov;
+        msg.msg_control = NULL;
+        msg.msg_controllen = 0;
+    }
+
+    return sent;
+}
+
+/* head and body go out in one syscall, and never interleave with another frame */
+int ss_com_send_frame(ss_com_inst_t *inst, void *head, uint32_t hlen, void *body, uint32_t len)
+{
+    return ss_com_send_fd(inst, head, hlen, body, len, -1);
+}
+
+/* as ss_com_send_frame, a local inst passes fd along with the frame, the receiver gets it in com->rx_fd */
+int ss_com_send_fd(ss_com_inst_t *inst, void *head, uint32_t hlen, void *body, uint32_t len, int fd)
 {
+    struct iovec iov[2];
     int ret;
+
     if (inst->type != SS_NODE_CLI) {
         printf("com send err, invalid type: %d\n", inst->type);
         return -1;
     }
 
-    ret = send(inst->fd, buf, len, 0);
+    iov[0].iov_base = head;
+    iov[0].iov_len = hlen;
+    iov[1].iov_base = body;
+    iov[1].iov_len = len;
 
-    SS_ASSERT(ret == len);
+    pthread_mutex_lock(&(inst->send_lock));
+    ret = (ss_inst_sendv(inst->fd, iov, len ? 2 : 1, inst->local ? fd : -1, 0) < 0) ? -1 : 0;
+    pthread_mutex_unlock(&(inst->send_lock));
 
-    return 0;
+    if (ret) {
+        printf("[%d] com send faild.\n", inst->id);
+    }
+
+    return ret;
+}
+
+int ss_com_send(ss_com_inst_t *inst, void *buf, uint32_t len)
+{
+    return ss_com_send_frame(inst, buf, len, NULL, 0);
+}
+
+/*
+ * as ss_com_send_fd, but the peer is not waited for: what the socket takes
+ * now goes out. returns the bytes sent, 0: none, the socket is full, -1 on
+ * an error. the caller keeps the rest, ss_com_watch_send tells when to go
+ * on with it. fd goes along with the first byte, it did not if 0 is returned.
+ */
+ssize_t ss_com_send_some(ss_com_inst_t *inst, void *head, uint32_t hlen, void *body, uint32_t len, int fd)
+{
+    struct iovec iov[2];
+    ssize_t ret;
+
+    if (inst->type != SS_NODE_CLI) {
+        printf("com send err, invalid type: %d\n", inst->type);
+        return -1;
+    }
+
+    iov[0].iov_base = head;
+    iov[0].iov_len = hlen;
+    iov[1].iov_base = body;
+    iov[1].iov_len = len;
+
+    pthread_mutex_lock(&(inst->send_lock));
+    ret = ss_inst_sendv(inst->fd, iov, len ? 2 : 1, inst->local ? fd : -1, MSG_DONTWAIT);
+    pthread_mutex_unlock(&(inst->send_lock));
+
+    if (ret < 0) {
+        printf("[%d] com send faild.\n", inst->id);
+    }
+
+    return ret;
+}
+
+/* any thread: SS_CBTYPE_WRITABLE once the socket of inst takes data again, once */
+int ss_com_watch_send(ss_com_inst_t *inst)
+{
+    struct epoll_event event;
+
+    memset(&event, 0, sizeof(struct epoll_event));
+    event.events = EPOLLIN | EPOLLOUT;
+    event.data.ptr = inst;
+
+    return epoll_ctl(inst->com->ep, EPOLL_CTL_MOD, inst->fd, &event);
+}
+
+/* epoll thread, the socket of a watched inst has room: back to EPOLLIN alone */
+static void ss_inst_writable(ss_com_inst_t *inst)
+{
+    ss_com_t *com = inst->com;
+    struct epoll_event event;
+
+    memset(&event, 0, sizeof(struct epoll_event));
+    event.events = EPOLLIN;
+    event.data.ptr = inst;
+    epoll_ctl(com->ep, EPOLL_CTL_MOD, inst->fd, &event);
+
+    if (com->cb) {
+        com->cb(inst, SS_CBTYPE_WRITABLE, NULL, NULL);
+    }
 }
@@ -0,0 +1,1112 @@
+#define _GNU_SOURCE
+#include "pub.h"
+#include <errno.h>
+
+/*
+ * srv transmit engine
+ *
+ * FILE_REQ no longer gets answered inside the epoll thread. each client has
+ * queues of jobs, clients with work sit on a run queue, and a pool of tx
+ * workers takes one client at a time and sends one frame of it, so clients
+ * are served round robin. the socket is never waited for: what a full one
+ * does not take is kept in out, and the client is parked off the run queue
+ * until epoll finds it writable, so a slow client does not hold up the
+ * others. the epoll thread does not send to clients either, digests and
+ * swarm chunks are queued here with ss_tx_msg.
+ *
+ * the jobs of one client are multiplexed: each active job is a stream with
+ * its own sid, and the streams take turns frame by frame. single frame jobs
+ * are always let in and go first, multi frame ones are limited to
+ * SS_TX_BULK_STREAMS at a time, so a small file never waits behind a huge
+ * one of the same client, and of the bulk jobs waiting the smallest is let
+ * in first. between clients it is the run queue that keeps small files
+ * moving: a client whose receiver stalls is parked, not sent to, so the
+ * workers go on with the others. bench/stall.sh checks that. a file,
+ * or the byte range of one a FILE_RREQ asks for, is read frame by frame
+ * instead of whole into memory, and the next frame of a stream gets a
+ * readahead hint while the others send. of a sparse file only the data
+ * extents SEEK_DATA / SEEK_HOLE find are read and sent, to clients of
+ * SS_VER_SPARSE. a client on the local socket gets the open fd of a file
+ * in place of its data, in a single frame.
+ *
+ * a FILE_BREQ becomes one job too, its files are read and packed into a
+ * single FILE_BRES frame when its turn comes. a file that no longer fits
+ * is marked DEFER in the bundle and queued as a FILE_RES of its own. the
+ * chunk map of a FILE_CREQ is built the same way, the file is read here.
+ *
+ * with -z frames are LZ compressed here too, off the epoll thread, for
+ * clients that sent ver >= SS_VER_LZ, but not on the local socket. known
+ * compressed formats are skipped by extension, and the first frame of a
+ * stream is sampled: a stream that does not shrink by 1/8 goes out plain.
+ */
+
+#define SS_LZ_SAMPLE                (64 * 1024)
+#define SS_LZ_MAXMISS               2           /* frames that did not shrink before a stream gives up */
+
+static const char *g_lz_skip_ext[] = {
+    "gz", "tgz", "bz2", "xz", "zst", "lz4", "lzma", "zip", "7z", "rar", "jar", "apk",
+    "jpg", "jpeg", "png", "gif", "webp", "heic", "mp3", "aac", "ogg", "flac",
+    "mp4", "mkv", "avi", "mov", "webm", "pdf", "docx", "xlsx", "pptx", NULL,
+};
+
+typedef struct {
+    int                 valid;
+    time_t              mtime;
+    uint32_t            mtime_ns;
+    uint64_t            size;               /* in the dm */
+    char                name[SS_MAXPATH_LEN];
+} ss_txbent_t;
+
+typedef struct _ss_txjob {
+    struct _ss_txjob    *next;
+    ss_msgtype_e        type;
+    int                 valid;              /* FILE_RES, FILE_CRES, SWARM_MAP: name is in the dm */
+    time_t              mtime;              /* FILE_RES, FILE_CRES, SWARM_MAP: relay serves the upstream time stamp */
+    uint64_t            size;               /* FILE_RES, FILE_CRES, SWARM_MAP: size in the dm, FILE_RRES: range len */
+    uint64_t            roff;               /* FILE_RRES: range offset */
+    uint32_t            token;              /* FILE_RRES, FILE_BRES */
+    void                *buf;               /* prebuilt message */
+    uint32_t            len;
+    ss_txbent_t         *bent;              /* FILE_BRES: the files asked for */
+    uint32_t            n_bent;
+    uint32_t            skip;               /* bulk: times a smaller job was let in ahead of it */
+
+    /* stream state, worker only */
+    uint32_t            sid;
+    int                 fd;
+    uint32_t            subh_len;
+    uint64_t            total, off;         /* message bytes, bytes sent */
+    int                 lz, lz_miss;
+    int                 pass;               /* FILE_RES: the fd goes to a local cli instead of the data */
+    ss_extent_t         *ext;               /* FILE_RES of a sparse file */
+    uint32_t            n_ext, i_ext;
+    uint64_t            ext_got;
+    char                name[SS_MAXPATH_LEN];
+} ss_txjob_t;
+
+typedef struct _ss_tx {
+    pthread_mutex_t     lock;
+    pthread_cond_t      cond;               /* run queue not empty */
+    pthread_cond_t      idle_cond;          /* a worker dropped a client */
+    ss_srvcli_t         *run_head, *run_tail;
+    pthread_t           worker[SS_TX_WORKERS];
+    ss_ctx_t            *ctx;
+} ss_tx_t;
+
+static ss_txjob_t *ss_txjob_alloc(ss_msgtype_e type)
+{
+    ss_txjob_t *job;
+
+    job = (ss_txjob_t *)ss_pool_zget(sizeof(ss_txjob_t));
+    job->type = type;
+    job->fd = -1;
+
+    return job;
+}
+
+static void ss_txjob_free(ss_txjob_t *job)
+{
+    if (job->fd >= 0) {
+        close(job->fd);
+    }
+    ss_pool_put(job->buf);
+    ss_pool_put(job->bent);
+    ss_pool_put(job->ext);
+    ss_pool_put(job);
+}
+
+/* jobs that stream a file */
+static int ss_txjob_file(ss_txjob_t *job)
+{
+    return (job->type == SS_MSGTYPE_FILE_RES) || (job->type == SS_MSGTYPE_FILE_RRES);
+}
+
+static int ss_txjob_bulk(ss_txjob_t *job)
+{
+    if (ss_txjob_file(job)) {
+        return (sizeof(ss_fileres_t) + SS_MAXPATH_LEN + job->size) > SS_FRAME_MAXLEN;
+    }
+    if (job->type == SS_MSGTYPE_FILE_CRES) {
+        /* not built yet, as many chunks as the file can have */
+        return (sizeof(ss_filecres_t) + SS_MAXPATH_LEN +
+                (job->size / SS_CDC_MINCHUNK + 1) * sizeof(ss_cdcent_t)) > SS_FRAME_MAXLEN;
+    }
+    if (job->type == SS_MSGTYPE_SWARM_MAP) {
+        /* not built yet either */
+        return (sizeof(ss_swarmmap_t) + SS_MAXPATH_LEN +
+                (job->size / SS_SWARM_CHUNK + 1) * sizeof(uint64_t)) > SS_FRAME_MAXLEN;
+    }
+
+    return job->len > SS_FRAME_MAXLEN;
+}
+
+/* what a job is to send, as far as it is known before it starts */
+static uint64_t ss_txjob_bytes(ss_txjob_t *job)
+{
+    if (ss_txjob_file(job) || (job->type == SS_MSGTYPE_FILE_CRES)) {
+        return job->size;
+    }
+
+    return job->len;
+}
+
+static void ss_txjob_push(ss_txjob_t **head, ss_txjob_t **tail, ss_txjob_t *job)
+{
+    job->next = NULL;
+    if (*tail) {
+        (*tail)->next = job;
+    } else {
+        *head = job;
+    }
+    *tail = job;
+}
+
+static ss_txjob_t *ss_txjob_pop(ss_txjob_t **head, ss_txjob_t **tail)
+{
+    ss_txjob_t *job = *head;
+
+    if (job) {
+        *head = job->next;
+        if (*head == NULL) {
+            *tail = NULL;
+        }
+        job->next = NULL;
+    }
+
+    return job;
+}
+
+/* tx lock held */
+static void ss_tx_runq_push(ss_tx_t *tx, ss_srvcli_t *sc)
+{
+    sc->run_next = NULL;
+    if (tx->run_tail) {
+        tx->run_tail->run_next = sc;
+    } else {
+        tx->run_head = sc;
+    }
+    tx->run_tail = sc;
+    sc->queued = 1;
+
+    pthread_cond_signal(&(tx->cond));
+}
+
+/* tx lock held */
+static ss_srvcli_t *ss_tx_runq_pop(ss_tx_t *tx)
+{
+    ss_srvcli_t *sc = tx->run_head;
+
+    if (sc) {
+        tx->run_head = sc->run_next;
+        if (tx->run_head == NULL) {
+            tx->run_tail = NULL;
+        }
+        sc->run_next = NULL;
+        sc->queued = 0;
+    }
+
+    return sc;
+}
+
+static void ss_tx_enqueue(ss_com_inst_t *inst, ss_txjob_t *job)
+{
+    ss_ctx_t *ctx = (ss_ctx_t *)inst->com->param;
+    ss_tx_t *tx = ctx->u.srv.tx;
+    ss_srvcli_t *sc = (ss_srvcli_t *)inst->payload;
+
+    pthread_mutex_lock(&(tx->lock));
+    if (ss_txjob_bulk(job)) {
+        ss_txjob_push(&(sc->bulk_head), &(sc->bulk_tail), job);
+    } else {
+        ss_txjob_push(&(sc->job_head), &(sc->job_tail), job);
+    }
+    sc->n_job++;
+
+    if (!sc->queued && !sc->busy && !sc->parked) {
+        ss_tx_runq_push(tx, sc);
+    }
+    pthread_mutex_unlock(&(tx->lock));
+}
+
+/* sid 0 is for messages that are not multiplexed */
+static uint32_t ss_tx_sid(ss_srvcli_t *sc)
+{
+    if (++(sc->next_sid) == 0) {
+        sc->next_sid = 1;
+    }
+
+    return sc->next_sid;
+}
+
+/*
+ * tx lock held, the next bulk job to start: the smallest one waiting, so a
+ * file of a few MB is not queued behind ones of GB. the head of the queue
+ * is taken once SS_TX_SJF_AGE smaller jobs went ahead of it, a large file
+ * still gets its turn while small ones keep coming.
+ */
+static ss_txjob_t *ss_tx_bulk_pick(ss_srvcli_t *sc)
+{
+    ss_txjob_t *job, *prev, *min = sc->bulk_head, *min_prev = NULL;
+
+    if (min->skip < SS_TX_SJF_AGE) {
+        for (prev = min, job = min->next; job; prev = job, job = job->next) {
+            if (ss_txjob_bytes(job) < ss_txjob_bytes(min)) {
+                min = job;
+                min_prev = prev;
+            }
+        }
+    }
+
+    if (min == sc->bulk_head) {
+        return ss_txjob_pop(&(sc->bulk_head), &(sc->bulk_tail));
+    }
+
+    sc->bulk_head->skip++;
+    min_prev->next = min->next;
+    if (sc->bulk_tail == min) {
+        sc->bulk_tail = min_prev;
+    }
+    min->next = NULL;
+
+    return min;
+}
+
+/*
+ * tx lock held, move waiting jobs to the active streams. single frame jobs
+ * go in front, they are done after one turn. this orders the streams of sc
+ * only, a parked sc is not taken off the run queue until it is writable.
+ */
+static void ss_tx_admit(ss_srvcli_t *sc)
+{
+    ss_txjob_t *job;
+
+    while ((sc->n_act < SS_TX_MAX_STREAMS) && sc->job_head) {
+        job = ss_txjob_pop(&(sc->job_head), &(sc->job_tail));
+        job->sid = ss_tx_sid(sc);
+        job->next = sc->act_head;
+        sc->act_head = job;
+        if (sc->act_tail == NULL) {
+            sc->act_tail = job;
+        }
+        sc->n_act++;
+        sc->n_job--;
+    }
+
+    while ((sc->n_act < SS_TX_MAX_STREAMS) && (sc->n_act_bulk < SS_TX_BULK_STREAMS) && sc->bulk_head) {
+        job = ss_tx_bulk_pick(sc);
+        job->sid = ss_tx_sid(sc);
+        ss_txjob_push(&(sc->act_head), &(sc->act_tail), job);
+        sc->n_act++;
+        sc->n_act_bulk++;
+        sc->n_job--;
+    }
+}
+
+/* the data extents of a file with holes, returns the data bytes or -1 to send it whole */
+static int64_t ss_tx_file_extents(ss_txjob_t *job, struct stat *st)
+{
+    uint64_t sum = 0;
+    off_t data, hole = 0;
+
+    if (((uint64_t)st->st_blocks * 512 >= (uint64_t)st->st_size) || (st->st_size == 0)) {
+        return -1;
+    }
+
+    job->ext = (ss_extent_t *)ss_pool_get(SS_SPARSE_MAXEXT * sizeof(ss_extent_t));
+
+    while (hole < st->st_size) {
+        data = lseek(job->fd, hole, SEEK_DATA);
+        if (data < 0) {
+            if (errno == ENXIO) {
+                /* a hole up to the end */
+                break;
+            }
+            ss_pool_put(job->ext);
+            job->ext = NULL;
+            job->n_ext = 0;
+            return -1;
+        }
+        hole = lseek(job->fd, data, SEEK_HOLE);
+        if ((hole < 0) || (hole > st->st_size) || (job->n_ext == SS_SPARSE_MAXEXT - 1)) {
+            hole = st->st_size;
+        }
+
+        job->ext[job->n_ext].off = data;
+        job->ext[job->n_ext].len = hole - data;
+        job->n_ext++;
+        sum += hole - data;
+    }
+
+    return sum;
+}
+
+/* read the next bytes of a FILE_RES, only the data extents of a sparse one */
+static ssize_t ss_tx_file_read(ss_txjob_t *job, char *buf, uint32_t len)
+{
+    ss_extent_t *ext;
+    ssize_t ret;
+
+    if (job->fd < 0) {
+        return 0;
+    }
+    if (job->ext == NULL) {
+        return read(job->fd, buf, len);
+    }
+
+    while ((job->i_ext < job->n_ext) && (job->ext_got == job->ext[job->i_ext].len)) {
+        job->i_ext++;
+        job->ext_got = 0;
+    }
+    if (job->i_ext == job->n_ext) {
+        return 0;
+    }
+
+    ext = &(job->ext[job->i_ext]);
+    if (len > ext->len - job->ext_got) {
+        len = ext->len - job->ext_got;
+    }
+    ret = pread(job->fd, buf, len, ext->off + job->ext_got);
+    if (ret > 0) {
+        job->ext_got += ret;
+    }
+
+    return ret;
+}
+
+/*
+ * first frame of a FILE_RES or FILE_RRES stream: open the file and put the
+ * fileres or filerres in front
+ */
+static uint32_t ss_tx_file_open(ss_tx_t *tx, ss_srvcli_t *sc, ss_txjob_t *job, char *frame)
+{
+    ss_ctx_t *ctx = tx->ctx;
+    uint32_t flag = 0;
+    uint64_t sz = 0, len;
+    char pathname[SS_MAXPATH_LEN];
+    ss_fileres_t *fileres;
+    ss_filerres_t *filerres;
+    ss_sparse_t *sparse;
+    struct stat st;
+    int64_t data = -1;
+
+    if (job->type == SS_MSGTYPE_FILE_RRES) {
+        job->subh_len = sizeof(ss_filerres_t) + strlen(job->name) + 1;
+    } else {
+        job->subh_len = sizeof(ss_fileres_t) + strlen(job->name) + 1;
+    }
+    memset(&st, 0, sizeof(st));
+
+    if (job->valid) {
+        flag |= SS_FILERES_VALID;
+
+        if (snprintf(pathname, sizeof(pathname), "%s/%s", ctx->localpath, job->name) >= (int)sizeof(pathname)) {
+            printf("tx: path of %s too long.\n", job->name);
+        } else {
+            job->fd = open(pathname, O_RDONLY);
+        }
+        if ((job->fd >= 0) && (fstat(job->fd, &st) == 0)) {
+            flag |= SS_FILERES_EXIST;
+            sz = st.st_size;
+            posix_fadvise(job->fd, job->roff, 0, POSIX_FADV_SEQUENTIAL);
+        }
+    }
+
+    if (job->type == SS_MSGTYPE_FILE_RRES) {
+        len = (job->roff < sz) ? (sz - job->roff) : 0;
+        len = (job->size < len) ? job->size : len;
+        if (len && (lseek(job->fd, job->roff, SEEK_SET) < 0)) {
+            len = 0;
+        }
+
+        filerres = (ss_filerres_t *)frame;
+        memset(filerres, 0, job->subh_len);
+        filerres->flag = flag;
+        filerres->token = job->token;
+        filerres->off = job->roff;
+        filerres->len = len;
+        filerres->size = sz;
+        filerres->mtime = ctx->relay ? job->mtime : st.st_mtime;
+        strcpy(filerres->name, job->name);
+    } else {
+        len = sz;
+        if ((flag & SS_FILERES_EXIST) && sc->inst->local && (sc->ver >= SS_VER_LOCAL) && (sz >= SS_LOCAL_MINFD)) {
+            /* a cli on this host copies it from the fd itself */
+            flag |= SS_FILERES_FD;
+            job->pass = 1;
+        } else if ((flag & SS_FILERES_EXIST) && (sc->ver >= SS_VER_SPARSE)) {
+            data = ss_tx_file_extents(job, &st);
+        }
+
+        fileres = (ss_fileres_t *)frame;
+        memset(fileres, 0, job->subh_len);
+        fileres->flag = flag;
+        fileres->len = len;
+        fileres->mtime = ctx->relay ? job->mtime : st.st_mtime;
+        strcpy(fileres->name, job->name);
+
+        if (data >= 0) {
+            fileres->flag |= SS_FILERES_SPARSE;
+            sparse = (ss_sparse_t *)(frame + job->subh_len);
+            memset(sparse, 0, sizeof(ss_sparse_t));
+            sparse->n_ext = job->n_ext;
+            memcpy(sparse->ext, job->ext, job->n_ext * sizeof(ss_extent_t));
+            job->subh_len += sizeof(ss_sparse_t) + job->n_ext * sizeof(ss_extent_t);
+            len = data;
+        }
+        if (job->pass) {
+            len = 0;
+        }
+    }
+
+    job->total = job->subh_len + len;
+
+    return job->subh_len;
+}
+
+/* read one file into a bundle record, returns 0 if it does not fit into room */
+static uint32_t ss_tx_bundle_file(ss_tx_t *tx, ss_txbent_t *be, char *rec, uint32_t room)
+{
+    ss_ctx_t *ctx = tx->ctx;
+    ss_fileres_t *fileres = (ss_fileres_t *)rec;
+    uint32_t subh_len, reclen, n;
+    char pathname[SS_MAXPATH_LEN];
+    struct stat st;
+    ssize_t ret;
+    int fd = -1;
+
+    subh_len = sizeof(ss_fileres_t) + strlen(be->name) + 1;
+    if (SS_BUNDLE_ALIGN(subh_len) > room) {
+        return 0;
+    }
+
+    memset(fileres, 0, subh_len);
+    strcpy(fileres->name, be->name);
+    memset(&st, 0, sizeof(st));
+
+    /* prefetched, or sent to another cli already */
+    reclen = SS_BUNDLE_ALIGN(subh_len + be->size);
+    if (be->valid && (reclen <= room) && (ss_hot_get(ctx, be->name, be->mtime, be->mtime_ns, be->size, rec + subh_len) == 0)) {
+        fileres->flag = SS_FILERES_VALID | SS_FILERES_EXIST;
+        fileres->len = be->size;
+        fileres->mtime = be->mtime;
+        memset(rec + subh_len + be->size, 0, reclen - subh_len - be->size);
+        return reclen;
+    }
+
+    if (be->valid) {
+        fileres->flag |= SS_FILERES_VALID;
+
+        if (snprintf(pathname, sizeof(pathname), "%s/%s", ctx->localpath, be->name) >= (int)sizeof(pathname)) {
+            printf("tx: path of %s too long.\n", be->name);
+        } else {
+            fd = open(pathname, O_RDONLY);
+        }
+        if ((fd >= 0) && (fstat(fd, &st) == 0)) {
+            fileres->flag |= SS_FILERES_EXIST;
+        }
+    }
+
+    if ((uint64_t)SS_BUNDLE_ALIGN(subh_len + st.st_size) > room) {
+        fileres->flag |= SS_FILERES_DEFER;
+        st.st_size = 0;
+    }
+    reclen = SS_BUNDLE_ALIGN(subh_len + st.st_size);
+
+    fileres->len = st.st_size;
+    fileres->mtime = ctx->relay ? be->mtime : st.st_mtime;
+
+    /* a file that shrank meanwhile is padded, the next digest fixes it */
+    for (n = 0; n < st.st_size; n += ret) {
+        ret = read(fd, rec + subh_len + n, st.st_size - n);
+        if (ret <= 0) {
+            memset(rec + subh_len + n, 0, st.st_size - n);
+            break;
+        }
+    }
+    memset(rec + subh_len + st.st_size, 0, reclen - subh_len - st.st_size);
+
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    /* the next cli asking for it is served from memory */
+    if ((n == st.st_size) && st.st_size && (st.st_mtim.tv_sec == be->mtime) &&
+        (st.st_mtim.tv_nsec == be->mtime_ns) && (st.st_size == be->size)) {
+        ss_hot_put(ctx, be->name, be->mtime, be->mtime_ns, be->size, rec + subh_len);
+    }
+
+    return reclen;
+}
+
+/* a bundled file that did not fit, it goes out as a bulk FILE_RES */
+static void ss_tx_defer(ss_srvcli_t *sc, ss_txbent_t *be)
+{
+    ss_txjob_t *job;
+
+    job = ss_txjob_alloc(SS_MSGTYPE_FILE_RES);
+    job->valid = be->valid;
+    job->mtime = be->mtime;
+    job->size = SS_FRAME_MAXLEN;
+    strcpy(job->name, be->name);
+
+    ss_tx_enqueue(sc->inst, job);
+}
+
+/* a SWARM_MAP that could not be built, the file goes out as FILE_RES */
+static void ss_tx_refile(ss_srvcli_t *sc, ss_txjob_t *swarm)
+{
+    ss_txjob_t *job;
+
+    job = ss_txjob_alloc(SS_MSGTYPE_FILE_RES);
+    job->valid = swarm->valid;
+    job->mtime = swarm->mtime;
+    job->size = swarm->size;
+    strcpy(job->name, swarm->name);
+
+    ss_tx_enqueue(sc->inst, job);
+}
+
+/* first frame of a FILE_BRES stream: pack the files */
+static void ss_tx_bundle_build(ss_tx_t *tx, ss_srvcli_t *sc, ss_txjob_t *job)
+{
+    ss_filebres_t *bres;
+    ss_fileres_t *fileres;
+    uint32_t i, off, reclen, reserve;
+    char *buf;
+
+    buf = (char *)ss_pool_get(SS_BUNDLE_BYTES);
+
+    bres = (ss_filebres_t *)buf;
+    memset(bres, 0, sizeof(ss_filebres_t));
+    bres->token = job->token;
+    off = sizeof(ss_filebres_t);
+
+    /* room for the DEFER records of all the names behind is kept back */
+    for (i = 0; i < job->n_bent; i++) {
+        reserve = (job->n_bent - i - 1) * SS_BUNDLE_ALIGN(sizeof(ss_fileres_t) + SS_MAXPATH_LEN);
+        reclen = ss_tx_bundle_file(tx, &(job->bent[i]), buf + off, SS_BUNDLE_BYTES - off - reserve);
+        SS_ASSERT(reclen);
+
+        fileres = (ss_fileres_t *)(buf + off);
+        if (fileres->flag & SS_FILERES_DEFER) {
+            ss_tx_defer(sc, &(job->bent[i]));
+        }
+
+        off += reclen;
+        bres->n_file++;
+    }
+
+    job->buf = buf;
+    job->len = off;
+}
+
+static int ss_tx_lz_skip(char *name)
+{
+    const char **ext;
+    char *p;
+
+    p = strrchr(name, '.');
+    if ((p == NULL) || strchr(p, '/')) {
+        return 0;
+    }
+
+    for (ext = g_lz_skip_ext; *ext; ext++) {
+        if (strcasecmp(p + 1, *ext) == 0) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/* whether a new stream is to be compressed */
+static int ss_tx_lz_start(ss_tx_t *tx, ss_srvcli_t *sc, ss_txjob_t *job)
+{
+    if (!tx->ctx->lz || (sc->ver < SS_VER_LZ) || sc->inst->local) {
+        return 0;
+    }
+
+    switch (job->type) {
+    case SS_MSGTYPE_FILE_RES:
+    case SS_MSGTYPE_FILE_RRES:
+        return !ss_tx_lz_skip(job->name);
+    case SS_MSGTYPE_FILE_BRES:
+    case SS_MSGTYPE_META_RES:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+/* compress one frame into lzbuf, returns the compressed len or 0 to send it plain */
+static uint32_t ss_tx_lz(ss_txjob_t *job, char *body, uint32_t len, char *lzbuf, int first)
+{
+    uint32_t zlen;
+
+    if (first && (len > SS_LZ_SAMPLE) &&
+        (alg_lz_compress(body, SS_LZ_SAMPLE, lzbuf, SS_LZ_SAMPLE - SS_LZ_SAMPLE / 8) == 0)) {
+        job->lz = 0;
+        return 0;
+    }
+
+    zlen = alg_lz_compress(body, len, lzbuf, len - len / 8);
+    if (zlen == 0) {
+        if (++(job->lz_miss) >= SS_LZ_MAXMISS) {
+            job->lz = 0;
+        }
+        return 0;
+    }
+
+    job->lz_miss = 0;
+    return zlen;
+}
+
+static void ss_tx_out_free(ss_srvcli_t *sc)
+{
+    ss_pool_put(sc->out);
+    sc->out = NULL;
+    sc->out_off = sc->out_len = 0;
+    if (sc->out_fd >= 0) {
+        close(sc->out_fd);
+        sc->out_fd = -1;
+    }
+}
+
+/* send a frame, what the socket does not take now waits in sc->out. -1 on an error */
+static int ss_tx_send(ss_srvcli_t *sc, void *head, uint32_t hlen, void *body, uint32_t len, int fd)
+{
+    ssize_t ret;
+
+    ret = ss_com_send_some(sc->inst, head, hlen, body, len, fd);
+    if (ret < 0) {
+        return -1;
+    }
+    if (ret == (ssize_t)hlen + len) {
+        return 0;
+    }
+
+    sc->out_len = hlen + len - ret;
+    sc->out_off = 0;
+    sc->out = (char *)ss_pool_get(sc->out_len);
+    if (ret < hlen) {
+        memcpy(sc->out, (char *)head + ret, hlen - ret);
+        memcpy(sc->out + hlen - ret, body, len);
+    } else {
+        memcpy(sc->out, (char *)body + (ret - hlen), sc->out_len);
+    }
+
+    /* the fd goes along with the first byte, the job may be gone by then */
+    if ((ret == 0) && (fd >= 0) && sc->inst->local) {
+        sc->out_fd = dup(fd);
+    }
+
+    return 0;
+}
+
+/* go on with the rest of a frame, -1 on an error */
+static int ss_tx_flush(ss_srvcli_t *sc)
+{
+    ssize_t ret;
+
+    ret = ss_com_send_some(sc->inst, NULL, 0, sc->out + sc->out_off, sc->out_len - sc->out_off, sc->out_fd);
+    if (ret < 0) {
+        ss_tx_out_free(sc);
+        return -1;
+    }
+    if ((ret > 0) && (sc->out_fd >= 0)) {
+        close(sc->out_fd);
+        sc->out_fd = -1;
+    }
+
+    sc->out_off += ret;
+    if (sc->out_off == sc->out_len) {
+        ss_tx_out_free(sc);
+    }
+
+    return 0;
+}
+
+/* send the next frame of a stream, returns 1 once the stream is done or broken */
+static int ss_tx_frame(ss_tx_t *tx, ss_srvcli_t *sc, ss_txjob_t *job, char *frame, char *lzbuf)
+{
+    uint32_t curlen, off = 0, n, zlen = 0;
+    ss_msghead_t msghead;
+    char *body = frame;
+    ssize_t ret;
+    int first = (job->off == 0);
+
+    if (first) {
+        job->lz = ss_tx_lz_start(tx, sc, job);
+    }
+
+    if (ss_txjob_file(job)) {
+        if (first) {
+            off = ss_tx_file_open(tx, sc, job, frame);
+        }
+    } else {
+        if ((job->type == SS_MSGTYPE_FILE_BRES) && first) {
+            ss_tx_bundle_build(tx, sc, job);
+        }
+        if ((job->type == SS_MSGTYPE_FILE_CRES) && first) {
+            job->buf = ss_cdc_srv_map(tx->ctx, job->name, job->valid, job->mtime, &(job->len));
+        }
+        if ((job->type == SS_MSGTYPE_SWARM_MAP) && first) {
+            job->buf = ss_swarm_srv_map(tx->ctx, job->name, job->mtime, &(job->len));
+            if (job->buf == NULL) {
+                /* gone, or too small for the swarm now: the plain way, nothing goes out here */
+                ss_tx_refile(sc, job);
+                return 1;
+            }
+        }
+        job->total = job->len;
+        body = (char *)(job->buf) + job->off;
+    }
+
+    curlen = (job->total - job->off) < SS_FRAME_MAXLEN ? (job->total - job->off) : SS_FRAME_MAXLEN;
+
+    if (ss_txjob_file(job)) {
+        /* fill the frame, a file that shrank meanwhile is padded, the next digest fixes it */
+        for (n = off; n < curlen; n += ret) {
+            ret = ss_tx_file_read(job, frame + n, curlen - n);
+            if (ret <= 0) {
+                memset(frame + n, 0, curlen - n);
+                break;
+            }
+        }
+    }
+
+    memset(&msghead, 0, sizeof(msghead));
+    msghead.magic = SS_MSGHEAD_MAGIC;
+    msghead.ver = SS_VER;
+    msghead.hlen = sizeof(ss_msghead_t);
+    msghead.type = job->type;
+    msghead.total_len = (uint32_t)(job->total);
+    msghead.sid = job->sid;
+    msghead.sop = first;
+    msghead.len = curlen;
+    job->off += curlen;
+    if (job->off == job->total) {
+        msghead.eop = 1;
+    }
+
+    if (job->lz) {
+        zlen = ss_tx_lz(job, body, curlen, lzbuf, first);
+    }
+    if (zlen) {
+        msghead.lz = 1;
+        msghead.rlen = curlen;
+        msghead.len = zlen;
+        body = lzbuf;
+    }
+
+    if (sc->closing || ss_tx_send(sc, &msghead, msghead.hlen, body, msghead.len, job->pass ? job->fd : -1)) {
+        return 1;
+    }
+
+    if (msghead.eop) {
+        return 1;
+    }
+
+    /* read the next frame of this stream while the others go out */
+    if (job->ext && (job->i_ext < job->n_ext)) {
+        posix_fadvise(job->fd, job->ext[job->i_ext].off + job->ext_got, SS_FRAME_MAXLEN, POSIX_FADV_WILLNEED);
+    } else if (job->fd >= 0) {
+        posix_fadvise(job->fd, job->roff + job->off - job->subh_len, SS_FRAME_MAXLEN, POSIX_FADV_WILLNEED);
+    }
+
+    return 0;
+}
+
+static void *ss_tx_worker(void *arg)
+{
+    ss_tx_t *tx = (ss_tx_t *)arg;
+    ss_srvcli_t *sc;
+    ss_txjob_t *job;
+    char *frame, *lzbuf;
+    int done;
+
+    frame = (char *)malloc(SS_FRAME_MAXLEN);
+    lzbuf = (char *)malloc(SS_FRAME_MAXLEN);
+    SS_ASSERT(frame && lzbuf);
+
+    while (1) {
+        pthread_mutex_lock(&(tx->lock));
+        while ((sc = ss_tx_runq_pop(tx)) == NULL) {
+            pthread_cond_wait(&(tx->cond), &(tx->lock));
+        }
+
+        /* the rest of a frame goes before anything else */
+        job = NULL;
+        done = 0;
+        if (sc->out == NULL) {
+            ss_tx_admit(sc);
+            job = ss_txjob_pop(&(sc->act_head), &(sc->act_tail));
+        }
+        sc->busy = 1;
+        pthread_mutex_unlock(&(tx->lock));
+
+        if (job) {
+            done = ss_tx_frame(tx, sc, job, frame, lzbuf);
+        } else if (!sc->closing) {
+            ss_tx_flush(sc);
+        }
+
+        pthread_mutex_lock(&(tx->lock));
+        if (job && (done || sc->closing)) {
+            sc->n_act--;
+            if (ss_txjob_bulk(job)) {
+                sc->n_act_bulk--;
+            }
+            ss_txjob_free(job);
+        } else if (job) {
+            ss_txjob_push(&(sc->act_head), &(sc->act_tail), job);
+        }
+
+        sc->busy = 0;
+        if (sc->closing) {
+            pthread_cond_broadcast(&(tx->idle_cond));
+        } else if (sc->out) {
+            /* the socket is full, the worker goes on with another client */
+            sc->parked = 1;
+            ss_com_watch_send(sc->inst);
+        } else if (sc->act_head || sc->job_head || sc->bulk_head) {
+            ss_tx_runq_push(tx, sc);
+        }
+        pthread_mutex_unlock(&(tx->lock));
+    }
+
+    return NULL;
+}
+
+int ss_tx_init(ss_ctx_t *ctx)
+{
+    ss_tx_t *tx;
+    int i;
+
+    tx = (ss_tx_t *)calloc(1, sizeof(ss_tx_t));
+    SS_ASSERT(tx);
+
+    pthread_mutex_init(&(tx->lock), NULL);
+    pthread_cond_init(&(tx->cond), NULL);
+    pthread_cond_init(&(tx->idle_cond), NULL);
+    tx->ctx = ctx;
+    ctx->u.srv.tx = tx;
+    ss_cdc_srv_init(ctx);
+    ss_hot_srv_init(ctx);
+
+    for (i = 0; i < SS_TX_WORKERS; i++) {
+        if (pthread_create(&(tx->worker[i]), NULL, ss_tx_worker, tx)) {
+            printf("tx worker create faild.\n");
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* epoll thread, queue the answer of a FILE_REQ */
+void ss_tx_filereq(ss_com_inst_t *inst, char *name)
+{
+    ss_ctx_t *ctx = (ss_ctx_t *)inst->com->param;
+    ss_filemeta_t *fm;
+    ss_txjob_t *job;
+
+    job = ss_txjob_alloc(SS_MSGTYPE_FILE_RES);
+    strcpy(job->name, name);
+
+    /* the dm belongs to the epoll thread, look it up here */
+    fm = ss_dm_find(ctx->dm, name);
+    if (fm) {
+        job->valid = 1;
+        job->mtime = fm->mtime;
+        job->size = fm->size;
+    }
+
+    ss_tx_enqueue(inst, job);
+}
+
+/* epoll thread, queue the answer of a FILE_RREQ */
+void ss_tx_filerreq(ss_com_inst_t *inst, ss_filerreq_t *rreq)
+{
+    ss_ctx_t *ctx = (ss_ctx_t *)inst->com->param;
+    ss_filemeta_t *fm;
+    ss_txjob_t *job;
+
+    job = ss_txjob_alloc(SS_MSGTYPE_FILE_RRES);
+    strcpy(job->name, rreq->name);
+    job->roff = rreq->off;
+    job->size = rreq->len;
+    job->token = rreq->token;
+
+    fm = ss_dm_find(ctx->dm, job->name);
+    if (fm) {
+        job->valid = 1;
+        job->mtime = fm->mtime;
+    }
+
+    ss_tx_enqueue(inst, job);
+}
+
+/* epoll thread, queue the answer of a FILE_CREQ */
+void ss_tx_filecreq(ss_com_inst_t *inst, char *name)
+{
+    ss_ctx_t *ctx = (ss_ctx_t *)inst->com->param;
+    ss_filemeta_t *fm;
+    ss_txjob_t *job;
+
+    job = ss_txjob_alloc(SS_MSGTYPE_FILE_CRES);
+    strcpy(job->name, name);
+
+    fm = ss_dm_find(ctx->dm, name);
+    if (fm) {
+        job->valid = 1;
+        job->mtime = fm->mtime;
+        job->size = fm->size;
+    }
+
+    ss_tx_enqueue(inst, job);
+}
+
+/* epoll thread, queue a SWARM_MAP as the answer of a FILE_REQ, see ss_swarm_srv_filereq */
+void ss_tx_swarmreq(ss_com_inst_t *inst, char *name)
+{
+    ss_ctx_t *ctx = (ss_ctx_t *)inst->com->param;
+    ss_filemeta_t *fm;
+    ss_txjob_t *job;
+
+    job = ss_txjob_alloc(SS_MSGTYPE_SWARM_MAP);
+    strcpy(job->name, name);
+
+    fm = ss_dm_find(ctx->dm, name);
+    if (fm) {
+        job->valid = 1;
+        job->mtime = fm->mtime;
+        job->size = fm->size;
+    }
+
+    ss_tx_enqueue(inst, job);
+}
+
+/* epoll thread, queue the answer of a FILE_BREQ */
+void ss_tx_filebreq(ss_com_inst_t *inst, ss_filebreq_t *breq, uint32_t len)
+{
+    ss_ctx_t *ctx = (ss_ctx_t *)inst->com->param;
+    ss_filemeta_t *fm;
+    ss_txjob_t *job;
+    ss_txbent_t *be;
+    char *name = breq->name, *end = (char *)breq + len;
+    uint32_t i, n;
+
+    n = breq->n_file < SS_BUNDLE_FILES ? breq->n_file : SS_BUNDLE_FILES;
+
+    job = ss_txjob_alloc(SS_MSGTYPE_FILE_BRES);
+    job->token = breq->token;
+    job->bent = (ss_txbent_t *)ss_pool_zget((n + 1) * sizeof(ss_txbent_t));
+
+    for (i = 0; i < n; i++) {
+        if ((name >= end) || (strnlen(name, end - name) >= SS_MAXPATH_LEN) ||
+            (strnlen(name, end - name) == (end - name))) {
+            printf("\tbroken file bundle req, %d of %d names.\n", i, breq->n_file);
+            break;
+        }
+
+        be = &(job->bent[i]);
+        strcpy(be->name, name);
+        name += strlen(name) + 1;
+
+        fm = ss_dm_find(ctx->dm, be->name);
+        if (fm) {
+            be->valid = 1;
+            be->mtime = fm->mtime;
+            be->mtime_ns = fm->mtime_ns;
+            be->size = fm->size;
+        }
+    }
+    job->n_bent = i;
+
+    ss_tx_enqueue(inst, job);
+}
+
+/*
+ * queue a prebuilt message as a stream of its own, so it does not have to
+ * wait for the FILE_RES of this client. buf is freed once sent.
+ */
+void ss_tx_msg(ss_com_inst_t *inst, ss_msgtype_e type, void *buf, uint32_t len)
+{
+    ss_txjob_t *job;
+
+    job = ss_txjob_alloc(type);
+    job->buf = buf;
+    job->len = len;
+
+    ss_tx_enqueue(inst, job);
+}
+
+/* epoll thread, the socket of a parked client takes data again */
+void ss_tx_writable(ss_com_inst_t *inst)
+{
+    ss_ctx_t *ctx = (ss_ctx_t *)inst->com->param;
+    ss_tx_t *tx = ctx->u.srv.tx;
+    ss_srvcli_t *sc = (ss_srvcli_t *)inst->payload;
+
+    if ((tx == NULL) || (sc == NULL)) {
+        return;
+    }
+
+    pthread_mutex_lock(&(tx->lock));
+    if (sc->parked && !sc->closing) {
+        sc->parked = 0;
+        ss_tx_runq_push(tx, sc);
+    }
+    pthread_mutex_unlock(&(tx->lock));
+}
+
+/* epoll thread, client is going away: wait for the worker on it and drop its jobs */
+void ss_tx_close(ss_com_inst_t *inst)
+{
+    ss_ctx_t *ctx = (ss_ctx_t *)inst->com->param;
+    ss_tx_t *tx = ctx->u.srv.tx;
+    ss_srvcli_t *sc = (ss_srvcli_t *)inst->payload, **pp, *prev;
+    ss_txjob_t *job;
+
+    if ((tx == NULL) || (sc == NULL)) {
+        return;
+    }
+
+    pthread_mutex_lock(&(tx->lock));
+    sc->closing = 1;
+
+    if (sc->queued) {
+        prev = NULL;
+        for (pp = &(tx->run_head); *pp; prev = *pp, pp = &((*pp)->run_next)) {
+            if (*pp == sc) {
+                *pp = sc->run_next;
+                if (tx->run_tail == sc) {
+                    tx->run_tail = prev;
+                }
+                break;
+            }
+        }
+        sc->queued = 0;
+    }
+
+    while (sc->busy) {
+        pthread_cond_wait(&(tx->idle_cond), &(tx->lock));
+    }
+
+    while ((job = ss_txjob_pop(&(sc->job_head), &(sc->job_tail)))) {
+        ss_txjob_free(job);
+    }
+    while ((job = ss_txjob_pop(&(sc->bulk_head), &(sc->bulk_tail)))) {
+        ss_txjob_free(job);
+    }
+    while ((job = ss_txjob_pop(&(sc->act_head), &(sc->act_tail)))) {
+        ss_txjob_free(job);
+    }
+    sc->n_job = 0;
+    sc->n_act = 0;
+    sc->n_act_bulk = 0;
+    sc->parked = 0;
+    ss_tx_out_free(sc);
+    pthread_mutex_unlock(&(tx->lock));
+}
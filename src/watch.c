@@ -0,0 +1,223 @@
+#include "pub.h"
+#include <poll.h>
+#include <errno.h>
+#include <sys/inotify.h>
+
+/*
+ * srv change notification
+ *
+ * an inotify watch on each directory of the tree, but the ignored ones.
+ * the first event of a burst starts a debounce window, which is extended
+ * while events keep coming, up to SS_WATCH_MAXDELAY, then the paced scan
+ * thread is woken, when there is one, or else the epoll thread, to rescan
+ * and push the digest if it changed. the periodic scan still runs, it
+ * catches what inotify does not see (writes to files kept open, a tree
+ * over the watch limit).
+ */
+
+#define SS_WATCH_MASK       (IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | \
+                             IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF)
+#define SS_WATCH_MAXDELAY   1000            /* ms, a steady stream of events still gets out */
+
+typedef struct {
+    char                    *path;          /* NULL: slot not in use */
+    ss_filterpos_t          pos;
+} ss_watchdir_t;
+
+typedef struct _ss_watch {
+    ss_ctx_t                *ctx;
+    int                     fd;
+    ss_watchdir_t           *dir;           /* indexed by wd */
+    int                     n_dir;
+    int                     full;           /* the watch limit was hit */
+    int                     changed;        /* a burst was told of, the epoll thread has not rescanned */
+    pthread_t               thread;
+} ss_watch_t;
+
+static uint64_t ss_watch_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* watch path and the directories below it, pos is where the filter stands at path/ */
+static void ss_watch_add(ss_watch_t *w, char *path, ss_filterpos_t *pos)
+{
+    ss_filefilter_t *ff = &(w->ctx->ff);
+    ss_filterpos_t sub;
+    char subpath[SS_MAXPATH_LEN * 2];
+    struct dirent *de;
+    DIR *dr;
+    int wd, n;
+
+    wd = inotify_add_watch(w->fd, path, SS_WATCH_MASK | IN_ONLYDIR);
+    if (wd < 0) {
+        if ((errno == ENOSPC) && !w->full) {
+            printf("watch: inotify limit reached, the rest of the tree is seen by the periodic scan.\n");
+            w->full = 1;
+        }
+        return;
+    }
+
+    if (wd >= w->n_dir) {
+        n = w->n_dir ? w->n_dir : 1024;
+        while (n <= wd) {
+            n *= 2;
+        }
+        w->dir = (ss_watchdir_t *)realloc(w->dir, n * sizeof(ss_watchdir_t));
+        SS_ASSERT(w->dir);
+        memset(w->dir + w->n_dir, 0, (n - w->n_dir) * sizeof(ss_watchdir_t));
+        w->n_dir = n;
+    }
+    if (w->dir[wd].path) {
+        /* watched already, under the same inode */
+        free(w->dir[wd].path);
+    }
+    w->dir[wd].path = strdup(path);
+    w->dir[wd].pos = *pos;
+
+    dr = opendir(path);
+    if (dr == NULL) {
+        return;
+    }
+    while ((de = readdir(dr)) != NULL) {
+        if (!(de->d_type & DT_DIR) ||
+            (strcmp(de->d_name, ".") == 0) || (strcmp(de->d_name, "..") == 0)) {
+            continue;
+        }
+        if (ss_filter_dir(ff, pos, de->d_name, &sub)) {
+            snprintf(subpath, sizeof(subpath), "%s/%s", path, de->d_name);
+            ss_watch_add(w, subpath, &sub);
+        }
+    }
+    closedir(dr);
+}
+
+/* take what is queued on the inotify fd, new directories get watched */
+static int ss_watch_read(ss_watch_t *w)
+{
+    char buf[64 * 1024] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    char subpath[SS_MAXPATH_LEN * 2];
+    struct inotify_event *ev;
+    ss_watchdir_t *d;
+    ss_filterpos_t sub;
+    ssize_t len;
+    char *p;
+
+    len = read(w->fd, buf, sizeof(buf));
+    if (len <= 0) {
+        return (len < 0) && (errno != EINTR) && (errno != EAGAIN) ? -1 : 0;
+    }
+
+    for (p = buf; p < buf + len; p += sizeof(struct inotify_event) + ev->len) {
+        ev = (struct inotify_event *)p;
+        d = ((ev->wd >= 0) && (ev->wd < w->n_dir)) ? &(w->dir[ev->wd]) : NULL;
+
+        if (ev->mask & IN_IGNORED) {
+            /* removed, or moved away and unwatched by the kernel */
+            if (d && d->path) {
+                free(d->path);
+                d->path = NULL;
+            }
+            continue;
+        }
+
+        if ((ev->mask & IN_ISDIR) && (ev->mask & (IN_CREATE | IN_MOVED_TO)) && d && d->path && ev->len &&
+            ss_filter_dir(&(w->ctx->ff), &(d->pos), ev->name, &sub)) {
+            snprintf(subpath, sizeof(subpath), "%s/%s", d->path, ev->name);
+            ss_watch_add(w, subpath, &sub);
+        }
+    }
+
+    return 0;
+}
+
+static void *ss_watch_thread(void *arg)
+{
+    ss_watch_t *w = (ss_watch_t *)arg;
+    ss_ctx_t *ctx = w->ctx;
+    struct pollfd pfd;
+    uint64_t first, now;
+
+    pfd.fd = w->fd;
+    pfd.events = POLLIN;
+
+    while (ctx->com.loop) {
+        /* the first event of a burst */
+        if (poll(&pfd, 1, -1) <= 0) {
+            continue;
+        }
+        if (ss_watch_read(w)) {
+            printf("watch: read faild, stop watching.\n");
+            break;
+        }
+
+        /* quiet for debounce ms, or at most SS_WATCH_MAXDELAY after the first one */
+        first = ss_watch_ms();
+        while (poll(&pfd, 1, ctx->debounce) > 0) {
+            ss_watch_read(w);
+            now = ss_watch_ms();
+            if (now - first >= SS_WATCH_MAXDELAY) {
+                break;
+            }
+        }
+
+        if (ctx->u.srv.scan) {
+            ss_scan_srv_kick(ctx);
+        } else {
+            __sync_lock_test_and_set(&(w->changed), 1);
+            ss_com_notify(&(ctx->com));
+        }
+    }
+
+    return NULL;
+}
+
+int ss_watch_start(ss_ctx_t *ctx)
+{
+    ss_watch_t *w;
+    ss_filterpos_t root;
+
+    ss_filter_compile(&(ctx->ff));
+    if (ss_filter_root(&(ctx->ff), &root) == 0) {
+        return -1;
+    }
+
+    w = (ss_watch_t *)calloc(1, sizeof(ss_watch_t));
+    SS_ASSERT(w);
+    w->ctx = ctx;
+    w->fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    if (w->fd < 0) {
+        printf("watch: inotify init faild, changes are seen by the periodic scan.\n");
+        free(w);
+        return -1;
+    }
+
+    ss_watch_add(w, ctx->localpath, &root);
+
+    if (pthread_create(&(w->thread), NULL, ss_watch_thread, w)) {
+        printf("watch: thread create faild.\n");
+        close(w->fd);
+        free(w->dir);
+        free(w);
+        return -1;
+    }
+    ctx->u.srv.watch = w;
+
+    return 0;
+}
+
+/* epoll thread, on SS_CBTYPE_EVENT: the tree changed since the last call */
+int ss_watch_take(ss_ctx_t *ctx)
+{
+    ss_watch_t *w = ctx->u.srv.watch;
+
+    if (w == NULL) {
+        return 0;
+    }
+
+    return __sync_lock_test_and_set(&(w->changed), 0);
+}
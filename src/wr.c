@@ -0,0 +1,401 @@
+#define _GNU_SOURCE
+#include "pub.h"
+#include <errno.h>
+
+/*
+ * cli write pipeline
+ *
+ * every file fetched is written to <name>.ss_part next to its target and
+ * renamed over it once complete, so a reader never sees half a file. the
+ * temp file gets its final size up front: a hole for a sparse file, a
+ * fallocate for the others. paths are resolved against a dirfd of the
+ * mirror, and directories are created with mkdirat and remembered, so a
+ * large update neither forks nor stats a directory per file. with --fsync
+ * 1 each file is fsynced before its rename, with --fsync n one syncfs
+ * covers every n files and the end of an update. a file a srv on the same
+ * host handed over as an fd is copied into the temp file by the kernel.
+ */
+
+#define SS_WR_PREALLOC              (64 * 1024)     /* smaller files are not fallocated */
+
+typedef struct _ss_wrdir {
+    struct _ss_wrdir        *next;
+    uint32_t                hash;
+    char                    name[0];        /* relative to the mirror */
+} ss_wrdir_t;
+
+typedef struct _ss_wr {
+    int                     root_fd;
+    ss_wrdir_t              **bucket;
+    uint32_t                n_bucket;       /* power of 2 */
+    uint32_t                n_dir;
+    uint32_t                n_unsynced;     /* files renamed since the last syncfs */
+} ss_wr_t;
+
+static void ss_wr_grow(ss_wr_t *wr)
+{
+    ss_wrdir_t **old = wr->bucket, *d, *next;
+    uint32_t i, n_old = wr->n_bucket;
+
+    wr->n_bucket = n_old ? n_old * 2 : SS_WR_BUCKETS;
+    wr->bucket = (ss_wrdir_t **)calloc(wr->n_bucket, sizeof(ss_wrdir_t *));
+    SS_ASSERT(wr->bucket);
+
+    for (i = 0; i < n_old; i++) {
+        for (d = old[i]; d; d = next) {
+            next = d->next;
+            d->next = wr->bucket[d->hash & (wr->n_bucket - 1)];
+            wr->bucket[d->hash & (wr->n_bucket - 1)] = d;
+        }
+    }
+
+    free(old);
+}
+
+static ss_wrdir_t **ss_wr_dir_find(ss_wr_t *wr, char *name, uint32_t hash)
+{
+    ss_wrdir_t **pp;
+
+    for (pp = &(wr->bucket[hash & (wr->n_bucket - 1)]); *pp; pp = &((*pp)->next)) {
+        if (((*pp)->hash == hash) && (strcmp((*pp)->name, name) == 0)) {
+            break;
+        }
+    }
+
+    return pp;
+}
+
+static void ss_wr_dir_add(ss_wr_t *wr, char *name, uint32_t hash)
+{
+    ss_wrdir_t *d;
+    uint32_t len = strlen(name);
+
+    if (wr->n_dir >= wr->n_bucket * 2) {
+        ss_wr_grow(wr);
+    }
+
+    d = (ss_wrdir_t *)malloc(sizeof(ss_wrdir_t) + len + 1);
+    SS_ASSERT(d);
+    d->hash = hash;
+    memcpy(d->name, name, len + 1);
+    d->next = wr->bucket[hash & (wr->n_bucket - 1)];
+    wr->bucket[hash & (wr->n_bucket - 1)] = d;
+    wr->n_dir++;
+}
+
+/* mkdir -p of dir relative to dirfd, the ones made or found are cached if wr is given */
+static int ss_wr_mkdir(ss_wr_t *wr, int dirfd, char *dir)
+{
+    uint32_t hash = wr ? (uint32_t)alg_xxh64(dir, strlen(dir), 0) : 0;
+    char *p;
+    int ret;
+
+    if (wr && *ss_wr_dir_find(wr, dir, hash)) {
+        return 0;
+    }
+
+    if (mkdirat(dirfd, dir, 0777) && (errno != EEXIST)) {
+        p = strrchr(dir, '/');
+        if ((errno != ENOENT) || (p == NULL) || (p == dir)) {
+            printf("mkdir %s faild.\n", dir);
+            return -1;
+        }
+
+        *p = '\0';
+        ret = ss_wr_mkdir(wr, dirfd, dir);
+        *p = '/';
+
+        if (ret || (mkdirat(dirfd, dir, 0777) && (errno != EEXIST))) {
+            printf("mkdir %s faild.\n", dir);
+            return -1;
+        }
+    }
+
+    if (wr) {
+        ss_wr_dir_add(wr, dir, hash);
+    }
+
+    return 0;
+}
+
+static ss_wr_t *ss_wr_get(ss_ctx_t *ctx)
+{
+    ss_wr_t *wr = ctx->u.cli.wr;
+    char root[SS_MAXPATH_LEN];
+
+    if (wr) {
+        return wr;
+    }
+
+    strcpy(root, ctx->localpath);
+    if (ss_wr_mkdir(NULL, AT_FDCWD, root)) {
+        return NULL;
+    }
+
+    wr = (ss_wr_t *)calloc(1, sizeof(ss_wr_t));
+    SS_ASSERT(wr);
+    wr->root_fd = open(ctx->localpath, O_RDONLY | O_DIRECTORY);
+    if (wr->root_fd < 0) {
+        printf("open %s faild.\n", ctx->localpath);
+        free(wr);
+        return NULL;
+    }
+    ss_wr_grow(wr);
+    ctx->u.cli.wr = wr;
+
+    return wr;
+}
+
+/* pathname under the mirror, NULL if it is not */
+static char *ss_wr_rel(ss_ctx_t *ctx, char *pathname)
+{
+    uint32_t len = strlen(ctx->localpath);
+
+    if ((strncmp(pathname, ctx->localpath, len) != 0) || (pathname[len] != '/')) {
+        return NULL;
+    }
+
+    return pathname + len + 1;
+}
+
+static int ss_wr_mkdir_parent(ss_wr_t *wr, char *name)
+{
+    char dir[SS_MAXPATH_LEN];
+    char *p;
+
+    p = strrchr(name, '/');
+    if (p == NULL) {
+        return 0;
+    }
+
+    memcpy(dir, name, p - name);
+    dir[p - name] = '\0';
+
+    return ss_wr_mkdir(wr, wr->root_fd, dir);
+}
+
+/* make the directory pathname is in, pathname is under the mirror */
+int ss_mkdir_parent(ss_ctx_t *ctx, char *pathname)
+{
+    ss_wr_t *wr = ss_wr_get(ctx);
+    char *name = ss_wr_rel(ctx, pathname);
+
+    if ((wr == NULL) || (name == NULL)) {
+        return -1;
+    }
+
+    return ss_wr_mkdir_parent(wr, name);
+}
+
+/* dirname under the mirror was removed */
+void ss_wr_forget(ss_ctx_t *ctx, char *dirname)
+{
+    ss_wr_t *wr = ctx->u.cli.wr;
+    ss_wrdir_t **pp, *d;
+    char *name = ss_wr_rel(ctx, dirname);
+
+    if ((wr == NULL) || (name == NULL)) {
+        return;
+    }
+
+    pp = ss_wr_dir_find(wr, name, (uint32_t)alg_xxh64(name, strlen(name), 0));
+    if ((d = *pp) != NULL) {
+        *pp = d->next;
+        free(d);
+        wr->n_dir--;
+    }
+}
+
+/* an update starts, directories may have been removed behind our back since the last one */
+void ss_wr_reset(ss_ctx_t *ctx)
+{
+    ss_wr_t *wr = ctx->u.cli.wr;
+    ss_wrdir_t *d, *next;
+    uint32_t i;
+
+    if (wr == NULL) {
+        return;
+    }
+
+    for (i = 0; i < wr->n_bucket; i++) {
+        for (d = wr->bucket[i]; d; d = next) {
+            next = d->next;
+            free(d);
+        }
+        wr->bucket[i] = NULL;
+    }
+    wr->n_dir = 0;
+}
+
+static void ss_wr_tmpname(char *name, char *tmpname)
+{
+    sprintf(tmpname, "%s%s", name, SS_PART_SUFFIX);
+}
+
+/*
+ * the temp file name is fetched into, size bytes long already. a sparse
+ * one is only truncated, what is not written stays a hole.
+ */
+int ss_wr_open(ss_ctx_t *ctx, char *name, uint64_t size, int sparse)
+{
+    ss_wr_t *wr = ss_wr_get(ctx);
+    char tmpname[SS_MAXPATH_LEN + 16];
+    int fd;
+
+    if ((wr == NULL) || ss_wr_mkdir_parent(wr, name)) {
+        return -1;
+    }
+
+    ss_wr_tmpname(name, tmpname);
+    fd = openat(wr->root_fd, tmpname, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+        printf("savefile: open %s faild.\n", tmpname);
+        return -1;
+    }
+
+    if (sparse) {
+        if (ftruncate(fd, size)) {
+            printf("savefile: truncate %s faild.\n", tmpname);
+            ss_wr_abort(ctx, fd, name);
+            return -1;
+        }
+    } else if (size >= SS_WR_PREALLOC) {
+        /* not every fs has it, the writes allocate then */
+        fallocate(fd, 0, 0, size);
+    }
+
+    return fd;
+}
+
+/* the temp file of name is complete, fd is closed and it takes the place of name */
+int ss_wr_commit(ss_ctx_t *ctx, int fd, char *name)
+{
+    ss_wr_t *wr = ctx->u.cli.wr;
+    char tmpname[SS_MAXPATH_LEN + 16];
+
+    SS_ASSERT(wr);
+
+    if ((ctx->fsync == 1) && fsync(fd)) {
+        printf("savefile: fsync %s faild.\n", name);
+        ss_wr_abort(ctx, fd, name);
+        return -1;
+    }
+    close(fd);
+
+    ss_wr_tmpname(name, tmpname);
+    if (renameat(wr->root_fd, tmpname, wr->root_fd, name)) {
+        printf("savefile: rename %s faild.\n", tmpname);
+        unlinkat(wr->root_fd, tmpname, 0);
+        return -1;
+    }
+
+    if ((ctx->fsync > 1) && (++(wr->n_unsynced) >= ctx->fsync)) {
+        ss_wr_flush(ctx);
+    }
+
+    return 0;
+}
+
+/* the temp file of name is of no use, fd is closed */
+void ss_wr_abort(ss_ctx_t *ctx, int fd, char *name)
+{
+    ss_wr_t *wr = ctx->u.cli.wr;
+    char tmpname[SS_MAXPATH_LEN + 16];
+
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    if (wr) {
+        ss_wr_tmpname(name, tmpname);
+        unlinkat(wr->root_fd, tmpname, 0);
+    }
+}
+
+/* batched fsync: what was renamed since the last one reaches the disk */
+void ss_wr_flush(ss_ctx_t *ctx)
+{
+    ss_wr_t *wr = ctx->u.cli.wr;
+
+    if ((wr == NULL) || (wr->n_unsynced == 0)) {
+        return;
+    }
+
+    if (syncfs(wr->root_fd)) {
+        printf("syncfs %s faild.\n", ctx->localpath);
+    }
+    wr->n_unsynced = 0;
+}
+
+/* the data of len bytes of src into dst, both at 0, the holes of src stay holes of the truncated dst */
+static int ss_local_copy_range(int src, int dst, uint64_t off, uint64_t len, char **buf)
+{
+    loff_t in = off, out = off;
+    ssize_t ret;
+    uint64_t n;
+
+    while (len) {
+        ret = *buf ? -1 : copy_file_range(src, &in, dst, &out, len, 0);
+        if (ret > 0) {
+            len -= ret;
+            continue;
+        }
+        if ((ret == 0) || (!*buf && (errno != EXDEV) && (errno != ENOSYS) &&
+                           (errno != EINVAL) && (errno != EOPNOTSUPP))) {
+            return -1;
+        }
+
+        /* no in-kernel copy between these two, through a buffer then */
+        if (*buf == NULL) {
+            *buf = (char *)malloc(SS_FRAME_MAXLEN);
+            SS_ASSERT(*buf);
+        }
+        n = len < SS_FRAME_MAXLEN ? len : SS_FRAME_MAXLEN;
+        ret = pread(src, *buf, n, in);
+        if ((ret <= 0) || (pwrite(dst, *buf, ret, out) != ret)) {
+            return -1;
+        }
+        in += ret;
+        out += ret;
+        len -= ret;
+    }
+
+    return 0;
+}
+
+/*
+ * a file handed over by a srv on the same host: src is its fd, dst the
+ * temp file truncated to len. the kernel copies the data extents, or
+ * shares the blocks where the fs can reflink them.
+ */
+int ss_local_copy(int src, int dst, uint64_t len)
+{
+    off_t data, hole = 0;
+    char *buf = NULL;
+    int ret = 0;
+
+    while ((hole < len) && !ret) {
+        data = lseek(src, hole, SEEK_DATA);
+        if (data < 0) {
+            if (errno == ENXIO) {
+                break;
+            }
+            /* no SEEK_DATA here, all of it is data */
+            data = hole;
+            hole = len;
+        } else {
+            hole = lseek(src, data, SEEK_HOLE);
+            if ((hole < 0) || (hole > len)) {
+                hole = len;
+            }
+        }
+        if (data >= len) {
+            break;
+        }
+        ret = ss_local_copy_range(src, dst, data, hole - data, &buf);
+    }
+
+    free(buf);
+
+    return ret;
+}